@@ -0,0 +1,215 @@
+/*
+ * Benchmark for cracked id indexes.
+ *
+ * Compares the cumulative cost of answering 1, 100 and 10000 lookups in an
+ * unsorted id column three ways: scanning the column for every lookup,
+ * sorting an index up front and binary searching it, and cracking the
+ * column as the lookups arrive (see crack.h).  Costs include building the
+ * index or the cracked copy.  All three run on one thread.
+ *
+ * By default a synthetic column of shuffled ids is used; if a PBF file is
+ * given, the node ids of that map are used instead, in map order.
+ *
+ * USAGE: bin/crack_bench [-c column_size] [file.pbf]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "osm.h"
+#include "crack.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Look every query up by scanning the column. */
+static void scan_always(const OSM_Id *col, int64_t num, const OSM_Id *queries, size_t n, int64_t *rows)
+{
+    for (size_t q = 0; q < n; q++) {
+        rows[q] = -1;
+        for (int64_t i = 0; i < num; i++) {
+            if (col[i] == queries[q]) {
+                rows[q] = i;
+                break;
+            }
+        }
+    }
+}
+
+static const OSM_Id *sort_col;
+
+static int compare_rows(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    if (sort_col[x] != sort_col[y]) return (sort_col[x] > sort_col[y]) - (sort_col[x] < sort_col[y]);
+    return (x > y) - (x < y);
+}
+
+/* Sort all rows by id first, then binary search for every query. */
+static int index_up_front(const OSM_Id *col, int64_t num, const OSM_Id *queries, size_t n, int64_t *rows)
+{
+    int64_t *order = malloc((num ? num : 1) * sizeof(int64_t));
+    if (!order) return -1;
+    for (int64_t i = 0; i < num; i++) order[i] = i;
+    sort_col = col;
+    qsort(order, num, sizeof(int64_t), compare_rows);
+    for (size_t q = 0; q < n; q++) {
+        int64_t lo = 0, hi = num;
+        while (lo < hi) {
+            int64_t mid = lo + (hi - lo) / 2;
+            if (col[order[mid]] < queries[q]) lo = mid + 1;
+            else hi = mid;
+        }
+        rows[q] = (lo < num && col[order[lo]] == queries[q]) ? order[lo] : -1;
+    }
+    free(order);
+    return 0;
+}
+
+/* Crack the column around every query. */
+static int cracking(const OSM_Id *col, int64_t num, const OSM_Id *queries, size_t n, int64_t *rows,
+                    int64_t *cracksp)
+{
+    CRK_Index *ix = CRK_create(col, num);
+    if (!ix) return -1;
+    for (size_t q = 0; q < n; q++) {
+        rows[q] = CRK_find(ix, queries[q]);
+    }
+    *cracksp = CRK_get_num_cracks(ix);
+    CRK_free(ix);
+    return 0;
+}
+
+static int bench_column(const char *what, const OSM_Id *col, int64_t num)
+{
+    static const size_t counts[] = {1, 100, 10000};
+    size_t max = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+    OSM_Id *queries = malloc(max * sizeof(OSM_Id));
+    int64_t *expect = malloc(max * sizeof(int64_t));
+    int64_t *rows = malloc(max * sizeof(int64_t));
+    if (!queries || !expect || !rows) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return -1;
+    }
+    for (size_t i = 0; i < max; i++) {
+        // Mostly present ids, plus some misses.
+        queries[i] = (i % 8 == 7) ? -(OSM_Id)(next_random() % 1000000) - 1 : col[next_random() % num];
+    }
+
+    printf("%s: %ld ids\n", what, (long)num);
+    printf("%10s %14s %14s %14s %10s\n", "lookups", "scan (ms)", "index (ms)", "crack (ms)", "cracks");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        size_t n = counts[c];
+        int64_t cracks = 0;
+        double t0 = now();
+        scan_always(col, num, queries, n, expect);
+        double t1 = now();
+        if (index_up_front(col, num, queries, n, rows) < 0) return -1;
+        double t2 = now();
+        for (size_t q = 0; q < n; q++) {
+            if (rows[q] != expect[q]) {
+                fprintf(stderr, "ERROR: index mismatch for id %ld\n", (long)queries[q]);
+                return -1;
+            }
+        }
+        double t3 = now();
+        if (cracking(col, num, queries, n, rows, &cracks) < 0) return -1;
+        double t4 = now();
+        for (size_t q = 0; q < n; q++) {
+            if (rows[q] != expect[q]) {
+                fprintf(stderr, "ERROR: cracking mismatch for id %ld\n", (long)queries[q]);
+                return -1;
+            }
+        }
+        printf("%10zu %14.3f %14.3f %14.3f %10ld\n", n,
+               (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t4 - t3) * 1e3, (long)cracks);
+    }
+    free(queries);
+    free(expect);
+    free(rows);
+    return 0;
+}
+
+static int bench_map(const char *filename)
+{
+    FILE *in = fopen(filename, "rb");
+    if (!in) {
+        fprintf(stderr, "ERROR: cannot open '%s'\n", filename);
+        return -1;
+    }
+    OSM_Map *mp = OSM_read_Map(in);
+    fclose(in);
+    int64_t num = 0;
+    const OSM_Id *col = mp ? OSM_Map_get_node_ids(mp, &num) : NULL;
+    if (!col) {
+        fprintf(stderr, "ERROR: no nodes in '%s'\n", filename);
+        return -1;
+    }
+    int rc = bench_column(filename, col, num);
+    OSM_free_Map(mp);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    int64_t num = 1 << 20;          // 1M ids
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c': num = atoll(optarg); break;
+        default:
+            fprintf(stderr, "USAGE: %s [-c column_size] [file.pbf]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        return bench_map(argv[optind]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (num < 1) {
+        fprintf(stderr, "ERROR: the column must not be empty\n");
+        return EXIT_FAILURE;
+    }
+
+    // Synthetic column: increasing ids with random gaps, like real node
+    // ids, in shuffled order.
+    OSM_Id *col = malloc(num * sizeof(OSM_Id));
+    if (!col) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    OSM_Id id = 1000;
+    for (int64_t i = 0; i < num; i++) {
+        id += 1 + next_random() % 8;
+        col[i] = id;
+    }
+    for (int64_t i = num - 1; i > 0; i--) {
+        int64_t j = next_random() % (i + 1);
+        OSM_Id t = col[i];
+        col[i] = col[j];
+        col[j] = t;
+    }
+
+    int rc = bench_column("synthetic", col, num);
+    free(col);
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+/*
+ * Benchmark for batch id lookup.
+ *
+ * Compares looking ids up one at a time against the batch API, which
+ * interleaves the searches with software prefetching.  By default a synthetic
+ * sorted id column is used, large enough to be DRAM-resident; if a PBF file is
+ * given, the node ids of that map are used as well.
+ *
+ * USAGE: bin/find_bench [-c column_size] [-q num_queries] [file.pbf]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "osm.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void report(const char *what, size_t n, double single, double batch, int64_t found)
+{
+    printf("%-10s %10zu lookups: single %8.1f ns/lookup, batch %8.1f ns/lookup, "
+           "speedup %.2fx (%ld found)\n",
+           what, n, single * 1e9 / n, batch * 1e9 / n, single / batch, (long)found);
+}
+
+/*
+ * Look up queries in a sorted column, once with a loop of single lookups and
+ * once with the batch API, and check that both agree.
+ */
+static int bench_column(const char *what, const OSM_Id *col, int64_t num,
+                        const OSM_Id *queries, size_t n)
+{
+    int64_t *single = malloc(n * sizeof(int64_t));
+    int64_t *batch = malloc(n * sizeof(int64_t));
+    if (!single || !batch) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return -1;
+    }
+
+    double t0 = now();
+    for (size_t i = 0; i < n; i++) {
+        OSM_find_ids(col, num, &queries[i], 1, &single[i]);
+    }
+    double t1 = now();
+    OSM_find_ids(col, num, queries, n, batch);
+    double t2 = now();
+
+    int64_t found = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (single[i] != batch[i]) {
+            fprintf(stderr, "ERROR: mismatch for id %ld: %ld vs %ld\n",
+                    (long)queries[i], (long)single[i], (long)batch[i]);
+            return -1;
+        }
+        found += (batch[i] >= 0);
+    }
+    report(what, n, t1 - t0, t2 - t1, found);
+    free(single);
+    free(batch);
+    return 0;
+}
+
+static int bench_map(const char *filename, size_t n)
+{
+    FILE *in = fopen(filename, "rb");
+    if (!in) {
+        fprintf(stderr, "ERROR: cannot open '%s'\n", filename);
+        return -1;
+    }
+    OSM_Map *mp = OSM_read_Map(in);
+    fclose(in);
+    int num = OSM_Map_get_num_nodes(mp);
+    if (!mp || num == 0) {
+        fprintf(stderr, "ERROR: no nodes in '%s'\n", filename);
+        return -1;
+    }
+
+    OSM_Id *queries = malloc(n * sizeof(OSM_Id));
+    int64_t *single = malloc(n * sizeof(int64_t));
+    int64_t *batch = malloc(n * sizeof(int64_t));
+    if (!queries || !single || !batch) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        queries[i] = OSM_Node_get_id(OSM_Map_get_Node(mp, next_random() % num));
+    }
+
+    double t0 = now();
+    for (size_t i = 0; i < n; i++) {
+        single[i] = OSM_Map_find_Node(mp, queries[i]);
+    }
+    double t1 = now();
+    OSM_Map_find_Nodes(mp, queries, n, batch);
+    double t2 = now();
+
+    int64_t found = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (single[i] != batch[i]) {
+            fprintf(stderr, "ERROR: mismatch for node %ld\n", (long)queries[i]);
+            return -1;
+        }
+        found += (batch[i] >= 0);
+    }
+    report("map", n, t1 - t0, t2 - t1, found);
+    free(queries);
+    free(single);
+    free(batch);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int64_t num = 1 << 25;          // 32M ids = 256 MiB column
+    size_t n = 1 << 22;             // 4M lookups
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:q:")) != -1) {
+        switch (opt) {
+        case 'c': num = atoll(optarg); break;
+        case 'q': n = (size_t)atoll(optarg); break;
+        default:
+            fprintf(stderr, "USAGE: %s [-c column_size] [-q num_queries] [file.pbf]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Synthetic column: increasing ids with random gaps, like real node ids.
+    OSM_Id *col = malloc(num * sizeof(OSM_Id));
+    OSM_Id *queries = malloc(n * sizeof(OSM_Id));
+    if (!col || !queries) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    OSM_Id id = 1000;
+    for (int64_t i = 0; i < num; i++) {
+        id += 1 + next_random() % 8;
+        col[i] = id;
+    }
+    for (size_t i = 0; i < n; i++) {
+        // Mostly present ids, plus some misses.
+        queries[i] = (i % 8 == 7) ? (OSM_Id)(next_random() % id)
+                                  : col[next_random() % num];
+    }
+
+    if (bench_column("synthetic", col, num, queries, n) < 0) return EXIT_FAILURE;
+    free(col);
+    free(queries);
+
+    if (optind < argc && bench_map(argv[optind], n) < 0) return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,512 @@
+/*
+ * Load generator for the query server.
+ *
+ * Drives a server (bin/pbf -S) over its UNIX socket from a number of
+ * concurrent connections, each sending one request at a time, and reports
+ * throughput and latency percentiles.  Requests are either replayed from a
+ * query log (one request per line, as accepted by the server or by -q) or
+ * synthesized from a map: node and way ids drawn from a Zipf distribution,
+ * so that a few ids are hot, as in production traffic.
+ *
+ * With a target rate (-r), requests are sent on a fixed schedule and
+ * latency is measured from the time each request was due, so that a
+ * stalled server is charged for the requests it delayed.  Without one,
+ * each connection sends its next request as soon as it has a response.
+ *
+ * USAGE: bin/loadgen -s socket [-l log | -z file.pbf [-a alpha] [-w way_fraction] [-m name]]
+ *                    [-c connections] [-r rate] [-n requests] [-d seconds] [-o out]
+ *
+ * With -o, the synthesized requests are written to a file (usable with
+ * bin/pbf -q, unless -m is given) instead of being sent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "osm.h"
+
+typedef struct {
+    char **lines;           // The requests, without newlines
+    size_t num;
+} Requests;
+
+typedef struct {
+    int id;
+    const char *socket_path;
+    const Requests *reqs;
+    uint64_t count;         // Requests to send (0: until the deadline)
+    double interval;        // Seconds between requests (0: closed loop)
+    double start;
+    double deadline;
+    uint64_t *latency_ns;   // Latency of each request sent
+    uint64_t num_sent;
+    uint64_t cap;
+    uint64_t errors;        // ERROR responses
+    int failed;             // Nonzero if the connection failed
+} Client;
+
+/* A log is replayed in order by all clients together, up to replay_limit
+ * requests (wrapping around the log). */
+static int replay = 0;
+static uint64_t replay_cursor = 0;
+static uint64_t replay_limit = 0;       // 0: until the deadline
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_until(double t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Append a request line, taking ownership of it. */
+static int add_request(Requests *r, char *line, size_t *cap)
+{
+    if (r->num == *cap) {
+        size_t n = *cap ? 2 * *cap : 1024;
+        char **lines = realloc(r->lines, n * sizeof(char *));
+        if (!lines) return -1;
+        r->lines = lines;
+        *cap = n;
+    }
+    r->lines[r->num++] = line;
+    return 0;
+}
+
+/* Read a query log: every non-empty line not starting with '#'. */
+static int read_log(Requests *r, const char *filename)
+{
+    FILE *in = fopen(filename, "r");
+    if (!in) {
+        fprintf(stderr, "ERROR: cannot open '%s'\n", filename);
+        return -1;
+    }
+    size_t cap = 0, len = 0;
+    char *line = NULL;
+    ssize_t n;
+    while ((n = getline(&line, &len, in)) > 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+        char *copy = strdup(line);
+        if (!copy || add_request(r, copy, &cap) < 0) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            fclose(in);
+            return -1;
+        }
+    }
+    free(line);
+    fclose(in);
+    if (r->num == 0) {
+        fprintf(stderr, "ERROR: no requests in '%s'\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Cumulative distribution of a Zipf law over ranks 0..n-1: rank k has
+ * weight 1/(k+1)^alpha.
+ */
+static double *zipf_cdf(size_t n, double alpha)
+{
+    double *cdf = malloc(n * sizeof(double));
+    if (!cdf) return NULL;
+    double sum = 0;
+    for (size_t k = 0; k < n; k++) {
+        sum += 1.0 / pow((double)(k + 1), alpha);
+        cdf[k] = sum;
+    }
+    for (size_t k = 0; k < n; k++) cdf[k] /= sum;
+    return cdf;
+}
+
+static size_t zipf_draw(const double *cdf, size_t n)
+{
+    double u = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+    size_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Shuffle ids, so that the hot ids are spread over the map. */
+static OSM_Id *shuffled(const OSM_Id *ids, int64_t n)
+{
+    OSM_Id *s = malloc((n ? n : 1) * sizeof(OSM_Id));
+    if (!s) return NULL;
+    memcpy(s, ids, n * sizeof(OSM_Id));
+    for (int64_t i = n - 1; i > 0; i--) {
+        int64_t j = next_random() % (uint64_t)(i + 1);
+        OSM_Id t = s[i];
+        s[i] = s[j];
+        s[j] = t;
+    }
+    return s;
+}
+
+/*
+ * Synthesize requests against a map: node queries, and a fraction of way
+ * queries, with ids drawn from Zipf distributions.
+ */
+static int synthesize(Requests *r, const char *filename, size_t n, double alpha,
+                      double way_fraction, const char *map_name)
+{
+    FILE *in = fopen(filename, "rb");
+    if (!in) {
+        fprintf(stderr, "ERROR: cannot open '%s'\n", filename);
+        return -1;
+    }
+    OSM_Map *mp = OSM_read_Map(in);
+    fclose(in);
+    int64_t num_nodes = 0, num_ways = 0;
+    const OSM_Id *node_ids = mp ? OSM_Map_get_node_ids(mp, &num_nodes) : NULL;
+    const OSM_Id *way_ids = mp ? OSM_Map_get_way_ids(mp, &num_ways) : NULL;
+    if (num_nodes == 0) {
+        fprintf(stderr, "ERROR: no nodes in '%s'\n", filename);
+        return -1;
+    }
+    if (num_ways == 0) way_fraction = 0;
+
+    OSM_Id *nodes = shuffled(node_ids, num_nodes);
+    OSM_Id *ways = shuffled(way_ids, num_ways);
+    double *node_cdf = zipf_cdf(num_nodes, alpha);
+    double *way_cdf = num_ways ? zipf_cdf(num_ways, alpha) : NULL;
+    if (!nodes || !ways || !node_cdf || (num_ways && !way_cdf)) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return -1;
+    }
+
+    size_t cap = 0;
+    char buf[256];
+    for (size_t i = 0; i < n; i++) {
+        int way = (next_random() >> 11) * (1.0 / 9007199254740992.0) < way_fraction;
+        OSM_Id id = way ? ways[zipf_draw(way_cdf, num_ways)] : nodes[zipf_draw(node_cdf, num_nodes)];
+        snprintf(buf, sizeof(buf), "%s%s%s%c %ld", map_name ? "@" : "", map_name ? map_name : "",
+                 map_name ? " " : "", way ? 'w' : 'n', (long)id);
+        char *copy = strdup(buf);
+        if (!copy || add_request(r, copy, &cap) < 0) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            return -1;
+        }
+    }
+    free(nodes);
+    free(ways);
+    free(node_cdf);
+    free(way_cdf);
+    OSM_free_Map(mp);
+    return 0;
+}
+
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Read one response, which ends with an empty line.  Bytes after it stay
+ * in the buffer.  Sets *error if the response is an ERROR line.
+ */
+static int read_response(int fd, char *buf, size_t size, size_t *have, int *error)
+{
+    size_t pos = 0;         // Start of the current line
+    *error = -1;
+    while (1) {
+        char *nl;
+        while ((nl = memchr(buf + pos, '\n', *have - pos))) {
+            size_t len = nl - (buf + pos);
+            if (*error < 0) *error = (len >= 5 && memcmp(buf + pos, "ERROR", 5) == 0);
+            pos = nl + 1 - buf;
+            if (len == 0) {
+                memmove(buf, buf + pos, *have - pos);
+                *have -= pos;
+                return 0;
+            }
+        }
+        if (*have == size) {
+            // A long response: keep only the unfinished line.
+            memmove(buf, buf + pos, *have - pos);
+            *have -= pos;
+            pos = 0;
+            if (*have == size) *have = 0;
+        }
+        ssize_t n = read(fd, buf + *have, size - *have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        *have += n;
+    }
+}
+
+/* Pick the next request, or return NULL when there are no more. */
+static const char *next_request(Client *c, uint64_t i, uint64_t *local_rng)
+{
+    const Requests *r = c->reqs;
+    if (replay) {
+        uint64_t k = __atomic_fetch_add(&replay_cursor, 1, __ATOMIC_RELAXED);
+        return (replay_limit && k >= replay_limit) ? NULL : r->lines[k % r->num];
+    }
+    if (c->count && i >= c->count) return NULL;
+    // xorshift64* per client
+    *local_rng ^= *local_rng >> 12;
+    *local_rng ^= *local_rng << 25;
+    *local_rng ^= *local_rng >> 27;
+    return r->lines[(*local_rng * 0x2545f4914f6cdd1dULL) % r->num];
+}
+
+static void *run_client(void *arg)
+{
+    Client *c = arg;
+    int fd = connect_socket(c->socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: cannot connect to '%s'\n", c->socket_path);
+        c->failed = 1;
+        return NULL;
+    }
+    size_t size = 1 << 16, have = 0;
+    char *buf = malloc(size);
+    char *req = malloc(size + 1);
+    uint64_t rng = 0x853c49e6748fea9bULL * (c->id + 1);
+    if (!buf || !req) {
+        c->failed = 1;
+        close(fd);
+        return NULL;
+    }
+
+    // Wake up on schedule: the default timer slack (50us) would count as latency.
+    prctl(PR_SET_TIMERSLACK, 1UL);
+    sleep_until(c->start);
+    for (uint64_t i = 0; ; i++) {
+        double due = c->interval > 0 ? c->start + i * c->interval : now();
+        if (c->deadline > 0 && due >= c->deadline) break;
+        const char *line = next_request(c, i, &rng);
+        if (!line) break;
+        if (c->interval > 0) sleep_until(due);
+
+        size_t len = strlen(line);
+        if (len > size - 1) len = size - 1;
+        memcpy(req, line, len);
+        req[len++] = '\n';
+        int error;
+        if (write_all(fd, req, len) < 0 || read_response(fd, buf, size, &have, &error) < 0) {
+            fprintf(stderr, "ERROR: connection %d closed by the server\n", c->id);
+            c->failed = 1;
+            break;
+        }
+        double done = now();
+
+        if (c->num_sent == c->cap) {
+            uint64_t cap = c->cap ? 2 * c->cap : 4096;
+            uint64_t *l = realloc(c->latency_ns, cap * sizeof(uint64_t));
+            if (!l) {
+                c->failed = 1;
+                break;
+            }
+            c->latency_ns = l;
+            c->cap = cap;
+        }
+        c->latency_ns[c->num_sent++] = (uint64_t)((done - due) * 1e9);
+        c->errors += (error == 1);
+    }
+    free(buf);
+    free(req);
+    close(fd);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, uint64_t n, double p)
+{
+    if (n == 0) return 0;
+    uint64_t k = (uint64_t)(p * (n - 1) + 0.5);
+    return sorted[k] / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    const char *socket_path = NULL, *log_file = NULL, *map_file = NULL;
+    const char *map_name = NULL, *out_file = NULL;
+    int connections = 4;
+    double rate = 0, duration = 0, alpha = 1.0, way_fraction = 0.2;
+    uint64_t count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:l:z:a:w:m:c:r:n:d:o:")) != -1) {
+        switch (opt) {
+        case 's': socket_path = optarg; break;
+        case 'l': log_file = optarg; break;
+        case 'z': map_file = optarg; break;
+        case 'a': alpha = atof(optarg); break;
+        case 'w': way_fraction = atof(optarg); break;
+        case 'm': map_name = optarg; break;
+        case 'c': connections = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'n': count = strtoull(optarg, NULL, 10); break;
+        case 'd': duration = atof(optarg); break;
+        case 'o': out_file = optarg; break;
+        default:
+            goto usage;
+        }
+    }
+    if ((!log_file == !map_file) || (!socket_path && !out_file) || connections < 1 || rate < 0)
+        goto usage;
+
+    Requests reqs = {0};
+    if (log_file) {
+        if (read_log(&reqs, log_file) < 0) return EXIT_FAILURE;
+        // A log is replayed once, unless a count or duration is given.
+        replay = 1;
+        replay_limit = (count == 0 && duration == 0) ? reqs.num : count;
+    } else {
+        size_t n = count ? count : 100000;
+        if (synthesize(&reqs, map_file, n, alpha, way_fraction, map_name) < 0) return EXIT_FAILURE;
+        if (count == 0 && duration == 0) duration = 10;
+    }
+
+    if (out_file) {
+        FILE *out = fopen(out_file, "w");
+        if (!out) {
+            fprintf(stderr, "ERROR: cannot create '%s'\n", out_file);
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < reqs.num; i++) fprintf(out, "%s\n", reqs.lines[i]);
+        fclose(out);
+        return EXIT_SUCCESS;
+    }
+
+    Client *clients = calloc(connections, sizeof(Client));
+    pthread_t *tids = calloc(connections, sizeof(pthread_t));
+    if (!clients || !tids) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    double start = now() + 0.01;
+    int launched = 0;           // Clients before this one were started or had nothing to send
+    int failed = 0;
+    for (int i = 0; i < connections; i++) {
+        Client *c = &clients[i];
+        c->id = i;
+        c->socket_path = socket_path;
+        c->reqs = &reqs;
+        c->count = (count && !replay) ? count * (i + 1) / connections - count * i / connections : 0;
+        c->interval = rate > 0 ? connections / rate : 0;
+        // Spread the schedules of the connections over one interval.
+        c->start = start + c->interval * i / connections;
+        c->deadline = duration > 0 ? start + duration : 0;
+        if (count && !replay && c->count == 0) {
+            launched = i + 1;
+            continue;
+        }
+        int err = pthread_create(&tids[i], NULL, run_client, c);
+        if (err != 0) {
+            fprintf(stderr, "ERROR: cannot start connection %d: %s\n", i, strerror(err));
+            failed = 1;
+            break;
+        }
+        launched = i + 1;
+    }
+
+    uint64_t total = 0, errors = 0;
+    for (int i = 0; i < launched; i++) {
+        if (count && !replay && clients[i].count == 0) continue;
+        pthread_join(tids[i], NULL);
+        total += clients[i].num_sent;
+        errors += clients[i].errors;
+        failed |= clients[i].failed;
+    }
+    double elapsed = now() - start;
+
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!all) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t n = 0, sum = 0;
+    for (int i = 0; i < connections; i++) {
+        for (uint64_t k = 0; k < clients[i].num_sent; k++) {
+            all[n++] = clients[i].latency_ns[k];
+            sum += clients[i].latency_ns[k];
+        }
+        free(clients[i].latency_ns);
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+
+    printf("requests: %lu, errors: %lu, connections: %d, seconds: %.3f\n",
+           (unsigned long)n, (unsigned long)errors, connections, elapsed);
+    printf("throughput: %.1f requests/s", n / elapsed);
+    if (rate > 0) printf(" (target %.1f)", rate);
+    printf("\n");
+    printf("latency_us: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           n ? sum / 1e3 / n : 0.0, percentile_us(all, n, 0.5), percentile_us(all, n, 0.9),
+           percentile_us(all, n, 0.99), percentile_us(all, n, 0.999), n ? all[n - 1] / 1e3 : 0.0);
+
+    free(all);
+    free(clients);
+    free(tids);
+    for (size_t i = 0; i < reqs.num; i++) free(reqs.lines[i]);
+    free(reqs.lines);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "USAGE: %s -s socket [-l log | -z file.pbf [-a alpha] [-w way_fraction] [-m name]]\n"
+                    "          [-c connections] [-r rate] [-n requests] [-d seconds] [-o out]\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,29 @@
+#ifndef BLOBCACHE_H
+#define BLOBCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-disk cache of decoded blocks, keyed by a hash of the raw blob.
+ *
+ * Each blob of a PBF file (its BlobHeader and its still compressed data)
+ * is hashed with BLC_hash, which is XXH64.  The loader keeps what it
+ * decoded from the blob in a cache directory under that hash, one file per
+ * blob.  Loading a new version of a file, most of whose blobs are
+ * unchanged, then only inflates and decodes the blobs that changed; the
+ * others are copied from the cache.
+ *
+ * Entries are written to a temporary file and renamed into place, so
+ * processes sharing a directory never see partial entries.  An entry that
+ * cannot be read back whole, or whose checksum does not match, is a miss.
+ * The cache never evicts; the directory may be emptied at any time.
+ */
+
+uint64_t BLC_hash(const void *buf, size_t len, uint64_t seed);
+
+int BLC_prepare(const char *dir);
+void *BLC_load(const char *dir, uint64_t key, size_t *sizep);
+int BLC_store(const char *dir, uint64_t key, const void *data, size_t size);
+
+#endif
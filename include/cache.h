@@ -0,0 +1,52 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded cache of formatted query responses, used by the query server.
+ *
+ * Responses are keyed by the query text.  The cache is split into shards,
+ * each with its own lock, hash table and CLOCK replacement hand, so that
+ * concurrent connections rarely contend.  Cached responses are reference
+ * counted: a hit hands out a reference to the stored bytes, which the caller
+ * can pass straight to writev(2) and release afterwards.
+ *
+ * Every entry records the cache generation in which it was computed.
+ * CACHE_invalidate starts a new generation (for instance when the map is
+ * reloaded), after which all older entries are treated as misses and are
+ * recycled first.
+ */
+
+typedef struct CACHE_Value {
+    int refs;           // Number of references; the value is freed at zero
+    size_t len;         // Length of data
+    char data[];        // The response bytes
+} CACHE_Value;
+
+typedef struct CACHE_Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    size_t entries;     // Entries currently held (of any generation)
+    size_t capacity;    // Maximum number of entries
+    uint64_t generation;
+} CACHE_Stats;
+
+typedef struct CACHE_Cache CACHE_Cache;
+
+CACHE_Value *CACHE_new_value(const char *data, size_t len);
+void CACHE_retain(CACHE_Value *v);
+void CACHE_release(CACHE_Value *v);
+
+CACHE_Cache *CACHE_create(size_t capacity, int nshards);
+void CACHE_destroy(CACHE_Cache *c);
+CACHE_Value *CACHE_lookup(CACHE_Cache *c, const char *key, size_t key_len);
+void CACHE_insert(CACHE_Cache *c, const char *key, size_t key_len, uint64_t gen, CACHE_Value *v);
+uint64_t CACHE_generation(CACHE_Cache *c);
+void CACHE_invalidate(CACHE_Cache *c);
+void CACHE_get_stats(CACHE_Cache *c, CACHE_Stats *st);
+
+#endif
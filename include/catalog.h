@@ -0,0 +1,51 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+
+/*
+ * Catalog of named maps, used by the query server to host many maps.
+ *
+ * Each map is read from its PBF file when it is first needed.  All loaded
+ * maps share one memory budget: when the heap memory of the loaded maps
+ * exceeds it, the least recently used maps that no query is using are
+ * freed, to be read again on demand.
+ *
+ * A map is used through a counted reference obtained with CAT_acquire, so
+ * that it is never freed while a query is reading it.  CAT_invalidate
+ * drops every loaded map (for instance when the files have changed); maps
+ * still in use are freed when their last reference is released.
+ */
+
+typedef struct CAT_Map {
+    OSM_Map *mp;            // The map
+    int refs;               // References held, including the catalog's own
+    size_t bytes;           // Heap memory of the map
+    uint64_t last_used;     // Catalog clock at the last acquisition
+} CAT_Map;
+
+typedef struct CAT_Stats {
+    int maps;               // Named maps
+    int loaded;             // Maps currently loaded (including ones being dropped)
+    size_t bytes;           // Heap memory of loaded maps
+    size_t budget;          // Memory budget (0: unlimited)
+    uint64_t loads;         // Maps read so far
+    uint64_t load_failures; // Maps that could not be read
+    uint64_t evictions;     // Maps freed to stay within the budget
+} CAT_Stats;
+
+typedef struct CAT_Catalog CAT_Catalog;
+
+CAT_Catalog *CAT_create(size_t budget);
+void CAT_destroy(CAT_Catalog *cat);
+int CAT_add(CAT_Catalog *cat, const char *spec);
+int CAT_find(CAT_Catalog *cat, const char *name, size_t name_len);
+CAT_Map *CAT_acquire(CAT_Catalog *cat, int index);
+void CAT_release(CAT_Catalog *cat, CAT_Map *m);
+void CAT_invalidate(CAT_Catalog *cat);
+void CAT_get_stats(CAT_Catalog *cat, CAT_Stats *st);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Dispatch of the decoding kernels by CPU features.
+ *
+ * Every kernel has a portable scalar version and, on x86-64, versions
+ * compiled for SSE4.2, AVX2 and AVX-512 with target attributes, so the
+ * build needs no -m flags.  At startup the highest level the CPU supports
+ * is detected and its versions are bound in CPU_kernels, which the
+ * decoders call through.  The environment variable PBF_CPU_LEVEL (scalar,
+ * sse4.2, avx2 or avx512) forces a lower level, for testing and for
+ * comparing the versions.
+ */
+
+typedef enum {
+    CPU_SCALAR,
+    CPU_SSE42,
+    CPU_AVX2,
+    CPU_AVX512,
+    CPU_NUM_LEVELS
+} CPU_Level;
+
+/*
+ * Decode the varints of [p, end) into out, which has room for end - p
+ * values.  Returns their number, or -1 if the last one is cut off.
+ */
+typedef int64_t (*CPU_Varints)(const uint8_t *p, const uint8_t *end, uint64_t *out);
+
+/*
+ * Set out[i] to the sum of the zigzag-decoded in[0] to in[i], as delta
+ * coded fields are stored.  out may be in.
+ */
+typedef void (*CPU_Deltas)(const uint64_t *in, int64_t *out, size_t n);
+
+typedef struct CPU_Kernels {
+    CPU_Level level;
+    CPU_Varints varints;
+    CPU_Deltas deltas;
+} CPU_Kernels;
+
+/* The kernels bound at startup. */
+extern CPU_Kernels CPU_kernels;
+
+CPU_Level CPU_detect(void);
+int CPU_select(CPU_Level level);
+const char *CPU_level_name(CPU_Level level);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CRACK_H
+#define CRACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "osm.h"
+
+/*
+ * Cracked id index: an adaptive index over an unsorted id column.
+ *
+ * The index is a copy of the column as (id, row) entries together with a
+ * sorted list of "cracks".  A crack at id v records a position p such that
+ * every entry before p has an id below v and every entry from p on has an
+ * id of at least v, so the cracks split the copy into pieces of disjoint id
+ * ranges.  Each lookup of an id partitions only the piece that the id falls
+ * in around it (one quicksort partitioning step) and records the new crack.
+ *
+ * The first lookup costs about as much as a scan of the column; later ones
+ * touch ever smaller pieces.  Small pieces are sorted outright the first
+ * time they are touched, so the copy converges to sorted order as the
+ * queried ids cover the column.  Nothing is spent on parts of the column
+ * that are never queried, which suits sessions with few lookups, where
+ * sorting the whole column up front would not pay off.
+ *
+ * Lookups change the index, so they are serialized by a lock, which
+ * CRK_find_many takes once for a whole batch.
+ */
+
+typedef struct CRK_Index CRK_Index;
+
+CRK_Index *CRK_create(const OSM_Id *ids, int64_t num);
+void CRK_free(CRK_Index *ix);
+int64_t CRK_find(CRK_Index *ix, OSM_Id id);
+void CRK_find_many(CRK_Index *ix, const OSM_Id *ids, size_t n, int64_t *out_index);
+int CRK_range(CRK_Index *ix, OSM_Id lo, OSM_Id hi, int64_t **rowsp, int64_t *countp);
+int64_t CRK_get_num_cracks(CRK_Index *ix);
+size_t CRK_get_memory(CRK_Index *ix);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Streaming diff of two PBF snapshots into an OsmChange document.
+ *
+ * Both files must be sorted by type, then id, with one version of each
+ * entity.  They are read side by side and merge-joined by type and id, so
+ * memory does not depend on their size.  Each file is decoded a block
+ * ahead in a background thread, which also hashes the content of every
+ * entity; an entity present in both files is compared in full only when
+ * the hashes match.
+ *
+ * Entities only in the old file are deleted, entities only in the new
+ * file are created, and entities in both whose coordinates, tags, refs or
+ * members differ are modified.  Changes of version metadata alone are not
+ * reported.  The changes are written in type, then id order, grouped into
+ * consecutive <create>, <modify> and <delete> sections.
+ */
+
+typedef struct DIF_Stats {
+    int64_t created;
+    int64_t modified;
+    int64_t deleted;
+    int64_t unchanged;
+} DIF_Stats;
+
+int DIF_write_osc(FILE *old_in, FILE *new_in, int fd, DIF_Stats *stats);
+
+#endif
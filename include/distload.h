@@ -0,0 +1,35 @@
+#ifndef DISTLOAD_H
+#define DISTLOAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Loading of a PBF file by several processes, into a map snapshot.
+ *
+ * The blobs are listed from their headers (PBF_index) and cut into parts:
+ * contiguous byte ranges of about the same compressed size.  Each part is
+ * decoded by a process of its own into a partial snapshot, as
+ * OSM_write_snapshot writes it, and the partial snapshots, concatenated in
+ * order, make the snapshot of the whole file, which OSM_read_Map loads
+ * without decoding a blob.  DST_load forks a process per part on this
+ * machine; DST_write_part does the work of one, so parts can as well be
+ * decoded on other hosts that share the file, and joined with cat.
+ */
+
+/* Largest number of parts. */
+#define DST_MAX_PARTS 1024
+
+typedef struct DST_Part {
+    int64_t begin;              // Offset of its first blob
+    int64_t end;                // Offset after its last blob
+    int64_t blobs;
+    int64_t bytes;              // Size of its partial snapshot, once written
+} DST_Part;
+
+int DST_split(FILE *in, int num_parts, DST_Part *parts);
+int DST_write_part(const char *input, const DST_Part *part, const char *output);
+int DST_concat(const char *const *inputs, int num_inputs, FILE *out);
+int DST_load(const char *input, const char *output, int num_parts, DST_Part *parts);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * External-memory sort of PBF files into Type_then_ID order.
+ *
+ * The input is read one block at a time into a store of at most the given
+ * memory budget.  Whenever the store is full its entities are sorted and
+ * written as a run to a temporary file.  The runs are then merged with a
+ * loser tree into the output, in several passes if there are more runs than
+ * the budget allows open at once.  A file that fits in the budget is sorted
+ * in memory and written directly.
+ *
+ * Entities of the same type and id keep their relative order, except that
+ * versions are put in ascending order.
+ *
+ * The same merge combines files that are sorted already, such as
+ * overlapping extracts, dropping all but the highest version of entities
+ * found in several of them.
+ */
+
+/* Memory assumed for each run being merged: one decoded block. */
+#define EXT_RUN_MEMORY (4 << 20)
+
+/* Default memory budget, in megabytes. */
+#define EXT_DEFAULT_BUDGET 256
+
+typedef struct EXT_Stats {
+    int64_t entities;       // Entities written
+    int64_t duplicates;     // Entities dropped by a merge as older versions
+    int runs;               // Runs written to temporary files (0: sorted in memory)
+    int passes;             // Merge passes
+} EXT_Stats;
+
+int EXT_sort(FILE *in, FILE *out, size_t budget, EXT_Stats *stats);
+int EXT_merge(FILE **ins, int num_ins, FILE *out, EXT_Stats *stats);
+
+#endif
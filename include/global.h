@@ -17,14 +17,38 @@
 
 #define USAGE(program_name, retcode) do { \
 fprintf(stderr, "USAGE: %s %s\n", program_name, \
-"[-h] [-f filename] [-s] [-b] [-n id] [-w id] [-w id key ...]\n" \
+"[-h] [-f filename] [-s] [-b] [-n id] [-w id] [-w id key ...] [-q file] [-t threads] [-S socket [-c entries] [-P workers] [-M name=file ...] [-B megabytes]] [-C dir] [--sort -o file [-m megabytes]] [--merge file ... -o file] [--diff old new -o file] [-f file --renumber -o file [--id-map file]] [-f file --shard N -o prefix [-t threads]] [-f file --snapshot K -o file] [-f file --snapshot-part I/K -o file] [-f file --sample percent [--seed n]] [-f file --validate [-t threads]] [--check-refs]\n" \
 "   -h              Help: displays this help menu.\n" \
 "   -f filename     File: read map data from the specified file\n" \
 "   -s              Summary: displays map summary information.\n" \
 "   -b              Bounding box: displays map bounding box.\n" \
 "   -n id           Node: displays information about the specified node.\n" \
+"   -n id,id,...    Nodes: displays information about each listed node.\n" \
+"   -n lo-hi        Node range: displays all nodes with ids from lo to hi.\n" \
 "   -w id           Way refs: displays node references for the specified way.\n" \
-"   -w id key ...   Way values: displays values associated with the specified way and keys.\n"); \
+"   -w id key ...   Way values: displays values associated with the specified way and keys.\n" \
+"   -q file         Batch: answers the queries in file, one per line (n id, n lo-hi, w id [key ...]).\n" \
+"   -t threads      Threads: number of threads used to answer queries (default: one per CPU).\n" \
+"   -S socket       Server: answers queries sent to the UNIX socket until interrupted.\n" \
+"   -c entries      Cache: number of responses cached by the server (default 65536, 0 for none).\n" \
+"   -P workers      Workers: number of server processes sharing the loaded map (default: 1, threaded).\n" \
+"   -M name=file    Named map: also serves the map in file to queries prefixed with @name.\n" \
+"   -B megabytes    Budget: memory for loaded named maps; least recently used ones are unloaded (default: unlimited).\n" \
+"   -C dir          Blob cache: keeps what is decoded from each blob in dir, so that blobs seen before are not decoded again.\n" \
+"   --sort          Sort: writes the map sorted by type, then id, to the -o file, using temporary files as needed.\n" \
+"   --merge files   Merge: writes the sorted files, keeping the highest version of each entity, to the -o file.\n" \
+"   --diff old new  Diff: writes the changes from the sorted old file to the sorted new one, as OsmChange XML, to the -o file.\n" \
+"   --renumber      Renumber: writes the -f map with ids 1 to N of each type, in file order, and refs to match, to the -o file.\n" \
+"   --id-map file   Id map: also writes the old and new id of every entity renumbered to file.\n" \
+"   --shard N       Shard: splits the -f map into N spatially balanced parts, written to prefix.0.pbf to prefix.N-1.pbf for -o prefix.\n" \
+"   --snapshot K    Snapshot: loads the -f map with K processes, each decoding a part of its blobs, into the -o snapshot file, which -f reads fast.\n" \
+"   --snapshot-part I/K  Snapshot part: writes the snapshot of part I of K only; the parts, concatenated in order, make the snapshot.\n" \
+"   --sample P      Sample: estimates the counts, tag keys and memory of the -f map from a random P% of its blobs.\n" \
+"   --seed n        Seed: makes the --sample blobs those of an earlier run that printed seed n (default: a new seed).\n" \
+"   --validate      Validate: checks the structure of every blob of the -f map, with -t threads, and reports the first bad one.\n" \
+"   --check-refs    Check refs: reports the way refs and relation members missing from the map, reading it once.\n" \
+"   -o file         Output: file written by --sort, --merge, --diff, --renumber or --snapshot, or prefix of the --shard files.\n" \
+"   -m megabytes    Memory: budget for --sort (default 256).\n"); \
 exit(retcode); \
 } while(0)
 
@@ -34,6 +58,10 @@ extern int help_requested;
 /* Variable to be set by process_args to any filename specified with '-f'. */
 extern char *osm_input_file;
 
+/* Variable to be set by process_args once it has run a tool such as --sort,
+ * which does not load the map. */
+extern int tool_requested;
+
 /*
  * This function is used to validate the command-line arguments and to perform
  * query processing.  See the specification associated with the stub in
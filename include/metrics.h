@@ -0,0 +1,60 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "outbuf.h"
+
+/*
+ * Request metrics for the query server, in Prometheus text format.
+ *
+ * Each connection thread registers its own block of counters and is the
+ * only thread that ever writes to it, so recording a request takes no lock
+ * and no atomic read-modify-write.  A scrape sums the blocks of all open
+ * connections with the totals left behind by closed ones.
+ */
+
+typedef enum {
+    MET_NODE,           // Node queries
+    MET_RANGE,          // Node range queries
+    MET_WAY,            // Way queries
+    MET_COMMAND,        // Server commands (CACHE, STATS, RELOAD, ...)
+    MET_INVALID,        // Requests that could not be parsed
+    MET_NUM_KINDS
+} MET_Kind;
+
+/* Latency histogram buckets: the last one has no upper bound. */
+#define MET_NUM_BUCKETS 20
+
+typedef struct MET_Counters {
+    uint64_t requests[MET_NUM_KINDS];
+    uint64_t cache_hits[MET_NUM_KINDS];
+    uint64_t latency_ns[MET_NUM_KINDS];             // Sum of request latencies
+    uint64_t buckets[MET_NUM_KINDS][MET_NUM_BUCKETS];
+    struct MET_Counters *prev;                      // Registry links
+    struct MET_Counters *next;
+} MET_Counters;
+
+typedef struct MET_Registry {
+    pthread_mutex_t lock;
+    MET_Counters *live;         // Counters of open connections
+    MET_Counters retired;       // Totals of closed connections
+    uint64_t connections;       // Connections registered so far
+    uint64_t open;              // Connections currently registered
+} MET_Registry;
+
+void MET_init(MET_Registry *reg);
+void MET_fini(MET_Registry *reg);
+MET_Counters *MET_register(MET_Registry *reg);
+void MET_unregister(MET_Registry *reg, MET_Counters *c);
+void MET_record(MET_Counters *c, MET_Kind kind, uint64_t ns, int cache_hit);
+void MET_collect(MET_Registry *reg, MET_Counters *total, uint64_t *connections, uint64_t *open);
+void MET_add(MET_Counters *total, const MET_Counters *c);
+uint64_t MET_now_ns(void);
+
+void MET_put_header(OUT_Buffer *out, const char *name, const char *type, const char *help);
+void MET_put_sample(OUT_Buffer *out, const char *name, const char *labels, int64_t value, int decimals);
+void MET_put_requests(OUT_Buffer *out, const MET_Counters *total);
+
+#endif
@@ -16,12 +16,57 @@ typedef int64_t OSM_Id;             // Id of OSM element (node, way, relation)
 typedef int64_t OSM_Lat;            // Latitude (in nanodegrees)
 typedef int64_t OSM_Lon;            // Longitude (in nanodegrees)
 
+#define OSM_REF_MISSING UINT32_MAX  // Node index of a way ref whose node is not in the map
+
+/*
+ * A contiguous run of nodes, as slices of the map's node columns.
+ * Produced by OSM_Map_node_batches.
+ */
+typedef struct OSM_Node_Batch {
+    int64_t first;          // Index of the first node in the batch
+    int64_t count;          // Number of nodes in the batch
+    const OSM_Id *ids;      // ids[i] is the id of node first + i
+    const OSM_Lat *lats;    // lats[i] is the latitude of node first + i
+    const OSM_Lon *lons;    // lons[i] is the longitude of node first + i
+} OSM_Node_Batch;
+
+/*
+ * Heap memory held by a map, in bytes, broken down by component.
+ * Filled in by OSM_Map_get_memory.
+ */
+typedef struct OSM_Map_Memory {
+    size_t nodes;       // Node id and coordinate columns
+    size_t ways;        // Way id column and ref/tag offset columns
+    size_t refs;        // Way refs (ids, or node indices and missing-ref table)
+    size_t tags;        // Tag key/value columns and strings
+    size_t handles;     // Node and way handles
+    size_t indexes;     // Id indexes (see OSM_Map_build_index) and cracked indexes
+} OSM_Map_Memory;
+
+/*
+ * Id indexes, which speed up lookups by id in maps whose ids are not
+ * sorted.  Sorted id columns need no index, and count as always ready.
+ */
+typedef enum {
+    OSM_INDEX_NODE_IDS,
+    OSM_INDEX_WAY_IDS,
+    OSM_NUM_INDEXES
+} OSM_Index;
+
 /*
  * Top-level constructor used by client to create an OSM_Map
  * from an input stream.
  */
 
+/* Flags for OSM_read_Map_with. */
+#define OSM_READ_KEEP_ORDER 1   // Keep nodes and ways in file order (do not sort by id)
+
 OSM_Map *OSM_read_Map(FILE *in);
+OSM_Map *OSM_read_Map_with(FILE *in, int flags);
+int OSM_set_blob_cache(const char *dir);
+int OSM_write_snapshot(FILE *in, int64_t begin, int64_t end, FILE *out);
+void OSM_free_Map(OSM_Map *mp);
+int OSM_Map_compact(OSM_Map *mp);
 
 /*
  * Accessors, for querying map objects.
@@ -34,6 +79,46 @@ int OSM_Map_get_num_nodes(OSM_Map *mp);
 int OSM_Map_get_num_ways(OSM_Map *mp);
 OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index);
 OSM_Way *OSM_Map_get_Way(OSM_Map *mp, int index);
+int64_t OSM_Map_get_load_ns(OSM_Map *mp);
+void OSM_Map_get_blob_counts(OSM_Map *mp, int64_t *decoded, int64_t *cached);
+void OSM_Map_get_memory(OSM_Map *mp, OSM_Map_Memory *mem);
+
+/* Lookup by id (binary search when the map's ids are sorted) */
+
+int64_t OSM_Map_find_Node(OSM_Map *mp, OSM_Id id);
+int64_t OSM_Map_find_Way(OSM_Map *mp, OSM_Id id);
+int64_t OSM_Map_lower_bound_Node(OSM_Map *mp, OSM_Id id);
+int OSM_Map_find_sorted_Nodes(OSM_Map *mp, const OSM_Id *ids, size_t n, int64_t *out_index);
+
+/* Batch lookup of ids in any order, with interleaved prefetching */
+
+int OSM_Map_find_Nodes(OSM_Map *mp, const OSM_Id *ids, size_t n, int64_t *out_index);
+int OSM_Map_find_Ways(OSM_Map *mp, const OSM_Id *ids, size_t n, int64_t *out_index);
+int OSM_find_ids(const OSM_Id *col, int64_t num, const OSM_Id *ids, size_t n, int64_t *out_index);
+
+/* Id indexes, which can be built while lookups run */
+
+int OSM_Map_build_index(OSM_Map *mp, OSM_Index which, int nthreads);
+int OSM_Map_index_ready(OSM_Map *mp, OSM_Index which);
+int64_t OSM_Map_get_index_ns(OSM_Map *mp, OSM_Index which);
+void OSM_Map_cancel_index(OSM_Map *mp);
+void OSM_Map_enable_cracking(OSM_Map *mp);
+int64_t OSM_Map_get_num_cracks(OSM_Map *mp, OSM_Index which);
+int OSM_Map_range_Nodes(OSM_Map *mp, OSM_Id lo, OSM_Id hi, int64_t **rowsp, int64_t *countp);
+
+/* Post-load translation of way refs into node indices */
+
+int OSM_Map_index_refs(OSM_Map *mp, int nthreads);
+
+/* Span accessors, for loops over whole columns */
+
+const OSM_Id *OSM_Map_get_node_ids(OSM_Map *mp, int64_t *countp);
+const OSM_Lat *OSM_Map_get_node_lats(OSM_Map *mp, int64_t *countp);
+const OSM_Lon *OSM_Map_get_node_lons(OSM_Map *mp, int64_t *countp);
+const OSM_Id *OSM_Map_get_way_ids(OSM_Map *mp, int64_t *countp);
+const OSM_Id *OSM_Way_get_refs(OSM_Way *wp, int *countp);
+const uint32_t *OSM_Way_get_ref_indices(OSM_Way *wp, int *countp);
+int OSM_Map_node_batches(OSM_Map *mp, int64_t *cursor, int64_t batch_size, OSM_Node_Batch *batch);
 
 /* OSM_BBox accessors */
 
@@ -57,6 +142,7 @@ OSM_Id OSM_Way_get_id(OSM_Way *wp);
 int OSM_Way_get_num_refs(OSM_Way *wp);
 int OSM_Way_get_num_keys(OSM_Way *wp);
 OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index);
+uint32_t OSM_Way_get_ref_index(OSM_Way *wp, int index);
 char *OSM_Way_get_key(OSM_Way *wp, int index);
 char *OSM_Way_get_value(OSM_Way *wp, int index);
 
@@ -0,0 +1,39 @@
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Buffered output writer used for query results.
+ *
+ * Output is accumulated in a large in-memory buffer and handed to the
+ * kernel with write(2) only when the buffer fills up or is explicitly
+ * flushed.  Numbers are formatted by hand (no printf, no locale and no
+ * round-trip through double), which keeps bulk result output cheap.
+ *
+ * A buffer opened on file descriptor -1 never flushes; it simply grows,
+ * which is useful for collecting output that is to be reassembled later.
+ */
+
+typedef struct OUT_Buffer {
+    int fd;             // Destination file descriptor, or -1 for memory only.
+    char *buf;          // Start of the buffer.
+    size_t len;         // Number of bytes currently buffered.
+    size_t cap;         // Capacity of the buffer.
+    int err;            // Set once any allocation or write has failed.
+} OUT_Buffer;
+
+#define OUT_DEFAULT_SIZE (1 << 20)
+
+int OUT_init(OUT_Buffer *ob, int fd, size_t cap);
+int OUT_flush(OUT_Buffer *ob);
+int OUT_fini(OUT_Buffer *ob);
+
+void OUT_put_char(OUT_Buffer *ob, char c);
+void OUT_put_bytes(OUT_Buffer *ob, const char *data, size_t len);
+void OUT_put_str(OUT_Buffer *ob, const char *str);
+void OUT_put_int64(OUT_Buffer *ob, int64_t val);
+void OUT_put_fixed(OUT_Buffer *ob, int64_t val, int decimals);
+
+#endif
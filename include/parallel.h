@@ -0,0 +1,21 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+
+/*
+ * Minimal fork-join helper for data-parallel passes over a map.
+ *
+ * PAR_for splits the index range [0, n) into contiguous chunks, one per
+ * worker thread, and calls the task once for each chunk.  Chunks are
+ * assigned in order, so worker w always receives a range that precedes the
+ * range of worker w + 1; tasks can rely on this to combine per-worker
+ * results in index order.
+ */
+
+typedef void (*PAR_Task)(void *arg, int worker, int64_t begin, int64_t end);
+
+int PAR_num_threads(int requested);
+int PAR_for(int64_t n, int nthreads, PAR_Task task, void *arg);
+
+#endif
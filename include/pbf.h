@@ -0,0 +1,117 @@
+#ifndef PBF_H
+#define PBF_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+
+/*
+ * Streaming access to OSM PBF files, one entity at a time.
+ *
+ * Unlike OSM_read_Map, which keeps only what queries need, a PBF_Reader
+ * decodes everything in the file: nodes (plain or dense), ways and
+ * relations, with their tags and their version metadata.  Only one block
+ * is held in memory at a time, so files of any size can be processed.
+ * A PBF_Writer encodes entities back into blocks of up to
+ * PBF_BLOCK_ENTITIES entities of one type, each with its own string table.
+ * Together they let tools rewrite files that do not fit in memory.
+ *
+ * Coordinates are in nanodegrees; the writer stores them with the usual
+ * granularity of 100 nanodegrees.
+ */
+
+typedef enum {
+    PBF_NODE = 0,
+    PBF_WAY = 1,
+    PBF_RELATION = 2
+} PBF_Type;
+
+typedef struct PBF_Member {
+    OSM_Id id;
+    PBF_Type type;
+    const char *role;
+} PBF_Member;
+
+typedef struct PBF_Entity {
+    PBF_Type type;
+    OSM_Id id;
+    int32_t version;            // 0 if not recorded
+    int64_t timestamp;          // Seconds since the epoch, 0 if not recorded
+    int64_t changeset;
+    int32_t uid;
+    const char *user;           // "" if not recorded
+    int64_t lat;                // Nodes only, in nanodegrees
+    int64_t lon;
+    int num_tags;
+    const char **keys;
+    const char **vals;
+    int num_refs;               // Ways only
+    const OSM_Id *refs;
+    int num_members;            // Relations only
+    const PBF_Member *members;
+    uint64_t hash;              // Content hash if read with PBF_READ_HASH, else 0
+} PBF_Entity;
+
+typedef struct PBF_Header {
+    int has_bbox;
+    int64_t min_lon;            // Bounding box, in nanodegrees
+    int64_t max_lon;
+    int64_t max_lat;
+    int64_t min_lat;
+    int sorted;                 // Declares Sort.Type_then_ID
+} PBF_Header;
+
+/* Maximum number of entities the writer puts in one block. */
+#define PBF_BLOCK_ENTITIES 8000
+
+typedef struct PBF_Reader PBF_Reader;
+typedef struct PBF_Writer PBF_Writer;
+
+/* Flags for PBF_open_with. */
+#define PBF_READ_AHEAD 1        // Decode the next block in the background
+#define PBF_READ_HASH 2         // Set the content hash of every entity
+
+PBF_Reader *PBF_open(FILE *in);
+PBF_Reader *PBF_open_with(FILE *in, int flags);
+const PBF_Header *PBF_get_header(PBF_Reader *r);
+int PBF_next(PBF_Reader *r, const PBF_Entity **ep);
+void PBF_close(PBF_Reader *r);
+
+PBF_Writer *PBF_create(FILE *out, const PBF_Header *hdr);
+int PBF_write(PBF_Writer *w, const PBF_Entity *e);
+int PBF_finish(PBF_Writer *w);
+
+/* A blob of a file, as listed by PBF_index. */
+typedef struct PBF_Blob {
+    int64_t offset;             // Where the blob starts in the file
+    int64_t size;               // Bytes it takes, with its header
+    int header;                 // Nonzero for OSMHeader blobs
+    int data;                   // Nonzero for OSMData blobs
+} PBF_Blob;
+
+int PBF_index(FILE *in, PBF_Blob **blobsp, int64_t *countp);
+int64_t PBF_read_block(PBF_Reader *r, int64_t offset, const PBF_Entity **entsp);
+
+int PBF_compare(const PBF_Entity *a, const PBF_Entity *b);
+uint64_t PBF_hash(const PBF_Entity *e);
+
+/*
+ * A store of copied entities, for holding entities beyond the lifetime the
+ * reader gives them.  Their data is kept in large chunks that are never
+ * moved, so entity pointers stay valid until the store is cleared.
+ */
+typedef struct PBF_Store {
+    PBF_Entity *ents;           // The entities, in the order added
+    size_t num;
+    size_t cap;
+    struct PBF_Chunk *chunks;   // Memory holding their tags, refs, ...
+    size_t bytes;               // Memory used by the entities and their data
+} PBF_Store;
+
+const PBF_Entity *PBF_store_add(PBF_Store *s, const PBF_Entity *e);
+void PBF_store_clear(PBF_Store *s);
+void PBF_store_free(PBF_Store *s);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "outbuf.h"
+
+/*
+ * Query execution.
+ *
+ * A query asks for a single node, for all nodes in an id range, or for a
+ * way (its refs, or the values of some of its keys).  Queries come from the
+ * command line (-n, -w) or from a batch file (-q), in which each line holds
+ * one query:
+ *
+ *     n 213352011
+ *     n 213352011-213358548
+ *     w 20175414
+ *     w 20175414 highway name
+ *
+ * Blank lines and lines starting with '#' are ignored.
+ *
+ * QRY_run answers a list of queries, optionally on several threads: the
+ * queries are partitioned by id, so that each worker searches a disjoint
+ * slice of the id columns, and the answers are reassembled in list order.
+ */
+
+typedef enum {
+    QRY_NODE,           // A single node
+    QRY_RANGE,          // All nodes with ids in [lo, hi]
+    QRY_WAY             // A way
+} QRY_Kind;
+
+typedef struct QRY_Query {
+    QRY_Kind kind;
+    OSM_Id lo;          // Node or way id, or the first id of a range
+    OSM_Id hi;          // The last id of a range (equal to lo otherwise)
+    char **keys;        // Keys whose values are wanted (way queries only)
+    int num_keys;
+} QRY_Query;
+
+typedef struct QRY_List {
+    QRY_Query *queries;
+    size_t num;
+    size_t cap;
+    char *text;         // Storage owned by the list, for queries read from a file
+    char **key_pool;    // Storage for the keys of queries read from a file
+} QRY_List;
+
+/* Maximum number of keys accepted for a single way query. */
+#define QRY_MAX_KEYS 10
+
+int QRY_add(QRY_List *ql, const QRY_Query *q);
+int QRY_parse_node_spec(QRY_List *ql, const char *spec);
+int QRY_parse_line(QRY_List *ql, char *line, char **keys, size_t *num_keys);
+int QRY_read_file(QRY_List *ql, const char *filename);
+void QRY_free_list(QRY_List *ql);
+
+void QRY_answer(OUT_Buffer *out, OSM_Map *mp, const QRY_Query *q);
+int QRY_run(OUT_Buffer *out, OSM_Map *mp, const QRY_List *ql, int nthreads);
+
+#endif
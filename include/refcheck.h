@@ -0,0 +1,44 @@
+#ifndef REFCHECK_H
+#define REFCHECK_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pbf.h"
+
+/*
+ * Referential integrity of a PBF file: do the refs of its ways and the
+ * members of its relations exist in the file?
+ *
+ * The file is streamed, and the ids present are recorded in paged bitsets,
+ * one per entity type, whose pages (of REF_PAGE_IDS ids) are allocated only
+ * where ids occur.  Memory is therefore a bit per id in the ranges used,
+ * not a map.  In files grouped by type (nodes, then ways, then relations),
+ * as files usually are, a ref to a type that is complete is tested as soon
+ * as it is read, and the rest (relation members that are relations) when
+ * the file ends, so one pass suffices.  Files in another order are read a
+ * second time to test the refs, if they can be rewound.
+ */
+
+/* Ids per bitset page. */
+#define REF_PAGE_BITS 12
+#define REF_PAGE_IDS (1 << REF_PAGE_BITS)
+
+/* Missing ids kept as examples, per type. */
+#define REF_SAMPLES 10
+
+typedef struct REF_Report {
+    int64_t entities[3];        // Entities read, by PBF_Type
+    int64_t refs[3];            // Refs and members checked, by type of the entity referred to
+    int64_t missing[3];         // Of which missing
+    int64_t broken[3];          // Ways and relations with at least one missing ref
+    OSM_Id samples[3][REF_SAMPLES];     // The first distinct missing ids
+    int num_samples[3];
+    size_t bitset_bytes;        // Memory of the bitsets
+    int passes;                 // Times the file was read
+} REF_Report;
+
+int REF_check(FILE *in, REF_Report *rep);
+
+#endif
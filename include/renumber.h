@@ -0,0 +1,33 @@
+#ifndef RENUMBER_H
+#define RENUMBER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Renumbering of a PBF file: the nodes, ways and relations get the ids 1 to
+ * N of their type, in file order, and way refs and relation members are
+ * rewritten to match, so that consumers can index entities by id in flat
+ * arrays.
+ *
+ * A first pass collects the ids of each type into a column, whose position
+ * is the new id.  A column that is not in ascending order, as it is in
+ * sorted files, is sorted with the new ids alongside.  The second pass
+ * rewrites the file a block at a time: the refs and members of the block
+ * are sorted and looked up together, each search continuing from where the
+ * previous one ended.  Refs to entities that are not in the file have no
+ * new id and are dropped.
+ *
+ * New ids ascend within each type, so the output is declared sorted when
+ * the input is grouped by type.
+ */
+
+typedef struct REN_Stats {
+    int64_t entities[3];        // Entities renumbered, by PBF_Type
+    int64_t dropped_refs;       // Way refs dropped
+    int64_t dropped[3];         // Relation members dropped, by member type
+} REN_Stats;
+
+int REN_renumber(FILE *in, FILE *out, FILE *table, REN_Stats *stats);
+
+#endif
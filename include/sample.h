@@ -0,0 +1,54 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Approximate statistics of a PBF file, from a random sample of its blobs.
+ *
+ * The blobs are listed from their headers (PBF_index) and evenly spaced
+ * OSMData blobs, from a random start, are decoded.  Files keep their nodes,
+ * ways and relations in separate stretches of blobs, which such a sample
+ * covers in proportion.  Totals are extrapolated with the ratio estimator,
+ * using the compressed size of the blobs, which is known for all of them,
+ * as the auxiliary variable.  Each estimate comes with the half-width of
+ * its 95% confidence interval, computed as for a simple random sample with
+ * the finite population correction, so it is 0 when every blob is sampled,
+ * and with Student's t rather than z for samples of up to 31 blobs.
+ *
+ * A small sample can miss every blob of a stretch, as two blobs of three
+ * miss the only one of nodes.  A quantity not seen in any sampled blob,
+ * short of all of them, is not estimated rather than given as exactly 0.
+ */
+
+/* Number of tag keys reported, the most frequent first. */
+#define SMP_TOP_KEYS 20
+
+typedef struct SMP_Estimate {
+    double value;
+    double margin;              // Half-width of the 95% confidence interval
+    int unseen;                 // Not seen in the sample: value and margin mean nothing
+} SMP_Estimate;
+
+typedef struct SMP_Key {
+    char *key;
+    SMP_Estimate count;         // Tags with this key, on all entity types
+} SMP_Key;
+
+typedef struct SMP_Result {
+    int64_t blobs;              // OSMData blobs in the file
+    int64_t sampled;            // Blobs decoded
+    SMP_Estimate nodes;
+    SMP_Estimate ways;
+    SMP_Estimate relations;
+    SMP_Estimate memory;        // Bytes of the columns OSM_read_Map would fill
+    SMP_Key *keys;              // Up to SMP_TOP_KEYS keys, by estimated count
+    int num_keys;
+} SMP_Result;
+
+int SMP_sample(FILE *in, double percent, uint64_t seed, SMP_Result *res);
+void SMP_free(SMP_Result *res);
+
+#endif
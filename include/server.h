@@ -0,0 +1,58 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+#include "osm.h"
+#include "catalog.h"
+
+/*
+ * Query server.
+ *
+ * The server keeps a map resident and answers queries sent by clients over
+ * a UNIX stream socket.  Each request is one line; it is either a query in
+ * the syntax of a batch query file (see query.h) or one of the commands
+ *
+ *     CACHE     response cache statistics
+ *     STATS     all server metrics, in Prometheus text format (see metrics.h)
+ *     RELOAD    re-read the map file, and invalidate the cache
+ *     QUIT      close the connection
+ *
+ * Each response is zero or more non-empty lines followed by an empty line.
+ * Requests can be pipelined; responses are sent in request order.
+ *
+ * Besides the map it is started with, the server can host named maps (see
+ * catalog.h), which are read when first queried and share a memory budget.
+ * A query prefixed with "@name " is answered from the named map.
+ *
+ * Responses to queries are kept in a sharded cache (see cache.h), so that
+ * a repeated query costs one hash lookup and is sent without copying.  The
+ * map is also reloaded on SIGHUP; SIGINT and SIGTERM stop the server.
+ *
+ * Optionally the map is loaded once and queries are answered by a pool of
+ * forked worker processes, which share the map's pages copy-on-write and
+ * accept connections on the same socket.  Each worker has its own cache and
+ * counters, which it publishes to memory shared with the others about once
+ * a second; CACHE and STATS report their sums over all workers, including
+ * those that have exited, whichever worker answers them.
+ *
+ * The server answers queries as soon as the map is read.  If its nodes or
+ * ways are not sorted by id, id indexes are then built in the background
+ * (see OSM_Map_build_index); until an index is ready, lookups on that
+ * column scan it instead.  STATS reports which indexes are ready.
+ */
+
+typedef struct SRV_Config {
+    const char *socket_path;    // Path of the UNIX socket to listen on
+    const char *map_file;       // File the map is reloaded from, or NULL
+    size_t cache_size;          // Maximum number of cached responses (0: none)
+    int workers;                // Number of worker processes (0: serve in this process)
+    CAT_Catalog *catalog;       // Named maps, or NULL
+} SRV_Config;
+
+/* Default number of cached responses. */
+#define SRV_DEFAULT_CACHE_SIZE 65536
+
+int SRV_run(const SRV_Config *cfg, OSM_Map *mp);
+
+#endif
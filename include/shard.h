@@ -0,0 +1,43 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Spatial sharding of a PBF file into balanced parts.
+ *
+ * The nodes are split by a k-d tree on their coordinates: each cell is cut
+ * across its longer side (longitude scaled by the cosine of the latitude)
+ * at the point that gives its two halves node counts in proportion to the
+ * shards they will hold, so the shards differ by at most one node.  The
+ * cut is found by parallel selection, a radix select on the coordinate
+ * whose digit histograms are counted by all threads, followed by a
+ * parallel stable partition.
+ *
+ * A way goes to the shard of its first node, and the nodes it refers to in
+ * other shards are copied into its shard, so every shard holds complete
+ * ways.  A relation goes to the shard of its first member found.  Each
+ * shard declares the bounding box of its cell.
+ *
+ * The file is read three times: for the coordinates, for the ways, and to
+ * write the shards.
+ */
+
+/* Largest number of shards. */
+#define SHD_MAX_SHARDS 4096
+
+typedef struct SHD_Shard {
+    int64_t nodes;              // Nodes of the cell
+    int64_t copies;             // Nodes of other cells copied for the ways
+    int64_t ways;
+    int64_t relations;
+    int64_t min_lat;            // The cell, in nanodegrees
+    int64_t max_lat;
+    int64_t min_lon;
+    int64_t max_lon;
+} SHD_Shard;
+
+int SHD_shard(FILE *in, FILE **outs, int num_shards, int nthreads, SHD_Shard *shards);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Structural validation of a PBF file, without building entities.
+ *
+ * The blob headers are walked first (PBF_index), which checks that every
+ * blob fits in the file.  The blobs are then inflated and checked by all
+ * threads at once: the protobuf framing of every message, the presence of
+ * required fields (string tables, ids, coordinates), string indices within
+ * the string table, and the agreement of parallel arrays, such as the ids,
+ * latitudes and longitudes of DenseNodes, or the keys and values of a way.
+ * Values themselves (coordinates, refs) are not interpreted.
+ */
+
+typedef struct VAL_Report {
+    int64_t blobs;              // Blobs in the file, or before the first bad one
+    int64_t bytes;              // Bytes of block data checked, after inflating
+    int64_t nodes;              // Entities seen in the blobs checked
+    int64_t ways;
+    int64_t relations;
+    int64_t bad_offset;         // Offset of the first bad blob, -1 if none
+    const char *reason;         // What is wrong with it, NULL if nothing
+} VAL_Report;
+
+int VAL_validate(FILE *in, int nthreads, VAL_Report *rep);
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "blobcache.h"
+#include "debug.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+/* Header of a cache entry; the decoded data follows it. */
+typedef struct {
+    char magic[8];
+    uint64_t key;               // Hash of the blob the entry was decoded from
+    uint64_t size;              // Size of the data
+    uint64_t check;             // BLC_hash of the data
+} BLC_Entry;
+
+static const char entry_magic[8] = "PBFBLK1";
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* XXH64 reads its input as little-endian words, on any host. */
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return le64toh(v);
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return le32toh(v);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    return rotl(acc, 31) * P1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+    h ^= xxh_round(0, v);
+    return h * P1 + P4;
+}
+
+/**
+ * @brief Hash a buffer with XXH64.
+ *
+ * Words are read as little-endian, so hashes agree with the reference
+ * implementation on any host.
+ *
+ * @param buf   The bytes to hash.
+ * @param len   Their number.
+ * @param seed  Seed, which gives an unrelated hash function for each value.
+ * @return The 64-bit hash.
+ */
+uint64_t BLC_hash(const void *buf, size_t len, uint64_t seed)
+{
+    const unsigned char *p = buf, *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (end - p >= 4) {
+        h ^= read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = rotl(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void entry_path(char *path, size_t size, const char *dir, uint64_t key)
+{
+    snprintf(path, size, "%s/%016llx.blk", dir, (unsigned long long)key);
+}
+
+/**
+ * @brief Make sure a cache directory exists, creating it if needed.
+ * @return 0 on success, -1 if it is not a directory and cannot be created.
+ */
+int BLC_prepare(const char *dir)
+{
+    struct stat sb;
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Cannot create cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if (stat(dir, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+        fprintf(stderr, "ERROR: %s is not a directory.\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Look up the entry for a blob.
+ *
+ * @param dir    The cache directory.
+ * @param key    The blob's hash.
+ * @param sizep  Receives the size of the entry's data.
+ * @return The data, to be freed by the caller, or NULL on a miss.
+ */
+void *BLC_load(const char *dir, uint64_t key, size_t *sizep)
+{
+    char path[4096];
+    entry_path(path, sizeof(path), dir, key);
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    BLC_Entry e;
+    void *data = NULL;
+    if (fread(&e, sizeof(e), 1, f) == 1 && memcmp(e.magic, entry_magic, sizeof(e.magic)) == 0 &&
+        e.key == key && (data = malloc(e.size ? e.size : 1)) &&
+        fread(data, 1, e.size, f) == e.size && fgetc(f) == EOF &&
+        BLC_hash(data, e.size, 0) == e.check)
+    {
+        fclose(f);
+        *sizep = e.size;
+        return data;
+    }
+    debug("DEBUG: BLC_load - ignoring damaged entry %s\n", path);
+    free(data);
+    fclose(f);
+    return NULL;
+}
+
+/**
+ * @brief Add the entry for a blob, replacing any existing one.
+ *
+ * @param dir   The cache directory.
+ * @param key   The blob's hash.
+ * @param data  What was decoded from the blob.
+ * @param size  Its size in bytes.
+ * @return 0 on success, -1 if the entry could not be written.
+ */
+int BLC_store(const char *dir, uint64_t key, const void *data, size_t size)
+{
+    char path[4096], tmp[4200];
+    entry_path(path, sizeof(path), dir, key);
+    // A name of its own, so that threads storing the same key at once each
+    // write a whole entry before the rename.
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    BLC_Entry e = {{0}, key, size, BLC_hash(data, size, 0)};
+    memcpy(e.magic, entry_magic, sizeof(e.magic));
+    int fd = mkstemp(tmp);
+    if (fd >= 0) fchmod(fd, 0644);      // mkstemp makes it private to the user
+    FILE *f = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && !f) close(fd);
+    int ok = f && fwrite(&e, sizeof(e), 1, f) == 1 && fwrite(data, 1, size, f) == size;
+    if (f && fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp, path) == 0) return 0;
+    debug("DEBUG: BLC_store - cannot write %s\n", path);
+    if (fd >= 0) unlink(tmp);
+    return -1;
+}
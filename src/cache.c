@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cache.h"
+#include "debug.h"
+
+/* One cache entry.  A slot is free when val is NULL. */
+typedef struct {
+    uint64_t hash;
+    uint64_t gen;           // Generation the response was computed in
+    char *key;
+    size_t key_len;
+    CACHE_Value *val;
+    int32_t next;           // Next slot in the same hash bucket, or -1
+    unsigned char ref;      // CLOCK reference bit, set on every hit
+} CACHE_Slot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CACHE_Slot *slots;
+    size_t num_slots;
+    int32_t *buckets;       // Head slot of each hash chain, or -1
+    size_t bucket_mask;     // Number of buckets - 1 (a power of two)
+    size_t hand;            // CLOCK hand
+    size_t used;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+} CACHE_Shard;
+
+struct CACHE_Cache {
+    CACHE_Shard *shards;
+    int nshards;
+    size_t capacity;
+    uint64_t generation;    // Accessed atomically
+};
+
+/* 64-bit FNV-1a hash of the key. */
+static uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Create a value holding a copy of some bytes, with one reference.
+ * @return The value, or NULL if memory could not be allocated.
+ */
+CACHE_Value *CACHE_new_value(const char *data, size_t len)
+{
+    CACHE_Value *v = malloc(sizeof(CACHE_Value) + len);
+    if (!v) return NULL;
+    v->refs = 1;
+    v->len = len;
+    memcpy(v->data, data, len);
+    return v;
+}
+
+/**
+ * @brief Add a reference to a value.
+ */
+void CACHE_retain(CACHE_Value *v)
+{
+    if (v) __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drop a reference to a value, freeing it with the last reference.
+ */
+void CACHE_release(CACHE_Value *v)
+{
+    if (v && __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) == 0) free(v);
+}
+
+/**
+ * @brief Create a response cache.
+ *
+ * @param capacity  Maximum number of entries, spread evenly over the shards.
+ * @param nshards   Number of independently locked shards (at least 1).
+ * @return The cache, or NULL if capacity is 0 or memory could not be
+ * allocated.  All functions accept a NULL cache, which caches nothing.
+ */
+CACHE_Cache *CACHE_create(size_t capacity, int nshards)
+{
+    if (capacity == 0) return NULL;
+    if (nshards < 1) nshards = 1;
+    if ((size_t)nshards > capacity) nshards = (int)capacity;
+
+    CACHE_Cache *c = calloc(1, sizeof(CACHE_Cache));
+    if (!c) return NULL;
+    c->shards = calloc(nshards, sizeof(CACHE_Shard));
+    if (!c->shards) {
+        free(c);
+        return NULL;
+    }
+    c->nshards = nshards;
+    c->capacity = capacity;
+
+    for (int s = 0; s < nshards; s++) {
+        CACHE_Shard *sh = &c->shards[s];
+        sh->num_slots = capacity * (s + 1) / nshards - capacity * s / nshards;
+        size_t num_buckets = 1;
+        while (num_buckets < sh->num_slots) num_buckets *= 2;
+        sh->bucket_mask = num_buckets - 1;
+        sh->slots = calloc(sh->num_slots, sizeof(CACHE_Slot));
+        sh->buckets = malloc(num_buckets * sizeof(int32_t));
+        pthread_mutex_init(&sh->lock, NULL);
+        if (!sh->slots || !sh->buckets) {
+            c->nshards = s + 1;
+            CACHE_destroy(c);
+            return NULL;
+        }
+        memset(sh->buckets, 0xff, num_buckets * sizeof(int32_t));
+    }
+    return c;
+}
+
+/**
+ * @brief Free a cache.  References handed out earlier remain valid.
+ */
+void CACHE_destroy(CACHE_Cache *c)
+{
+    if (!c) return;
+    for (int s = 0; s < c->nshards; s++) {
+        CACHE_Shard *sh = &c->shards[s];
+        for (size_t i = 0; sh->slots && i < sh->num_slots; i++) {
+            free(sh->slots[i].key);
+            CACHE_release(sh->slots[i].val);
+        }
+        free(sh->slots);
+        free(sh->buckets);
+        pthread_mutex_destroy(&sh->lock);
+    }
+    free(c->shards);
+    free(c);
+}
+
+/**
+ * @brief Get the current generation of a cache.
+ *
+ * A response computed after reading the generation can be inserted with
+ * it; if the cache is invalidated meanwhile, the insertion is ignored.
+ */
+uint64_t CACHE_generation(CACHE_Cache *c)
+{
+    return c ? __atomic_load_n(&c->generation, __ATOMIC_ACQUIRE) : 0;
+}
+
+/**
+ * @brief Invalidate every entry of a cache, by starting a new generation.
+ */
+void CACHE_invalidate(CACHE_Cache *c)
+{
+    if (c) __atomic_add_fetch(&c->generation, 1, __ATOMIC_ACQ_REL);
+}
+
+static CACHE_Shard *shard_for(CACHE_Cache *c, uint64_t hash)
+{
+    return &c->shards[(hash >> 32) % (uint64_t)c->nshards];
+}
+
+/* Find the slot holding a key, or -1.  The shard must be locked. */
+static int32_t find_slot(CACHE_Shard *sh, uint64_t hash, const char *key, size_t key_len)
+{
+    for (int32_t i = sh->buckets[hash & sh->bucket_mask]; i >= 0; i = sh->slots[i].next) {
+        CACHE_Slot *sl = &sh->slots[i];
+        if (sl->hash == hash && sl->key_len == key_len && memcmp(sl->key, key, key_len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Empty an occupied slot, unlinking it from its chain.  The shard must be locked. */
+static void clear_slot(CACHE_Shard *sh, int32_t i)
+{
+    CACHE_Slot *sl = &sh->slots[i];
+    int32_t *link = &sh->buckets[sl->hash & sh->bucket_mask];
+    while (*link != i) link = &sh->slots[*link].next;
+    *link = sl->next;
+
+    free(sl->key);
+    CACHE_release(sl->val);
+    sl->key = NULL;
+    sl->val = NULL;
+    sh->used--;
+}
+
+/**
+ * @brief Look up the response cached for a key.
+ *
+ * @param c        The cache.
+ * @param key      The key (the query text).
+ * @param key_len  Length of the key.
+ * @return A new reference to the response, to be released by the caller
+ * with CACHE_release, or NULL on a miss.
+ */
+CACHE_Value *CACHE_lookup(CACHE_Cache *c, const char *key, size_t key_len)
+{
+    if (!c) return NULL;
+    uint64_t hash = hash_key(key, key_len);
+    uint64_t gen = CACHE_generation(c);
+    CACHE_Shard *sh = shard_for(c, hash);
+    CACHE_Value *v = NULL;
+
+    pthread_mutex_lock(&sh->lock);
+    int32_t i = find_slot(sh, hash, key, key_len);
+    if (i >= 0 && sh->slots[i].gen != gen) {
+        clear_slot(sh, i);
+        i = -1;
+    }
+    if (i >= 0) {
+        sh->slots[i].ref = 1;
+        v = sh->slots[i].val;
+        CACHE_retain(v);
+        sh->hits++;
+    } else {
+        sh->misses++;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return v;
+}
+
+/**
+ * @brief Cache a response.
+ *
+ * The cache takes its own reference to the value; the caller keeps theirs.
+ * If the shard is full, the CLOCK hand picks a victim: entries from an old
+ * generation first, then entries that have not been hit since the hand
+ * last passed them.
+ *
+ * @param c        The cache.
+ * @param key      The key (the query text).
+ * @param key_len  Length of the key.
+ * @param gen      Generation the response was computed in (see
+ *                 CACHE_generation).  Stale responses are not cached.
+ * @param v        The response.
+ */
+void CACHE_insert(CACHE_Cache *c, const char *key, size_t key_len, uint64_t gen, CACHE_Value *v)
+{
+    if (!c || !v) return;
+    uint64_t hash = hash_key(key, key_len);
+    CACHE_Shard *sh = shard_for(c, hash);
+    char *key_copy = malloc(key_len ? key_len : 1);
+    if (!key_copy) return;
+    memcpy(key_copy, key, key_len);
+
+    pthread_mutex_lock(&sh->lock);
+    uint64_t cur = CACHE_generation(c);
+    if (gen != cur) {
+        pthread_mutex_unlock(&sh->lock);
+        free(key_copy);
+        return;
+    }
+
+    int32_t i = find_slot(sh, hash, key, key_len);
+    if (i >= 0) clear_slot(sh, i);
+
+    // Advance the hand to a free slot, or to a victim.  Each slot is passed
+    // at most twice: the first pass clears its reference bit.
+    while (1) {
+        CACHE_Slot *sl = &sh->slots[sh->hand];
+        if (!sl->val) break;
+        if (sl->gen != cur || !sl->ref) {
+            clear_slot(sh, (int32_t)sh->hand);
+            sh->evictions++;
+            break;
+        }
+        sl->ref = 0;
+        sh->hand = (sh->hand + 1) % sh->num_slots;
+    }
+
+    i = (int32_t)sh->hand;
+    CACHE_Slot *sl = &sh->slots[i];
+    sl->hash = hash;
+    sl->gen = gen;
+    sl->key = key_copy;
+    sl->key_len = key_len;
+    sl->val = v;
+    sl->ref = 0;
+    CACHE_retain(v);
+    sl->next = sh->buckets[hash & sh->bucket_mask];
+    sh->buckets[hash & sh->bucket_mask] = i;
+    sh->used++;
+    sh->insertions++;
+    sh->hand = (sh->hand + 1) % sh->num_slots;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/**
+ * @brief Collect the counters of all shards of a cache.
+ */
+void CACHE_get_stats(CACHE_Cache *c, CACHE_Stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!c) return;
+    st->capacity = c->capacity;
+    st->generation = CACHE_generation(c);
+    for (int s = 0; s < c->nshards; s++) {
+        CACHE_Shard *sh = &c->shards[s];
+        pthread_mutex_lock(&sh->lock);
+        st->hits += sh->hits;
+        st->misses += sh->misses;
+        st->insertions += sh->insertions;
+        st->evictions += sh->evictions;
+        st->entries += sh->used;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "catalog.h"
+#include "debug.h"
+
+typedef struct {
+    char *name;
+    char *file;
+    CAT_Map *cur;           // The loaded map, or NULL
+    int loading;            // Nonzero while a thread is reading the map
+    uint64_t reads;         // Reads of the map finished, successfully or not
+    int failed;             // Nonzero if the last read failed
+} CAT_Entry;
+
+struct CAT_Catalog {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;  // Signalled when a map has been read (or not)
+    CAT_Entry *entries;
+    int num_entries;
+    int cap_entries;
+    size_t budget;
+    size_t bytes;           // Heap memory of all live CAT_Maps
+    int live;               // Number of live CAT_Maps
+    uint64_t clock;         // Counts acquisitions, for LRU order
+    uint64_t generation;    // Counts calls to CAT_invalidate
+    uint64_t loads;
+    uint64_t load_failures;
+    uint64_t evictions;
+};
+
+/**
+ * @brief Create an empty catalog.
+ * @param budget  Memory budget for loaded maps, in bytes (0: unlimited).
+ * @return The catalog, or NULL if memory could not be allocated.
+ */
+CAT_Catalog *CAT_create(size_t budget)
+{
+    CAT_Catalog *cat = calloc(1, sizeof(CAT_Catalog));
+    if (!cat) return NULL;
+    cat->budget = budget;
+    pthread_mutex_init(&cat->lock, NULL);
+    pthread_cond_init(&cat->loaded, NULL);
+    return cat;
+}
+
+/**
+ * @brief Free a catalog and all loaded maps.  No map may be in use.
+ */
+void CAT_destroy(CAT_Catalog *cat)
+{
+    if (!cat) return;
+    for (int i = 0; i < cat->num_entries; i++) {
+        CAT_Entry *e = &cat->entries[i];
+        if (e->cur) {
+            OSM_free_Map(e->cur->mp);
+            free(e->cur);
+        }
+        free(e->name);
+        free(e->file);
+    }
+    free(cat->entries);
+    pthread_mutex_destroy(&cat->lock);
+    pthread_cond_destroy(&cat->loaded);
+    free(cat);
+}
+
+/**
+ * @brief Add a named map to a catalog.  The map is not read yet.
+ *
+ * @param cat   The catalog.
+ * @param spec  "name=file".  The name must be non-empty, must not contain
+ *              white space and must not already be in the catalog.
+ * @return 0 on success, -1 if the spec is invalid or memory could not be
+ * allocated.
+ */
+int CAT_add(CAT_Catalog *cat, const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || eq[1] == '\0') return -1;
+    size_t name_len = eq - spec;
+    if (strcspn(spec, " \t\r\n") < name_len) return -1;
+    if (CAT_find(cat, spec, name_len) >= 0) return -1;
+
+    if (cat->num_entries == cat->cap_entries) {
+        int cap = cat->cap_entries ? 2 * cat->cap_entries : 8;
+        CAT_Entry *entries = realloc(cat->entries, cap * sizeof(CAT_Entry));
+        if (!entries) return -1;
+        cat->entries = entries;
+        cat->cap_entries = cap;
+    }
+    CAT_Entry *e = &cat->entries[cat->num_entries];
+    memset(e, 0, sizeof(*e));
+    e->name = strndup(spec, name_len);
+    e->file = strdup(eq + 1);
+    if (!e->name || !e->file) {
+        free(e->name);
+        free(e->file);
+        return -1;
+    }
+    cat->num_entries++;
+    return 0;
+}
+
+/**
+ * @brief Find a map by name.
+ * @return Its index, or -1 if the catalog has no map of that name.
+ */
+int CAT_find(CAT_Catalog *cat, const char *name, size_t name_len)
+{
+    if (!cat) return -1;
+    for (int i = 0; i < cat->num_entries; i++) {
+        const char *n = cat->entries[i].name;
+        if (strncmp(n, name, name_len) == 0 && n[name_len] == '\0') return i;
+    }
+    return -1;
+}
+
+/* Read and compact a map file, or return NULL. */
+static OSM_Map *read_map(const char *filename)
+{
+    FILE *in = fopen(filename, "rb");
+    if (!in) return NULL;
+    OSM_Map *mp = OSM_read_Map(in);
+    fclose(in);
+    if (mp) OSM_Map_compact(mp);
+    return mp;
+}
+
+/* Drop a reference to a map.  The catalog must be locked.
+ * Returns 1 if the map is no longer referenced and must now be freed. */
+static int drop_ref(CAT_Catalog *cat, CAT_Map *m)
+{
+    if (--m->refs > 0) return 0;
+    cat->bytes -= m->bytes;
+    cat->live--;
+    return 1;
+}
+
+static void free_map(CAT_Map *m)
+{
+    OSM_free_Map(m->mp);
+    free(m);
+}
+
+/*
+ * Read the map of an entry.  The catalog must be locked; it is unlocked
+ * while reading, and locked again on return.  A map read while the catalog
+ * was invalidated may come from a file that has since changed, so it is
+ * dropped and read again.
+ */
+static CAT_Map *read_entry(CAT_Catalog *cat, CAT_Entry *e)
+{
+    while (1) {
+        uint64_t generation = cat->generation;
+        pthread_mutex_unlock(&cat->lock);
+        CAT_Map *m = NULL;
+        OSM_Map *mp = read_map(e->file);
+        if (mp && !(m = calloc(1, sizeof(CAT_Map)))) OSM_free_Map(mp);
+        if (m) m->mp = mp;
+        pthread_mutex_lock(&cat->lock);
+        if (cat->generation == generation) return m;
+        pthread_mutex_unlock(&cat->lock);
+        debug("DEBUG: read_entry - map '%s' invalidated while being read.\n", e->name);
+        if (m) free_map(m);
+        pthread_mutex_lock(&cat->lock);
+    }
+}
+
+/*
+ * Free least recently used idle maps until the loaded maps fit in the
+ * budget, or no map is idle.  Maps are freed without holding the lock.
+ */
+static void trim(CAT_Catalog *cat)
+{
+    while (1) {
+        pthread_mutex_lock(&cat->lock);
+        CAT_Entry *victim = NULL;
+        if (cat->budget && cat->bytes > cat->budget) {
+            for (int i = 0; i < cat->num_entries; i++) {
+                CAT_Map *m = cat->entries[i].cur;
+                if (m && m->refs == 1 && (!victim || m->last_used < victim->cur->last_used))
+                    victim = &cat->entries[i];
+            }
+        }
+        if (!victim) {
+            pthread_mutex_unlock(&cat->lock);
+            return;
+        }
+        CAT_Map *m = victim->cur;
+        victim->cur = NULL;
+        drop_ref(cat, m);
+        cat->evictions++;
+        pthread_mutex_unlock(&cat->lock);
+        debug("DEBUG: trim - evicted map '%s'.\n", victim->name);
+        free_map(m);
+    }
+}
+
+/**
+ * @brief Get a reference to a map, reading it first if it is not loaded.
+ *
+ * Only one thread reads a given map; others asking for it meanwhile wait
+ * for the result, and all get NULL if the read fails.  Loading a map may
+ * evict others to stay within budget.
+ *
+ * @param cat    The catalog.
+ * @param index  Index of the map, from CAT_find.
+ * @return The map, to be released with CAT_release, or NULL if it could
+ * not be read.
+ */
+CAT_Map *CAT_acquire(CAT_Catalog *cat, int index)
+{
+    CAT_Entry *e = &cat->entries[index];
+    pthread_mutex_lock(&cat->lock);
+    if (e->loading) {
+        uint64_t reads = e->reads;
+        while (e->loading) pthread_cond_wait(&cat->loaded, &cat->lock);
+        if (e->reads != reads && e->failed) {
+            pthread_mutex_unlock(&cat->lock);
+            return NULL;
+        }
+    }
+    CAT_Map *m = e->cur;
+    if (m) {
+        m->refs++;
+        m->last_used = ++cat->clock;
+        pthread_mutex_unlock(&cat->lock);
+        return m;
+    }
+    e->loading = 1;
+    m = read_entry(cat, e);
+    e->loading = 0;
+    e->reads++;
+    e->failed = !m;
+    pthread_cond_broadcast(&cat->loaded);
+    if (!m) {
+        cat->load_failures++;
+        pthread_mutex_unlock(&cat->lock);
+        fprintf(stderr, "ERROR: Cannot read map '%s' from '%s'.\n", e->name, e->file);
+        return NULL;
+    }
+    OSM_Map_Memory mem;
+    OSM_Map_get_memory(m->mp, &mem);
+    m->refs = 2;            // The catalog's and the caller's
+    m->bytes = mem.nodes + mem.ways + mem.refs + mem.tags + mem.handles + mem.indexes;
+    m->last_used = ++cat->clock;
+    e->cur = m;
+    cat->bytes += m->bytes;
+    cat->live++;
+    cat->loads++;
+    pthread_mutex_unlock(&cat->lock);
+    debug("DEBUG: CAT_acquire - loaded map '%s' (%zu bytes).\n", e->name, m->bytes);
+
+    trim(cat);
+    return m;
+}
+
+/**
+ * @brief Release a reference obtained with CAT_acquire.
+ */
+void CAT_release(CAT_Catalog *cat, CAT_Map *m)
+{
+    if (!m) return;
+    pthread_mutex_lock(&cat->lock);
+    int last = drop_ref(cat, m);
+    int over = cat->budget && cat->bytes > cat->budget;
+    pthread_mutex_unlock(&cat->lock);
+    if (last) free_map(m);
+    else if (over) trim(cat);
+}
+
+/**
+ * @brief Drop every loaded map, so that each is read again when next used.
+ *
+ * Maps being read are read again before they are returned.
+ */
+void CAT_invalidate(CAT_Catalog *cat)
+{
+    if (!cat) return;
+    pthread_mutex_lock(&cat->lock);
+    cat->generation++;
+    pthread_mutex_unlock(&cat->lock);
+    for (int i = 0; i < cat->num_entries; i++) {
+        pthread_mutex_lock(&cat->lock);
+        CAT_Map *m = cat->entries[i].cur;
+        cat->entries[i].cur = NULL;
+        int last = m && drop_ref(cat, m);
+        pthread_mutex_unlock(&cat->lock);
+        if (last) free_map(m);
+    }
+}
+
+/**
+ * @brief Collect the counters of a catalog.
+ */
+void CAT_get_stats(CAT_Catalog *cat, CAT_Stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!cat) return;
+    pthread_mutex_lock(&cat->lock);
+    st->maps = cat->num_entries;
+    st->loaded = cat->live;
+    st->bytes = cat->bytes;
+    st->budget = cat->budget;
+    st->loads = cat->loads;
+    st->load_failures = cat->load_failures;
+    st->evictions = cat->evictions;
+    pthread_mutex_unlock(&cat->lock);
+}
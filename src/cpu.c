@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "debug.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define CPU_X86 1
+#endif
+
+static const char *level_names[CPU_NUM_LEVELS] = {"scalar", "sse4.2", "avx2", "avx512"};
+
+/* Decode the varint at *pp, which must be before end.  Bits past 64 are
+ * dropped, as protobuf does. */
+static inline int decode_varint(const uint8_t **pp, const uint8_t *end, uint64_t *v)
+{
+    const uint8_t *p = *pp;
+    uint64_t x = 0;
+    int shift = 0;
+    while (p < end && (*p & 0x80)) {
+        if (shift < 64) x |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+        p++;
+    }
+    if (p == end) return -1;
+    if (shift < 64) x |= (uint64_t)*p << shift;
+    *pp = p + 1;
+    *v = x;
+    return 0;
+}
+
+static int64_t varints_scalar(const uint8_t *p, const uint8_t *end, uint64_t *out)
+{
+    int64_t n = 0;
+    while (p < end) {
+        if (decode_varint(&p, end, &out[n++]) < 0) return -1;
+    }
+    return n;
+}
+
+static void deltas_scalar(const uint64_t *in, int64_t *out, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += (in[i] >> 1) ^ -(in[i] & 1);
+        out[i] = (int64_t)sum;
+    }
+}
+
+#ifdef CPU_X86
+
+/*
+ * The SIMD varint decoders test a vector of bytes for continuation bits at
+ * once.  A vector of one-byte values, as small deltas and string indices
+ * are, is widened in place; otherwise the one-byte values before the first
+ * continuation byte are copied and the next varint is decoded alone.
+ */
+
+__attribute__((target("sse4.2")))
+static int64_t varints_sse42(const uint8_t *p, const uint8_t *end, uint64_t *out)
+{
+    int64_t n = 0;
+    while (end - p >= 16) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p));
+        if (mask == 0) {
+            for (int k = 0; k < 16; k += 2) {
+                uint16_t w;
+                memcpy(&w, p + k, sizeof(w));
+                _mm_storeu_si128((__m128i *)&out[n + k], _mm_cvtepu8_epi64(_mm_cvtsi32_si128(w)));
+            }
+            n += 16;
+            p += 16;
+            continue;
+        }
+        for (int run = __builtin_ctz(mask); run > 0; run--) out[n++] = *p++;
+        if (decode_varint(&p, end, &out[n++]) < 0) return -1;
+    }
+    int64_t rest = varints_scalar(p, end, &out[n]);
+    return rest < 0 ? -1 : n + rest;
+}
+
+__attribute__((target("avx2")))
+static int64_t varints_avx2(const uint8_t *p, const uint8_t *end, uint64_t *out)
+{
+    int64_t n = 0;
+    while (end - p >= 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)p));
+        if (mask == 0) {
+            for (int k = 0; k < 32; k += 4) {
+                uint32_t w;
+                memcpy(&w, p + k, sizeof(w));
+                _mm256_storeu_si256((__m256i *)&out[n + k], _mm256_cvtepu8_epi64(_mm_cvtsi32_si128((int)w)));
+            }
+            n += 32;
+            p += 32;
+            continue;
+        }
+        for (int run = __builtin_ctz(mask); run > 0; run--) out[n++] = *p++;
+        if (decode_varint(&p, end, &out[n++]) < 0) return -1;
+    }
+    int64_t rest = varints_sse42(p, end, &out[n]);
+    return rest < 0 ? -1 : n + rest;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int64_t varints_avx512(const uint8_t *p, const uint8_t *end, uint64_t *out)
+{
+    int64_t n = 0;
+    while (end - p >= 64) {
+        uint64_t mask = _mm512_movepi8_mask(_mm512_loadu_si512((const void *)p));
+        if (mask == 0) {
+            for (int k = 0; k < 64; k += 8) {
+                _mm512_storeu_si512((void *)&out[n + k], _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i *)(p + k))));
+            }
+            n += 64;
+            p += 64;
+            continue;
+        }
+        for (int run = __builtin_ctzll(mask); run > 0; run--) out[n++] = *p++;
+        if (decode_varint(&p, end, &out[n++]) < 0) return -1;
+    }
+    int64_t rest = varints_avx2(p, end, &out[n]);
+    return rest < 0 ? -1 : n + rest;
+}
+
+/*
+ * The SIMD delta decoders zigzag-decode a vector, sum it in log2(lanes)
+ * shift-and-add steps, and add the last sum of the vector before.
+ */
+
+__attribute__((target("sse4.2")))
+static void deltas_sse42(const uint64_t *in, int64_t *out, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi64x(1);
+    __m128i carry = zero;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+        __m128i z = _mm_xor_si128(_mm_srli_epi64(v, 1), _mm_sub_epi64(zero, _mm_and_si128(v, one)));
+        z = _mm_add_epi64(z, _mm_slli_si128(z, 8));
+        z = _mm_add_epi64(z, carry);
+        _mm_storeu_si128((__m128i *)&out[i], z);
+        carry = _mm_shuffle_epi32(z, _MM_SHUFFLE(3, 2, 3, 2));
+    }
+    uint64_t sum = (uint64_t)_mm_cvtsi128_si64(carry);
+    for (; i < n; i++) {
+        sum += (in[i] >> 1) ^ -(in[i] & 1);
+        out[i] = (int64_t)sum;
+    }
+}
+
+__attribute__((target("avx2")))
+static void deltas_avx2(const uint64_t *in, int64_t *out, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi64x(1);
+    __m256i carry = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&in[i]);
+        __m256i z = _mm256_xor_si256(_mm256_srli_epi64(v, 1), _mm256_sub_epi64(zero, _mm256_and_si256(v, one)));
+        // Lanes shifted up by one, then by two, with zeros coming in.
+        z = _mm256_add_epi64(z, _mm256_blend_epi32(_mm256_permute4x64_epi64(z, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        z = _mm256_add_epi64(z, _mm256_blend_epi32(_mm256_permute4x64_epi64(z, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0f));
+        z = _mm256_add_epi64(z, carry);
+        _mm256_storeu_si256((__m256i *)&out[i], z);
+        carry = _mm256_permute4x64_epi64(z, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    uint64_t sum = (uint64_t)_mm256_extract_epi64(carry, 0);
+    for (; i < n; i++) {
+        sum += (in[i] >> 1) ^ -(in[i] & 1);
+        out[i] = (int64_t)sum;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void deltas_avx512(const uint64_t *in, int64_t *out, size_t n)
+{
+    const __m512i zero = _mm512_setzero_si512(), one = _mm512_set1_epi64(1), last = _mm512_set1_epi64(7);
+    __m512i carry = zero;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i v = _mm512_loadu_si512((const void *)&in[i]);
+        __m512i z = _mm512_xor_si512(_mm512_srli_epi64(v, 1), _mm512_sub_epi64(zero, _mm512_and_si512(v, one)));
+        // alignr with zeros below shifts the lanes up by 8 - imm.
+        z = _mm512_add_epi64(z, _mm512_alignr_epi64(z, zero, 7));
+        z = _mm512_add_epi64(z, _mm512_alignr_epi64(z, zero, 6));
+        z = _mm512_add_epi64(z, _mm512_alignr_epi64(z, zero, 4));
+        z = _mm512_add_epi64(z, carry);
+        _mm512_storeu_si512((void *)&out[i], z);
+        carry = _mm512_permutexvar_epi64(last, z);
+    }
+    uint64_t sum = (uint64_t)_mm_cvtsi128_si64(_mm512_castsi512_si128(carry));
+    for (; i < n; i++) {
+        sum += (in[i] >> 1) ^ -(in[i] & 1);
+        out[i] = (int64_t)sum;
+    }
+}
+
+#endif
+
+static const CPU_Kernels all_kernels[CPU_NUM_LEVELS] = {
+    {CPU_SCALAR, varints_scalar, deltas_scalar},
+#ifdef CPU_X86
+    {CPU_SSE42, varints_sse42, deltas_sse42},
+    {CPU_AVX2, varints_avx2, deltas_avx2},
+    {CPU_AVX512, varints_avx512, deltas_avx512},
+#endif
+};
+
+CPU_Kernels CPU_kernels = {CPU_SCALAR, varints_scalar, deltas_scalar};
+
+/**
+ * @brief Find the highest level of kernels this CPU can run.
+ *
+ * @return The level, CPU_SCALAR if not on x86-64.
+ */
+CPU_Level CPU_detect(void)
+{
+#ifdef CPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return CPU_AVX512;
+    if (__builtin_cpu_supports("avx2")) return CPU_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return CPU_SSE42;
+#endif
+    return CPU_SCALAR;
+}
+
+/**
+ * @brief Bind the kernels of a level in CPU_kernels.
+ *
+ * This is not synchronized with the decoders, so it is meant for startup
+ * and for tests, while nothing is being decoded.
+ *
+ * @param level  The level, which the CPU must support.
+ * @return 0 on success, -1 if the CPU does not support the level.
+ */
+int CPU_select(CPU_Level level)
+{
+    if (level < CPU_SCALAR || level > CPU_detect()) return -1;
+    CPU_kernels = all_kernels[level];
+    return 0;
+}
+
+/**
+ * @brief Name of a level, as PBF_CPU_LEVEL takes it.
+ */
+const char *CPU_level_name(CPU_Level level)
+{
+    return (level >= CPU_SCALAR && level < CPU_NUM_LEVELS) ? level_names[level] : "unknown";
+}
+
+/* Bind the kernels of the highest level supported, or of PBF_CPU_LEVEL. */
+__attribute__((constructor))
+static void bind_kernels(void)
+{
+    CPU_Level level = CPU_detect();
+    const char *forced = getenv("PBF_CPU_LEVEL");
+    if (forced && *forced) {
+        CPU_Level want = CPU_NUM_LEVELS;
+        for (int l = 0; l < CPU_NUM_LEVELS; l++) {
+            if (strcmp(forced, level_names[l]) == 0) want = (CPU_Level)l;
+        }
+        if (want == CPU_NUM_LEVELS) {
+            fprintf(stderr, "WARNING: Unknown PBF_CPU_LEVEL '%s', using %s.\n", forced, level_names[level]);
+        } else if (want > level) {
+            fprintf(stderr, "WARNING: PBF_CPU_LEVEL %s is not supported by this CPU, using %s.\n", forced,
+                    level_names[level]);
+        } else {
+            level = want;
+        }
+    }
+    CPU_select(level);
+    debug("DEBUG: CPU kernels - %s.\n", level_names[level]);
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "crack.h"
+#include "debug.h"
+
+/* Pieces at most this long are sorted rather than cracked further. */
+#define CRK_SORT_MAX 1024
+
+/* One entry of the cracked copy of the column. */
+typedef struct {
+    OSM_Id id;
+    int64_t row;
+} CRK_Entry;
+
+struct CRK_Index {
+    pthread_mutex_t lock;
+    CRK_Entry *entries;     // The column, partitioned around every crack
+    int64_t num;
+    OSM_Id *crack_ids;      // Ids of the cracks, ascending
+    int64_t *crack_pos;     // First entry with an id >= crack_ids[k]
+    unsigned char *crack_sorted; // Nonzero if the piece from crack_pos[k] is sorted
+    unsigned char first_sorted; // Nonzero if the piece before the first crack is sorted
+    int64_t num_cracks;
+    int64_t cap_cracks;
+};
+
+/**
+ * @brief Create a cracked index over an id column.
+ *
+ * @param ids  The id column, in any order.  It is copied.
+ * @param num  The number of ids.
+ * @return The index, or NULL if memory could not be allocated.
+ */
+CRK_Index *CRK_create(const OSM_Id *ids, int64_t num)
+{
+    CRK_Index *ix = calloc(1, sizeof(CRK_Index));
+    if (!ix) return NULL;
+    ix->entries = malloc((num ? num : 1) * sizeof(CRK_Entry));
+    if (!ix->entries) {
+        free(ix);
+        return NULL;
+    }
+    for (int64_t r = 0; r < num; r++) {
+        ix->entries[r].id = ids[r];
+        ix->entries[r].row = r;
+    }
+    ix->num = num;
+    pthread_mutex_init(&ix->lock, NULL);
+    return ix;
+}
+
+/**
+ * @brief Free a cracked index.
+ */
+void CRK_free(CRK_Index *ix)
+{
+    if (!ix) return;
+    pthread_mutex_destroy(&ix->lock);
+    free(ix->entries);
+    free(ix->crack_ids);
+    free(ix->crack_pos);
+    free(ix->crack_sorted);
+    free(ix);
+}
+
+/* Record a crack at position k of the crack list.  Failing to grow the list
+ * only loses the crack (and returns -1); later lookups will make it again. */
+static int add_crack(CRK_Index *ix, int64_t k, OSM_Id id, int64_t pos)
+{
+    if (ix->num_cracks == ix->cap_cracks) {
+        int64_t cap = ix->cap_cracks ? 2 * ix->cap_cracks : 64;
+        OSM_Id *cids = realloc(ix->crack_ids, cap * sizeof(OSM_Id));
+        if (cids) ix->crack_ids = cids;
+        int64_t *cpos = realloc(ix->crack_pos, cap * sizeof(int64_t));
+        if (cpos) ix->crack_pos = cpos;
+        unsigned char *csorted = realloc(ix->crack_sorted, cap);
+        if (csorted) ix->crack_sorted = csorted;
+        if (!cids || !cpos || !csorted) return -1;
+        ix->cap_cracks = cap;
+    }
+    memmove(&ix->crack_ids[k + 1], &ix->crack_ids[k], (ix->num_cracks - k) * sizeof(OSM_Id));
+    memmove(&ix->crack_pos[k + 1], &ix->crack_pos[k], (ix->num_cracks - k) * sizeof(int64_t));
+    memmove(&ix->crack_sorted[k + 1], &ix->crack_sorted[k], ix->num_cracks - k);
+    ix->crack_ids[k] = id;
+    ix->crack_pos[k] = pos;
+    ix->crack_sorted[k] = 0;
+    ix->num_cracks++;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const CRK_Entry *x = a, *y = b;
+    if (x->id != y->id) return (x->id > y->id) - (x->id < y->id);
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+/* The number of cracks below an id. */
+static int64_t find_crack(CRK_Index *ix, OSM_Id id)
+{
+    int64_t lo = 0, hi = ix->num_cracks;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (ix->crack_ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Prepare a lookup in the piece after the first k cracks, which holds an id
+ * that is not itself a crack: get its bounds and, if it is small or sorted
+ * already, sort it and return the first entry with an id >= id.  Returns -1
+ * if the piece has to be partitioned instead.
+ */
+static int64_t open_piece(CRK_Index *ix, int64_t k, OSM_Id id, int64_t *beginp, int64_t *endp)
+{
+    int64_t begin = (k > 0) ? ix->crack_pos[k - 1] : 0;
+    int64_t end = (k < ix->num_cracks) ? ix->crack_pos[k] : ix->num;
+    unsigned char *sorted = (k > 0) ? &ix->crack_sorted[k - 1] : &ix->first_sorted;
+    *beginp = begin;
+    *endp = end;
+    if (!*sorted && end - begin > CRK_SORT_MAX) return -1;
+
+    CRK_Entry *e = ix->entries;
+    if (!*sorted) {
+        qsort(e + begin, end - begin, sizeof(CRK_Entry), compare_entries);
+        *sorted = 1;
+    }
+    while (begin < end) {
+        int64_t mid = begin + (end - begin) / 2;
+        if (e[mid].id < id) begin = mid + 1;
+        else end = mid;
+    }
+    return begin;
+}
+
+/*
+ * Crack the index at an id: partition the piece holding the id so that the
+ * entries below it come first.  A piece of at most CRK_SORT_MAX entries is
+ * sorted instead, once, and then binary searched.  The index must be locked.
+ * Returns the position of the first entry with an id >= id.
+ */
+static int64_t crack(CRK_Index *ix, OSM_Id id)
+{
+    // The piece is bounded by the nearest cracks on either side of the id.
+    int64_t k = find_crack(ix, id);
+    if (k < ix->num_cracks && ix->crack_ids[k] == id) return ix->crack_pos[k];
+    int64_t begin, end;
+    int64_t pos = open_piece(ix, k, id, &begin, &end);
+    if (pos >= 0) return pos;
+
+    CRK_Entry *e = ix->entries;
+    int64_t i = begin, j = end - 1;
+    while (i <= j) {
+        if (e[i].id < id) {
+            i++;
+        } else {
+            CRK_Entry t = e[i];
+            e[i] = e[j];
+            e[j--] = t;
+        }
+    }
+    add_crack(ix, k, id, i);
+    return i;
+}
+
+/* The position of the first entry with an id > id.  The index must be locked. */
+static int64_t crack_after(CRK_Index *ix, OSM_Id id)
+{
+    return (id == INT64_MAX) ? ix->num : crack(ix, id + 1);
+}
+
+/*
+ * Crack the index at an id and the next one, finding the entries holding
+ * the id.  When neither is a crack yet and the piece has to be partitioned,
+ * this is done in a single three-way pass.  The index must be locked.
+ */
+static void crack_id(CRK_Index *ix, OSM_Id id, int64_t *firstp, int64_t *lastp)
+{
+    int64_t k = find_crack(ix, id);
+    int64_t begin, end;
+    if (id == INT64_MAX || (k < ix->num_cracks && ix->crack_ids[k] <= id + 1) ||
+        open_piece(ix, k, id, &begin, &end) >= 0) {
+        *firstp = crack(ix, id);
+        *lastp = crack_after(ix, id);
+        return;
+    }
+
+    // Entries below the id go to [begin, i), equal ones to [i, m), and
+    // greater ones to (j, end).
+    CRK_Entry *e = ix->entries;
+    int64_t i = begin, m = begin, j = end - 1;
+    while (m <= j) {
+        CRK_Entry t = e[m];
+        if (t.id < id) {
+            e[m++] = e[i];
+            e[i++] = t;
+        } else if (t.id > id) {
+            e[m] = e[j];
+            e[j--] = t;
+        } else {
+            m++;
+        }
+    }
+    if (add_crack(ix, k, id, i) == 0) add_crack(ix, k + 1, id + 1, m);
+    *firstp = i;
+    *lastp = m;
+}
+
+/* The first row holding an id, or -1.  The index must be locked. */
+static int64_t find_locked(CRK_Index *ix, OSM_Id id)
+{
+    int64_t first, last;
+    crack_id(ix, id, &first, &last);
+    int64_t row = -1;
+    for (int64_t i = first; i < last; i++) {
+        if (row < 0 || ix->entries[i].row < row) row = ix->entries[i].row;
+    }
+    return row;
+}
+
+/**
+ * @brief Look up an id, cracking the index around it.
+ *
+ * @param ix  The index.
+ * @param id  The id to look up.
+ * @return The row of the id (the first, if it occurs more than once), or
+ * -1 if it does not occur.
+ */
+int64_t CRK_find(CRK_Index *ix, OSM_Id id)
+{
+    pthread_mutex_lock(&ix->lock);
+    int64_t row = find_locked(ix, id);
+    pthread_mutex_unlock(&ix->lock);
+    return row;
+}
+
+/**
+ * @brief Look up a batch of ids, cracking the index around each.
+ *
+ * The lock is taken once for the whole batch, rather than once per id, so
+ * that threads looking up batches at once do not queue on it for every id.
+ *
+ * @param ix         The index.
+ * @param ids        The ids to look up.
+ * @param n          Their number.
+ * @param out_index  Receives the row of each id, as CRK_find returns it.
+ */
+void CRK_find_many(CRK_Index *ix, const OSM_Id *ids, size_t n, int64_t *out_index)
+{
+    pthread_mutex_lock(&ix->lock);
+    for (size_t q = 0; q < n; q++) out_index[q] = find_locked(ix, ids[q]);
+    pthread_mutex_unlock(&ix->lock);
+}
+
+static int compare_rows(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Find the rows whose ids lie in [lo, hi], cracking the index at
+ * both ends of the range.
+ *
+ * @param ix      The index.
+ * @param lo      Lowest id of the range.
+ * @param hi      Highest id of the range.
+ * @param rowsp   Receives a malloc'd array of the rows, in ascending order,
+ *                to be freed by the caller.
+ * @param countp  Receives the number of rows.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int CRK_range(CRK_Index *ix, OSM_Id lo, OSM_Id hi, int64_t **rowsp, int64_t *countp)
+{
+    *rowsp = NULL;
+    *countp = 0;
+    if (lo > hi) return 0;
+    pthread_mutex_lock(&ix->lock);
+    int64_t first = crack(ix, lo);
+    int64_t last = crack_after(ix, hi);
+    int64_t count = last - first;
+    int64_t *rows = malloc((count ? count : 1) * sizeof(int64_t));
+    if (rows) {
+        for (int64_t i = 0; i < count; i++) rows[i] = ix->entries[first + i].row;
+    }
+    pthread_mutex_unlock(&ix->lock);
+    if (!rows) return -1;
+    qsort(rows, count, sizeof(int64_t), compare_rows);
+    *rowsp = rows;
+    *countp = count;
+    return 0;
+}
+
+/**
+ * @brief Get the number of cracks made so far.
+ */
+int64_t CRK_get_num_cracks(CRK_Index *ix)
+{
+    if (!ix) return 0;
+    pthread_mutex_lock(&ix->lock);
+    int64_t n = ix->num_cracks;
+    pthread_mutex_unlock(&ix->lock);
+    return n;
+}
+
+/**
+ * @brief Get the heap memory used by an index, in bytes.
+ */
+size_t CRK_get_memory(CRK_Index *ix)
+{
+    if (!ix) return 0;
+    pthread_mutex_lock(&ix->lock);
+    size_t bytes = (size_t)ix->num * sizeof(CRK_Entry)
+                 + (size_t)ix->cap_cracks * (sizeof(OSM_Id) + sizeof(int64_t) + 1);
+    pthread_mutex_unlock(&ix->lock);
+    return bytes;
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "diff.h"
+#include "pbf.h"
+#include "outbuf.h"
+#include "debug.h"
+
+typedef enum {
+    DIF_NONE,
+    DIF_CREATE,
+    DIF_MODIFY,
+    DIF_DELETE
+} DIF_Action;
+
+static const char *action_names[] = {NULL, "create", "modify", "delete"};
+static const char *type_names[] = {"node", "way", "relation"};
+
+/* One side of the join. */
+typedef struct {
+    PBF_Reader *r;
+    const PBF_Entity *cur;      // NULL once the file is exhausted
+    PBF_Type last_type;
+    OSM_Id last_id;
+    const char *name;
+} DIF_Side;
+
+static int compare_keys(const PBF_Entity *a, const PBF_Entity *b)
+{
+    if (a->type != b->type) return (a->type > b->type) - (a->type < b->type);
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+/* Read the next entity of a side, checking that the file is sorted with
+ * one version of each entity.  Returns -1 on error. */
+static int advance(DIF_Side *s)
+{
+    if (s->cur) {
+        s->last_type = s->cur->type;
+        s->last_id = s->cur->id;
+    }
+    int had = (s->cur != NULL);
+    int rc = PBF_next(s->r, &s->cur);
+    if (rc <= 0) s->cur = NULL;
+    if (rc < 0) return -1;
+    if (rc > 0 && had) {
+        PBF_Entity last = {.type = s->last_type, .id = s->last_id};
+        if (compare_keys(&last, s->cur) >= 0) {
+            fprintf(stderr, "ERROR: The %s file is not sorted by type, then id, without duplicates.\n", s->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Do two entities of the same type and id have the same content? */
+static int same_content(const PBF_Entity *a, const PBF_Entity *b)
+{
+    if (a->hash != b->hash) return 0;
+    if (a->lat != b->lat || a->lon != b->lon || a->num_tags != b->num_tags ||
+        a->num_refs != b->num_refs || a->num_members != b->num_members) return 0;
+    for (int i = 0; i < a->num_tags; i++) {
+        if (strcmp(a->keys[i], b->keys[i]) != 0 || strcmp(a->vals[i], b->vals[i]) != 0) return 0;
+    }
+    if (a->num_refs && memcmp(a->refs, b->refs, a->num_refs * sizeof(OSM_Id)) != 0) return 0;
+    for (int i = 0; i < a->num_members; i++) {
+        const PBF_Member *x = &a->members[i], *y = &b->members[i];
+        if (x->type != y->type || x->id != y->id || strcmp(x->role, y->role) != 0) return 0;
+    }
+    return 1;
+}
+
+/* Append a string with the characters that are special in XML attributes escaped. */
+static void put_escaped(OUT_Buffer *out, const char *s)
+{
+    const char *run = s;
+    for (; *s; s++) {
+        const char *esc;
+        switch (*s) {
+        case '&': esc = "&amp;"; break;
+        case '<': esc = "&lt;"; break;
+        case '>': esc = "&gt;"; break;
+        case '"': esc = "&quot;"; break;
+        case '\n': esc = "&#10;"; break;
+        case '\r': esc = "&#13;"; break;
+        case '\t': esc = "&#9;"; break;
+        default: continue;
+        }
+        OUT_put_bytes(out, run, s - run);
+        OUT_put_str(out, esc);
+        run = s + 1;
+    }
+    OUT_put_bytes(out, run, s - run);
+}
+
+static void put_attr_int(OUT_Buffer *out, const char *name, int64_t v)
+{
+    OUT_put_char(out, ' ');
+    OUT_put_str(out, name);
+    OUT_put_str(out, "=\"");
+    OUT_put_int64(out, v);
+    OUT_put_char(out, '"');
+}
+
+/*
+ * Write an entity as an OSM XML element.  Deleted entities are written
+ * with their attributes only.
+ */
+static void put_entity(OUT_Buffer *out, const PBF_Entity *e, int full)
+{
+    OUT_put_str(out, "    <");
+    OUT_put_str(out, type_names[e->type]);
+    put_attr_int(out, "id", e->id);
+    if (e->version) {
+        char ts[32];
+        time_t t = (time_t)e->timestamp;
+        struct tm tm;
+        strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+        put_attr_int(out, "version", e->version);
+        OUT_put_str(out, " timestamp=\"");
+        OUT_put_str(out, ts);
+        OUT_put_char(out, '"');
+        put_attr_int(out, "changeset", e->changeset);
+        put_attr_int(out, "uid", e->uid);
+        OUT_put_str(out, " user=\"");
+        put_escaped(out, e->user);
+        OUT_put_char(out, '"');
+    }
+    if (full && e->type == PBF_NODE) {
+        // Nanodegrees, written with 7 decimals as in OSM XML.
+        OUT_put_str(out, " lat=\"");
+        OUT_put_fixed(out, e->lat / 100, 7);
+        OUT_put_str(out, "\" lon=\"");
+        OUT_put_fixed(out, e->lon / 100, 7);
+        OUT_put_char(out, '"');
+    }
+    if (!full || (!e->num_tags && !e->num_refs && !e->num_members)) {
+        OUT_put_str(out, "/>\n");
+        return;
+    }
+    OUT_put_str(out, ">\n");
+    for (int i = 0; i < e->num_refs; i++) {
+        OUT_put_str(out, "      <nd");
+        put_attr_int(out, "ref", e->refs[i]);
+        OUT_put_str(out, "/>\n");
+    }
+    for (int i = 0; i < e->num_members; i++) {
+        OUT_put_str(out, "      <member type=\"");
+        OUT_put_str(out, type_names[e->members[i].type]);
+        OUT_put_char(out, '"');
+        put_attr_int(out, "ref", e->members[i].id);
+        OUT_put_str(out, " role=\"");
+        put_escaped(out, e->members[i].role);
+        OUT_put_str(out, "\"/>\n");
+    }
+    for (int i = 0; i < e->num_tags; i++) {
+        OUT_put_str(out, "      <tag k=\"");
+        put_escaped(out, e->keys[i]);
+        OUT_put_str(out, "\" v=\"");
+        put_escaped(out, e->vals[i]);
+        OUT_put_str(out, "\"/>\n");
+    }
+    OUT_put_str(out, "    </");
+    OUT_put_str(out, type_names[e->type]);
+    OUT_put_str(out, ">\n");
+}
+
+/* Write a change, opening a new section if the action differs from the last one. */
+static void put_change(OUT_Buffer *out, DIF_Action *section, DIF_Action action, const PBF_Entity *e)
+{
+    if (*section != action) {
+        if (*section != DIF_NONE) {
+            OUT_put_str(out, "  </");
+            OUT_put_str(out, action_names[*section]);
+            OUT_put_str(out, ">\n");
+        }
+        OUT_put_str(out, "  <");
+        OUT_put_str(out, action_names[action]);
+        OUT_put_str(out, ">\n");
+        *section = action;
+    }
+    put_entity(out, e, action != DIF_DELETE);
+}
+
+/**
+ * @brief Write the changes from one sorted PBF file to another as an
+ * OsmChange document.
+ *
+ * @param old_in  The old snapshot.
+ * @param new_in  The new snapshot.
+ * @param fd      The file descriptor to write the document to.
+ * @param stats   If not NULL, receives the number of entities created,
+ *                modified, deleted and left unchanged.
+ * @return 0 on success, -1 if a file is unreadable or unsorted or the
+ * document could not be written.
+ */
+int DIF_write_osc(FILE *old_in, FILE *new_in, int fd, DIF_Stats *stats)
+{
+    DIF_Stats st = {0};
+    DIF_Side old_side = {PBF_open_with(old_in, PBF_READ_AHEAD | PBF_READ_HASH), NULL, 0, 0, "old"};
+    DIF_Side new_side = {PBF_open_with(new_in, PBF_READ_AHEAD | PBF_READ_HASH), NULL, 0, 0, "new"};
+    OUT_Buffer out;
+    int rc = -1;
+    if (!old_side.r || !new_side.r || OUT_init(&out, fd, OUT_DEFAULT_SIZE) < 0) goto done;
+
+    OUT_put_str(&out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    OUT_put_str(&out, "<osmChange version=\"0.6\" generator=\"pbf\">\n");
+    DIF_Action section = DIF_NONE;
+    rc = (advance(&old_side) < 0 || advance(&new_side) < 0) ? -1 : 0;
+    while (rc == 0 && (old_side.cur || new_side.cur)) {
+        const PBF_Entity *o = old_side.cur, *n = new_side.cur;
+        int c = !o ? 1 : !n ? -1 : compare_keys(o, n);
+        if (c < 0) {
+            put_change(&out, &section, DIF_DELETE, o);
+            st.deleted++;
+            rc = advance(&old_side);
+        } else if (c > 0) {
+            put_change(&out, &section, DIF_CREATE, n);
+            st.created++;
+            rc = advance(&new_side);
+        } else {
+            if (same_content(o, n)) {
+                st.unchanged++;
+            } else {
+                put_change(&out, &section, DIF_MODIFY, n);
+                st.modified++;
+            }
+            rc = (advance(&old_side) < 0 || advance(&new_side) < 0) ? -1 : 0;
+        }
+    }
+    if (section != DIF_NONE) {
+        OUT_put_str(&out, "  </");
+        OUT_put_str(&out, action_names[section]);
+        OUT_put_str(&out, ">\n");
+    }
+    OUT_put_str(&out, "</osmChange>\n");
+    if (OUT_fini(&out) < 0) {
+        fprintf(stderr, "ERROR: DIF_write_osc - write failed.\n");
+        rc = -1;
+    }
+
+done:
+    PBF_close(old_side.r);
+    PBF_close(new_side.r);
+    if (stats) *stats = st;
+    return rc;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "distload.h"
+#include "osm.h"
+#include "pbf.h"
+#include "debug.h"
+
+/* Bytes copied at a time when joining snapshots. */
+#define DST_COPY_SIZE (1 << 20)
+
+/**
+ * @brief Cut the blobs of a PBF file into contiguous parts of about the
+ * same size.
+ *
+ * A blob belongs to the part its first byte falls in when the file is cut
+ * into num_parts equal byte ranges, so parts may be empty if there are
+ * few blobs.  The first part starts at offset 0, with the OSMHeader blob.
+ *
+ * @param in         The file, positioned at its start.
+ * @param num_parts  Number of parts, from 1 to DST_MAX_PARTS.
+ * @param parts      Receives the num_parts parts, in file order.
+ * @return 0 on success, -1 on error.
+ */
+int DST_split(FILE *in, int num_parts, DST_Part *parts)
+{
+    PBF_Blob *blobs;
+    int64_t num;
+    int rc = PBF_index(in, &blobs, &num);
+    if (rc != 0) {
+        if (rc > 0) {
+            free(blobs);
+            fprintf(stderr, "ERROR: DST_split - malformed blob after offset %lld.\n",
+                    num ? (long long)(blobs[num - 1].offset + blobs[num - 1].size) : 0LL);
+        }
+        return -1;
+    }
+    int64_t total = num ? blobs[num - 1].offset + blobs[num - 1].size : 0;
+    int64_t j = 0;
+    memset(parts, 0, num_parts * sizeof(DST_Part));
+    for (int i = 0; i < num_parts; i++) {
+        parts[i].begin = (i == 0) ? 0 : (j < num) ? blobs[j].offset : total;
+        while (j < num && (i == num_parts - 1 || blobs[j].offset * num_parts < total * (i + 1))) {
+            parts[i].blobs++;
+            j++;
+        }
+        parts[i].end = (j == num) ? total : blobs[j].offset;
+    }
+    free(blobs);
+    return 0;
+}
+
+/**
+ * @brief Decode a part of a PBF file into a partial snapshot.
+ *
+ * @param input   Path of the PBF file.
+ * @param part    The part, as DST_split gives it.
+ * @param output  Path of the partial snapshot, which is removed on error.
+ * @return 0 on success, -1 on error.
+ */
+int DST_write_part(const char *input, const DST_Part *part, const char *output)
+{
+    FILE *in = fopen(input, "rb");
+    if (!in) {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", input);
+        return -1;
+    }
+    FILE *out = fopen(output, "wb");
+    if (!out) {
+        fprintf(stderr, "ERROR: Cannot create '%s'.\n", output);
+        fclose(in);
+        return -1;
+    }
+    int rc = OSM_write_snapshot(in, part->begin, part->end, out);
+    if (fclose(out) != 0) rc = -1;
+    fclose(in);
+    if (rc < 0) remove(output);
+    return rc;
+}
+
+/**
+ * @brief Join partial snapshots, in order, into one snapshot.
+ *
+ * @param inputs      Paths of the partial snapshots.
+ * @param num_inputs  Their number.
+ * @param out         Where the snapshot is written.
+ * @return 0 on success, -1 on error.
+ */
+int DST_concat(const char *const *inputs, int num_inputs, FILE *out)
+{
+    char *buf = malloc(DST_COPY_SIZE);
+    int rc = buf ? 0 : -1;
+    for (int i = 0; rc == 0 && i < num_inputs; i++) {
+        FILE *in = fopen(inputs[i], "rb");
+        if (!in) {
+            fprintf(stderr, "ERROR: Cannot open '%s'.\n", inputs[i]);
+            rc = -1;
+            break;
+        }
+        size_t n;
+        while (rc == 0 && (n = fread(buf, 1, DST_COPY_SIZE, in)) > 0) {
+            if (fwrite(buf, 1, n, out) != n) rc = -1;
+        }
+        if (ferror(in)) rc = -1;
+        fclose(in);
+    }
+    if (fflush(out) != 0) rc = -1;
+    free(buf);
+    return rc;
+}
+
+/**
+ * @brief Load a PBF file into a snapshot with a process per part.
+ *
+ * The parts are decoded by forked processes at once, each into the
+ * partial snapshot output.partN, which are then joined into output and
+ * removed.
+ *
+ * @param input      Path of the PBF file.
+ * @param output     Path of the snapshot.
+ * @param num_parts  Number of parts and processes, from 1 to DST_MAX_PARTS.
+ * @param parts      Receives the num_parts parts, with the sizes of their
+ *                   snapshots.
+ * @return 0 on success, -1 on error.
+ */
+int DST_load(const char *input, const char *output, int num_parts, DST_Part *parts)
+{
+    FILE *in = fopen(input, "rb");
+    if (!in) {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", input);
+        return -1;
+    }
+    int rc = DST_split(in, num_parts, parts);
+    fclose(in);
+    if (rc < 0) return -1;
+
+    size_t len = strlen(output) + 16;
+    char **paths = calloc(num_parts, sizeof(char *));
+    pid_t *pids = calloc(num_parts, sizeof(pid_t));
+    for (int i = 0; paths && i < num_parts; i++) {
+        if ((paths[i] = malloc(len))) snprintf(paths[i], len, "%s.part%d", output, i);
+        else rc = -1;
+    }
+    if (!paths || !pids || rc < 0) {
+        fprintf(stderr, "ERROR: DST_load - out of memory.\n");
+        rc = -1;
+        goto done;
+    }
+
+    // Buffered output would otherwise be written by every process.
+    fflush(NULL);
+    for (int i = 0; i < num_parts; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) _exit(DST_write_part(input, &parts[i], paths[i]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        if (pids[i] < 0) {
+            fprintf(stderr, "ERROR: Cannot fork a loader process.\n");
+            rc = -1;
+            break;
+        }
+        debug("DEBUG: DST_load - part %d, bytes %lld to %lld, in process %d.\n", i, (long long)parts[i].begin,
+              (long long)parts[i].end, (int)pids[i]);
+    }
+    for (int i = 0; i < num_parts; i++) {
+        int status;
+        if (pids[i] <= 0) continue;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) rc = -1;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "ERROR: DST_load - a part could not be decoded.\n");
+        goto done;
+    }
+
+    for (int i = 0; i < num_parts; i++) {
+        struct stat sb;
+        parts[i].bytes = (stat(paths[i], &sb) == 0) ? (int64_t)sb.st_size : 0;
+    }
+    FILE *out = fopen(output, "wb");
+    if (!out) {
+        fprintf(stderr, "ERROR: Cannot create '%s'.\n", output);
+        rc = -1;
+        goto done;
+    }
+    rc = DST_concat((const char *const *)paths, num_parts, out);
+    if (fclose(out) != 0) rc = -1;
+    if (rc < 0) remove(output);
+
+done:
+    for (int i = 0; paths && i < num_parts; i++) {
+        if (paths[i]) remove(paths[i]);
+        free(paths[i]);
+    }
+    free(paths);
+    free(pids);
+    return rc;
+}
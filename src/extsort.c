@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "extsort.h"
+#include "pbf.h"
+#include "debug.h"
+
+/* One input of a merge: a sorted file being read, and its current entity. */
+typedef struct {
+    PBF_Reader *r;
+    const PBF_Entity *cur;      // NULL once the input is exhausted
+    PBF_Entity last;            // Type, id and version of the previous entity
+    int has_last;
+} EXT_Source;
+
+/*
+ * Loser tree over k sources.  Node 0 holds the index of the overall winner
+ * (the source with the least current entity), nodes 1 to k - 1 the loser
+ * of the match played there.  Leaf i sits below node (i + k) / 2, so
+ * replacing the winner's entity replays only the matches on its path.
+ */
+typedef struct {
+    EXT_Source *src;
+    int k;
+    int *node;
+} EXT_Tree;
+
+/* Does source a come before source b?  Index k stands for a source that
+ * beats all others, exhausted sources lose to all others, and ties go to
+ * the lower index, which keeps the merge stable. */
+static int beats(EXT_Tree *t, int a, int b)
+{
+    if (a == t->k || b == t->k) return a == t->k;
+    const PBF_Entity *x = t->src[a].cur, *y = t->src[b].cur;
+    if (!x || !y) return x != NULL || (!y && a < b);
+    int c = PBF_compare(x, y);
+    return c < 0 || (c == 0 && a < b);
+}
+
+/* Replay the matches from leaf s up to the root. */
+static void replay(EXT_Tree *t, int s)
+{
+    for (int n = (s + t->k) / 2; n > 0; n /= 2) {
+        if (beats(t, t->node[n], s)) {
+            int w = t->node[n];
+            t->node[n] = s;
+            s = w;
+        }
+    }
+    t->node[0] = s;
+}
+
+/* Read the next entity of a source, which must not come before the
+ * previous one.  Returns -1 on a read error or if the input is unsorted. */
+static int advance(EXT_Source *s, int i)
+{
+    if (s->cur) {
+        s->last.type = s->cur->type;
+        s->last.id = s->cur->id;
+        s->last.version = s->cur->version;
+        s->has_last = 1;
+    }
+    int rc = PBF_next(s->r, &s->cur);
+    if (rc <= 0) s->cur = NULL;
+    if (rc > 0 && s->has_last && PBF_compare(&s->last, s->cur) > 0) {
+        fprintf(stderr, "ERROR: Input %d is not sorted by type, then id.\n", i + 1);
+        return -1;
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+static int same_entity(const PBF_Entity *a, const PBF_Entity *b)
+{
+    return a->type == b->type && a->id == b->id;
+}
+
+/*
+ * Merge k sorted files into out.  With hdr NULL, the output header has the
+ * union of the inputs' bounding boxes.  With dedup, only the last of the
+ * entities with the same type and id is kept, which is the one with the
+ * highest version.  Counts are added to st.  Returns 0 on success, -1 on
+ * error.
+ */
+static int merge_files(FILE **files, int k, FILE *out, const PBF_Header *hdr, int dedup, EXT_Stats *st)
+{
+    EXT_Source *src = calloc(k, sizeof(EXT_Source));
+    int *node = malloc((k + 1) * sizeof(int));
+    PBF_Store pending = {0};
+    PBF_Writer *w = NULL;
+    int rc = -1, opened = 0;
+    if (!src || !node) goto done;
+    PBF_Header merged = {0};
+    for (; opened < k; opened++) {
+        if (!(src[opened].r = PBF_open(files[opened]))) goto done;
+        const PBF_Header *h = PBF_get_header(src[opened].r);
+        if (opened == 0 || (merged.has_bbox && h->has_bbox)) {
+            if (opened == 0 || h->min_lon < merged.min_lon) merged.min_lon = h->min_lon;
+            if (opened == 0 || h->max_lon > merged.max_lon) merged.max_lon = h->max_lon;
+            if (opened == 0 || h->max_lat > merged.max_lat) merged.max_lat = h->max_lat;
+            if (opened == 0 || h->min_lat < merged.min_lat) merged.min_lat = h->min_lat;
+        }
+        merged.has_bbox = h->has_bbox && (opened == 0 || merged.has_bbox);
+    }
+    merged.sorted = 1;
+    for (int i = 0; i < k; i++) {
+        if (advance(&src[i], i) < 0) goto done;
+    }
+    if (!(w = PBF_create(out, hdr ? hdr : &merged))) goto done;
+
+    EXT_Tree t = {src, k, node};
+    for (int n = 0; n < k; n++) node[n] = k;
+    for (int i = k - 1; i >= 0; i--) replay(&t, i);
+    rc = 0;
+    while (rc == 0 && src[node[0]].cur) {
+        int i = node[0];
+        const PBF_Entity *e = src[i].cur;
+        if (!dedup) {
+            if (PBF_write(w, e) < 0) rc = -1;
+            st->entities++;
+        } else {
+            // Entities come by ascending version, so a later duplicate wins.
+            if (pending.num && same_entity(&pending.ents[0], e)) {
+                st->duplicates++;
+            } else if (pending.num) {
+                if (PBF_write(w, &pending.ents[0]) < 0) rc = -1;
+                st->entities++;
+            }
+            PBF_store_clear(&pending);
+            if (!PBF_store_add(&pending, e)) rc = -1;
+        }
+        if (rc == 0 && advance(&src[i], i) < 0) rc = -1;
+        replay(&t, i);
+    }
+    if (rc == 0 && pending.num) {
+        if (PBF_write(w, &pending.ents[0]) < 0) rc = -1;
+        st->entities++;
+    }
+
+done:
+    if (w && PBF_finish(w) < 0) rc = -1;
+    for (int i = 0; src && i < opened; i++) PBF_close(src[i].r);
+    PBF_store_free(&pending);
+    free(src);
+    free(node);
+    return rc;
+}
+
+static int compare_ptrs(const void *a, const void *b)
+{
+    const PBF_Entity *x = *(const PBF_Entity *const *)a, *y = *(const PBF_Entity *const *)b;
+    int c = PBF_compare(x, y);
+    // Entities were added at increasing addresses; keep that order on ties.
+    return c ? c : (x > y) - (x < y);
+}
+
+/*
+ * Sort the entities of a store and write them, as a run to a new temporary
+ * file or, if out is given, to the output.  The store is cleared.
+ */
+static FILE *write_sorted(PBF_Store *s, const PBF_Entity **order, const PBF_Header *hdr, FILE *out)
+{
+    for (size_t i = 0; i < s->num; i++) order[i] = &s->ents[i];
+    qsort(order, s->num, sizeof(PBF_Entity *), compare_ptrs);
+
+    FILE *f = out ? out : tmpfile();
+    PBF_Writer *w = f ? PBF_create(f, hdr) : NULL;
+    int rc = w ? 0 : -1;
+    for (size_t i = 0; rc == 0 && i < s->num; i++) rc = PBF_write(w, order[i]);
+    if (w && PBF_finish(w) < 0) rc = -1;
+    PBF_store_clear(s);
+    if (rc < 0) {
+        fprintf(stderr, "ERROR: EXT_sort - cannot write %s.\n", out ? "output" : "temporary run");
+        if (f && !out) fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+/**
+ * @brief Sort a PBF file by type, then id, within a memory budget.
+ *
+ * @param in      The file to sort.
+ * @param out     Where to write the sorted file, whose header declares
+ *                Sort.Type_then_ID and keeps the input's bounding box.
+ * @param budget  Memory budget in bytes.  It bounds the entities held for
+ *                sorting and, through EXT_RUN_MEMORY, the number of runs
+ *                merged at once.
+ * @param stats   If not NULL, receives statistics about the sort.
+ * @return 0 on success, -1 on error.
+ */
+int EXT_sort(FILE *in, FILE *out, size_t budget, EXT_Stats *stats)
+{
+    EXT_Stats st = {0};
+    PBF_Reader *r = PBF_open(in);
+    if (!r) return -1;
+    PBF_Header hdr = *PBF_get_header(r);
+    hdr.sorted = 1;
+
+    PBF_Store store = {0};
+    const PBF_Entity **order = NULL;
+    size_t cap_order = 0;
+    FILE **runs = NULL;
+    int num_runs = 0, cap_runs = 0;
+    int rc = 0;
+
+    // Phase 1: sorted runs of at most the budget each.
+    const PBF_Entity *e;
+    int more;
+    do {
+        while ((more = PBF_next(r, &e)) > 0) {
+            if (!PBF_store_add(&store, e)) {
+                more = -1;
+                break;
+            }
+            st.entities++;
+            // The sort needs a pointer per entity besides the store.
+            if (store.bytes + store.num * sizeof(PBF_Entity *) >= budget) break;
+        }
+        if (more < 0) {
+            rc = -1;
+            break;
+        }
+        if (store.num > cap_order) {
+            const PBF_Entity **o = realloc(order, store.cap * sizeof(PBF_Entity *));
+            if (!o) {
+                rc = -1;
+                break;
+            }
+            order = o;
+            cap_order = store.cap;
+        }
+        if (more == 0 && num_runs == 0) {
+            // Everything fit: no runs needed.
+            if (!write_sorted(&store, order, &hdr, out)) rc = -1;
+            break;
+        }
+        if (num_runs == cap_runs) {
+            cap_runs = cap_runs ? 2 * cap_runs : 16;
+            FILE **rs = realloc(runs, cap_runs * sizeof(FILE *));
+            if (!rs) {
+                rc = -1;
+                break;
+            }
+            runs = rs;
+        }
+        if (!(runs[num_runs] = write_sorted(&store, order, &hdr, NULL))) {
+            rc = -1;
+            break;
+        }
+        num_runs++;
+        debug("DEBUG: EXT_sort - run %d written\n", num_runs);
+    } while (more > 0);
+    PBF_close(r);
+    PBF_store_free(&store);
+    free(order);
+    st.runs = num_runs;
+
+    // Phase 2: merge the runs, fan_in at a time, until one pass can finish.
+    int fan_in = (int)(budget / EXT_RUN_MEMORY);
+    if (fan_in < 2) fan_in = 2;
+    int first = 0;
+    while (rc == 0 && num_runs - first > 0) {
+        int k = num_runs - first;
+        int last_pass = (k <= fan_in);
+        if (!last_pass) k = fan_in;
+        FILE *f = last_pass ? out : tmpfile();
+        EXT_Stats pass = {0};
+        for (int i = 0; i < k; i++) rewind(runs[first + i]);
+        if (!f || merge_files(runs + first, k, f, &hdr, 0, &pass) < 0) rc = -1;
+        for (int i = 0; i < k; i++) fclose(runs[first + i]);
+        first += k;
+        st.passes++;
+        if (rc < 0) {
+            fprintf(stderr, "ERROR: EXT_sort - merge failed.\n");
+            if (f && !last_pass) fclose(f);
+            break;
+        }
+        if (last_pass) break;
+        // The merged run joins the queue behind the remaining ones.
+        if (num_runs == cap_runs) {
+            FILE **rs = realloc(runs, 2 * cap_runs * sizeof(FILE *));
+            if (!rs) {
+                fclose(f);
+                rc = -1;
+                break;
+            }
+            runs = rs;
+            cap_runs *= 2;
+        }
+        runs[num_runs++] = f;
+    }
+    for (int i = first; i < num_runs; i++) fclose(runs[i]);
+    free(runs);
+    if (stats) *stats = st;
+    return rc;
+}
+
+/**
+ * @brief Merge sorted PBF files into one, dropping duplicate entities.
+ *
+ * The inputs are streamed side by side, so memory is about one decoded
+ * block per input.  Where inputs overlap, only the entity with the highest
+ * version is kept; of equal versions, the one from the later input.
+ *
+ * @param ins     The inputs, each sorted by type, then id.
+ * @param num_ins The number of inputs.
+ * @param out     Where to write the merged file, whose header declares
+ *                Sort.Type_then_ID and has the union of the inputs'
+ *                bounding boxes.
+ * @param stats   If not NULL, receives the entities written and dropped.
+ * @return 0 on success, -1 on error, including an unsorted input.
+ */
+int EXT_merge(FILE **ins, int num_ins, FILE *out, EXT_Stats *stats)
+{
+    EXT_Stats st = {0};
+    int rc = merge_files(ins, num_ins, out, NULL, 1, &st);
+    if (stats) *stats = st;
+    return rc;
+}
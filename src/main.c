@@ -10,6 +10,11 @@ int main(int argc, char **argv)
     // First pass: Validate args
     // --------------------------
     int rc = process_args(argc, argv, NULL);
+
+    // Tools such as --sort stream the file themselves and are done.
+    if (tool_requested) {
+        return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
     if (rc < 0) {
         USAGE(argv[0], EXIT_FAILURE);
     }
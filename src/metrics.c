@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+#include "debug.h"
+
+/* Upper bounds of the latency buckets, in nanoseconds (1us to 1s). */
+static const uint64_t bucket_bounds[MET_NUM_BUCKETS - 1] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000
+};
+
+/* The same bounds in seconds, as written in the "le" label. */
+static const char *bucket_labels[MET_NUM_BUCKETS] = {
+    "0.000001", "0.0000025", "0.000005", "0.00001", "0.000025", "0.00005",
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01",
+    "0.025", "0.05", "0.1", "0.25", "0.5", "1", "+Inf"
+};
+
+static const char *kind_names[MET_NUM_KINDS] = {
+    "node", "range", "way", "command", "invalid"
+};
+
+/*
+ * Counters have a single writer, so an increment is a relaxed load and
+ * store (plain moves), yet scrapes from other threads never see torn values.
+ */
+#define BUMP(x, d) __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (d), __ATOMIC_RELAXED)
+#define READ(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/**
+ * @brief Initialize an empty registry.
+ */
+void MET_init(MET_Registry *reg)
+{
+    memset(reg, 0, sizeof(*reg));
+    pthread_mutex_init(&reg->lock, NULL);
+}
+
+/**
+ * @brief Release a registry.  All counters must have been unregistered.
+ */
+void MET_fini(MET_Registry *reg)
+{
+    pthread_mutex_destroy(&reg->lock);
+}
+
+/**
+ * @brief Create and register a block of counters for the calling thread.
+ * @return The counters, or NULL if memory could not be allocated.
+ */
+MET_Counters *MET_register(MET_Registry *reg)
+{
+    MET_Counters *c = calloc(1, sizeof(MET_Counters));
+    if (!c) return NULL;
+    pthread_mutex_lock(&reg->lock);
+    c->next = reg->live;
+    if (reg->live) reg->live->prev = c;
+    reg->live = c;
+    reg->connections++;
+    reg->open++;
+    pthread_mutex_unlock(&reg->lock);
+    return c;
+}
+
+/**
+ * @brief Add the values of one block of counters to another.
+ *
+ * @param total  The sums, which only the calling thread may be writing.
+ * @param c      The counters to add (their links are not used).
+ */
+void MET_add(MET_Counters *total, const MET_Counters *c)
+{
+    for (int k = 0; k < MET_NUM_KINDS; k++) {
+        total->requests[k] += READ(c->requests[k]);
+        total->cache_hits[k] += READ(c->cache_hits[k]);
+        total->latency_ns[k] += READ(c->latency_ns[k]);
+        for (int b = 0; b < MET_NUM_BUCKETS; b++) total->buckets[k][b] += READ(c->buckets[k][b]);
+    }
+}
+
+/**
+ * @brief Fold a block of counters into the registry's totals and free it.
+ */
+void MET_unregister(MET_Registry *reg, MET_Counters *c)
+{
+    if (!c) return;
+    pthread_mutex_lock(&reg->lock);
+    MET_add(&reg->retired, c);
+    if (c->prev) c->prev->next = c->next;
+    else reg->live = c->next;
+    if (c->next) c->next->prev = c->prev;
+    reg->open--;
+    pthread_mutex_unlock(&reg->lock);
+    free(c);
+}
+
+/**
+ * @brief Record one request.  Must only be called by the owning thread.
+ *
+ * @param c          The calling thread's counters (NULL to record nothing).
+ * @param kind       Kind of request.
+ * @param ns         Time taken to answer it, in nanoseconds.
+ * @param cache_hit  Nonzero if it was answered from the cache.
+ */
+void MET_record(MET_Counters *c, MET_Kind kind, uint64_t ns, int cache_hit)
+{
+    if (!c) return;
+    int b = 0;
+    while (b < MET_NUM_BUCKETS - 1 && ns > bucket_bounds[b]) b++;
+    BUMP(c->requests[kind], 1);
+    BUMP(c->cache_hits[kind], cache_hit != 0);
+    BUMP(c->latency_ns[kind], ns);
+    BUMP(c->buckets[kind][b], 1);
+}
+
+/**
+ * @brief Sum the counters of all connections, open and closed.
+ *
+ * @param reg          The registry.
+ * @param total        Receives the sums (links are cleared).
+ * @param connections  Receives the number of connections registered so far.
+ * @param open         Receives the number of connections currently open.
+ */
+void MET_collect(MET_Registry *reg, MET_Counters *total, uint64_t *connections, uint64_t *open)
+{
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&reg->lock);
+    MET_add(total, &reg->retired);
+    for (MET_Counters *c = reg->live; c; c = c->next) MET_add(total, c);
+    *connections = reg->connections;
+    *open = reg->open;
+    pthread_mutex_unlock(&reg->lock);
+}
+
+/**
+ * @brief Get the time of a monotonic clock, in nanoseconds.
+ */
+uint64_t MET_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Output the HELP and TYPE lines of a metric.
+ */
+void MET_put_header(OUT_Buffer *out, const char *name, const char *type, const char *help)
+{
+    OUT_put_str(out, "# HELP ");
+    OUT_put_str(out, name);
+    OUT_put_char(out, ' ');
+    OUT_put_str(out, help);
+    OUT_put_str(out, "\n# TYPE ");
+    OUT_put_str(out, name);
+    OUT_put_char(out, ' ');
+    OUT_put_str(out, type);
+    OUT_put_char(out, '\n');
+}
+
+/**
+ * @brief Output one sample line: name{labels} value.
+ *
+ * @param out       Buffer to append to.
+ * @param name      Metric name.
+ * @param labels    Label list without braces (e.g. "kind=\"node\""), or NULL.
+ * @param value     The value, scaled by 10^decimals.
+ * @param decimals  Number of decimal places in value.
+ */
+void MET_put_sample(OUT_Buffer *out, const char *name, const char *labels, int64_t value, int decimals)
+{
+    OUT_put_str(out, name);
+    if (labels) {
+        OUT_put_char(out, '{');
+        OUT_put_str(out, labels);
+        OUT_put_char(out, '}');
+    }
+    OUT_put_char(out, ' ');
+    OUT_put_fixed(out, value, decimals);
+    OUT_put_char(out, '\n');
+}
+
+/**
+ * @brief Output the request counters and latency histograms, by kind.
+ */
+void MET_put_requests(OUT_Buffer *out, const MET_Counters *total)
+{
+    char labels[64];
+
+    MET_put_header(out, "pbf_requests_total", "counter", "Requests answered, by kind.");
+    for (int k = 0; k < MET_NUM_KINDS; k++) {
+        snprintf(labels, sizeof(labels), "kind=\"%s\"", kind_names[k]);
+        MET_put_sample(out, "pbf_requests_total", labels, (int64_t)total->requests[k], 0);
+    }
+
+    MET_put_header(out, "pbf_request_cache_hits_total", "counter", "Requests answered from the response cache, by kind.");
+    for (int k = 0; k < MET_NUM_KINDS; k++) {
+        snprintf(labels, sizeof(labels), "kind=\"%s\"", kind_names[k]);
+        MET_put_sample(out, "pbf_request_cache_hits_total", labels, (int64_t)total->cache_hits[k], 0);
+    }
+
+    MET_put_header(out, "pbf_request_duration_seconds", "histogram", "Time taken to answer requests, by kind.");
+    for (int k = 0; k < MET_NUM_KINDS; k++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < MET_NUM_BUCKETS; b++) {
+            cumulative += total->buckets[k][b];
+            snprintf(labels, sizeof(labels), "kind=\"%s\",le=\"%s\"", kind_names[k], bucket_labels[b]);
+            MET_put_sample(out, "pbf_request_duration_seconds_bucket", labels, (int64_t)cumulative, 0);
+        }
+        snprintf(labels, sizeof(labels), "kind=\"%s\"", kind_names[k]);
+        MET_put_sample(out, "pbf_request_duration_seconds_sum", labels, (int64_t)total->latency_ns[k], 9);
+        MET_put_sample(out, "pbf_request_duration_seconds_count", labels, (int64_t)total->requests[k], 0);
+    }
+}
@@ -2,10 +2,17 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <endian.h>
 #include "global.h"
 #include "protobuf.h"
 #include "osm.h"
 #include "debug.h"
+#include "parallel.h"
+#include "crack.h"
+#include "outbuf.h"
+#include "blobcache.h"
+#include "cpu.h"
 #include <arpa/inet.h>  // for ntohl()
 
 /* =======================
@@ -20,33 +27,89 @@ struct OSM_BBox {
     int64_t max_lat;
 };
 
-// Structure representing a node in the map.
+/*
+ * Nodes and ways are stored column-wise in the map: one array per field,
+ * indexed by the entity's row.  Variable-length data (way refs and tags) is
+ * kept in flat arrays, with a start-offset column giving each way's slice.
+ *
+ * OSM_Node and OSM_Way objects handed out by the accessors are lightweight
+ * handles.  Each handle only records the owning map; the row it refers to is
+ * its position within the map's handle array.
+ */
+
+// Handle for a node in the map.
 struct OSM_Node {
-    int64_t id;         // Unique identifier for the node.
-    int64_t lat;        // Latitude (in nanodegrees).
-    int64_t lon;        // Longitude (in nanodegrees).
-    int num_keys;       // Number of key/value pairs.
-    char **keys;        // Array of keys (null-terminated strings).
-    char **vals;        // Array of values (null-terminated strings).
+    OSM_Map *map;       // Map that owns the node (row = this - map->node_handles).
 };
 
-// Structure representing a way in the map.
+// Handle for a way in the map.
 struct OSM_Way {
-    int64_t id;         // Unique identifier for the way.
-    int num_refs;       // Number of node references in the way.
-    int64_t *refs;      // Array of node IDs that form the way.
-    int num_keys;       // Number of key/value pairs.
-    char **keys;        // Array of keys (null-terminated strings).
-    char **vals;        // Array of values (null-terminated strings).
+    OSM_Map *map;       // Map that owns the way (row = this - map->way_handles).
 };
 
 // Structure representing the entire map.
 struct OSM_Map {
     OSM_BBox *bbox;     // Pointer to the bounding box (if any).
+
+    // Node columns.
     int num_nodes;      // Total number of nodes.
-    OSM_Node **nodes;   // Array of pointers to nodes (can be NULL if not populated).
+    int node_cap;       // Allocated length of the node columns.
+    OSM_Id *node_ids;   // Node ids.
+    OSM_Lat *node_lats; // Node latitudes.
+    OSM_Lon *node_lons; // Node longitudes.
+    int nodes_sorted;   // Nonzero if node_ids is strictly increasing.
+
+    // Way columns.
     int num_ways;       // Total number of ways.
-    OSM_Way **ways;     // Array of pointers to ways (can be NULL if not populated).
+    int way_cap;        // Allocated length of the way columns.
+    OSM_Id *way_ids;    // Way ids.
+    int64_t *way_ref_start;  // num_ways + 1 offsets into way_refs.
+    int64_t *way_tag_start;  // num_ways + 1 offsets into way_keys/way_vals.
+    int ways_sorted;    // Nonzero if way_ids is strictly increasing.
+
+    int64_t num_refs;   // Total number of way refs.
+    int64_t ref_cap;    // Allocated length of way_refs.
+    OSM_Id *way_refs;   // Node ids referenced by all ways, way after way.
+
+    int64_t num_tags;   // Total number of way tags.
+    int64_t tag_cap;    // Allocated length of way_keys/way_vals.
+    char **way_keys;    // Tag keys of all ways (null-terminated strings).
+    char **way_vals;    // Tag values of all ways (null-terminated strings).
+    int64_t tag_bytes;  // Total size of those strings, including terminators.
+    char *tag_arena;    // Single block holding all of them, once compacted.
+
+    // Way refs as node indices; once built by OSM_Map_index_refs these
+    // replace way_refs.  Refs to nodes that are not in the map hold
+    // OSM_REF_MISSING, and their ids are kept in a side table.
+    uint32_t *way_ref_index; // Node index of each way ref.
+    int64_t num_missing;     // Number of refs to nodes not in the map.
+    int64_t *missing_pos;    // Positions of those refs (ascending).
+    OSM_Id *missing_ids;     // Node ids of those refs.
+
+    // Handles returned by OSM_Map_get_Node/OSM_Map_get_Way (built after load).
+    OSM_Node *node_handles;
+    OSM_Way *way_handles;
+
+    // Id indexes of unsorted id columns: every row, in (id, row) order.
+    // Built by OSM_Map_build_index, possibly while lookups are running,
+    // and published with an atomic store once complete.
+    int *id_order[OSM_NUM_INDEXES];
+    int64_t index_ns[OSM_NUM_INDEXES];  // Time taken to build each index.
+    int index_cancel;   // Set to abandon index builds in progress.
+
+    // Cracked indexes of unsorted id columns, used until id_order is ready
+    // if cracking is enabled.  Created by the first lookup that needs one.
+    CRK_Index *crackers[OSM_NUM_INDEXES];
+    int cracking;       // Nonzero if lookups may crack the id columns.
+
+    int header_sorted;  // Nonzero if the header declares Sort.Type_then_ID.
+    int64_t sort_ns;    // Time taken to sort the map by id after loading.
+    int64_t load_ns;    // Time taken by OSM_read_Map, in nanoseconds.
+    int64_t blobs_decoded;   // OSMData blobs inflated and decoded by OSM_read_Map.
+    int64_t blobs_cached;    // OSMData blobs copied from the blob cache instead.
+
+    uint64_t *packed;   // Scratch array for packed fields while loading.
+    int64_t packed_cap; // Allocated length of packed.
 };
 
 
@@ -63,6 +126,9 @@ static int parse_ways_in_group(PB_Message group_msg, OSM_Map *map,
                                char **stringtable, int string_count);
 static int64_t zigzag_decode(int64_t val);
 
+// Helpers for lookup by id:
+static int64_t lower_bound_id(const OSM_Id *ids, int64_t lo, int64_t hi, OSM_Id id);
+
 
 
 /* ===========================
@@ -108,6 +174,846 @@ static int64_t zigzag_decode(int64_t val) {
     return (val >> 1) ^ -(val & 1);
 }
 
+/**
+ * @brief Compute the capacity to grow a column to.
+ *
+ * Capacity is doubled until it suffices, so appending one element at a time
+ * costs amortized constant time.
+ *
+ * @param cap   Current capacity, in elements.
+ * @param need  Number of elements required.
+ * @return The new capacity (cap itself if it already suffices).
+ */
+static int64_t grow_capacity(int64_t cap, int64_t need)
+{
+    if (need <= cap) return cap;
+    int64_t ncap = cap ? cap : 64;
+    while (ncap < need) ncap *= 2;
+    return ncap;
+}
+
+/**
+ * @brief Resize a column array to hold `count` elements of size `elem`.
+ * @return 0 on success, -1 if memory could not be allocated (the original
+ * array is left intact).
+ */
+static int resize_column(void **arrp, size_t elem, int64_t count)
+{
+    void *arr = realloc(*arrp, (size_t)count * elem);
+    if (!arr) {
+        fprintf(stderr, "ERROR: Out of memory growing map column.\n");
+        return -1;
+    }
+    *arrp = arr;
+    return 0;
+}
+
+/**
+ * @brief Make room for `extra` more nodes in the node columns.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int reserve_nodes(OSM_Map *map, int extra)
+{
+    int64_t cap = grow_capacity(map->node_cap, (int64_t)map->num_nodes + extra);
+    if (cap == map->node_cap) return 0;
+    if (resize_column((void **)&map->node_ids, sizeof(OSM_Id), cap) < 0 ||
+        resize_column((void **)&map->node_lats, sizeof(OSM_Lat), cap) < 0 ||
+        resize_column((void **)&map->node_lons, sizeof(OSM_Lon), cap) < 0)
+    {
+        return -1;
+    }
+    map->node_cap = (int)cap;
+    return 0;
+}
+
+/**
+ * @brief Make room for one more way in the way columns.
+ *
+ * The start-offset columns hold one more entry than there are ways, so that
+ * the slice of way i is always [start[i], start[i+1]).
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int reserve_way(OSM_Map *map)
+{
+    int64_t cap = grow_capacity(map->way_cap, (int64_t)map->num_ways + 1);
+    if (cap == map->way_cap) return 0;
+    if (resize_column((void **)&map->way_ids, sizeof(OSM_Id), cap) < 0 ||
+        resize_column((void **)&map->way_ref_start, sizeof(int64_t), cap + 1) < 0 ||
+        resize_column((void **)&map->way_tag_start, sizeof(int64_t), cap + 1) < 0)
+    {
+        return -1;
+    }
+    if (map->way_cap == 0) {
+        map->way_ref_start[0] = 0;
+        map->way_tag_start[0] = 0;
+    }
+    map->way_cap = (int)cap;
+    return 0;
+}
+
+/**
+ * @brief Make room for `extra_refs` more way refs and `extra_tags` more way tags.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int reserve_way_data(OSM_Map *map, int64_t extra_refs, int64_t extra_tags)
+{
+    int64_t cap = grow_capacity(map->ref_cap, map->num_refs + extra_refs);
+    if (cap != map->ref_cap) {
+        if (resize_column((void **)&map->way_refs, sizeof(OSM_Id), cap) < 0)
+            return -1;
+        map->ref_cap = cap;
+    }
+
+    cap = grow_capacity(map->tag_cap, map->num_tags + extra_tags);
+    if (cap != map->tag_cap) {
+        if (resize_column((void **)&map->way_keys, sizeof(char *), cap) < 0 ||
+            resize_column((void **)&map->way_vals, sizeof(char *), cap) < 0)
+            return -1;
+        map->tag_cap = cap;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decode every value of a repeated varint field, packed or not, into
+ * the map's scratch array.
+ * @return The number of values, or -1 if the field is malformed or memory
+ * could not be allocated.
+ */
+static int64_t decode_packed(OSM_Map *map, PB_Message msg, int fnum)
+{
+    int64_t n = 0;
+    PB_Field *f = msg;
+    while ((f = PB_next_field(f, fnum, ANY_TYPE, FORWARD_DIR)) != NULL) {
+        if (f->type != VARINT_TYPE && f->type != LEN_TYPE) continue;
+        // Every packed value takes at least one byte.
+        int64_t cap = grow_capacity(map->packed_cap, n + (f->type == LEN_TYPE ? (int64_t)f->value.bytes.size : 1));
+        if (cap != map->packed_cap) {
+            if (resize_column((void **)&map->packed, sizeof(uint64_t), cap) < 0) return -1;
+            map->packed_cap = cap;
+        }
+        if (f->type == VARINT_TYPE) {
+            map->packed[n++] = f->value.i64;
+            continue;
+        }
+        const uint8_t *p = (const uint8_t *)f->value.bytes.buf;
+        int64_t got = CPU_kernels.varints(p, p + f->value.bytes.size, &map->packed[n]);
+        if (got < 0) return -1;
+        n += got;
+    }
+    return n;
+}
+
+/**
+ * @brief Check whether an id column is strictly increasing.
+ */
+static int ids_sorted(const OSM_Id *ids, int n)
+{
+    for (int i = 1; i < n; i++) {
+        if (ids[i] <= ids[i - 1]) return 0;
+    }
+    return 1;
+}
+
+/* ===========================
+ * Blob Cache
+ * ===========================*/
+
+/*
+ * Version of the cached block format.  It seeds the blob hashes, so entries
+ * written in an older format are never looked up again.
+ */
+#define BLOCK_CACHE_VERSION 1
+
+/* Directory of the blob cache, or NULL if blobs are always decoded. */
+static char *blob_cache_dir;
+
+/* Row counts of the map before a block was appended. */
+typedef struct {
+    int nodes;
+    int ways;
+    int64_t refs;
+    int64_t tags;
+} Block_Mark;
+
+static Block_Mark mark_map(const OSM_Map *map)
+{
+    Block_Mark m = {map->num_nodes, map->num_ways, map->num_refs, map->num_tags};
+    return m;
+}
+
+/* Drop the rows appended since mark m. */
+static void truncate_map(OSM_Map *map, Block_Mark m)
+{
+    for (int64_t i = m.tags; i < map->num_tags; i++) {
+        if (map->way_keys[i]) map->tag_bytes -= strlen(map->way_keys[i]) + 1;
+        if (map->way_vals[i]) map->tag_bytes -= strlen(map->way_vals[i]) + 1;
+        free(map->way_keys[i]);
+        free(map->way_vals[i]);
+    }
+    map->num_nodes = m.nodes;
+    map->num_ways = m.ways;
+    map->num_refs = m.refs;
+    map->num_tags = m.tags;
+}
+
+/* Columns of blocks without such rows may not be allocated. */
+static void put_column(OUT_Buffer *ob, const void *col, int64_t n)
+{
+    if (n) OUT_put_bytes(ob, col, n * sizeof(int64_t));
+}
+
+static void put_string(OUT_Buffer *ob, const char *s)
+{
+    uint32_t len = s ? (uint32_t)strlen(s) + 1 : 0;     // 0 for a missing string
+    OUT_put_bytes(ob, (const char *)&len, sizeof(len));
+    if (len) OUT_put_bytes(ob, s, len - 1);
+}
+
+/*
+ * Write the rows appended since mark m to a buffer: the row counts, then
+ * the node columns, the way ids, each way's end offsets into the block's
+ * refs and tags, the refs and the tag strings.  This is the format of blob
+ * cache entries and of snapshot blocks.
+ */
+static void put_block(OUT_Buffer *ob, OSM_Map *map, Block_Mark m)
+{
+    int64_t counts[4] = {map->num_nodes - m.nodes, map->num_ways - m.ways,
+                         map->num_refs - m.refs, map->num_tags - m.tags};
+    OUT_put_bytes(ob, (const char *)counts, sizeof(counts));
+    put_column(ob, map->node_ids + m.nodes, counts[0]);
+    put_column(ob, map->node_lats + m.nodes, counts[0]);
+    put_column(ob, map->node_lons + m.nodes, counts[0]);
+    put_column(ob, map->way_ids + m.ways, counts[1]);
+    for (int i = m.ways; i < map->num_ways; i++) {
+        int64_t ends[2] = {map->way_ref_start[i + 1] - m.refs, map->way_tag_start[i + 1] - m.tags};
+        OUT_put_bytes(ob, (const char *)ends, sizeof(ends));
+    }
+    put_column(ob, map->way_refs + m.refs, counts[2]);
+    for (int64_t i = m.tags; i < map->num_tags; i++) {
+        put_string(ob, map->way_keys[i]);
+        put_string(ob, map->way_vals[i]);
+    }
+}
+
+/* Save the rows appended since mark m, which were decoded from the blob
+ * with hash key, to the blob cache. */
+static void save_cached_block(OSM_Map *map, uint64_t key, Block_Mark m)
+{
+    OUT_Buffer ob;
+    if (OUT_init(&ob, -1, 0) < 0) return;
+    put_block(&ob, map, m);
+    if (!ob.err) BLC_store(blob_cache_dir, key, ob.buf, ob.len);
+    OUT_fini(&ob);
+}
+
+/* Copy n bytes from *pp, which must not pass end, and advance *pp. */
+static int take(const char **pp, const char *end, void *dst, size_t n)
+{
+    if ((size_t)(end - *pp) < n) return -1;
+    if (n) memcpy(dst, *pp, n);
+    *pp += n;
+    return 0;
+}
+
+static int take_string(const char **pp, const char *end, char **sp)
+{
+    uint32_t len;
+    *sp = NULL;
+    if (take(pp, end, &len, sizeof(len)) < 0 || (size_t)(end - *pp) < (len ? len - 1 : 0)) return -1;
+    if (!len) return 0;
+    if (!(*sp = malloc(len))) return -1;
+    take(pp, end, *sp, len - 1);
+    (*sp)[len - 1] = '\0';
+    return 0;
+}
+
+/*
+ * Append the rows of a block written by put_block to the map.  Returns 1
+ * if they were appended, 0 if the data is unusable (the map is then left
+ * as it was) and -1 if memory ran out.
+ */
+static int take_block(OSM_Map *map, const char *data, size_t size)
+{
+    const char *p = data, *end = data + size;
+    Block_Mark m = mark_map(map);
+    int64_t counts[4];
+    int rc = 0;
+    if (take(&p, end, counts, sizeof(counts)) < 0 || counts[0] < 0 || counts[1] < 0 ||
+        counts[2] < 0 || counts[3] < 0 || counts[0] > INT32_MAX - map->num_nodes ||
+        counts[1] > INT32_MAX - map->num_ways || counts[2] > (int64_t)size || counts[3] > (int64_t)size ||
+        (size_t)(end - p) < (3 * counts[0] + 3 * counts[1] + counts[2]) * sizeof(int64_t))
+    {
+        goto unusable;
+    }
+    if (reserve_nodes(map, (int)counts[0]) < 0 || reserve_way_data(map, counts[2], counts[3]) < 0) {
+        rc = -1;
+        goto unusable;
+    }
+    take(&p, end, map->node_ids + m.nodes, counts[0] * sizeof(OSM_Id));
+    take(&p, end, map->node_lats + m.nodes, counts[0] * sizeof(OSM_Lat));
+    take(&p, end, map->node_lons + m.nodes, counts[0] * sizeof(OSM_Lon));
+    map->num_nodes += (int)counts[0];
+
+    const char *way_ids = p;
+    p += counts[1] * sizeof(OSM_Id);
+    int64_t ref_end = 0, tag_end = 0;
+    for (int64_t i = 0; i < counts[1]; i++) {
+        int64_t ends[2];
+        take(&p, end, ends, sizeof(ends));
+        if (ends[0] < ref_end || ends[0] > counts[2] || ends[1] < tag_end || ends[1] > counts[3])
+            goto unusable;
+        ref_end = ends[0];
+        tag_end = ends[1];
+        if (reserve_way(map) < 0) {
+            rc = -1;
+            goto unusable;
+        }
+        memcpy(&map->way_ids[map->num_ways], way_ids + i * sizeof(OSM_Id), sizeof(OSM_Id));
+        map->num_ways++;
+        map->way_ref_start[map->num_ways] = m.refs + ref_end;
+        map->way_tag_start[map->num_ways] = m.tags + tag_end;
+    }
+    if (ref_end != counts[2] || tag_end != counts[3]) goto unusable;
+
+    take(&p, end, map->way_refs + m.refs, counts[2] * sizeof(OSM_Id));
+    map->num_refs += counts[2];
+    for (int64_t i = 0; i < counts[3]; i++) {
+        char *key_str, *val_str = NULL;
+        if (take_string(&p, end, &key_str) < 0 || take_string(&p, end, &val_str) < 0) {
+            free(key_str);
+            free(val_str);
+            goto unusable;
+        }
+        map->way_keys[map->num_tags] = key_str;
+        map->way_vals[map->num_tags] = val_str;
+        if (key_str) map->tag_bytes += strlen(key_str) + 1;
+        if (val_str) map->tag_bytes += strlen(val_str) + 1;
+        map->num_tags++;
+    }
+    if (p != end) goto unusable;
+    return 1;
+
+unusable:
+    truncate_map(map, m);
+    return rc;
+}
+
+/*
+ * Append the rows cached for the blob with hash key to the map.
+ * Returns 1 if they were appended, 0 if the blob is not cached (or its
+ * entry is unusable) and -1 if memory ran out.
+ */
+static int load_cached_block(OSM_Map *map, uint64_t key)
+{
+    size_t size;
+    char *data = BLC_load(blob_cache_dir, key, &size);
+    if (!data) return 0;
+    int rc = take_block(map, data, size);
+    if (rc == 0) debug("DEBUG: load_cached_block - entry %016llx not used\n", (unsigned long long)key);
+    free(data);
+    return rc;
+}
+
+/**
+ * @brief Set the directory of the blob cache used when reading maps.
+ *
+ * With a cache, OSM_read_Map keeps the rows decoded from each OSMData blob
+ * under a hash of the raw blob, and copies them from there instead of
+ * decoding blobs it has seen before.  This makes loading a new version of
+ * a file, which mostly has the same blobs, much cheaper.
+ *
+ * @param dir  The cache directory, created if it does not exist, or NULL
+ *             to decode every blob.
+ * @return 0 on success, -1 if the directory cannot be used.
+ */
+int OSM_set_blob_cache(const char *dir)
+{
+    char *d = NULL;
+    if (dir && (BLC_prepare(dir) < 0 || !(d = strdup(dir)))) return -1;
+    free(blob_cache_dir);
+    blob_cache_dir = d;
+    return 0;
+}
+
+/* ===========================
+ * Snapshots
+ * ===========================*/
+
+/*
+ * A map snapshot is a sequence of records, each with a header of its own,
+ * so that the snapshots of consecutive parts of a file, concatenated, are
+ * the snapshot of the whole file.  A header record holds what the
+ * OSMHeader block says, a block record the rows of an OSMData block, as
+ * put_block writes them.  The magic is what a PBF reader takes for the
+ * length of the first blob header, far beyond any valid one, so
+ * OSM_read_Map tells snapshots from PBF files by their first four bytes.
+ *
+ * Parts may be written on other hosts, so every integer of a snapshot is
+ * little-endian, the magic aside, which is the bytes "PBFS".  On such
+ * hosts that costs nothing; big-endian ones swap the block data in place.
+ */
+#define SNAPSHOT_MAGIC 0x50424653       // "PBFS"
+#define SNAPSHOT_HEADER 1
+#define SNAPSHOT_BLOCK 2
+
+/* Largest record accepted, as a check on damaged headers. */
+#define SNAPSHOT_MAX_RECORD (1LL << 32)
+
+typedef struct {
+    uint32_t magic;             // SNAPSHOT_MAGIC, big-endian
+    uint32_t kind;
+    uint64_t size;              // Bytes of data after the header
+    uint64_t check;             // BLC_hash of the data, seeded with the kind
+} Snapshot_Record;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static void swap64(char *p, int64_t n)
+{
+    for (int64_t i = 0; i < n; i++, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v = __builtin_bswap64(v);
+        memcpy(p, &v, 8);
+    }
+}
+
+/*
+ * Swap the integers of a block written by put_block between host and
+ * little-endian order, in place.  to_host tells that they are little-endian
+ * now.  Returns 0, or -1 if the block is malformed.
+ */
+static int swap_block(char *data, size_t size, int to_host)
+{
+    int64_t counts[4];
+    if (size < sizeof(counts)) return -1;
+    if (!to_host) memcpy(counts, data, sizeof(counts));
+    swap64(data, 4);
+    if (to_host) memcpy(counts, data, sizeof(counts));
+    char *p = data + sizeof(counts), *end = data + size;
+    // The node columns, the way ids, two ends per way and the refs.
+    int64_t words = 3 * counts[0] + 3 * counts[1] + counts[2];
+    if (counts[0] < 0 || counts[1] < 0 || counts[2] < 0 || counts[3] < 0 || words > (end - p) / 8) return -1;
+    swap64(p, words);
+    p += words * 8;
+    for (int64_t i = 0; i < 2 * counts[3]; i++) {
+        uint32_t len;
+        if (end - p < (ptrdiff_t)sizeof(len)) return -1;
+        memcpy(&len, p, sizeof(len));
+        uint32_t swapped = __builtin_bswap32(len);
+        memcpy(p, &swapped, sizeof(len));
+        if (to_host) len = swapped;
+        p += sizeof(len);
+        if ((size_t)(end - p) < (len ? len - 1 : 0)) return -1;
+        p += len ? len - 1 : 0;
+    }
+    return 0;
+}
+#endif
+
+static int put_record(FILE *out, uint32_t kind, const char *data, size_t size)
+{
+    Snapshot_Record rec = {htonl(SNAPSHOT_MAGIC), htole32(kind), htole64(size), htole64(BLC_hash(data, size, kind))};
+    if (fwrite(&rec, sizeof(rec), 1, out) != 1) return -1;
+    return (size && fwrite(data, 1, size, out) != size) ? -1 : 0;
+}
+
+/* Write what the OSMHeader block gave the map: its sort order and bounding box. */
+static int put_header_record(FILE *out, const OSM_Map *map)
+{
+    int64_t h[6] = {map->header_sorted, map->bbox != NULL, 0, 0, 0, 0};
+    if (map->bbox) {
+        h[2] = map->bbox->min_lon;
+        h[3] = map->bbox->max_lon;
+        h[4] = map->bbox->max_lat;
+        h[5] = map->bbox->min_lat;
+    }
+    for (int i = 0; i < 6; i++) h[i] = (int64_t)htole64((uint64_t)h[i]);
+    return put_record(out, SNAPSHOT_HEADER, (const char *)h, sizeof(h));
+}
+
+/* Write the rows appended since mark m as a block record, and drop them. */
+static int put_block_record(FILE *out, OSM_Map *map, Block_Mark m)
+{
+    OUT_Buffer ob;
+    if (OUT_init(&ob, -1, 0) < 0) return -1;
+    put_block(&ob, map, m);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if (!ob.err) swap_block(ob.buf, ob.len, 0);
+#endif
+    int rc = ob.err ? -1 : put_record(out, SNAPSHOT_BLOCK, ob.buf, ob.len);
+    OUT_fini(&ob);
+    truncate_map(map, m);
+    return rc;
+}
+
+/* Apply a header record to the map. */
+static int take_header(OSM_Map *map, const char *data, size_t size)
+{
+    int64_t h[6];
+    if (size != sizeof(h)) return 0;
+    memcpy(h, data, sizeof(h));
+    for (int i = 0; i < 6; i++) h[i] = (int64_t)le64toh((uint64_t)h[i]);
+    map->header_sorted = (int)h[0];
+    if (h[1]) {
+        if (!map->bbox && !(map->bbox = calloc(1, sizeof(OSM_BBox)))) return -1;
+        map->bbox->min_lon = h[2];
+        map->bbox->max_lon = h[3];
+        map->bbox->max_lat = h[4];
+        map->bbox->min_lat = h[5];
+    }
+    return 1;
+}
+
+/*
+ * Read the records of a snapshot into the map, up to the end of in, the
+ * magic of the first record having been read already.
+ * Returns 0 on success, -1 on error.
+ */
+static int read_snapshot(FILE *in, OSM_Map *map)
+{
+    Snapshot_Record rec;
+    size_t skip = sizeof(rec.magic);
+    for (;;) {
+        size_t got = fread((char *)&rec + skip, 1, sizeof(rec) - skip, in);
+        if (got == 0 && skip == 0 && feof(in)) return 0;
+        rec.kind = le32toh(rec.kind);
+        rec.size = le64toh(rec.size);
+        rec.check = le64toh(rec.check);
+        if (got != sizeof(rec) - skip || (skip == 0 && ntohl(rec.magic) != SNAPSHOT_MAGIC) ||
+            rec.size > SNAPSHOT_MAX_RECORD) {
+            fprintf(stderr, "ERROR: OSM_read_Map - damaged snapshot record.\n");
+            return -1;
+        }
+        skip = 0;
+        char *data = malloc(rec.size ? rec.size : 1);
+        if (!data) {
+            fprintf(stderr, "ERROR: OSM_read_Map - out of memory for snapshot record.\n");
+            return -1;
+        }
+        int rc = 0;
+        if (fread(data, 1, rec.size, in) == rec.size && BLC_hash(data, rec.size, rec.kind) == rec.check) {
+            if (rec.kind == SNAPSHOT_HEADER) rc = take_header(map, data, rec.size);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            else if (rec.kind == SNAPSHOT_BLOCK && swap_block(data, rec.size, 1) < 0) rc = 0;
+#endif
+            else if (rec.kind == SNAPSHOT_BLOCK) rc = take_block(map, data, rec.size);
+        }
+        free(data);
+        if (rc <= 0) {
+            fprintf(stderr, "ERROR: OSM_read_Map - %s.\n", rc < 0 ? "out of memory for snapshot record" :
+                    "damaged snapshot record");
+            return -1;
+        }
+    }
+}
+
+/* ===========================
+ * Sorting by Id
+ * ===========================*/
+
+/* Bits sorted per pass of the radix sort. */
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+/*
+ * One pass of a parallel LSD radix sort of (key, row) pairs.  Each worker
+ * counts the digits of its chunk, and then moves its chunk's pairs to their
+ * places, so that pairs with equal digits keep their order.
+ */
+typedef struct {
+    const uint64_t *keys;
+    const int *rows;
+    uint64_t *keys_out;
+    int *rows_out;
+    int shift;
+    int64_t *pos;           // RADIX_SIZE counts, then positions, per worker
+} Radix_Job;
+
+static void radix_count_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Radix_Job *job = arg;
+    int64_t *pos = &job->pos[(size_t)worker * RADIX_SIZE];
+    memset(pos, 0, RADIX_SIZE * sizeof(int64_t));
+    for (int64_t i = begin; i < end; i++) {
+        pos[(job->keys[i] >> job->shift) & (RADIX_SIZE - 1)]++;
+    }
+}
+
+static void radix_scatter_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Radix_Job *job = arg;
+    int64_t *pos = &job->pos[(size_t)worker * RADIX_SIZE];
+    for (int64_t i = begin; i < end; i++) {
+        int64_t j = pos[(job->keys[i] >> job->shift) & (RADIX_SIZE - 1)]++;
+        job->keys_out[j] = job->keys[i];
+        job->rows_out[j] = job->rows[i];
+    }
+}
+
+/*
+ * Sort the rows of an id column by id, stably.  Only the digits in which
+ * the ids differ are sorted on, so ids spanning 2^40 take five passes.
+ * On success *orderp receives a malloc'd array of the rows in id order.
+ */
+static int radix_sort_ids(const OSM_Id *ids, int64_t n, int nthreads, int **orderp)
+{
+    // Flipping the sign bit makes unsigned order agree with signed order.
+    const uint64_t flip = 1ULL << 63;
+    uint64_t *keys = malloc((n ? n : 1) * sizeof(uint64_t));
+    uint64_t *keys_tmp = malloc((n ? n : 1) * sizeof(uint64_t));
+    int *rows = malloc((n ? n : 1) * sizeof(int));
+    int *rows_tmp = malloc((n ? n : 1) * sizeof(int));
+    Radix_Job job = {0};
+    job.pos = malloc((size_t)nthreads * RADIX_SIZE * sizeof(int64_t));
+    int rc = -1;
+    if (!keys || !keys_tmp || !rows || !rows_tmp || !job.pos) {
+        goto done;
+    }
+
+    uint64_t differ = 0;
+    for (int64_t i = 0; i < n; i++) {
+        keys[i] = (uint64_t)ids[i] ^ flip;
+        rows[i] = (int)i;
+        differ |= keys[i] ^ keys[0];
+    }
+    for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+        if (!((differ >> shift) & (RADIX_SIZE - 1))) {
+            continue;
+        }
+        job.keys = keys;
+        job.rows = rows;
+        job.keys_out = keys_tmp;
+        job.rows_out = rows_tmp;
+        job.shift = shift;
+        int used = PAR_for(n, nthreads, radix_count_task, &job);
+        if (used < 0) {
+            goto done;
+        }
+        // Digit-major, worker-minor prefix sums keep the sort stable.
+        int64_t total = 0;
+        for (int d = 0; d < RADIX_SIZE; d++) {
+            for (int w = 0; w < used; w++) {
+                int64_t c = job.pos[(size_t)w * RADIX_SIZE + d];
+                job.pos[(size_t)w * RADIX_SIZE + d] = total;
+                total += c;
+            }
+        }
+        // The same n and thread count give the same chunks as the count pass.
+        if (PAR_for(n, nthreads, radix_scatter_task, &job) < 0) {
+            goto done;
+        }
+        uint64_t *kt = keys;
+        keys = keys_tmp;
+        keys_tmp = kt;
+        int *rt = rows;
+        rows = rows_tmp;
+        rows_tmp = rt;
+    }
+    *orderp = rows;
+    rows = NULL;
+    rc = 0;
+
+done:
+    free(keys);
+    free(keys_tmp);
+    free(rows);
+    free(rows_tmp);
+    free(job.pos);
+    return rc;
+}
+
+/* Gathering of map columns into id order. */
+typedef struct {
+    OSM_Map *map;
+    const int *order;
+    OSM_Id *ids;
+    OSM_Lat *lats;
+    OSM_Lon *lons;
+    int64_t *ref_start;
+    int64_t *tag_start;
+    OSM_Id *refs;
+    char **keys;
+    char **vals;
+} Permute_Job;
+
+static void permute_nodes_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Permute_Job *job = arg;
+    OSM_Map *map = job->map;
+    for (int64_t i = begin; i < end; i++) {
+        int r = job->order[i];
+        job->ids[i] = map->node_ids[r];
+        job->lats[i] = map->node_lats[r];
+        job->lons[i] = map->node_lons[r];
+    }
+}
+
+static void permute_ways_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Permute_Job *job = arg;
+    OSM_Map *map = job->map;
+    for (int64_t i = begin; i < end; i++) {
+        int r = job->order[i];
+        job->ids[i] = map->way_ids[r];
+        memcpy(&job->refs[job->ref_start[i]], &map->way_refs[map->way_ref_start[r]],
+               (job->ref_start[i + 1] - job->ref_start[i]) * sizeof(OSM_Id));
+        for (int64_t k = job->tag_start[i], t = map->way_tag_start[r]; k < job->tag_start[i + 1]; k++, t++) {
+            job->keys[k] = map->way_keys[t];
+            job->vals[k] = map->way_vals[t];
+        }
+    }
+}
+
+/* Put the nodes of a map in id order, replacing its node columns. */
+static int sort_nodes(OSM_Map *map, int nthreads)
+{
+    int64_t n = map->num_nodes;
+    int *order = NULL;
+    if (radix_sort_ids(map->node_ids, n, nthreads, &order) < 0) {
+        return -1;
+    }
+    Permute_Job job = { map, order };
+    job.ids = malloc(n * sizeof(OSM_Id));
+    job.lats = malloc(n * sizeof(OSM_Lat));
+    job.lons = malloc(n * sizeof(OSM_Lon));
+    int rc = -1;
+    if (job.ids && job.lats && job.lons && PAR_for(n, nthreads, permute_nodes_task, &job) >= 0) {
+        free(map->node_ids);
+        free(map->node_lats);
+        free(map->node_lons);
+        map->node_ids = job.ids;
+        map->node_lats = job.lats;
+        map->node_lons = job.lons;
+        map->node_cap = map->num_nodes;
+        job.ids = NULL;
+        job.lats = NULL;
+        job.lons = NULL;
+        rc = 0;
+    }
+    free(job.ids);
+    free(job.lats);
+    free(job.lons);
+    free(order);
+    return rc;
+}
+
+/* Put the ways of a map in id order, replacing its way columns. */
+static int sort_ways(OSM_Map *map, int nthreads)
+{
+    int64_t n = map->num_ways;
+    int *order = NULL;
+    if (radix_sort_ids(map->way_ids, n, nthreads, &order) < 0) {
+        return -1;
+    }
+    Permute_Job job = { map, order };
+    job.ids = malloc(n * sizeof(OSM_Id));
+    job.ref_start = malloc((n + 1) * sizeof(int64_t));
+    job.tag_start = malloc((n + 1) * sizeof(int64_t));
+    job.refs = malloc((map->num_refs ? map->num_refs : 1) * sizeof(OSM_Id));
+    job.keys = malloc((map->num_tags ? map->num_tags : 1) * sizeof(char *));
+    job.vals = malloc((map->num_tags ? map->num_tags : 1) * sizeof(char *));
+    int rc = -1;
+    if (job.ids && job.ref_start && job.tag_start && job.refs && job.keys && job.vals) {
+        job.ref_start[0] = job.tag_start[0] = 0;
+        for (int64_t i = 0; i < n; i++) {
+            int r = order[i];
+            job.ref_start[i + 1] = job.ref_start[i] + map->way_ref_start[r + 1] - map->way_ref_start[r];
+            job.tag_start[i + 1] = job.tag_start[i] + map->way_tag_start[r + 1] - map->way_tag_start[r];
+        }
+        if (PAR_for(n, nthreads, permute_ways_task, &job) >= 0) {
+            free(map->way_ids);
+            free(map->way_ref_start);
+            free(map->way_tag_start);
+            free(map->way_refs);
+            free(map->way_keys);
+            free(map->way_vals);
+            map->way_ids = job.ids;
+            map->way_ref_start = job.ref_start;
+            map->way_tag_start = job.tag_start;
+            map->way_refs = job.refs;
+            map->way_keys = job.keys;
+            map->way_vals = job.vals;
+            map->way_cap = map->num_ways;
+            map->ref_cap = map->num_refs;
+            map->tag_cap = map->num_tags;
+            memset(&job, 0, sizeof(job));
+            rc = 0;
+        }
+    }
+    free(job.ids);
+    free(job.ref_start);
+    free(job.tag_start);
+    free(job.refs);
+    free(job.keys);
+    free(job.vals);
+    free(order);
+    return rc;
+}
+
+/**
+ * @brief Sort the nodes and the ways of a freshly read map by id.
+ *
+ * Each unsorted id column is ordered with a parallel LSD radix sort of
+ * (id, row) pairs, and all the columns of its entities are then gathered
+ * into that order, in parallel.  Entities with equal ids keep their file
+ * order.  If memory runs short, the column is left as it was.
+ */
+static void sort_Map(OSM_Map *map)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int nthreads = PAR_num_threads(0);
+    if (!ids_sorted(map->node_ids, map->num_nodes) && sort_nodes(map, nthreads) < 0) {
+        debug("DEBUG: sort_Map - nodes left in file order.\n");
+    }
+    if (!ids_sorted(map->way_ids, map->num_ways) && sort_ways(map, nthreads) < 0) {
+        debug("DEBUG: sort_Map - ways left in file order.\n");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    map->sort_ns = (int64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 + (t1.tv_nsec - t0.tv_nsec);
+    debug("DEBUG: sort_Map - sorted in %lld ns.\n", (long long)map->sort_ns);
+}
+
+/**
+ * @brief Complete a map after all blocks have been read.
+ *
+ * Sorts the map by id unless its header declares it sorted or the caller
+ * asked for file order, records whether the id columns are sorted (which
+ * enables binary search in the lookup functions) and builds the handles
+ * returned by the accessors.
+ *
+ * @param map    The map to finalize.
+ * @param flags  The flags passed to OSM_read_Map_with.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int finalize_Map(OSM_Map *map, int flags)
+{
+    free(map->packed);
+    map->packed = NULL;
+    map->packed_cap = 0;
+    if (!map->header_sorted && !(flags & OSM_READ_KEEP_ORDER)) {
+        sort_Map(map);
+    }
+    map->nodes_sorted = ids_sorted(map->node_ids, map->num_nodes);
+    map->ways_sorted = ids_sorted(map->way_ids, map->num_ways);
+    debug("DEBUG: finalize_Map - nodes_sorted=%d, ways_sorted=%d\n",
+          map->nodes_sorted, map->ways_sorted);
+
+    if (map->num_nodes > 0) {
+        map->node_handles = malloc((size_t)map->num_nodes * sizeof(OSM_Node));
+        if (!map->node_handles) return -1;
+        for (int i = 0; i < map->num_nodes; i++) map->node_handles[i].map = map;
+    }
+    if (map->num_ways > 0) {
+        map->way_handles = malloc((size_t)map->num_ways * sizeof(OSM_Way));
+        if (!map->way_handles) return -1;
+        for (int i = 0; i < map->num_ways; i++) map->way_handles[i].map = map;
+    }
+    return 0;
+}
+
 /**
  * @brief Read a 4-byte big-endian unsigned integer from the stream.
  *
@@ -172,6 +1078,16 @@ static int parse_HeaderBlock(PB_Message pb_msg, OSM_Map *map)
     }
     debug("DEBUG: parse_HeaderBlock invoked.\n");
 
+    // #5 => optional_features; sorted files declare "Sort.Type_then_ID".
+    PB_Field *feature = pb_msg;
+    while ((feature = PB_next_field(feature, 5, LEN_TYPE, FORWARD_DIR)) != NULL) {
+        static const char sort_feature[] = "Sort.Type_then_ID";
+        if (feature->value.bytes.size == sizeof(sort_feature) - 1 &&
+            memcmp(feature->value.bytes.buf, sort_feature, sizeof(sort_feature) - 1) == 0) {
+            map->header_sorted = 1;
+        }
+    }
+
     // #1 => HeaderBBox
     PB_Field *bbox_field = PB_get_field(pb_msg, 1, LEN_TYPE);
     if (!bbox_field) {
@@ -224,6 +1140,10 @@ static int parse_HeaderBlock(PB_Message pb_msg, OSM_Map *map)
  * @brief Read map data in OSM PBF format from the specified input stream,
  * construct and return a corresponding OSM_Map object.  Storage required
  * for the map object and any related entities is allocated on the heap.
+ *
+ * Unless the file declares Sort.Type_then_ID, the nodes and ways are sorted
+ * by id after reading, so that lookups are binary searches.
+ *
  * @param in  The input stream to read.
  * @return  If reading was successful, a pointer to the OSM_Map object constructed
  * from the input, otherwise NULL in case of any error.
@@ -231,38 +1151,42 @@ static int parse_HeaderBlock(PB_Message pb_msg, OSM_Map *map)
 
 OSM_Map *OSM_read_Map(FILE *in)
 {
-    if (!in) return NULL;
-
-    debug("DEBUG: Entering OSM_read_Map()\n");
-
-    OSM_Map *map = calloc(1, sizeof(OSM_Map));
-    if (!map) {
-        fprintf(stderr, "ERROR: OSM_read_Map - out of memory.\n");
-        return NULL;
-    }
+    return OSM_read_Map_with(in, 0);
+}
 
-    while (1) {
-        // 1) Read 4-byte BlobHeader length (big-endian)
+/*
+ * Read blobs from in into the map, up to the end of the file or, if end is
+ * not negative, until a blob would start at or beyond offset end.  With
+ * snap, the rows of each OSMData block are written to it as a snapshot
+ * record and dropped from the map, which so holds one block at a time.
+ * Returns 0 on success, -1 on error (the map must then be freed).
+ */
+static int read_blobs(FILE *in, OSM_Map *map, int64_t end, FILE *snap)
+{
+    int rc = 0;
+    while (end < 0 || ftello(in) < end) {
+        // 1) Read 4-byte BlobHeader length (big-endian)
         uint32_t blob_header_len = read_uint32_be(in);
         if (blob_header_len == 0 || feof(in)) {
             debug("DEBUG: No more data or EOF reached. Stopping.\n");
             break;
         }
+        if (blob_header_len == SNAPSHOT_MAGIC) {
+            return read_snapshot(in, map);
+        }
 
         // 2) Read BlobHeader
         char *header_buf = malloc(blob_header_len);
         if (!header_buf) {
             fprintf(stderr, "ERROR: OSM_read_Map - out of memory reading header.\n");
-            free(map);
-            return NULL;
+            return -1;
         }
 
         size_t read_size = fread(header_buf, 1, blob_header_len, in);
         if (read_size != blob_header_len || feof(in)) {
             fprintf(stderr, "ERROR: OSM_read_Map - failed to read blob header.\n");
             free(header_buf);
-            free(map);
-            return NULL;
+            return -1;
         }
 
         // 3) Parse BlobHeader
@@ -270,9 +1194,9 @@ OSM_Map *OSM_read_Map(FILE *in)
         if (PB_read_embedded_message(header_buf, blob_header_len, &header_msg) < 0 || !header_msg) {
             fprintf(stderr, "ERROR: OSM_read_Map - could not parse BlobHeader.\n");
             free(header_buf);
-            free(map);
-            return NULL;
+            return -1;
         }
+        uint64_t blob_key = blob_cache_dir ? BLC_hash(header_buf, blob_header_len, BLOCK_CACHE_VERSION) : 0;
         free(header_buf);
 
         // Extract fields from BlobHeader
@@ -282,8 +1206,7 @@ OSM_Map *OSM_read_Map(FILE *in)
         if (!type_field || !datasize_field) {
             fprintf(stderr, "ERROR: BlobHeader missing type or datasize.\n");
             PB_delete_message(header_msg);
-            free(map);
-            return NULL;
+            return -1;
         }
 
         size_t datasize = (size_t)datasize_field->value.i64;
@@ -293,8 +1216,7 @@ OSM_Map *OSM_read_Map(FILE *in)
         if (!type_str) {
             fprintf(stderr, "ERROR: OSM_read_Map - out of memory for type_str.\n");
             PB_delete_message(header_msg);
-            free(map);
-            return NULL;
+            return -1;
         }
         memcpy(type_str, type_field->value.bytes.buf, type_field->value.bytes.size);
         type_str[type_field->value.bytes.size] = '\0';
@@ -313,8 +1235,7 @@ OSM_Map *OSM_read_Map(FILE *in)
         if (!blob_buf) {
             fprintf(stderr, "ERROR: OSM_read_Map - out of memory for blob.\n");
             free(type_str);
-            free(map);
-            return NULL;
+            return -1;
         }
 
         read_size = fread(blob_buf, 1, datasize, in);
@@ -322,8 +1243,29 @@ OSM_Map *OSM_read_Map(FILE *in)
             fprintf(stderr, "ERROR: OSM_read_Map - failed to read blob data.\n");
             free(type_str);
             free(blob_buf);
-            free(map);
-            return NULL;
+            return -1;
+        }
+
+        // Rows of a blob seen before come from the cache, still compressed
+        int is_data = strcmp(type_str, "OSMData") == 0;
+        Block_Mark mark = mark_map(map);
+        if (is_data && blob_cache_dir) {
+            blob_key = BLC_hash(blob_buf, datasize, blob_key);
+            int hit = load_cached_block(map, blob_key);
+            if (hit) {
+                free(type_str);
+                free(blob_buf);
+                if (hit < 0) {
+                    fprintf(stderr, "ERROR: OSM_read_Map - out of memory for cached block.\n");
+                    return -1;
+                }
+                map->blobs_cached++;
+                if (snap && put_block_record(snap, map, mark) < 0) {
+                    fprintf(stderr, "ERROR: OSM_read_Map - cannot write the snapshot.\n");
+                    return -1;
+                }
+                continue;
+            }
         }
 
         // 5) Parse Blob
@@ -332,8 +1274,7 @@ OSM_Map *OSM_read_Map(FILE *in)
             fprintf(stderr, "ERROR: OSM_read_Map - failed to parse Blob.\n");
             free(type_str);
             free(blob_buf);
-            free(map);
-            return NULL;
+            return -1;
         }
         free(blob_buf);
 
@@ -350,8 +1291,7 @@ OSM_Map *OSM_read_Map(FILE *in)
                 fprintf(stderr, "ERROR: OSM_read_Map - inflate zlib_data failed.\n");
                 PB_delete_message(blob_msg);
                 free(type_str);
-                free(map);
-                return NULL;
+                return -1;
             }
         } else if (raw_field) {
             debug("DEBUG: Parsing raw blob data.\n");
@@ -361,15 +1301,13 @@ OSM_Map *OSM_read_Map(FILE *in)
                 fprintf(stderr, "ERROR: OSM_read_Map - parse raw blob data failed.\n");
                 PB_delete_message(blob_msg);
                 free(type_str);
-                free(map);
-                return NULL;
+                return -1;
             }
         } else {
             fprintf(stderr, "ERROR: OSM_read_Map - neither raw nor zlib_data found.\n");
             PB_delete_message(blob_msg);
             free(type_str);
-            free(map);
-            return NULL;
+            return -1;
         }
 
         // Process OSMHeader or OSMData
@@ -378,10 +1316,21 @@ OSM_Map *OSM_read_Map(FILE *in)
             if (parse_HeaderBlock(uncompressed_msg, map) < 0) {
                 debug("WARN: parse_HeaderBlock failed.\n");
             }
-        } else if (strcmp(type_str, "OSMData") == 0) {
+            if (snap && put_header_record(snap, map) < 0) {
+                fprintf(stderr, "ERROR: OSM_read_Map - cannot write the snapshot.\n");
+                rc = -1;
+            }
+        } else if (is_data) {
             debug("DEBUG: Processing OSMData...\n");
             if (parse_PrimitiveBlock(uncompressed_msg, map) < 0) {
                 debug("WARN: parse_PrimitiveBlock failed.\n");
+            } else if (blob_cache_dir) {
+                save_cached_block(map, blob_key, mark);
+            }
+            map->blobs_decoded++;
+            if (snap && put_block_record(snap, map, mark) < 0) {
+                fprintf(stderr, "ERROR: OSM_read_Map - cannot write the snapshot.\n");
+                rc = -1;
             }
         } else {
             debug("DEBUG: Unknown blob type \"%s\". Skipping.\n", type_str);
@@ -390,17 +1339,192 @@ OSM_Map *OSM_read_Map(FILE *in)
         PB_delete_message(blob_msg);
         PB_delete_message(uncompressed_msg);
         free(type_str);
+        if (rc < 0) {
+            return -1;
+        }
 
         if (feof(in)) {
             debug("DEBUG: Reached EOF after processing blobs. Exiting loop.\n");
             break;
         }
     }
+    return 0;
+}
+
+/**
+ * @brief Read a map, as OSM_read_Map does, with options.
+ *
+ * @param in     The input stream to read.
+ * @param flags  OSM_READ_KEEP_ORDER to keep nodes and ways in file order.
+ * @return The map, or NULL in case of any error.
+ */
+OSM_Map *OSM_read_Map_with(FILE *in, int flags)
+{
+    if (!in) return NULL;
+
+    debug("DEBUG: Entering OSM_read_Map()\n");
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    OSM_Map *map = calloc(1, sizeof(OSM_Map));
+    if (!map) {
+        fprintf(stderr, "ERROR: OSM_read_Map - out of memory.\n");
+        return NULL;
+    }
+    if (read_blobs(in, map, -1, NULL) < 0) {
+        OSM_free_Map(map);
+        return NULL;
+    }
+    if (finalize_Map(map, flags) < 0) {
+        fprintf(stderr, "ERROR: OSM_read_Map - out of memory finalizing map.\n");
+        OSM_free_Map(map);
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    map->load_ns = (int64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 + (t1.tv_nsec - t0.tv_nsec);
 
     debug("DEBUG: Successfully exited OSM_read_Map(), returning map.\n");
     return map;
 }
 
+/**
+ * @brief Write a snapshot of the map data in a part of a PBF file.
+ *
+ * The blobs that start from offset begin up to offset end are decoded, as
+ * OSM_read_Map does, and their rows written to out, one block at a time.
+ * OSM_read_Map reads snapshots as it reads PBF files, and the snapshots of
+ * consecutive parts of a file, concatenated in order, read as the whole
+ * file does, so parts can be decoded by separate processes.
+ *
+ * @param in     The PBF file.  It must be seekable unless begin is 0.
+ * @param begin  Offset of the first blob of the part, 0 for the first.
+ * @param end    Offset where the part ends, -1 for the end of the file.
+ * @param out    Where the snapshot is written.
+ * @return 0 on success, -1 on error.
+ */
+int OSM_write_snapshot(FILE *in, int64_t begin, int64_t end, FILE *out)
+{
+    OSM_Map *map = calloc(1, sizeof(OSM_Map));
+    if (!map) {
+        fprintf(stderr, "ERROR: OSM_write_snapshot - out of memory.\n");
+        return -1;
+    }
+    int rc = (begin == 0 || fseeko(in, begin, SEEK_SET) == 0) ? read_blobs(in, map, end, out) : -1;
+    if (fflush(out) != 0) rc = -1;
+    OSM_free_Map(map);
+    return rc;
+}
+
+/* Shrink an allocated column to count elements; on failure the larger block is kept. */
+static void shrink_column(void **arrp, size_t elem, int64_t count)
+{
+    if (count <= 0 || !*arrp) return;
+    void *arr = realloc(*arrp, (size_t)count * elem);
+    if (arr) *arrp = arr;
+}
+
+/**
+ * @brief Pack a loaded map into a few tightly sized allocations.
+ *
+ * The tag strings, which are read as one small heap allocation each, are
+ * copied into a single block, and every column is shrunk to its final
+ * length.  Besides saving memory, this leaves the map's data in large
+ * blocks of their own (rather than in heap pages shared with unrelated small
+ * allocations), so processes forked after loading can share the map's pages
+ * without their own allocations ever writing to, and so copying, them.
+ *
+ * No more data may be added to the map afterwards.
+ *
+ * @param mp  The map to compact.
+ * @return 0 on success, -1 if memory could not be allocated (the map is
+ * left unchanged).
+ */
+int OSM_Map_compact(OSM_Map *mp)
+{
+    if (!mp) {
+        return -1;
+    }
+    if (!mp->tag_arena && mp->num_tags > 0) {
+        char *arena = malloc(mp->tag_bytes > 0 ? (size_t)mp->tag_bytes : 1);
+        if (!arena) {
+            return -1;
+        }
+        char *p = arena;
+        for (int64_t i = 0; i < mp->num_tags; i++) {
+            char **strs[2] = { &mp->way_keys[i], &mp->way_vals[i] };
+            for (int k = 0; k < 2; k++) {
+                if (!*strs[k]) continue;
+                size_t n = strlen(*strs[k]) + 1;
+                memcpy(p, *strs[k], n);
+                free(*strs[k]);
+                *strs[k] = p;
+                p += n;
+            }
+        }
+        mp->tag_arena = arena;
+    }
+
+    shrink_column((void **)&mp->node_ids, sizeof(OSM_Id), mp->num_nodes);
+    shrink_column((void **)&mp->node_lats, sizeof(OSM_Lat), mp->num_nodes);
+    shrink_column((void **)&mp->node_lons, sizeof(OSM_Lon), mp->num_nodes);
+    if (mp->num_nodes > 0) mp->node_cap = mp->num_nodes;
+
+    shrink_column((void **)&mp->way_ids, sizeof(OSM_Id), mp->num_ways);
+    shrink_column((void **)&mp->way_ref_start, sizeof(int64_t), mp->num_ways + 1);
+    shrink_column((void **)&mp->way_tag_start, sizeof(int64_t), mp->num_ways + 1);
+    if (mp->num_ways > 0) mp->way_cap = mp->num_ways;
+
+    if (mp->way_refs) {
+        shrink_column((void **)&mp->way_refs, sizeof(OSM_Id), mp->num_refs);
+        if (mp->num_refs > 0) mp->ref_cap = mp->num_refs;
+    }
+    shrink_column((void **)&mp->way_keys, sizeof(char *), mp->num_tags);
+    shrink_column((void **)&mp->way_vals, sizeof(char *), mp->num_tags);
+    if (mp->num_tags > 0) mp->tag_cap = mp->num_tags;
+
+    debug("DEBUG: OSM_Map_compact - %lld bytes of tag strings packed.\n", (long long)mp->tag_bytes);
+    return 0;
+}
+
+/**
+ * @brief Free an OSM_Map object and everything it owns.
+ *
+ * Handles previously obtained from the map's accessors become invalid.
+ *
+ * @param mp  The map to free (may be NULL).
+ */
+void OSM_free_Map(OSM_Map *mp)
+{
+    if (!mp) return;
+    for (int64_t i = 0; !mp->tag_arena && i < mp->num_tags; i++) {
+        free(mp->way_keys[i]);
+        free(mp->way_vals[i]);
+    }
+    free(mp->tag_arena);
+    free(mp->bbox);
+    free(mp->node_ids);
+    free(mp->node_lats);
+    free(mp->node_lons);
+    free(mp->way_ids);
+    free(mp->way_ref_start);
+    free(mp->way_tag_start);
+    free(mp->way_refs);
+    free(mp->way_keys);
+    free(mp->way_vals);
+    free(mp->way_ref_index);
+    free(mp->missing_pos);
+    free(mp->missing_ids);
+    free(mp->node_handles);
+    free(mp->way_handles);
+    free(mp->packed);
+    for (int i = 0; i < OSM_NUM_INDEXES; i++) {
+        free(mp->id_order[i]);
+        CRK_free(mp->crackers[i]);
+    }
+    free(mp);
+}
+
 /**
  * @brief Parse repeated "Way" entries from a group message and store the
  *        parsed data into the given OSM_Map object.
@@ -408,9 +1532,10 @@ OSM_Map *OSM_read_Map(FILE *in)
  * This function extracts information about "Way" elements from the group message.
  * For each "Way" object:
  *   - Parses the ID field.
- *   - Expands packed fields for keys, values, and references.
- *   - Decodes the reference IDs using delta coding and zigzag encoding.
- *   - Stores the parsed "Way" object into the OSM_Map's list of ways.
+ *   - Expands packed fields for keys and values.
+ *   - Decodes the reference IDs, packed, delta coded and zigzag encoded,
+ *     with the CPU kernels.
+ *   - Appends the way to the OSM_Map's way columns.
  *
  * @param group_msg  The group message containing the "Way" objects to be parsed.
  * @param map        The map structure where the parsed "Way" objects will be stored.
@@ -445,10 +1570,17 @@ static int parse_ways_in_group(PB_Message group_msg, OSM_Map *map,
         }
         int64_t way_id = id_f->value.i64;
 
-        // expand packed fields: keys (#2), vals (#3), refs (#8)
+        // refs (#8) are decoded in the scratch array
+        int64_t num_refs = decode_packed(map, way_msg, 8);
+        if (num_refs < 0) {
+            debug("WARN: Way %lld has malformed refs (#8).\n", (long long)way_id);
+            PB_delete_message(way_msg);
+            continue;
+        }
+
+        // expand packed fields: keys (#2), vals (#3)
         PB_expand_packed_fields(way_msg, 2, VARINT_TYPE);
         PB_expand_packed_fields(way_msg, 3, VARINT_TYPE);
-        PB_expand_packed_fields(way_msg, 8, VARINT_TYPE);
 
         // count how many key fields
         int num_keys = 0;
@@ -459,14 +1591,15 @@ static int parse_ways_in_group(PB_Message group_msg, OSM_Map *map,
             num_keys++;
         }
 
-        // allocate arrays for keys/vals
-        char **way_keys = (num_keys > 0) ? calloc(num_keys, sizeof(char*)) : NULL;
-        char **way_vals = (num_keys > 0) ? calloc(num_keys, sizeof(char*)) : NULL;
+        if (reserve_way(map) < 0 || reserve_way_data(map, num_refs, num_keys) < 0) {
+            debug("ERROR: Out of memory for OSM_Way.\n");
+            PB_delete_message(way_msg);
+            return -1;
+        }
 
-        // walk them in parallel
+        // walk keys/vals in parallel, mapping them to the stringtable
         kf = NULL;
         PB_Field *vf = NULL;
-        int idx = 0;
         while ((kf = PB_next_field((kf ? kf : way_msg),
                                    2, VARINT_TYPE, FORWARD_DIR)) &&
                (vf = PB_next_field((vf ? vf : way_msg),
@@ -474,77 +1607,27 @@ static int parse_ways_in_group(PB_Message group_msg, OSM_Map *map,
         {
             uint32_t k_idx = (uint32_t)kf->value.i64;
             uint32_t v_idx = (uint32_t)vf->value.i64;
-            // map them to stringtable
-            if (k_idx < (uint32_t)string_count && way_keys) {
-                way_keys[idx] = strdup(stringtable[k_idx]);
-            }
-            if (v_idx < (uint32_t)string_count && way_vals) {
-                way_vals[idx] = strdup(stringtable[v_idx]);
-            }
-            idx++;
+            map->way_keys[map->num_tags] =
+                (k_idx < (uint32_t)string_count) ? strdup(stringtable[k_idx]) : NULL;
+            map->way_vals[map->num_tags] =
+                (v_idx < (uint32_t)string_count) ? strdup(stringtable[v_idx]) : NULL;
+            if (map->way_keys[map->num_tags]) map->tag_bytes += strlen(map->way_keys[map->num_tags]) + 1;
+            if (map->way_vals[map->num_tags]) map->tag_bytes += strlen(map->way_vals[map->num_tags]) + 1;
+            map->num_tags++;
         }
 
-        // parse refs (#8), repeated sint64 with delta
-        int num_refs = 0;
-        PB_Field *rf = NULL;
-        while ((rf = PB_next_field((rf ? rf : way_msg),
-                                   8, VARINT_TYPE, FORWARD_DIR)))
-        {
-            num_refs++;
-        }
-
-        int64_t *refs_array = (num_refs > 0) ? calloc(num_refs, sizeof(int64_t)) : NULL;
-
-        // read them with delta
-        int64_t running = 0;
-        int r_idx = 0;
-        rf = NULL;
-        while ((rf = PB_next_field((rf ? rf : way_msg),
-                                   8, VARINT_TYPE, FORWARD_DIR)))
-        {
-            // "refs" are stored as sint64 => zigzag
-            // plus delta-coded
-            int64_t encoded = rf->value.i64;
-            // zigzag:
-            int64_t delta = zigzag_decode(encoded);
-            running += delta;
-            if (refs_array) {
-                refs_array[r_idx] = running;
-            }
-            r_idx++;
-        }
+        // refs (#8) are repeated sint64 => zigzag plus delta-coded
+        CPU_kernels.deltas(map->packed, &map->way_refs[map->num_refs], num_refs);
+        map->num_refs += num_refs;
 
-        // build an OSM_Way
-        OSM_Way *way = calloc(1, sizeof(OSM_Way));
-        if (!way) {
-            debug("ERROR: Out of memory for OSM_Way.\n");
-            // clean up
-            PB_delete_message(way_msg);
-            if (way_keys) {
-                for (int i=0; i<num_keys; i++) {
-                    free(way_keys[i]);
-                    free(way_vals[i]);
-                }
-                free(way_keys);
-                free(way_vals);
-            }
-            free(refs_array);
-            continue;
-        }
-        way->id        = way_id;
-        way->num_keys  = num_keys;
-        way->keys      = way_keys;
-        way->vals      = way_vals;
-        way->num_refs  = num_refs;
-        way->refs      = refs_array;
-
-        // insert it into map->ways
+        // append the way row
+        map->way_ids[map->num_ways] = way_id;
         map->num_ways++;
-        map->ways = realloc(map->ways, map->num_ways * sizeof(OSM_Way*));
-        map->ways[ map->num_ways - 1 ] = way;
+        map->way_ref_start[map->num_ways] = map->num_refs;
+        map->way_tag_start[map->num_ways] = map->num_tags;
 
-        debug("DEBUG: Found Way id=%lld, keys=%d, refs=%d\n",
-              (long long)way_id, num_keys, num_refs);
+        debug("DEBUG: Found Way id=%lld, keys=%d, refs=%lld\n",
+              (long long)way_id, num_keys, (long long)num_refs);
 
         PB_delete_message(way_msg);
     }
@@ -582,65 +1665,38 @@ static int parse_nodes_in_group(PB_Message group_msg, OSM_Map *map) {
 
     debug("DEBUG: Parsing DenseNodes...\n");
 
-    // Expand packed fields (IDs, latitudes, longitudes)
-    PB_expand_packed_fields(dense_msg, 1, VARINT_TYPE); // Node IDs
-    PB_expand_packed_fields(dense_msg, 8, VARINT_TYPE); // Latitudes
-    PB_expand_packed_fields(dense_msg, 9, VARINT_TYPE); // Longitudes
-
-    // Extract and decode nodes
-    int num_nodes = 0;
-    PB_Field *id_field = NULL;
-    PB_Field *lat_field = NULL;
-    PB_Field *lon_field = NULL;
-
-    int64_t last_id = 0;
-    int64_t last_lat = 0;
-    int64_t last_lon = 0;
-
-    while ((id_field = PB_next_field((id_field ? id_field : dense_msg), 1, VARINT_TYPE, FORWARD_DIR)) &&
-           (lat_field = PB_next_field((lat_field ? lat_field : dense_msg), 8, VARINT_TYPE, FORWARD_DIR)) &&
-           (lon_field = PB_next_field((lon_field ? lon_field : dense_msg), 9, VARINT_TYPE, FORWARD_DIR))) {
-
-        int64_t delta_id = id_field->value.i64;
-        int64_t delta_lat = lat_field->value.i64;
-        int64_t delta_lon = lon_field->value.i64;
-
-        // Apply delta encoding and zigzag decoding
-        last_id += zigzag_decode(delta_id);
-        last_lat += zigzag_decode(delta_lat);
-        last_lon += zigzag_decode(delta_lon);
-
-        // Allocate and store the node
-        OSM_Node *node = calloc(1, sizeof(OSM_Node));
-        if (!node) {
-            debug("ERROR: Out of memory for OSM_Node.\n");
+    // Decode the packed IDs, latitudes and longitudes (#1, #8, #9) one
+    // after the other, summing their deltas into the node columns.  Only
+    // the nodes that have all three are kept.
+    static const int fnums[3] = {1, 8, 9};
+    int64_t num_nodes = 0;
+    for (int c = 0; c < 3; c++) {
+        int64_t n = decode_packed(map, dense_msg, fnums[c]);
+        if (n < 0 || (c == 0 && reserve_nodes(map, (int)n) < 0)) {
+            debug("ERROR: Could not decode DenseNodes field #%d.\n", fnums[c]);
             PB_delete_message(dense_msg);
             return -1;
         }
-
-        node->id = last_id;
-        node->lat = last_lat;
-        node->lon = last_lon;
-
-        // Store in map->nodes array
-        map->num_nodes++;
-        map->nodes = realloc(map->nodes, map->num_nodes * sizeof(OSM_Node *));
-        map->nodes[map->num_nodes - 1] = node;
-
-        debug("DEBUG: Read Node ID %lld at lat=%.7lf, lon=%.7lf\n",
-              (long long)node->id, node->lat * 1e-7, node->lon * 1e-7);
-
-        num_nodes++;
+        if (c == 0 || n < num_nodes) num_nodes = n;
+        int64_t *col = (c == 0) ? map->node_ids : (c == 1) ? map->node_lats : map->node_lons;
+        CPU_kernels.deltas(map->packed, &col[map->num_nodes], num_nodes);
     }
+    map->num_nodes += (int)num_nodes;
+
+    debug("DEBUG: Read %lld DenseNodes.\n", (long long)num_nodes);
 
     PB_delete_message(dense_msg);
-    return num_nodes;
+    return (int)num_nodes;
 }
 
 /* ===========================
  * Accessor Functions
  * ===========================*/
 
+/* Row of a node or way handle within its map's columns. */
+static inline int64_t node_row(OSM_Node *np) { return np - np->map->node_handles; }
+static inline int64_t way_row(OSM_Way *wp) { return wp - wp->map->way_handles; }
+
 /**
  * @brief Get the number of nodes in an OSM_Map object.
  *
@@ -661,6 +1717,66 @@ int OSM_Map_get_num_ways(OSM_Map *mp) {
     return (mp) ? mp->num_ways : 0;
 }
 
+/**
+ * @brief Get the time it took to read an OSM_Map object.
+ *
+ * @param mp The map object to query.
+ * @return The time spent in OSM_read_Map, in nanoseconds, or 0 if mp is NULL.
+ */
+int64_t OSM_Map_get_load_ns(OSM_Map *mp) {
+    return (mp) ? mp->load_ns : 0;
+}
+
+/**
+ * @brief Get how the OSMData blobs of a map were read.
+ *
+ * @param mp       The map object to query.
+ * @param decoded  Receives the number of blobs inflated and decoded.
+ * @param cached   Receives the number of blobs copied from the blob cache
+ *                 (see OSM_set_blob_cache).
+ */
+void OSM_Map_get_blob_counts(OSM_Map *mp, int64_t *decoded, int64_t *cached) {
+    *decoded = mp ? mp->blobs_decoded : 0;
+    *cached = mp ? mp->blobs_cached : 0;
+}
+
+/**
+ * @brief Report how much heap memory an OSM_Map object holds, by component.
+ *
+ * Columns are counted at their allocated size, so the figures include the
+ * slack left by growing them during loading.
+ *
+ * @param mp The map object to query.
+ * @param mem Receives the sizes in bytes (all zero if mp is NULL).
+ */
+void OSM_Map_get_memory(OSM_Map *mp, OSM_Map_Memory *mem) {
+    memset(mem, 0, sizeof(*mem));
+    if (!mp) {
+        return;
+    }
+    mem->nodes = (size_t)mp->node_cap * (sizeof(OSM_Id) + sizeof(OSM_Lat) + sizeof(OSM_Lon));
+    mem->ways = (size_t)mp->way_cap * sizeof(OSM_Id);
+    if (mp->way_ref_start) {
+        mem->ways += (size_t)(mp->way_cap + 1) * 2 * sizeof(int64_t);
+    }
+    mem->refs = (size_t)mp->ref_cap * sizeof(OSM_Id);
+    if (mp->way_ref_index) {
+        mem->refs += (size_t)(mp->num_refs + 1) * sizeof(uint32_t);
+        mem->refs += (size_t)mp->num_missing * (sizeof(int64_t) + sizeof(OSM_Id));
+    }
+    mem->tags = (size_t)mp->tag_cap * 2 * sizeof(char *) + (size_t)mp->tag_bytes;
+    mem->handles = (size_t)mp->num_nodes * sizeof(OSM_Node) + (size_t)mp->num_ways * sizeof(OSM_Way);
+    if (__atomic_load_n(&mp->id_order[OSM_INDEX_NODE_IDS], __ATOMIC_ACQUIRE)) {
+        mem->indexes += (size_t)mp->num_nodes * sizeof(int);
+    }
+    if (__atomic_load_n(&mp->id_order[OSM_INDEX_WAY_IDS], __ATOMIC_ACQUIRE)) {
+        mem->indexes += (size_t)mp->num_ways * sizeof(int);
+    }
+    for (int i = 0; i < OSM_NUM_INDEXES; i++) {
+        mem->indexes += CRK_get_memory(__atomic_load_n(&mp->crackers[i], __ATOMIC_ACQUIRE));
+    }
+}
+
 /**
  * @brief Get the node at the specified index from an OSM_Map object.
  *
@@ -669,10 +1785,10 @@ int OSM_Map_get_num_ways(OSM_Map *mp) {
  * @return The node at the specified index, or NULL if index is out of range or nodes not populated.
  */
 OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index) {
-    if (!mp || !mp->nodes || index < 0 || index >= mp->num_nodes) {
+    if (!mp || !mp->node_handles || index < 0 || index >= mp->num_nodes) {
         return NULL;
     }
-    return mp->nodes[index];
+    return &mp->node_handles[index];
 }
 
 /**
@@ -683,10 +1799,10 @@ OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index) {
  * @return The way at the specified index, or NULL if index is out of range or ways not populated.
  */
 OSM_Way *OSM_Map_get_Way(OSM_Map *mp, int index) {
-    if (!mp || !mp->ways || index < 0 || index >= mp->num_ways) {
+    if (!mp || !mp->way_handles || index < 0 || index >= mp->num_ways) {
         return NULL;
     }
-    return mp->ways[index];
+    return &mp->way_handles[index];
 }
 
 /**
@@ -706,7 +1822,7 @@ OSM_BBox *OSM_Map_get_BBox(OSM_Map *mp) {
  * @return The id of the node.
  */
 int64_t OSM_Node_get_id(OSM_Node *np) {
-    return (np) ? np->id : 0;
+    return (np) ? np->map->node_ids[node_row(np)] : 0;
 }
 
 /**
@@ -716,7 +1832,7 @@ int64_t OSM_Node_get_id(OSM_Node *np) {
  * @return The latitude (in nanodegrees) of the node.
  */
 int64_t OSM_Node_get_lat(OSM_Node *np) {
-    return (np) ? np->lat : 0;
+    return (np) ? np->map->node_lats[node_row(np)] : 0;
 }
 
 /**
@@ -726,17 +1842,20 @@ int64_t OSM_Node_get_lat(OSM_Node *np) {
  * @return The longitude (in nanodegrees) of the node.
  */
 int64_t OSM_Node_get_lon(OSM_Node *np) {
-    return (np) ? np->lon : 0;
+    return (np) ? np->map->node_lons[node_row(np)] : 0;
 }
 
 /**
  * @brief Get the number of keys (key/value pairs) in an OSM_Node object.
  *
+ * Node tags are not retained when reading DenseNodes, so this is always 0.
+ *
  * @param np The node object to be queried.
  * @return The number of keys, or 0 if np is NULL.
  */
 int OSM_Node_get_num_keys(OSM_Node *np) {
-    return (np) ? np->num_keys : 0;
+    (void)np;
+    return 0;
 }
 
 /**
@@ -747,10 +1866,9 @@ int OSM_Node_get_num_keys(OSM_Node *np) {
  * @return The key as a null-terminated string, or NULL if index is out of range.
  */
 char *OSM_Node_get_key(OSM_Node *np, int index) {
-    if (!np || !np->keys || index < 0 || index >= np->num_keys) {
-        return NULL;
-    }
-    return np->keys[index];
+    (void)np;
+    (void)index;
+    return NULL;
 }
 
 /**
@@ -761,10 +1879,9 @@ char *OSM_Node_get_key(OSM_Node *np, int index) {
  * @return The value as a null-terminated string, or NULL if index is out of range.
  */
 char *OSM_Node_get_value(OSM_Node *np, int index) {
-    if (!np || !np->vals || index < 0 || index >= np->num_keys) {
-        return NULL;
-    }
-    return np->vals[index];
+    (void)np;
+    (void)index;
+    return NULL;
 }
 
 
@@ -776,7 +1893,7 @@ char *OSM_Node_get_value(OSM_Node *np, int index) {
  * @return The id of the way.
  */
 int64_t OSM_Way_get_id(OSM_Way *wp) {
-    return (wp) ? wp->id : 0;
+    return (wp) ? wp->map->way_ids[way_row(wp)] : 0;
 }
 
 /**
@@ -786,7 +1903,9 @@ int64_t OSM_Way_get_id(OSM_Way *wp) {
  * @return The number of node references, or 0 if wp is NULL.
  */
 int OSM_Way_get_num_refs(OSM_Way *wp) {
-    return (wp) ? wp->num_refs : 0;
+    if (!wp) return 0;
+    int64_t row = way_row(wp);
+    return (int)(wp->map->way_ref_start[row + 1] - wp->map->way_ref_start[row]);
 }
 
 /**
@@ -797,10 +1916,45 @@ int OSM_Way_get_num_refs(OSM_Way *wp) {
  * @return The node id at the specified index, or 0 if index is out of range.
  */
 OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index) {
-    if (!wp || !wp->refs || index < 0 || index >= wp->num_refs) {
+    if (!wp || index < 0 || index >= OSM_Way_get_num_refs(wp)) {
         return 0;
     }
-    return wp->refs[index];
+    OSM_Map *mp = wp->map;
+    int64_t pos = mp->way_ref_start[way_row(wp)] + index;
+    if (!mp->way_ref_index) {
+        return mp->way_refs[pos];
+    }
+    uint32_t node = mp->way_ref_index[pos];
+    if (node != OSM_REF_MISSING) {
+        return mp->node_ids[node];
+    }
+    int64_t m = lower_bound_id(mp->missing_pos, 0, mp->num_missing, pos);
+    return mp->missing_ids[m];
+}
+
+/**
+ * @brief Get the index of the node referenced at a specified position in an
+ * OSM_Way object.
+ *
+ * After OSM_Map_index_refs this is a direct array read; otherwise the ref's
+ * node id is looked up.
+ *
+ * @param wp The way object to be queried.
+ * @param index The position of the node reference.
+ * @return The index of the referenced node, suitable for OSM_Map_get_Node,
+ * or OSM_REF_MISSING if the node is not in the map or index is out of range.
+ */
+uint32_t OSM_Way_get_ref_index(OSM_Way *wp, int index) {
+    if (!wp || index < 0 || index >= OSM_Way_get_num_refs(wp)) {
+        return OSM_REF_MISSING;
+    }
+    OSM_Map *mp = wp->map;
+    int64_t pos = mp->way_ref_start[way_row(wp)] + index;
+    if (mp->way_ref_index) {
+        return mp->way_ref_index[pos];
+    }
+    int64_t node = OSM_Map_find_Node(mp, mp->way_refs[pos]);
+    return (node >= 0) ? (uint32_t)node : OSM_REF_MISSING;
 }
 
 /**
@@ -810,7 +1964,9 @@ OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index) {
  * @return The number of keys, or 0 if wp is NULL.
  */
 int OSM_Way_get_num_keys(OSM_Way *wp) {
-    return (wp) ? wp->num_keys : 0;
+    if (!wp) return 0;
+    int64_t row = way_row(wp);
+    return (int)(wp->map->way_tag_start[row + 1] - wp->map->way_tag_start[row]);
 }
 
 /**
@@ -821,10 +1977,10 @@ int OSM_Way_get_num_keys(OSM_Way *wp) {
  * @return The key as a null-terminated string, or NULL if index is out of range.
  */
 char *OSM_Way_get_key(OSM_Way *wp, int index) {
-    if (!wp || !wp->keys || index < 0 || index >= wp->num_keys) {
+    if (!wp || index < 0 || index >= OSM_Way_get_num_keys(wp)) {
         return NULL;
     }
-    return wp->keys[index];
+    return wp->map->way_keys[wp->map->way_tag_start[way_row(wp)] + index];
 }
 
 /**
@@ -835,10 +1991,1018 @@ char *OSM_Way_get_key(OSM_Way *wp, int index) {
  * @return The value as a null-terminated string, or NULL if index is out of range.
  */
 char *OSM_Way_get_value(OSM_Way *wp, int index) {
-    if (!wp || !wp->vals || index < 0 || index >= wp->num_keys) {
+    if (!wp || index < 0 || index >= OSM_Way_get_num_keys(wp)) {
         return NULL;
     }
-    return wp->vals[index];
+    return wp->map->way_vals[wp->map->way_tag_start[way_row(wp)] + index];
+}
+
+/* ===========================
+ * Lookup by Id
+ * ===========================*/
+
+/**
+ * @brief Find the first position in a sorted id column whose id is >= id.
+ *
+ * @param ids  The id column (strictly increasing).
+ * @param lo   First position to consider.
+ * @param hi   One past the last position to consider.
+ * @param id   The id to search for.
+ * @return The lower bound position, in [lo, hi].
+ */
+static int64_t lower_bound_id(const OSM_Id *ids, int64_t lo, int64_t hi, OSM_Id id)
+{
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Minimum length of an id column for a scan of it to be split between threads. */
+#define SCAN_PARALLEL_MIN (1 << 20)
+
+/* The published index of an id column, or NULL if it is not (yet) built. */
+static const int *get_order(OSM_Map *mp, OSM_Index which)
+{
+    return __atomic_load_n(&mp->id_order[which], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The cracked index of an unsorted id column whose index is not built,
+ * created on first use, or NULL if cracking is disabled, the column does not
+ * need it or memory could not be allocated.  Threads racing to create it
+ * agree on one with a compare-and-swap.
+ */
+static CRK_Index *get_cracker(OSM_Map *mp, OSM_Index which, const int *order)
+{
+    int sorted = (which == OSM_INDEX_NODE_IDS) ? mp->nodes_sorted : mp->ways_sorted;
+    if (!mp->cracking || sorted || order) {
+        return NULL;
+    }
+    CRK_Index *crk = __atomic_load_n(&mp->crackers[which], __ATOMIC_ACQUIRE);
+    if (crk) {
+        return crk;
+    }
+    crk = (which == OSM_INDEX_NODE_IDS) ? CRK_create(mp->node_ids, mp->num_nodes)
+                                        : CRK_create(mp->way_ids, mp->num_ways);
+    CRK_Index *expected = NULL;
+    if (crk && !__atomic_compare_exchange_n(&mp->crackers[which], &expected, crk, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        CRK_free(crk);
+        crk = expected;
+    }
+    return crk;
+}
+
+/**
+ * @brief Find the first position in an id index whose id is >= id.
+ *
+ * @param ids    The id column.
+ * @param order  Its index: all rows, in (id, row) order.
+ * @param n      Length of the column.
+ * @param id     The id to search for.
+ * @return The lower bound position in order, in [0, n].
+ */
+static int64_t lower_bound_order(const OSM_Id *ids, const int *order, int64_t n, OSM_Id id)
+{
+    int64_t lo = 0, hi = n;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (ids[order[mid]] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* A scan of an id column for a set of ids. */
+typedef struct {
+    const OSM_Id *col;
+    const OSM_Id *keys;     // The ids searched for, ascending and distinct
+    size_t num_keys;
+    int64_t *first;         // Per worker: first row holding each key, or -1
+} Scan_Job;
+
+static void scan_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Scan_Job *job = arg;
+    const OSM_Id *keys = job->keys;
+    size_t nk = job->num_keys;
+    int64_t *first = job->first + (size_t)worker * nk;
+    for (size_t k = 0; k < nk; k++) first[k] = -1;
+
+    for (int64_t r = begin; r < end; r++) {
+        OSM_Id id = job->col[r];
+        if (id < keys[0] || id > keys[nk - 1]) continue;
+        size_t lo = 0, hi = nk;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (keys[mid] < id) lo = mid + 1;
+            else hi = mid;
+        }
+        if (keys[lo] == id && first[lo] < 0) first[lo] = r;
+    }
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    OSM_Id x = *(const OSM_Id *)a, y = *(const OSM_Id *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Look up ids in an unsorted id column with a single pass over it.
+ *
+ * Each element of the column is searched for among the (sorted) ids, so m
+ * lookups cost one scan rather than m.  Long columns are split between
+ * threads; the first row holding an id is found, as with a linear search.
+ *
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int scan_ids(const OSM_Id *col, int64_t num, const OSM_Id *ids, size_t n, int64_t *out_index)
+{
+    if (n == 0) return 0;
+    if (num <= 0) {
+        for (size_t q = 0; q < n; q++) out_index[q] = -1;
+        return 0;
+    }
+    OSM_Id *keys = malloc(n * sizeof(OSM_Id));
+    if (!keys) return -1;
+    memcpy(keys, ids, n * sizeof(OSM_Id));
+    qsort(keys, n, sizeof(OSM_Id), compare_ids);
+    size_t nk = 1;
+    for (size_t q = 1; q < n; q++) {
+        if (keys[q] != keys[nk - 1]) keys[nk++] = keys[q];
+    }
+
+    int nthreads = (num >= SCAN_PARALLEL_MIN) ? PAR_num_threads(0) : 1;
+    if (nthreads > num) nthreads = (int)num;
+    Scan_Job job = { col, keys, nk, malloc((size_t)nthreads * nk * sizeof(int64_t)) };
+    int used = job.first ? PAR_for(num, nthreads, scan_task, &job) : -1;
+    if (used < 0) {
+        free(keys);
+        free(job.first);
+        return -1;
+    }
+
+    // Worker order is row order: the first worker to find a key has its first row.
+    for (size_t k = 0; k < nk; k++) {
+        for (int w = 1; w < used && job.first[k] < 0; w++) {
+            job.first[k] = job.first[(size_t)w * nk + k];
+        }
+    }
+    for (size_t q = 0; q < n; q++) {
+        size_t lo = 0, hi = nk;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (keys[mid] < ids[q]) lo = mid + 1;
+            else hi = mid;
+        }
+        out_index[q] = job.first[lo];
+    }
+    free(keys);
+    free(job.first);
+    return 0;
+}
+
+/**
+ * @brief Find the row of an id in an id column, sorted or not.
+ *
+ * Sorted columns are binary searched, and so are unsorted ones once their
+ * index is built; otherwise the column is cracked if it has a cracked index,
+ * or else scanned.
+ *
+ * @return The row of the id (the first, if it occurs more than once), or
+ * -1 if it does not occur.
+ */
+static int64_t find_id(const OSM_Id *ids, int64_t n, int sorted, const int *order, CRK_Index *crk, OSM_Id id)
+{
+    if (sorted) {
+        int64_t i = lower_bound_id(ids, 0, n, id);
+        return (i < n && ids[i] == id) ? i : -1;
+    }
+    if (order) {
+        int64_t i = lower_bound_order(ids, order, n, id);
+        return (i < n && ids[order[i]] == id) ? order[i] : -1;
+    }
+    if (crk) {
+        return CRK_find(crk, id);
+    }
+    int64_t row;
+    if (n >= SCAN_PARALLEL_MIN && scan_ids(ids, n, &id, 1, &row) == 0) {
+        return row;
+    }
+    for (int64_t i = 0; i < n; i++) {
+        if (ids[i] == id) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Look up a batch of ids in an unsorted id column, with its index if
+ * it has been built, by cracking if enabled, under one lock for the batch,
+ * or else with one scan of the column.
+ */
+static void find_unsorted_ids(const OSM_Id *col, int64_t num, const int *order, CRK_Index *crk,
+                              const OSM_Id *ids, size_t n, int64_t *out_index)
+{
+    if (!order && !crk && scan_ids(col, num, ids, n, out_index) == 0) {
+        return;
+    }
+    if (!order && crk) {
+        CRK_find_many(crk, ids, n, out_index);
+        return;
+    }
+    for (size_t q = 0; q < n; q++) {
+        out_index[q] = find_id(col, num, 0, order, crk, ids[q]);
+    }
+}
+
+/**
+ * @brief Find the index of the first node whose id is greater than or equal
+ * to a given id.
+ *
+ * Nodes with ids in a range [lo, hi] can be visited by starting at the lower
+ * bound of lo and scanning forward until an id greater than hi is seen.
+ *
+ * @param mp The map to be queried.
+ * @param id The id to search for.
+ * @return The lower bound index (equal to the number of nodes if all ids are
+ * smaller), or -1 if the map's node ids are not sorted.
+ */
+int64_t OSM_Map_lower_bound_Node(OSM_Map *mp, OSM_Id id) {
+    if (!mp || !mp->nodes_sorted) {
+        return -1;
+    }
+    return lower_bound_id(mp->node_ids, 0, mp->num_nodes, id);
+}
+
+/**
+ * @brief Find the index of the node with a given id.
+ *
+ * Uses binary search over the node id column when the ids are sorted or
+ * indexed (see OSM_Map_build_index), and a scan otherwise.
+ *
+ * @param mp The map to be queried.
+ * @param id The node id to search for.
+ * @return The index of the node, or -1 if there is no node with that id.
+ */
+int64_t OSM_Map_find_Node(OSM_Map *mp, OSM_Id id) {
+    if (!mp) {
+        return -1;
+    }
+    const int *order = get_order(mp, OSM_INDEX_NODE_IDS);
+    return find_id(mp->node_ids, mp->num_nodes, mp->nodes_sorted, order,
+                   get_cracker(mp, OSM_INDEX_NODE_IDS, order), id);
+}
+
+/**
+ * @brief Find the index of the way with a given id.
+ *
+ * @param mp The map to be queried.
+ * @param id The way id to search for.
+ * @return The index of the way, or -1 if there is no way with that id.
+ */
+int64_t OSM_Map_find_Way(OSM_Map *mp, OSM_Id id) {
+    if (!mp) {
+        return -1;
+    }
+    const int *order = get_order(mp, OSM_INDEX_WAY_IDS);
+    return find_id(mp->way_ids, mp->num_ways, mp->ways_sorted, order,
+                   get_cracker(mp, OSM_INDEX_WAY_IDS, order), id);
+}
+
+/**
+ * @brief Find the indices of many nodes, given their ids in ascending order.
+ *
+ * The ids are merged against the sorted node id column: each search starts
+ * where the previous one ended and gallops forward, so looking up m ids costs
+ * O(m log(n/m)) rather than m independent binary searches.
+ *
+ * @param mp        The map to be queried.
+ * @param ids       The ids to look up, in non-decreasing order.
+ * @param n         The number of ids.
+ * @param out_index Array of n entries receiving the index of each node,
+ *                  or -1 for ids that are not present.
+ * @return 0 on success, -1 if an argument is invalid.
+ */
+int OSM_Map_find_sorted_Nodes(OSM_Map *mp, const OSM_Id *ids, size_t n, int64_t *out_index) {
+    if (!mp || (n > 0 && (!ids || !out_index))) {
+        return -1;
+    }
+    if (!mp->nodes_sorted) {
+        const int *order = get_order(mp, OSM_INDEX_NODE_IDS);
+        find_unsorted_ids(mp->node_ids, mp->num_nodes, order, get_cracker(mp, OSM_INDEX_NODE_IDS, order),
+                          ids, n, out_index);
+        return 0;
+    }
+
+    const OSM_Id *col = mp->node_ids;
+    int64_t num = mp->num_nodes;
+    int64_t pos = 0;
+    for (size_t q = 0; q < n; q++) {
+        // Gallop forward from pos to bracket the id, then binary search.
+        int64_t step = 1;
+        int64_t hi = pos;
+        while (hi < num && col[hi] < ids[q]) {
+            pos = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        if (hi > num) hi = num;
+        pos = lower_bound_id(col, pos, hi, ids[q]);
+        out_index[q] = (pos < num && col[pos] == ids[q]) ? pos : -1;
+    }
+    return 0;
+}
+
+/* Number of lookups advanced together by the batch search. */
+#define FIND_GROUP 16
+
+/**
+ * @brief Look up a batch of ids in a sorted id column.
+ *
+ * A single binary search is a chain of dependent loads, each of which is
+ * likely to miss in cache when the column is large, so one-at-a-time search
+ * spends most of its time waiting on memory.  Here the ids are processed in
+ * groups of FIND_GROUP: every search in the group takes one step, and the
+ * element each search will probe next is prefetched, before any search takes
+ * its following step.  This keeps up to FIND_GROUP independent misses in
+ * flight at once.  Because all searches over the same column take the same
+ * number of steps, the searches of a group stay in lock step and no
+ * per-search state machine is needed.
+ *
+ * @param col        The id column, in strictly increasing order.
+ * @param num        The number of entries in the column.
+ * @param ids        The ids to look up, in any order.
+ * @param n          The number of ids.
+ * @param out_index  Array of n entries receiving the position of each id in
+ *                   the column, or -1 for ids that are not present.
+ * @return 0 on success, -1 if an argument is invalid.
+ */
+int OSM_find_ids(const OSM_Id *col, int64_t num, const OSM_Id *ids, size_t n, int64_t *out_index)
+{
+    if (n == 0) return 0;
+    if (!ids || !out_index || (num > 0 && !col)) return -1;
+    if (num <= 0) {
+        for (size_t q = 0; q < n; q++) out_index[q] = -1;
+        return 0;
+    }
+
+    int64_t base[FIND_GROUP];
+    for (size_t g = 0; g < n; g += FIND_GROUP) {
+        int lanes = (n - g < FIND_GROUP) ? (int)(n - g) : FIND_GROUP;
+        const OSM_Id *key = ids + g;
+
+        for (int l = 0; l < lanes; l++) base[l] = 0;
+        __builtin_prefetch(&col[num / 2]);
+
+        // Branch-free search: each step halves the candidate range [base, base + len).
+        int64_t len = num;
+        while (len > 1) {
+            int64_t half = len / 2;
+            int64_t next_half = (len - half) / 2;
+            for (int l = 0; l < lanes; l++) {
+                base[l] = (col[base[l] + half] < key[l]) ? base[l] + half : base[l];
+                __builtin_prefetch(&col[base[l] + next_half]);
+            }
+            len -= half;
+        }
+
+        for (int l = 0; l < lanes; l++) {
+            int64_t pos = base[l] + (col[base[l]] < key[l]);
+            out_index[g + l] = (pos < num && col[pos] == key[l]) ? pos : -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the indices of many nodes at once.
+ *
+ * Equivalent to calling OSM_Map_find_Node for each id, but when the node ids
+ * are sorted the searches are interleaved with software prefetching (see
+ * OSM_find_ids), which is much faster for large maps.  If the ids are
+ * neither sorted nor indexed, all of them are found in one scan.
+ *
+ * @param mp        The map to be queried.
+ * @param ids       The node ids to look up, in any order.
+ * @param n         The number of ids.
+ * @param out_index Array of n entries receiving the index of each node,
+ *                  or -1 for ids that are not present.
+ * @return 0 on success, -1 if an argument is invalid.
+ */
+int OSM_Map_find_Nodes(OSM_Map *mp, const OSM_Id *ids, size_t n, int64_t *out_index) {
+    if (!mp) {
+        return -1;
+    }
+    if (!mp->nodes_sorted) {
+        const int *order = get_order(mp, OSM_INDEX_NODE_IDS);
+        find_unsorted_ids(mp->node_ids, mp->num_nodes, order, get_cracker(mp, OSM_INDEX_NODE_IDS, order),
+                          ids, n, out_index);
+        return 0;
+    }
+    return OSM_find_ids(mp->node_ids, mp->num_nodes, ids, n, out_index);
+}
+
+/**
+ * @brief Find the indices of many ways at once.
+ *
+ * The way counterpart of OSM_Map_find_Nodes.
+ *
+ * @param mp        The map to be queried.
+ * @param ids       The way ids to look up, in any order.
+ * @param n         The number of ids.
+ * @param out_index Array of n entries receiving the index of each way,
+ *                  or -1 for ids that are not present.
+ * @return 0 on success, -1 if an argument is invalid.
+ */
+int OSM_Map_find_Ways(OSM_Map *mp, const OSM_Id *ids, size_t n, int64_t *out_index) {
+    if (!mp) {
+        return -1;
+    }
+    if (!mp->ways_sorted) {
+        const int *order = get_order(mp, OSM_INDEX_WAY_IDS);
+        find_unsorted_ids(mp->way_ids, mp->num_ways, order, get_cracker(mp, OSM_INDEX_WAY_IDS, order),
+                          ids, n, out_index);
+        return 0;
+    }
+    return OSM_find_ids(mp->way_ids, mp->num_ways, ids, n, out_index);
+}
+
+/* ===========================
+ * Id Indexes
+ * ===========================*/
+
+/* Sorting of an id column's rows into an index. */
+typedef struct {
+    const OSM_Id *ids;
+    int *src;               // Sorted runs
+    int *dst;               // Receives the merged runs
+    int64_t *bounds;        // num_runs + 1 run boundaries in src
+    int64_t num_runs;
+} Sort_Job;
+
+/* Id column that compare_rows orders rows by, set by each sorting thread. */
+static __thread const OSM_Id *sort_ids;
+
+static int compare_rows(const void *a, const void *b)
+{
+    const OSM_Id *ids = sort_ids;
+    int x = *(const int *)a, y = *(const int *)b;
+    if (ids[x] != ids[y]) return (ids[x] > ids[y]) - (ids[x] < ids[y]);
+    return (x > y) - (x < y);
+}
+
+/* Sort the rows [begin, end) into one run. */
+static void sort_run_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Sort_Job *job = arg;
+    for (int64_t r = begin; r < end; r++) job->src[r] = (int)r;
+    sort_ids = job->ids;
+    qsort(job->src + begin, end - begin, sizeof(int), compare_rows);
+}
+
+/* Merge pairs of adjacent runs [begin, end) (the last run may be unpaired). */
+static void merge_runs_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Sort_Job *job = arg;
+    const OSM_Id *ids = job->ids;
+    for (int64_t p = begin; p < end; p++) {
+        int64_t i = job->bounds[2 * p];
+        int64_t mid = (2 * p + 1 < job->num_runs) ? job->bounds[2 * p + 1] : job->bounds[job->num_runs];
+        int64_t hi = (2 * p + 2 <= job->num_runs) ? job->bounds[2 * p + 2] : job->bounds[job->num_runs];
+        int64_t j = mid, k = i;
+        while (i < mid && j < hi) {
+            int a = job->src[i], b = job->src[j];
+            // Rows of equal ids stay in row order: runs cover increasing rows.
+            if (ids[b] < ids[a]) {
+                job->dst[k++] = b;
+                j++;
+            } else {
+                job->dst[k++] = a;
+                i++;
+            }
+        }
+        while (i < mid) job->dst[k++] = job->src[i++];
+        while (j < hi) job->dst[k++] = job->src[j++];
+    }
+}
+
+/**
+ * @brief Build the index of an id column that is not sorted.
+ *
+ * The index lists every row in (id, row) order, so that lookups by id are
+ * binary searches instead of scans.  It is built in the background of
+ * lookups: until it is published, with a single atomic store once it is
+ * complete, lookups scan the column.  Runs of rows are sorted in parallel
+ * and then merged pairwise, also in parallel.
+ *
+ * @param mp        The map.
+ * @param which     The id column to index.
+ * @param nthreads  Number of threads to use, or 0 for one per CPU.
+ * @return 0 once the index is ready (immediately if the column is sorted
+ * or already indexed), -1 if memory could not be allocated or the build
+ * was cancelled with OSM_Map_cancel_index.
+ */
+int OSM_Map_build_index(OSM_Map *mp, OSM_Index which, int nthreads) {
+    if (!mp || which < 0 || which >= OSM_NUM_INDEXES) {
+        return -1;
+    }
+    if (OSM_Map_index_ready(mp, which)) {
+        return 0;
+    }
+    int64_t n = (which == OSM_INDEX_NODE_IDS) ? mp->num_nodes : mp->num_ways;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    nthreads = PAR_num_threads(nthreads);
+    if (nthreads > n) nthreads = (int)n;
+    Sort_Job job = {
+        (which == OSM_INDEX_NODE_IDS) ? mp->node_ids : mp->way_ids,
+        malloc(n * sizeof(int)), malloc(n * sizeof(int)),
+        malloc((nthreads + 1) * sizeof(int64_t)), 0
+    };
+    int failed = !job.src || !job.dst || !job.bounds;
+    if (!failed) {
+        job.num_runs = PAR_for(n, nthreads, sort_run_task, &job);
+        failed = (job.num_runs < 0);
+    }
+    // PAR_for splits [0, n) evenly: run r starts at n * r / num_runs.
+    for (int64_t r = 0; !failed && r <= job.num_runs; r++) {
+        job.bounds[r] = n * r / job.num_runs;
+    }
+    while (!failed && job.num_runs > 1) {
+        if (__atomic_load_n(&mp->index_cancel, __ATOMIC_RELAXED)) {
+            failed = 1;
+            break;
+        }
+        int64_t pairs = (job.num_runs + 1) / 2;
+        if (PAR_for(pairs, (int)pairs, merge_runs_task, &job) < 0) {
+            failed = 1;
+            break;
+        }
+        for (int64_t p = 0; p < pairs; p++) {
+            job.bounds[p] = job.bounds[2 * p];
+        }
+        job.bounds[pairs] = job.bounds[job.num_runs];
+        job.num_runs = pairs;
+        int *t = job.src;
+        job.src = job.dst;
+        job.dst = t;
+    }
+    free(job.dst);
+    free(job.bounds);
+    if (failed || __atomic_load_n(&mp->index_cancel, __ATOMIC_RELAXED)) {
+        free(job.src);
+        debug("DEBUG: OSM_Map_build_index - index %d not built.\n", (int)which);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mp->index_ns[which] = (int64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 + (t1.tv_nsec - t0.tv_nsec);
+    __atomic_store_n(&mp->id_order[which], job.src, __ATOMIC_RELEASE);
+    debug("DEBUG: OSM_Map_build_index - index %d built in %lld ns.\n", (int)which,
+          (long long)mp->index_ns[which]);
+    return 0;
+}
+
+/**
+ * @brief Check whether lookups in an id column are binary searches.
+ *
+ * @param mp     The map.
+ * @param which  The id column.
+ * @return 1 if the column is sorted or its index has been published, else 0.
+ */
+int OSM_Map_index_ready(OSM_Map *mp, OSM_Index which) {
+    if (!mp || which < 0 || which >= OSM_NUM_INDEXES) {
+        return 0;
+    }
+    int sorted = (which == OSM_INDEX_NODE_IDS) ? mp->nodes_sorted : mp->ways_sorted;
+    return sorted || get_order(mp, which) != NULL;
+}
+
+/**
+ * @brief Get the time it took to build an index.
+ * @return The build time in nanoseconds, or 0 if the index was not built.
+ */
+int64_t OSM_Map_get_index_ns(OSM_Map *mp, OSM_Index which) {
+    if (!mp || which < 0 || which >= OSM_NUM_INDEXES || !get_order(mp, which)) {
+        return 0;
+    }
+    return mp->index_ns[which];
+}
+
+/**
+ * @brief Ask index builds in progress on a map to stop early.
+ *
+ * A cancelled build stops at its next merge pass and returns -1, so that
+ * the map can be freed soon after.  Builds started afterwards fail too.
+ */
+void OSM_Map_cancel_index(OSM_Map *mp) {
+    if (mp) {
+        __atomic_store_n(&mp->index_cancel, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Let lookups in unsorted id columns build cracked indexes.
+ *
+ * Until a column's index is built with OSM_Map_build_index, lookups in it
+ * then crack an adaptive index (see crack.h) instead of scanning the
+ * column.  This suits short sessions, where a few lookups would not repay
+ * sorting the whole column.
+ */
+void OSM_Map_enable_cracking(OSM_Map *mp) {
+    if (mp) {
+        mp->cracking = 1;
+    }
+}
+
+/**
+ * @brief Get the number of cracks made in an id column's cracked index.
+ * @return The number of cracks, or 0 if the column has no cracked index.
+ */
+int64_t OSM_Map_get_num_cracks(OSM_Map *mp, OSM_Index which) {
+    if (!mp || which < 0 || which >= OSM_NUM_INDEXES) {
+        return 0;
+    }
+    return CRK_get_num_cracks(__atomic_load_n(&mp->crackers[which], __ATOMIC_ACQUIRE));
+}
+
+/* A parallel scan of the node ids for a range. */
+typedef struct {
+    const OSM_Id *ids;
+    OSM_Id lo;
+    OSM_Id hi;
+    int64_t *counts;        // Matching rows per worker
+    int64_t *starts;        // Where each worker's rows go in rows
+    int64_t *rows;          // NULL in the counting pass
+} Range_Job;
+
+static void range_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Range_Job *job = arg;
+    int64_t k = job->rows ? job->starts[worker] : 0;
+    for (int64_t r = begin; r < end; r++) {
+        if (job->ids[r] < job->lo || job->ids[r] > job->hi) continue;
+        if (job->rows) job->rows[k] = r;
+        k++;
+    }
+    if (!job->rows) job->counts[worker] = k;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Find the nodes whose ids lie in [lo, hi].
+ *
+ * With sorted ids the nodes are one run from the lower bound of lo; with an
+ * index they are gathered from it; with cracking enabled the column is
+ * cracked at both ends of the range; otherwise the ids are scanned (in
+ * parallel if there are many).
+ *
+ * @param mp      The map.
+ * @param lo      Lowest id of the range.
+ * @param hi      Highest id of the range.
+ * @param rowsp   Receives a malloc'd array of the rows of the nodes, in
+ *                ascending order, to be freed by the caller.
+ * @param countp  Receives the number of rows.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int OSM_Map_range_Nodes(OSM_Map *mp, OSM_Id lo, OSM_Id hi, int64_t **rowsp, int64_t *countp) {
+    *rowsp = NULL;
+    *countp = 0;
+    if (!mp || lo > hi) {
+        return mp ? 0 : -1;
+    }
+    int64_t num = mp->num_nodes;
+    const OSM_Id *ids = mp->node_ids;
+    const int *order = get_order(mp, OSM_INDEX_NODE_IDS);
+    CRK_Index *crk = mp->nodes_sorted ? NULL : get_cracker(mp, OSM_INDEX_NODE_IDS, order);
+    int64_t *rows = NULL;
+    int64_t count = 0;
+
+    if (crk) {
+        return CRK_range(crk, lo, hi, rowsp, countp);
+    } else if (mp->nodes_sorted || order) {
+        int64_t first = mp->nodes_sorted ? lower_bound_id(ids, 0, num, lo) : lower_bound_order(ids, order, num, lo);
+        int64_t last = first;
+        while (last < num && ids[mp->nodes_sorted ? last : order[last]] <= hi) last++;
+        count = last - first;
+        if (!(rows = malloc((count ? count : 1) * sizeof(int64_t)))) return -1;
+        for (int64_t i = 0; i < count; i++) {
+            rows[i] = mp->nodes_sorted ? first + i : order[first + i];
+        }
+        if (!mp->nodes_sorted) qsort(rows, count, sizeof(int64_t), compare_int64);
+    } else {
+        int nthreads = (num >= SCAN_PARALLEL_MIN) ? PAR_num_threads(0) : 1;
+        Range_Job job = { ids, lo, hi, calloc(nthreads, sizeof(int64_t)), calloc(nthreads + 1, sizeof(int64_t)), NULL };
+        int used = (job.counts && job.starts) ? PAR_for(num, nthreads, range_task, &job) : -1;
+        for (int w = 0; w < used; w++) {
+            job.starts[w + 1] = job.starts[w] + job.counts[w];
+        }
+        count = (used > 0) ? job.starts[used] : 0;
+        if (used >= 0 && (rows = malloc((count ? count : 1) * sizeof(int64_t)))) {
+            job.rows = rows;
+            if (count > 0 && PAR_for(num, nthreads, range_task, &job) < 0) {
+                free(rows);
+                rows = NULL;
+            }
+        }
+        free(job.counts);
+        free(job.starts);
+        if (!rows) return -1;
+    }
+    *rowsp = rows;
+    *countp = count;
+    return 0;
+}
+
+/* ===========================
+ * Span Accessors
+ * ===========================*/
+
+/**
+ * @brief Get the node id column of an OSM_Map object.
+ *
+ * The returned array is valid for as long as the map is, and holds the id of
+ * node i at position i.  Together with OSM_Map_get_node_lats and
+ * OSM_Map_get_node_lons this lets callers run tight (vectorizable) loops
+ * over all nodes without any per-element function calls.
+ *
+ * @param mp The map object to be queried.
+ * @param countp If non-NULL, receives the number of nodes.
+ * @return Pointer to the first node id, or NULL if the map has no nodes.
+ */
+const OSM_Id *OSM_Map_get_node_ids(OSM_Map *mp, int64_t *countp) {
+    if (countp) *countp = OSM_Map_get_num_nodes(mp);
+    return (mp && mp->num_nodes > 0) ? mp->node_ids : NULL;
+}
+
+/**
+ * @brief Get the node latitude column of an OSM_Map object.
+ *
+ * @param mp The map object to be queried.
+ * @param countp If non-NULL, receives the number of nodes.
+ * @return Pointer to the first latitude, or NULL if the map has no nodes.
+ */
+const OSM_Lat *OSM_Map_get_node_lats(OSM_Map *mp, int64_t *countp) {
+    if (countp) *countp = OSM_Map_get_num_nodes(mp);
+    return (mp && mp->num_nodes > 0) ? mp->node_lats : NULL;
+}
+
+/**
+ * @brief Get the node longitude column of an OSM_Map object.
+ *
+ * @param mp The map object to be queried.
+ * @param countp If non-NULL, receives the number of nodes.
+ * @return Pointer to the first longitude, or NULL if the map has no nodes.
+ */
+const OSM_Lon *OSM_Map_get_node_lons(OSM_Map *mp, int64_t *countp) {
+    if (countp) *countp = OSM_Map_get_num_nodes(mp);
+    return (mp && mp->num_nodes > 0) ? mp->node_lons : NULL;
+}
+
+/**
+ * @brief Get the way id column of an OSM_Map object.
+ *
+ * @param mp The map object to be queried.
+ * @param countp If non-NULL, receives the number of ways.
+ * @return Pointer to the first way id, or NULL if the map has no ways.
+ */
+const OSM_Id *OSM_Map_get_way_ids(OSM_Map *mp, int64_t *countp) {
+    if (countp) *countp = OSM_Map_get_num_ways(mp);
+    return (mp && mp->num_ways > 0) ? mp->way_ids : NULL;
+}
+
+/**
+ * @brief Get the node ids referenced by an OSM_Way object, as one span.
+ *
+ * Once OSM_Map_index_refs has translated the refs, the ids are no longer
+ * stored contiguously; use OSM_Way_get_ref_indices instead.
+ *
+ * @param wp The way object to be queried.
+ * @param countp If non-NULL, receives the number of refs.
+ * @return Pointer to the way's first ref, or NULL if the way has no refs or
+ * its refs have been translated to indices.
+ */
+const OSM_Id *OSM_Way_get_refs(OSM_Way *wp, int *countp) {
+    int n = OSM_Way_get_num_refs(wp);
+    if (countp) *countp = n;
+    if (!wp || n == 0 || !wp->map->way_refs) {
+        return NULL;
+    }
+    return wp->map->way_refs + wp->map->way_ref_start[way_row(wp)];
+}
+
+/**
+ * @brief Get the node indices referenced by an OSM_Way object, as one span.
+ *
+ * Only available after OSM_Map_index_refs.  Entries are indices suitable for
+ * the node columns, or OSM_REF_MISSING for refs to nodes not in the map.
+ *
+ * @param wp The way object to be queried.
+ * @param countp If non-NULL, receives the number of refs.
+ * @return Pointer to the index of the way's first ref, or NULL if the way
+ * has no refs or refs have not been translated.
+ */
+const uint32_t *OSM_Way_get_ref_indices(OSM_Way *wp, int *countp) {
+    int n = OSM_Way_get_num_refs(wp);
+    if (countp) *countp = n;
+    if (!wp || n == 0 || !wp->map->way_ref_index) {
+        return NULL;
+    }
+    return wp->map->way_ref_index + wp->map->way_ref_start[way_row(wp)];
+}
+
+/**
+ * @brief Iterate over the nodes of a map in fixed-size batches.
+ *
+ * Each call fills in the next batch: the index of its first node, its
+ * length, and pointers to the corresponding slices of the id, latitude and
+ * longitude columns.  Typical use:
+ *
+ *     int64_t cursor = 0;
+ *     OSM_Node_Batch b;
+ *     while (OSM_Map_node_batches(mp, &cursor, 4096, &b)) {
+ *         for (int64_t i = 0; i < b.count; i++)
+ *             ... b.ids[i], b.lats[i], b.lons[i] ...
+ *     }
+ *
+ * @param mp The map to iterate over.
+ * @param cursor Iteration state; set to 0 before the first call.
+ * @param batch_size Maximum number of nodes per batch.
+ * @param batch Receives the next batch.
+ * @return 1 if a batch was produced, 0 once all nodes have been visited.
+ */
+int OSM_Map_node_batches(OSM_Map *mp, int64_t *cursor, int64_t batch_size, OSM_Node_Batch *batch) {
+    if (!mp || !cursor || !batch || batch_size <= 0 || *cursor < 0 || *cursor >= mp->num_nodes) {
+        return 0;
+    }
+    int64_t first = *cursor;
+    int64_t count = mp->num_nodes - first;
+    if (count > batch_size) count = batch_size;
+
+    batch->first = first;
+    batch->count = count;
+    batch->ids = mp->node_ids + first;
+    batch->lats = mp->node_lats + first;
+    batch->lons = mp->node_lons + first;
+    *cursor = first + count;
+    return 1;
+}
+
+/* ===========================
+ * Way Ref Translation
+ * ===========================*/
+
+/* Number of refs translated per batch lookup call. */
+#define REF_BATCH 4096
+
+/* Per-worker state for OSM_Map_index_refs. */
+typedef struct {
+    int64_t num_missing;
+    int64_t missing_cap;
+    int64_t *missing_pos;
+    OSM_Id *missing_ids;
+    int failed;
+} Ref_Worker;
+
+typedef struct {
+    OSM_Map *map;
+    Ref_Worker *workers;
+} Ref_Job;
+
+/**
+ * @brief Translate the refs of ways [begin, end) into node indices.
+ *
+ * The refs of consecutive ways are contiguous, so the whole range is looked
+ * up as one run of batch lookups.  Misses are recorded in the worker's own
+ * side table, in ascending ref position.
+ */
+static void index_refs_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    Ref_Job *job = arg;
+    OSM_Map *mp = job->map;
+    Ref_Worker *w = &job->workers[worker];
+    int64_t found[REF_BATCH];
+
+    int64_t first = mp->way_ref_start[begin];
+    int64_t last = mp->way_ref_start[end];
+    for (int64_t pos = first; pos < last; pos += REF_BATCH) {
+        size_t n = (last - pos < REF_BATCH) ? (size_t)(last - pos) : REF_BATCH;
+        OSM_Map_find_Nodes(mp, &mp->way_refs[pos], n, found);
+        for (size_t i = 0; i < n; i++) {
+            if (found[i] >= 0) {
+                mp->way_ref_index[pos + i] = (uint32_t)found[i];
+                continue;
+            }
+            mp->way_ref_index[pos + i] = OSM_REF_MISSING;
+            if (w->num_missing == w->missing_cap) {
+                int64_t cap = grow_capacity(w->missing_cap, w->num_missing + 1);
+                if (resize_column((void **)&w->missing_pos, sizeof(int64_t), cap) < 0 ||
+                    resize_column((void **)&w->missing_ids, sizeof(OSM_Id), cap) < 0) {
+                    w->failed = 1;
+                    return;
+                }
+                w->missing_cap = cap;
+            }
+            w->missing_pos[w->num_missing] = pos + i;
+            w->missing_ids[w->num_missing] = mp->way_refs[pos + i];
+            w->num_missing++;
+        }
+    }
+}
+
+/**
+ * @brief Rewrite all way refs as 32-bit indices into the node columns.
+ *
+ * This optional post-load pass replaces the 64-bit node id of every way ref
+ * by the index of that node, halving the memory used by refs and turning
+ * way geometry access into direct array indexing (see
+ * OSM_Way_get_ref_index).  Refs to nodes that are not in the map are marked
+ * OSM_REF_MISSING; their ids are retained, so OSM_Way_get_ref still returns
+ * every ref's id.  The work is split over ways between threads, and each
+ * thread uses the batch lookup path.
+ *
+ * @param mp        The map whose refs are to be translated.
+ * @param nthreads  Number of threads to use, or 0 for one per CPU.
+ * @return 0 on success (or if the refs were already translated), -1 if the
+ * map has too many nodes for 32-bit indices or memory ran out, in which case
+ * the map is left unchanged.
+ */
+int OSM_Map_index_refs(OSM_Map *mp, int nthreads) {
+    if (!mp) {
+        return -1;
+    }
+    if (mp->way_ref_index) {
+        return 0;
+    }
+    if ((int64_t)mp->num_nodes >= (int64_t)OSM_REF_MISSING) {
+        fprintf(stderr, "ERROR: OSM_Map_index_refs - too many nodes for 32-bit refs.\n");
+        return -1;
+    }
+
+    nthreads = PAR_num_threads(nthreads);
+    Ref_Job job = { mp, calloc(nthreads, sizeof(Ref_Worker)) };
+    mp->way_ref_index = malloc((size_t)(mp->num_refs + 1) * sizeof(uint32_t));
+    if (!job.workers || !mp->way_ref_index) {
+        free(job.workers);
+        free(mp->way_ref_index);
+        mp->way_ref_index = NULL;
+        return -1;
+    }
+
+    int used = PAR_for(mp->num_ways, nthreads, index_refs_task, &job);
+
+    // Concatenate the per-worker side tables; worker order is ref order.
+    int64_t total = 0;
+    int failed = (used < 0);
+    for (int w = 0; w < nthreads; w++) {
+        total += job.workers[w].num_missing;
+        failed |= job.workers[w].failed;
+    }
+    if (!failed && total > 0) {
+        mp->missing_pos = malloc(total * sizeof(int64_t));
+        mp->missing_ids = malloc(total * sizeof(OSM_Id));
+        failed = !mp->missing_pos || !mp->missing_ids;
+    }
+    for (int w = 0; w < nthreads; w++) {
+        Ref_Worker *rw = &job.workers[w];
+        if (!failed && rw->num_missing > 0) {
+            memcpy(mp->missing_pos + mp->num_missing, rw->missing_pos, rw->num_missing * sizeof(int64_t));
+            memcpy(mp->missing_ids + mp->num_missing, rw->missing_ids, rw->num_missing * sizeof(OSM_Id));
+            mp->num_missing += rw->num_missing;
+        }
+        free(rw->missing_pos);
+        free(rw->missing_ids);
+    }
+    free(job.workers);
+
+    if (failed) {
+        fprintf(stderr, "ERROR: OSM_Map_index_refs - out of memory.\n");
+        free(mp->way_ref_index);
+        free(mp->missing_pos);
+        free(mp->missing_ids);
+        mp->way_ref_index = NULL;
+        mp->missing_pos = NULL;
+        mp->missing_ids = NULL;
+        mp->num_missing = 0;
+        return -1;
+    }
+
+    debug("DEBUG: OSM_Map_index_refs - %lld refs, %lld missing.\n",
+          (long long)mp->num_refs, (long long)mp->num_missing);
+    free(mp->way_refs);
+    mp->way_refs = NULL;
+    mp->ref_cap = 0;
+    return 0;
 }
 
 /**
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "outbuf.h"
+#include "debug.h"
+
+/* Two-digit lookup table, so integers are emitted two digits at a time. */
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t pow10_table[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL
+};
+
+/**
+ * @brief Initialize an output buffer.
+ *
+ * @param ob   The buffer to initialize.
+ * @param fd   File descriptor that flushed output is written to, or -1 for a
+ *             memory-only buffer that grows as needed and never flushes.
+ * @param cap  Initial capacity in bytes (OUT_DEFAULT_SIZE if 0).
+ * @return 0 on success, -1 if the buffer could not be allocated.
+ */
+int OUT_init(OUT_Buffer *ob, int fd, size_t cap)
+{
+    if (!ob) return -1;
+    if (cap == 0) cap = OUT_DEFAULT_SIZE;
+
+    ob->fd = fd;
+    ob->len = 0;
+    ob->err = 0;
+    ob->buf = malloc(cap);
+    ob->cap = ob->buf ? cap : 0;
+    if (!ob->buf) {
+        fprintf(stderr, "ERROR: OUT_init - out of memory.\n");
+        ob->err = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write all buffered bytes to the underlying file descriptor.
+ *
+ * Short writes and EINTR are retried.  Memory-only buffers are left alone.
+ *
+ * @param ob  The buffer to flush.
+ * @return 0 on success, -1 if a write error occurred.
+ */
+int OUT_flush(OUT_Buffer *ob)
+{
+    if (!ob || ob->fd < 0) return 0;
+
+    size_t done = 0;
+    while (done < ob->len) {
+        ssize_t n = write(ob->fd, ob->buf + done, ob->len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            debug("DEBUG: OUT_flush - write failed (errno=%d).\n", errno);
+            ob->err = 1;
+            break;
+        }
+        done += (size_t)n;
+    }
+    ob->len = 0;
+    return ob->err ? -1 : 0;
+}
+
+/**
+ * @brief Flush and release an output buffer.
+ *
+ * @param ob  The buffer to finalize.
+ * @return 0 if all output was written successfully, -1 otherwise.
+ */
+int OUT_fini(OUT_Buffer *ob)
+{
+    if (!ob) return -1;
+    OUT_flush(ob);
+    free(ob->buf);
+    ob->buf = NULL;
+    ob->cap = ob->len = 0;
+    return ob->err ? -1 : 0;
+}
+
+/*
+ * Make room for at least n more bytes: flush for file-backed buffers,
+ * grow for memory-only ones (or when a single item exceeds the capacity).
+ * Returns 0 if the space is available, -1 otherwise.
+ */
+static int reserve(OUT_Buffer *ob, size_t n)
+{
+    if (ob->cap - ob->len >= n) return 0;
+    if (ob->fd >= 0) {
+        OUT_flush(ob);
+        if (ob->cap >= n) return 0;
+    }
+
+    size_t cap = ob->cap ? ob->cap : OUT_DEFAULT_SIZE;
+    while (cap - ob->len < n) cap *= 2;
+    char *buf = realloc(ob->buf, cap);
+    if (!buf) {
+        ob->err = 1;
+        return -1;
+    }
+    ob->buf = buf;
+    ob->cap = cap;
+    return 0;
+}
+
+/**
+ * @brief Append a single character.
+ */
+void OUT_put_char(OUT_Buffer *ob, char c)
+{
+    if (reserve(ob, 1) < 0) return;
+    ob->buf[ob->len++] = c;
+}
+
+/**
+ * @brief Append len bytes of raw data.
+ */
+void OUT_put_bytes(OUT_Buffer *ob, const char *data, size_t len)
+{
+    if (reserve(ob, len) < 0) return;
+    memcpy(ob->buf + ob->len, data, len);
+    ob->len += len;
+}
+
+/**
+ * @brief Append a null-terminated string (nothing is appended for NULL).
+ */
+void OUT_put_str(OUT_Buffer *ob, const char *str)
+{
+    if (str) OUT_put_bytes(ob, str, strlen(str));
+}
+
+/*
+ * Format an unsigned value into the bytes immediately before end (at least
+ * 20 bytes must be available), padding with zeros up to min_digits.
+ * Returns a pointer to the first digit.
+ */
+static char *format_uint64(char *end, uint64_t v, int min_digits)
+{
+    char *p = end;
+    while (v >= 100) {
+        unsigned idx = (unsigned)(v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[idx + 1];
+        *--p = digit_pairs[idx];
+    }
+    if (v >= 10) {
+        unsigned idx = (unsigned)v * 2;
+        *--p = digit_pairs[idx + 1];
+        *--p = digit_pairs[idx];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    while (end - p < min_digits) *--p = '0';
+    return p;
+}
+
+/**
+ * @brief Append a signed 64-bit integer in decimal.
+ *
+ * Produces the same text as printf("%ld", val).
+ */
+void OUT_put_int64(OUT_Buffer *ob, int64_t val)
+{
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    uint64_t mag = (val < 0) ? -(uint64_t)val : (uint64_t)val;
+    char *p = format_uint64(end, mag, 1);
+    if (val < 0) *--p = '-';
+    OUT_put_bytes(ob, p, (size_t)(end - p));
+}
+
+/**
+ * @brief Append a fixed-point value with the given number of decimals.
+ *
+ * The value is interpreted as val / 10^decimals and printed exactly, e.g.
+ * OUT_put_fixed(ob, -731338574, 7) appends "-73.1338574".  This matches
+ * printf("%.*f", decimals, val / 1e<decimals>) for coordinate-sized values
+ * without converting through double.
+ *
+ * @param ob        The buffer to append to.
+ * @param val       The scaled integer value.
+ * @param decimals  Number of digits after the decimal point (0 to 18).
+ */
+void OUT_put_fixed(OUT_Buffer *ob, int64_t val, int decimals)
+{
+    if (decimals <= 0) {
+        OUT_put_int64(ob, val);
+        return;
+    }
+    if (decimals > 18) decimals = 18;
+
+    char tmp[48];
+    char *end = tmp + sizeof(tmp);
+    uint64_t mag = (val < 0) ? -(uint64_t)val : (uint64_t)val;
+    uint64_t scale = pow10_table[decimals];
+
+    char *p = format_uint64(end, mag % scale, decimals);
+    *--p = '.';
+    p = format_uint64(p, mag / scale, 1);
+    if (val < 0) *--p = '-';
+    OUT_put_bytes(ob, p, (size_t)(end - p));
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+#include "debug.h"
+
+/* Arguments for one worker thread. */
+typedef struct {
+    PAR_Task task;
+    void *arg;
+    int worker;
+    int64_t begin;
+    int64_t end;
+} PAR_Chunk;
+
+static void *run_chunk(void *p)
+{
+    PAR_Chunk *c = p;
+    c->task(c->arg, c->worker, c->begin, c->end);
+    return NULL;
+}
+
+/**
+ * @brief Determine how many worker threads to use.
+ *
+ * @param requested  Number of threads asked for by the caller; 0 or less
+ * means one per online CPU.
+ * @return The number of threads to use (at least 1).
+ */
+int PAR_num_threads(int requested)
+{
+    if (requested > 0) return requested;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncpu > 0) ? (int)ncpu : 1;
+}
+
+/**
+ * @brief Run a task over [0, n) split into one contiguous chunk per thread.
+ *
+ * The calling thread runs the first chunk itself.  If threads cannot be
+ * created, the remaining chunks are run on the calling thread as well, so
+ * the task is always applied to the whole range.
+ *
+ * @param n         Size of the index range.
+ * @param nthreads  Number of threads (0 for one per CPU); fewer are used
+ *                  if n is small.
+ * @param task      Function called once per chunk.
+ * @param arg       Argument passed through to the task.
+ * @return The number of chunks the range was split into (0 if n <= 0), or
+ * -1 if memory could not be allocated.
+ */
+int PAR_for(int64_t n, int nthreads, PAR_Task task, void *arg)
+{
+    if (n <= 0) return 0;
+    nthreads = PAR_num_threads(nthreads);
+    if (nthreads > n) nthreads = (int)n;
+
+    PAR_Chunk *chunks = calloc(nthreads, sizeof(PAR_Chunk));
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    int *started = calloc(nthreads, sizeof(int));
+    if (!chunks || !tids || !started) {
+        free(chunks);
+        free(tids);
+        free(started);
+        return -1;
+    }
+
+    for (int w = 0; w < nthreads; w++) {
+        chunks[w].task = task;
+        chunks[w].arg = arg;
+        chunks[w].worker = w;
+        chunks[w].begin = n * w / nthreads;
+        chunks[w].end = n * (w + 1) / nthreads;
+    }
+    for (int w = 1; w < nthreads; w++) {
+        started[w] = (pthread_create(&tids[w], NULL, run_chunk, &chunks[w]) == 0);
+        if (!started[w]) debug("DEBUG: PAR_for - running chunk %d inline.\n", w);
+    }
+    run_chunk(&chunks[0]);
+    for (int w = 1; w < nthreads; w++) {
+        if (started[w]) pthread_join(tids[w], NULL);
+        else run_chunk(&chunks[w]);
+    }
+
+    free(chunks);
+    free(tids);
+    free(started);
+    return nthreads;
+}
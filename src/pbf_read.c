@@ -0,0 +1,730 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>  // for ntohl()
+#include "pbf.h"
+#include "protobuf.h"
+#include "cpu.h"
+#include "debug.h"
+
+/* Where the tags, refs and members of a decoded entity start. */
+typedef struct {
+    size_t tag;
+    size_t ref;
+    size_t member;
+} PBF_Slices;
+
+/* One block of the file, fully decoded. */
+typedef struct {
+    PBF_Entity *ents;
+    PBF_Slices *slices;
+    size_t num_ents;
+    size_t cap_ents;
+    size_t cap_slices;
+
+    char *string_data;          // The block's string table
+    const char **strings;
+    size_t num_strings;
+
+    const char **keys;          // Tags of all entities of the block
+    const char **vals;
+    size_t num_tags;
+    size_t cap_keys;
+    size_t cap_vals;
+    OSM_Id *refs;               // Refs of all ways of the block
+    size_t num_refs;
+    size_t cap_refs;
+    PBF_Member *members;        // Members of all relations of the block
+    size_t num_members;
+    size_t cap_members;
+
+    uint64_t *packed[8];        // Scratch arrays for packed fields
+    size_t packed_cap[8];
+    int hash;                   // Compute content hashes
+} PBF_Block;
+
+struct PBF_Reader {
+    FILE *in;
+    PBF_Header header;
+    int flags;
+    PBF_Block blocks[2];        // The current block and, reading ahead, the next
+    int cur;
+    size_t next;                // Next entity of the current block to return
+    pthread_t thread;           // Decodes the next block, if running
+    int reading;
+    int ahead_rc;               // Its result, as for load_block
+};
+
+/* Grow an array to hold at least need elements. */
+static int reserve(void **arrp, size_t *capp, size_t need, size_t elem)
+{
+    if (need <= *capp) return 0;
+    size_t cap = *capp ? *capp : 256;
+    while (cap < need) cap *= 2;
+    void *arr = realloc(*arrp, cap * elem);
+    if (!arr) return -1;
+    *arrp = arr;
+    *capp = cap;
+    return 0;
+}
+
+static int64_t zigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * Decode every value of a repeated varint field of a message, whether it
+ * is packed or not, into scratch array slot.  Returns the number of values,
+ * or -1 if the field is malformed or memory could not be allocated.
+ */
+static int64_t get_packed(PBF_Block *b, PB_Message msg, int fnum, int slot)
+{
+    size_t n = 0;
+    PB_Field *f = msg;
+    while (msg && (f = PB_next_field(f, fnum, ANY_TYPE, FORWARD_DIR)) != NULL) {
+        if (f->type == VARINT_TYPE) {
+            if (reserve((void **)&b->packed[slot], &b->packed_cap[slot], n + 1, sizeof(uint64_t)) < 0) return -1;
+            b->packed[slot][n++] = f->value.i64;
+            continue;
+        }
+        if (f->type != LEN_TYPE) continue;
+        const unsigned char *p = (const unsigned char *)f->value.bytes.buf;
+        const unsigned char *end = p + f->value.bytes.size;
+        // Every value takes at least one byte.
+        if (reserve((void **)&b->packed[slot], &b->packed_cap[slot], n + (end - p), sizeof(uint64_t)) < 0)
+            return -1;
+        int64_t got = CPU_kernels.varints(p, end, &b->packed[slot][n]);
+        if (got < 0) return -1;
+        n += got;
+    }
+    return (int64_t)n;
+}
+
+static uint64_t get_varint(PB_Message msg, int fnum, uint64_t dflt)
+{
+    PB_Field *f = msg ? PB_get_field(msg, fnum, VARINT_TYPE) : NULL;
+    return f ? f->value.i64 : dflt;
+}
+
+/*
+ * Parse the sub-message in a field of a message.  An absent or empty
+ * sub-message gives NULL, which the getters treat as having no fields.
+ */
+static int get_message(PB_Message msg, int fnum, PB_Message *subp)
+{
+    *subp = NULL;
+    PB_Field *f = msg ? PB_get_field(msg, fnum, LEN_TYPE) : NULL;
+    if (!f || f->value.bytes.size == 0) return 0;
+    return PB_read_embedded_message(f->value.bytes.buf, f->value.bytes.size, subp);
+}
+
+static const char *get_string(PBF_Block *b, uint64_t sid)
+{
+    return (sid < b->num_strings) ? b->strings[sid] : "";
+}
+
+/* Start a new entity of the block.  Returns NULL if memory ran out. */
+static PBF_Entity *new_entity(PBF_Block *b, PBF_Type type)
+{
+    if (reserve((void **)&b->ents, &b->cap_ents, b->num_ents + 1, sizeof(PBF_Entity)) < 0 ||
+        reserve((void **)&b->slices, &b->cap_slices, b->num_ents + 1, sizeof(PBF_Slices)) < 0) return NULL;
+    PBF_Entity *e = &b->ents[b->num_ents];
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    e->user = "";
+    b->slices[b->num_ents].tag = b->num_tags;
+    b->slices[b->num_ents].ref = b->num_refs;
+    b->slices[b->num_ents].member = b->num_members;
+    b->num_ents++;
+    return e;
+}
+
+static int add_tag(PBF_Block *b, PBF_Entity *e, uint64_t key, uint64_t val)
+{
+    if (reserve((void **)&b->keys, &b->cap_keys, b->num_tags + 1, sizeof(char *)) < 0 ||
+        reserve((void **)&b->vals, &b->cap_vals, b->num_tags + 1, sizeof(char *)) < 0) return -1;
+    b->keys[b->num_tags] = get_string(b, key);
+    b->vals[b->num_tags] = get_string(b, val);
+    b->num_tags++;
+    e->num_tags++;
+    return 0;
+}
+
+/* Decode the tags given as parallel key and value arrays (fields 2 and 3). */
+static int get_tags(PBF_Block *b, PB_Message msg, PBF_Entity *e)
+{
+    int64_t nk = get_packed(b, msg, 2, 0);
+    int64_t nv = get_packed(b, msg, 3, 1);
+    if (nk < 0 || nv != nk) return -1;
+    for (int64_t i = 0; i < nk; i++) {
+        if (add_tag(b, e, b->packed[0][i], b->packed[1][i]) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Decode the Info message (field 4) of a node, way or relation. */
+static int get_info(PBF_Block *b, PB_Message msg, PBF_Entity *e, int64_t date_granularity)
+{
+    PB_Message info;
+    if (get_message(msg, 4, &info) < 0) return -1;
+    e->version = (int32_t)get_varint(info, 1, 0);
+    e->timestamp = (int64_t)get_varint(info, 2, 0) * date_granularity / 1000;
+    e->changeset = (int64_t)get_varint(info, 3, 0);
+    e->uid = (int32_t)get_varint(info, 4, 0);
+    e->user = get_string(b, get_varint(info, 5, 0));
+    if (info) PB_delete_message(info);
+    return 0;
+}
+
+typedef struct {
+    int64_t granularity;
+    int64_t date_granularity;
+    int64_t lat_offset;
+    int64_t lon_offset;
+} PBF_Scale;
+
+static int decode_node(PBF_Block *b, PB_Message msg, const PBF_Scale *sc)
+{
+    PBF_Entity *e = new_entity(b, PBF_NODE);
+    if (!e) return -1;
+    e->id = zigzag(get_varint(msg, 1, 0));
+    e->lat = sc->lat_offset + sc->granularity * zigzag(get_varint(msg, 8, 0));
+    e->lon = sc->lon_offset + sc->granularity * zigzag(get_varint(msg, 9, 0));
+    return (get_tags(b, msg, e) < 0 || get_info(b, msg, e, sc->date_granularity) < 0) ? -1 : 0;
+}
+
+static int decode_dense(PBF_Block *b, PB_Message msg, const PBF_Scale *sc)
+{
+    int64_t n = get_packed(b, msg, 1, 0);
+    if (n < 0 || get_packed(b, msg, 8, 1) != n || get_packed(b, msg, 9, 2) != n) return -1;
+    int64_t nkv = get_packed(b, msg, 10, 3);
+    if (nkv < 0) return -1;
+
+    PB_Message info;
+    if (get_message(msg, 5, &info) < 0) return -1;
+    int64_t ninfo = info ? get_packed(b, info, 1, 4) : 0;
+    int rc = -1;
+    if (ninfo != 0 && ninfo != n) goto done;
+    if (ninfo && (get_packed(b, info, 2, 5) != n || get_packed(b, info, 3, 6) != n ||
+                  get_packed(b, info, 4, 7) != n)) goto done;
+    // The delta coded columns are summed in place.  The user string ids
+    // are only needed once the others are decoded.
+    int64_t *sums[8];
+    for (int s = 0; s < 8; s++) sums[s] = (int64_t *)b->packed[s];
+    for (int s = 0; s < (ninfo ? 8 : 3); s++) {
+        if (s != 3 && s != 4) CPU_kernels.deltas(b->packed[s], sums[s], n);
+    }
+    size_t kv = 0;
+    for (int64_t i = 0; i < n; i++) {
+        PBF_Entity *e = new_entity(b, PBF_NODE);
+        if (!e) goto done;
+        e->id = sums[0][i];
+        e->lat = sc->lat_offset + sc->granularity * sums[1][i];
+        e->lon = sc->lon_offset + sc->granularity * sums[2][i];
+        while (kv < (size_t)nkv && b->packed[3][kv] != 0) {
+            if (kv + 1 >= (size_t)nkv || add_tag(b, e, b->packed[3][kv], b->packed[3][kv + 1]) < 0) goto done;
+            kv += 2;
+        }
+        kv++;
+        if (ninfo) {
+            e->version = (int32_t)b->packed[4][i];
+            e->timestamp = sums[5][i] * sc->date_granularity / 1000;
+            e->changeset = sums[6][i];
+            e->uid = (int32_t)sums[7][i];
+        }
+    }
+    if (ninfo) {
+        if (get_packed(b, info, 5, 4) != n) goto done;
+        CPU_kernels.deltas(b->packed[4], sums[4], n);
+        PBF_Entity *first = &b->ents[b->num_ents - n];
+        for (int64_t i = 0; i < n; i++) first[i].user = get_string(b, (uint64_t)sums[4][i]);
+    }
+    rc = 0;
+done:
+    if (info) PB_delete_message(info);
+    return rc;
+}
+
+static int decode_way(PBF_Block *b, PB_Message msg, const PBF_Scale *sc)
+{
+    PBF_Entity *e = new_entity(b, PBF_WAY);
+    if (!e) return -1;
+    e->id = (OSM_Id)get_varint(msg, 1, 0);
+    if (get_tags(b, msg, e) < 0 || get_info(b, msg, e, sc->date_granularity) < 0) return -1;
+    int64_t n = get_packed(b, msg, 8, 0);
+    if (n < 0 || reserve((void **)&b->refs, &b->cap_refs, b->num_refs + n, sizeof(OSM_Id)) < 0) return -1;
+    CPU_kernels.deltas(b->packed[0], &b->refs[b->num_refs], n);
+    b->num_refs += n;
+    e->num_refs = (int)n;
+    return 0;
+}
+
+static int decode_relation(PBF_Block *b, PB_Message msg, const PBF_Scale *sc)
+{
+    PBF_Entity *e = new_entity(b, PBF_RELATION);
+    if (!e) return -1;
+    e->id = (OSM_Id)get_varint(msg, 1, 0);
+    if (get_tags(b, msg, e) < 0 || get_info(b, msg, e, sc->date_granularity) < 0) return -1;
+    int64_t n = get_packed(b, msg, 8, 0);
+    if (n < 0 || get_packed(b, msg, 9, 1) != n || get_packed(b, msg, 10, 2) != n) return -1;
+    if (reserve((void **)&b->members, &b->cap_members, b->num_members + n, sizeof(PBF_Member)) < 0) return -1;
+    int64_t *ids = (int64_t *)b->packed[1];
+    CPU_kernels.deltas(b->packed[1], ids, n);
+    for (int64_t i = 0; i < n; i++) {
+        PBF_Member *m = &b->members[b->num_members++];
+        m->id = ids[i];
+        m->type = (b->packed[2][i] <= PBF_RELATION) ? (PBF_Type)b->packed[2][i] : PBF_NODE;
+        m->role = get_string(b, b->packed[0][i]);
+    }
+    e->num_members = (int)n;
+    return 0;
+}
+
+/* Copy the string table (field 1) of a block into the reader. */
+static int get_strings(PBF_Block *b, PB_Message block)
+{
+    PB_Message st;
+    if (get_message(block, 1, &st) < 0) return -1;
+    size_t n = 0, bytes = 0;
+    PB_Field *f = st;
+    while (st && (f = PB_next_field(f, 1, LEN_TYPE, FORWARD_DIR)) != NULL) {
+        n++;
+        bytes += f->value.bytes.size + 1;
+    }
+    free(b->string_data);
+    free(b->strings);
+    b->string_data = malloc(bytes ? bytes : 1);
+    b->strings = malloc((n ? n : 1) * sizeof(char *));
+    b->num_strings = 0;
+    if (!b->string_data || !b->strings) {
+        if (st) PB_delete_message(st);
+        return -1;
+    }
+    char *p = b->string_data;
+    f = st;
+    while (st && (f = PB_next_field(f, 1, LEN_TYPE, FORWARD_DIR)) != NULL) {
+        memcpy(p, f->value.bytes.buf, f->value.bytes.size);
+        p[f->value.bytes.size] = '\0';
+        b->strings[b->num_strings++] = p;
+        p += f->value.bytes.size + 1;
+    }
+    if (st) PB_delete_message(st);
+    return 0;
+}
+
+/* Decode every entity of a PrimitiveBlock into the reader. */
+static int decode_block(PBF_Block *b, PB_Message block)
+{
+    b->num_ents = 0;
+    b->num_tags = b->num_refs = b->num_members = 0;
+    if (get_strings(b, block) < 0) return -1;
+    PBF_Scale sc = {
+        (int64_t)get_varint(block, 17, 100), (int64_t)get_varint(block, 18, 1000),
+        (int64_t)get_varint(block, 19, 0), (int64_t)get_varint(block, 20, 0)
+    };
+
+    PB_Field *gf = block;
+    while ((gf = PB_next_field(gf, 2, LEN_TYPE, FORWARD_DIR)) != NULL) {
+        PB_Message group;
+        if (gf->value.bytes.size == 0) continue;
+        if (PB_read_embedded_message(gf->value.bytes.buf, gf->value.bytes.size, &group) < 0) return -1;
+        int rc = 0;
+        PB_Field *f = group;
+        while (rc == 0 && (f = PB_next_field(f, ANY_FIELD, LEN_TYPE, FORWARD_DIR)) != NULL) {
+            if (f->number < 1 || f->number > 4) continue;   // ChangeSets are skipped
+            PB_Message msg = NULL;
+            if (f->value.bytes.size > 0 &&
+                PB_read_embedded_message(f->value.bytes.buf, f->value.bytes.size, &msg) < 0) {
+                rc = -1;
+                break;
+            }
+            switch (f->number) {
+            case 1: rc = decode_node(b, msg, &sc); break;
+            case 2: rc = decode_dense(b, msg, &sc); break;
+            case 3: rc = decode_way(b, msg, &sc); break;
+            case 4: rc = decode_relation(b, msg, &sc); break;
+            }
+            if (msg) PB_delete_message(msg);
+        }
+        PB_delete_message(group);
+        if (rc < 0) return -1;
+    }
+
+    // The arrays are complete, so entities can now point into them.
+    for (size_t i = 0; i < b->num_ents; i++) {
+        PBF_Entity *e = &b->ents[i];
+        e->keys = b->keys ? b->keys + b->slices[i].tag : NULL;
+        e->vals = b->vals ? b->vals + b->slices[i].tag : NULL;
+        e->refs = b->refs ? b->refs + b->slices[i].ref : NULL;
+        e->members = b->members ? b->members + b->slices[i].member : NULL;
+        if (b->hash) e->hash = PBF_hash(e);
+    }
+    return 0;
+}
+
+/*
+ * Read the header of the next blob of the file.  Returns 1 with its type (a
+ * malloc'd string) and the size of its data, 0 at the end of the file, or
+ * -1 if the file is malformed.
+ */
+static int read_blob_header(FILE *in, char **typep, size_t *datasizep)
+{
+    unsigned char len_buf[4];
+    size_t got = fread(len_buf, 1, 4, in);
+    if (got == 0 && feof(in)) return 0;
+    if (got != 4) return -1;
+    uint32_t header_len;
+    memcpy(&header_len, len_buf, 4);
+    header_len = ntohl(header_len);
+    if (header_len == 0 || header_len > (64 << 10)) return -1;
+
+    char *buf = malloc(header_len);
+    PB_Message header = NULL;
+    if (!buf || fread(buf, 1, header_len, in) != header_len ||
+        PB_read_embedded_message(buf, header_len, &header) < 0) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    PB_Field *type = PB_get_field(header, 1, LEN_TYPE);
+    PB_Field *size = PB_get_field(header, 3, VARINT_TYPE);
+    if (!type || !size || size->value.i64 == 0 || size->value.i64 > (32 << 20)) {
+        PB_delete_message(header);
+        return -1;
+    }
+    *datasizep = (size_t)size->value.i64;
+    *typep = strndup(type->value.bytes.buf, type->value.bytes.size);
+    PB_delete_message(header);
+    return *typep ? 1 : -1;
+}
+
+/*
+ * Read the next blob of the file.  Returns 1 with its type (a malloc'd
+ * string) and its decompressed message, 0 at the end of the file, or -1 if
+ * the file is malformed.
+ */
+static int read_blob(FILE *in, char **typep, PB_Message *msgp)
+{
+    size_t datasize;
+    int rc = read_blob_header(in, typep, &datasize);
+    if (rc <= 0) return rc;
+
+    char *buf = malloc(datasize);
+    PB_Message blob = NULL;
+    rc = -1;
+    if (buf && fread(buf, 1, datasize, in) == datasize &&
+        PB_read_embedded_message(buf, datasize, &blob) == 0) {
+        PB_Field *zf = PB_get_field(blob, 3, LEN_TYPE);
+        PB_Field *rf = PB_get_field(blob, 1, LEN_TYPE);
+        *msgp = NULL;
+        if (zf) {
+            rc = PB_inflate_embedded_message(zf->value.bytes.buf, zf->value.bytes.size, msgp);
+        } else if (rf) {
+            rc = PB_read_embedded_message(rf->value.bytes.buf, rf->value.bytes.size, msgp);
+        }
+        PB_delete_message(blob);
+    }
+    free(buf);
+    if (rc < 0 || !*msgp) {
+        free(*typep);
+        return -1;
+    }
+    return 1;
+}
+
+static void decode_header(PBF_Reader *r, PB_Message hb)
+{
+    PB_Message bbox;
+    if (get_message(hb, 1, &bbox) == 0 && bbox) {
+        PB_Field *l = PB_get_field(bbox, 1, VARINT_TYPE), *rt = PB_get_field(bbox, 2, VARINT_TYPE);
+        PB_Field *t = PB_get_field(bbox, 3, VARINT_TYPE), *b = PB_get_field(bbox, 4, VARINT_TYPE);
+        if (l && rt && t && b) {
+            r->header.has_bbox = 1;
+            r->header.min_lon = zigzag(l->value.i64);
+            r->header.max_lon = zigzag(rt->value.i64);
+            r->header.max_lat = zigzag(t->value.i64);
+            r->header.min_lat = zigzag(b->value.i64);
+        }
+        PB_delete_message(bbox);
+    }
+    PB_Field *f = hb;
+    while ((f = PB_next_field(f, 5, LEN_TYPE, FORWARD_DIR)) != NULL) {
+        if (f->value.bytes.size == 17 && memcmp(f->value.bytes.buf, "Sort.Type_then_ID", 17) == 0) {
+            r->header.sorted = 1;
+        }
+    }
+}
+
+/*
+ * Read blobs until an OSMData block has been decoded into b.  Blocks of
+ * unknown types are skipped.  Returns 1 if a block was decoded, 0 at the
+ * end of the file, or -1 on error.
+ */
+static int load_block(FILE *in, PBF_Block *b)
+{
+    for (;;) {
+        char *type = NULL;
+        PB_Message msg = NULL;
+        int rc = read_blob(in, &type, &msg);
+        if (rc <= 0) {
+            if (rc < 0) fprintf(stderr, "ERROR: PBF_next - malformed blob.\n");
+            return rc;
+        }
+        int data = (strcmp(type, "OSMData") == 0);
+        rc = data ? decode_block(b, msg) : 0;
+        PB_delete_message(msg);
+        free(type);
+        if (rc < 0) {
+            fprintf(stderr, "ERROR: PBF_next - malformed block.\n");
+            b->num_ents = 0;
+            return -1;
+        }
+        if (data) return 1;
+    }
+}
+
+/* Thread reading ahead: decode the block after the current one. */
+static void *read_ahead(void *arg)
+{
+    PBF_Reader *r = arg;
+    r->ahead_rc = load_block(r->in, &r->blocks[1 - r->cur]);
+    return NULL;
+}
+
+static void free_block(PBF_Block *b)
+{
+    free(b->ents);
+    free(b->slices);
+    free(b->string_data);
+    free(b->strings);
+    free(b->keys);
+    free(b->vals);
+    free(b->refs);
+    free(b->members);
+    for (int i = 0; i < 8; i++) free(b->packed[i]);
+}
+
+/**
+ * @brief Start reading a PBF file, whose header block is read now.
+ *
+ * @param in     The stream to read, positioned at the start of the file.
+ *               It is not closed by PBF_close.
+ * @param flags  PBF_READ_AHEAD to decode the next block in a background
+ *               thread while the current one is consumed, PBF_READ_HASH to
+ *               set the hash of every entity; 0 for neither.
+ * @return The reader, or NULL if the file does not start with a header
+ * block or memory could not be allocated.
+ */
+PBF_Reader *PBF_open_with(FILE *in, int flags)
+{
+    PBF_Reader *r = calloc(1, sizeof(PBF_Reader));
+    if (!r) return NULL;
+    r->in = in;
+    r->flags = flags;
+    r->blocks[0].hash = r->blocks[1].hash = (flags & PBF_READ_HASH) != 0;
+    char *type = NULL;
+    PB_Message msg = NULL;
+    if (read_blob(in, &type, &msg) <= 0 || strcmp(type, "OSMHeader") != 0) {
+        fprintf(stderr, "ERROR: PBF_open - no OSMHeader block.\n");
+        free(type);
+        if (msg) PB_delete_message(msg);
+        free(r);
+        return NULL;
+    }
+    decode_header(r, msg);
+    PB_delete_message(msg);
+    free(type);
+    return r;
+}
+
+/**
+ * @brief Start reading a PBF file, as PBF_open_with with no flags.
+ */
+PBF_Reader *PBF_open(FILE *in)
+{
+    return PBF_open_with(in, 0);
+}
+
+/**
+ * @brief Get the header of the file being read.
+ */
+const PBF_Header *PBF_get_header(PBF_Reader *r)
+{
+    return &r->header;
+}
+
+/**
+ * @brief Get the next entity of the file.
+ *
+ * Entities are returned in file order.  Blocks of unknown types are
+ * skipped.
+ *
+ * @param r   The reader.
+ * @param ep  Receives the entity, which stays valid until the next call.
+ * @return 1 if an entity was returned, 0 at the end of the file, or -1 if
+ * the file is malformed or memory ran out.
+ */
+int PBF_next(PBF_Reader *r, const PBF_Entity **ep)
+{
+    while (r->next == r->blocks[r->cur].num_ents) {
+        int rc;
+        if (r->reading) {
+            pthread_join(r->thread, NULL);
+            r->reading = 0;
+            rc = r->ahead_rc;
+            r->cur = 1 - r->cur;
+        } else {
+            rc = load_block(r->in, &r->blocks[r->cur]);
+        }
+        r->next = 0;
+        if (rc <= 0) {
+            r->blocks[r->cur].num_ents = 0;
+            return rc;
+        }
+        if ((r->flags & PBF_READ_AHEAD) && pthread_create(&r->thread, NULL, read_ahead, r) == 0) {
+            r->reading = 1;
+        }
+    }
+    *ep = &r->blocks[r->cur].ents[r->next++];
+    return 1;
+}
+
+/**
+ * @brief Free a reader.  Its stream is left open.
+ */
+void PBF_close(PBF_Reader *r)
+{
+    if (!r) return;
+    if (r->reading) pthread_join(r->thread, NULL);
+    free_block(&r->blocks[0]);
+    free_block(&r->blocks[1]);
+    free(r);
+}
+
+/**
+ * @brief List the blobs of a file, from their headers alone.
+ *
+ * The data of each blob is skipped, not read, so this takes about one seek
+ * per blob.
+ *
+ * @param in      The file, which must be seekable, positioned at its start.
+ * @param blobsp  Receives the blobs, in file order, to be freed by the
+ *                caller.
+ * @param countp  Receives their number.
+ * @return 0 on success, 1 if a blob header is malformed or a blob extends
+ * past the end of the file, in which case the blobs before it are listed
+ * and it starts where the last of them ends, or -1 if the file cannot be
+ * read or memory ran out.
+ */
+int PBF_index(FILE *in, PBF_Blob **blobsp, int64_t *countp)
+{
+    PBF_Blob *blobs = NULL;
+    size_t num = 0, cap = 0;
+    int64_t end = -1;
+    int rc = 0;
+    if (fseeko(in, 0, SEEK_END) == 0) end = ftello(in);
+    if (end < 0 || fseeko(in, 0, SEEK_SET) < 0) {
+        fprintf(stderr, "ERROR: PBF_index - the file is not seekable.\n");
+        return -1;
+    }
+    while (rc == 0) {
+        int64_t offset = ftello(in);
+        char *type = NULL;
+        size_t datasize;
+        int got = read_blob_header(in, &type, &datasize);
+        if (got == 0) break;
+        int64_t next = ftello(in) + (int64_t)datasize;
+        if (got < 0 || next > end || fseeko(in, next, SEEK_SET) < 0) {
+            rc = 1;
+        } else if (reserve((void **)&blobs, &cap, num + 1, sizeof(PBF_Blob)) < 0) {
+            fprintf(stderr, "ERROR: PBF_index - out of memory.\n");
+            rc = -1;
+        } else {
+            blobs[num].offset = offset;
+            blobs[num].size = next - offset;
+            blobs[num].header = strcmp(type, "OSMHeader") == 0;
+            blobs[num].data = strcmp(type, "OSMData") == 0;
+            num++;
+        }
+        free(type);
+    }
+    *blobsp = blobs;
+    *countp = (int64_t)num;
+    return rc;
+}
+
+/**
+ * @brief Decode the OSMData block at a given offset of the file.
+ *
+ * After this, PBF_next continues with the block that follows.
+ *
+ * @param r       The reader, whose stream must be seekable.
+ * @param offset  Where the blob of the block starts, as given by PBF_index.
+ * @param entsp   Receives the block's entities, which stay valid until the
+ *                reader is next used.
+ * @return The number of entities, or -1 if the block cannot be decoded.
+ */
+int64_t PBF_read_block(PBF_Reader *r, int64_t offset, const PBF_Entity **entsp)
+{
+    if (r->reading) {
+        pthread_join(r->thread, NULL);
+        r->reading = 0;
+    }
+    PBF_Block *b = &r->blocks[r->cur];
+    b->num_ents = 0;
+    r->next = 0;
+    if (fseeko(r->in, offset, SEEK_SET) < 0 || load_block(r->in, b) <= 0) {
+        b->num_ents = 0;
+        return -1;
+    }
+    r->next = b->num_ents;
+    *entsp = b->ents;
+    return (int64_t)b->num_ents;
+}
+
+/**
+ * @brief Order entities as in files sorted Type_then_ID: nodes, then ways,
+ * then relations, each by id, and versions of the same entity by version.
+ * @return Negative, zero or positive, as for qsort.
+ */
+int PBF_compare(const PBF_Entity *a, const PBF_Entity *b)
+{
+    if (a->type != b->type) return (a->type > b->type) - (a->type < b->type);
+    if (a->id != b->id) return (a->id > b->id) - (a->id < b->id);
+    return (a->version > b->version) - (a->version < b->version);
+}
+
+/**
+ * @brief Hash the content of an entity: its type, id, coordinates, tags,
+ * refs and members, but not its version metadata.  Entities with equal
+ * content have equal hashes.
+ */
+uint64_t PBF_hash(const PBF_Entity *e)
+{
+    // FNV-1a, over 64-bit words for numbers and bytes for strings.
+    uint64_t h = 14695981039346656037ULL;
+#define PBF_MIX(v) (h = (h ^ (uint64_t)(v)) * 1099511628211ULL)
+#define PBF_MIX_STR(s) do { for (const char *p_ = (s); *p_; p_++) PBF_MIX((unsigned char)*p_); PBF_MIX(0xff); } while (0)
+    PBF_MIX(e->type);
+    PBF_MIX(e->id);
+    PBF_MIX(e->lat);
+    PBF_MIX(e->lon);
+    PBF_MIX(e->num_tags);
+    for (int i = 0; i < e->num_tags; i++) {
+        PBF_MIX_STR(e->keys[i]);
+        PBF_MIX_STR(e->vals[i]);
+    }
+    PBF_MIX(e->num_refs);
+    for (int i = 0; i < e->num_refs; i++) PBF_MIX(e->refs[i]);
+    PBF_MIX(e->num_members);
+    for (int i = 0; i < e->num_members; i++) {
+        PBF_MIX(e->members[i].type);
+        PBF_MIX(e->members[i].id);
+        PBF_MIX_STR(e->members[i].role);
+    }
+#undef PBF_MIX
+#undef PBF_MIX_STR
+    return h;
+}
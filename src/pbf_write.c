@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>  // for htonl()
+#include <zlib.h>
+#include "pbf.h"
+#include "debug.h"
+
+/* A growable byte buffer holding encoded protobuf. */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    int err;                    // Nonzero once memory has run out
+} PBF_Buf;
+
+struct PBF_Writer {
+    FILE *out;
+    PBF_Store block;            // Entities of the block being filled
+    const char **strings;       // String table of the block; 0 is ""
+    size_t num_strings;
+    size_t cap_strings;
+    uint32_t *slots;            // Hash of the string table: index + 1, or 0
+    size_t num_slots;
+    PBF_Buf group;
+    PBF_Buf data;
+    PBF_Buf packed[6];
+    PBF_Buf blob;
+    unsigned char *zbuf;
+    size_t zcap;
+    int err;
+};
+
+static void buf_put(PBF_Buf *b, const void *src, size_t len)
+{
+    if (b->err) return;
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap *= 2;
+        unsigned char *data = realloc(b->data, cap);
+        if (!data) {
+            b->err = 1;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, src, len);
+    b->len += len;
+}
+
+static void put_varint(PBF_Buf *b, uint64_t v)
+{
+    unsigned char tmp[10];
+    int n = 0;
+    while (v >= 0x80) {
+        tmp[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (unsigned char)v;
+    buf_put(b, tmp, n);
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static void put_uint(PBF_Buf *b, int fnum, uint64_t v)
+{
+    put_varint(b, (uint64_t)fnum << 3);
+    put_varint(b, v);
+}
+
+static void put_sint(PBF_Buf *b, int fnum, int64_t v)
+{
+    put_uint(b, fnum, zigzag(v));
+}
+
+static void put_bytes(PBF_Buf *b, int fnum, const void *src, size_t len)
+{
+    put_varint(b, ((uint64_t)fnum << 3) | 2);
+    put_varint(b, len);
+    buf_put(b, src, len);
+}
+
+/* Append a sub-message, or packed values, built in another buffer. */
+static void put_buf(PBF_Buf *b, int fnum, PBF_Buf *sub)
+{
+    if (sub->err) b->err = 1;
+    put_bytes(b, fnum, sub->data, sub->len);
+    sub->len = 0;
+}
+
+/* Find a string in the block's string table, adding it if it is new. */
+static uint32_t string_id(PBF_Writer *w, const char *s)
+{
+    if (!s || !*s) return 0;
+    if (2 * (w->num_strings + 1) > w->num_slots) {
+        size_t n = w->num_slots ? 2 * w->num_slots : 1024;
+        uint32_t *slots = calloc(n, sizeof(uint32_t));
+        if (!slots) {
+            w->err = 1;
+            return 0;
+        }
+        free(w->slots);
+        w->slots = slots;
+        w->num_slots = n;
+        for (size_t i = 1; i < w->num_strings; i++) {
+            size_t h = 2166136261u;
+            for (const char *p = w->strings[i]; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+            while (w->slots[h & (n - 1)]) h++;
+            w->slots[h & (n - 1)] = (uint32_t)i + 1;
+        }
+    }
+    size_t h = 2166136261u;
+    for (const char *p = s; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    size_t mask = w->num_slots - 1;
+    for (; w->slots[h & mask]; h++) {
+        uint32_t i = w->slots[h & mask] - 1;
+        if (strcmp(w->strings[i], s) == 0) return i;
+    }
+    if (w->num_strings >= w->cap_strings) {
+        size_t cap = w->cap_strings ? 2 * w->cap_strings : 1024;
+        const char **strings = realloc(w->strings, cap * sizeof(char *));
+        if (!strings) {
+            w->err = 1;
+            return 0;
+        }
+        w->strings = strings;
+        w->cap_strings = cap;
+    }
+    w->strings[w->num_strings] = s;
+    w->slots[h & mask] = (uint32_t)w->num_strings + 1;
+    return (uint32_t)w->num_strings++;
+}
+
+/*
+ * Write one blob: the length of its header, the BlobHeader and the Blob,
+ * with the data zlib-compressed.
+ */
+static int write_blob(PBF_Writer *w, const char *type, PBF_Buf *data)
+{
+    if (data->err) return -1;
+    uLongf zlen = compressBound(data->len);
+    if (zlen > w->zcap) {
+        unsigned char *zbuf = realloc(w->zbuf, zlen);
+        if (!zbuf) return -1;
+        w->zbuf = zbuf;
+        w->zcap = zlen;
+    }
+    if (compress2(w->zbuf, &zlen, data->data, data->len, Z_DEFAULT_COMPRESSION) != Z_OK) return -1;
+
+    PBF_Buf *blob = &w->blob;
+    blob->len = 0;
+    put_uint(blob, 2, data->len);               // raw_size
+    put_bytes(blob, 3, w->zbuf, zlen);          // zlib_data
+    size_t blob_len = blob->len;
+    put_bytes(blob, 1, type, strlen(type));     // BlobHeader: type
+    put_uint(blob, 3, blob_len);                // BlobHeader: datasize
+    if (blob->err) return -1;
+
+    uint32_t header_len = htonl((uint32_t)(blob->len - blob_len));
+    if (fwrite(&header_len, 4, 1, w->out) != 1 ||
+        fwrite(blob->data + blob_len, 1, blob->len - blob_len, w->out) != blob->len - blob_len ||
+        fwrite(blob->data, 1, blob_len, w->out) != blob_len) {
+        fprintf(stderr, "ERROR: write_blob - write failed.\n");
+        return -1;
+    }
+    data->len = 0;
+    return 0;
+}
+
+static void put_tags(PBF_Writer *w, PBF_Buf *b, const PBF_Entity *e)
+{
+    for (int i = 0; i < e->num_tags; i++) {
+        put_varint(&w->packed[0], string_id(w, e->keys[i]));
+        put_varint(&w->packed[1], string_id(w, e->vals[i]));
+    }
+    if (e->num_tags) {
+        put_buf(b, 2, &w->packed[0]);
+        put_buf(b, 3, &w->packed[1]);
+    }
+}
+
+static void put_info(PBF_Writer *w, PBF_Buf *b, const PBF_Entity *e)
+{
+    if (!e->version && !e->timestamp && !e->changeset && !e->uid) return;
+    PBF_Buf *info = &w->packed[2];
+    put_uint(info, 1, (uint64_t)e->version);
+    put_uint(info, 2, (uint64_t)e->timestamp);
+    put_uint(info, 3, (uint64_t)e->changeset);
+    put_uint(info, 4, (uint64_t)e->uid);
+    put_uint(info, 5, string_id(w, e->user));
+    put_buf(b, 4, info);
+}
+
+/* Encode the nodes of the block as one DenseNodes message. */
+static void encode_dense(PBF_Writer *w, PBF_Buf *group)
+{
+    PBF_Buf *dense = &w->data, *p = w->packed;
+    int with_info = 0, with_tags = 0;
+    for (size_t i = 0; i < w->block.num; i++) {
+        const PBF_Entity *e = &w->block.ents[i];
+        if (e->version || e->timestamp || e->changeset || e->uid) with_info = 1;
+        if (e->num_tags) with_tags = 1;
+    }
+
+    int64_t id = 0, lat = 0, lon = 0;
+    for (size_t i = 0; i < w->block.num; i++) {
+        const PBF_Entity *e = &w->block.ents[i];
+        put_varint(&p[0], zigzag(e->id - id));
+        id = e->id;
+    }
+    put_buf(dense, 1, &p[0]);
+
+    if (with_info) {
+        int64_t ts = 0, cs = 0, uid = 0, sid = 0;
+        PBF_Buf info = {0};
+        for (size_t i = 0; i < w->block.num; i++) {
+            const PBF_Entity *e = &w->block.ents[i];
+            int64_t s = string_id(w, e->user);
+            put_varint(&p[0], (uint64_t)e->version);
+            put_varint(&p[1], zigzag(e->timestamp - ts));
+            put_varint(&p[2], zigzag(e->changeset - cs));
+            put_varint(&p[3], zigzag(e->uid - uid));
+            put_varint(&p[4], zigzag(s - sid));
+            ts = e->timestamp;
+            cs = e->changeset;
+            uid = e->uid;
+            sid = s;
+        }
+        for (int f = 0; f < 5; f++) put_buf(&info, f + 1, &p[f]);
+        put_buf(dense, 5, &info);
+        free(info.data);
+    }
+
+    for (size_t i = 0; i < w->block.num; i++) {
+        const PBF_Entity *e = &w->block.ents[i];
+        // Stored with a granularity of 100 nanodegrees, rounding to nearest.
+        int64_t la = (e->lat >= 0 ? e->lat + 50 : e->lat - 50) / 100;
+        int64_t lo = (e->lon >= 0 ? e->lon + 50 : e->lon - 50) / 100;
+        put_varint(&p[0], zigzag(la - lat));
+        put_varint(&p[1], zigzag(lo - lon));
+        lat = la;
+        lon = lo;
+        if (with_tags) {
+            for (int t = 0; t < e->num_tags; t++) {
+                put_varint(&p[2], string_id(w, e->keys[t]));
+                put_varint(&p[2], string_id(w, e->vals[t]));
+            }
+            put_varint(&p[2], 0);
+        }
+    }
+    put_buf(dense, 8, &p[0]);
+    put_buf(dense, 9, &p[1]);
+    if (with_tags) put_buf(dense, 10, &p[2]);
+    put_buf(group, 2, dense);
+}
+
+static void encode_way(PBF_Writer *w, PBF_Buf *group, const PBF_Entity *e)
+{
+    PBF_Buf *way = &w->data;
+    put_uint(way, 1, (uint64_t)e->id);
+    put_tags(w, way, e);
+    put_info(w, way, e);
+    int64_t ref = 0;
+    for (int i = 0; i < e->num_refs; i++) {
+        put_varint(&w->packed[3], zigzag(e->refs[i] - ref));
+        ref = e->refs[i];
+    }
+    if (e->num_refs) put_buf(way, 8, &w->packed[3]);
+    put_buf(group, 3, way);
+}
+
+static void encode_relation(PBF_Writer *w, PBF_Buf *group, const PBF_Entity *e)
+{
+    PBF_Buf *rel = &w->data;
+    put_uint(rel, 1, (uint64_t)e->id);
+    put_tags(w, rel, e);
+    put_info(w, rel, e);
+    int64_t id = 0;
+    for (int i = 0; i < e->num_members; i++) {
+        const PBF_Member *m = &e->members[i];
+        put_varint(&w->packed[3], string_id(w, m->role));
+        put_varint(&w->packed[4], zigzag(m->id - id));
+        put_varint(&w->packed[5], (uint64_t)m->type);
+        id = m->id;
+    }
+    if (e->num_members) {
+        put_buf(rel, 8, &w->packed[3]);
+        put_buf(rel, 9, &w->packed[4]);
+        put_buf(rel, 10, &w->packed[5]);
+    }
+    put_buf(group, 4, rel);
+}
+
+/* Encode the buffered entities as one PrimitiveBlock and write it. */
+static int flush_block(PBF_Writer *w)
+{
+    if (w->block.num == 0) return 0;
+    w->num_strings = 1;
+    if (w->slots) memset(w->slots, 0, w->num_slots * sizeof(uint32_t));
+
+    PBF_Buf *group = &w->group;
+    if (w->block.ents[0].type == PBF_NODE) {
+        encode_dense(w, group);
+    } else {
+        for (size_t i = 0; i < w->block.num; i++) {
+            if (w->block.ents[i].type == PBF_WAY) encode_way(w, group, &w->block.ents[i]);
+            else encode_relation(w, group, &w->block.ents[i]);
+        }
+    }
+
+    // The string table goes first, so it is built in a separate buffer.
+    PBF_Buf table = {0};
+    for (size_t i = 0; i < w->num_strings; i++) {
+        const char *s = (i == 0) ? "" : w->strings[i];
+        put_bytes(&table, 1, s, strlen(s));
+    }
+    PBF_Buf *data = &w->data;
+    put_buf(data, 1, &table);
+    free(table.data);
+    put_buf(data, 2, group);
+    PBF_store_clear(&w->block);
+    if (w->err) return -1;
+    return write_blob(w, "OSMData", data);
+}
+
+/**
+ * @brief Start writing a PBF file, whose header block is written now.
+ *
+ * @param out  The stream to write.  It is not closed by PBF_finish.
+ * @param hdr  The header: its bounding box, if any, and whether the file
+ *             will be sorted by type, then id.
+ * @return The writer, or NULL if the header could not be written.
+ */
+PBF_Writer *PBF_create(FILE *out, const PBF_Header *hdr)
+{
+    PBF_Writer *w = calloc(1, sizeof(PBF_Writer));
+    if (!w) return NULL;
+    w->out = out;
+
+    PBF_Buf *data = &w->data;
+    if (hdr->has_bbox) {
+        PBF_Buf bbox = {0};
+        put_sint(&bbox, 1, hdr->min_lon);
+        put_sint(&bbox, 2, hdr->max_lon);
+        put_sint(&bbox, 3, hdr->max_lat);
+        put_sint(&bbox, 4, hdr->min_lat);
+        put_buf(data, 1, &bbox);
+        free(bbox.data);
+    }
+    put_bytes(data, 4, "OsmSchema-V0.6", 14);
+    put_bytes(data, 4, "DenseNodes", 10);
+    if (hdr->sorted) put_bytes(data, 5, "Sort.Type_then_ID", 17);
+    put_bytes(data, 16, "pbf", 3);             // writingprogram
+    if (write_blob(w, "OSMHeader", data) < 0) {
+        fprintf(stderr, "ERROR: PBF_create - cannot write header.\n");
+        free(w->data.data);
+        free(w->blob.data);
+        free(w->zbuf);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/**
+ * @brief Write one entity.  Entities are buffered and written in blocks of
+ * a single type, so a block ends whenever the type changes.
+ *
+ * @param w  The writer.
+ * @param e  The entity, which is copied.
+ * @return 0 on success, -1 on error.
+ */
+int PBF_write(PBF_Writer *w, const PBF_Entity *e)
+{
+    if (w->block.num == PBF_BLOCK_ENTITIES ||
+        (w->block.num && w->block.ents[0].type != e->type)) {
+        if (flush_block(w) < 0) return -1;
+    }
+    return PBF_store_add(&w->block, e) ? 0 : -1;
+}
+
+/**
+ * @brief Write the last block and free the writer.  The stream is flushed
+ * but left open.
+ *
+ * @return 0 if everything was written, -1 on error.
+ */
+int PBF_finish(PBF_Writer *w)
+{
+    int rc = flush_block(w);
+    if (fflush(w->out) != 0) rc = -1;
+    PBF_store_free(&w->block);
+    free(w->strings);
+    free(w->slots);
+    free(w->group.data);
+    free(w->data.data);
+    for (int i = 0; i < 6; i++) free(w->packed[i].data);
+    free(w->blob.data);
+    free(w->zbuf);
+    free(w);
+    return rc;
+}
+
+/*
+ * Entity data in a store is kept in chunks of at least PBF_CHUNK_SIZE bytes,
+ * which are filled in order and freed together.
+ */
+#define PBF_CHUNK_SIZE (256 << 10)
+
+struct PBF_Chunk {
+    struct PBF_Chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static void *store_alloc(PBF_Store *s, size_t len)
+{
+    len = (len + 7) & ~(size_t)7;
+    struct PBF_Chunk *c = s->chunks;
+    if (!c || c->size - c->used < len) {
+        size_t size = (len > PBF_CHUNK_SIZE) ? len : PBF_CHUNK_SIZE;
+        c = malloc(sizeof(struct PBF_Chunk) + size);
+        if (!c) return NULL;
+        c->next = s->chunks;
+        c->used = 0;
+        c->size = size;
+        s->chunks = c;
+        s->bytes += sizeof(struct PBF_Chunk) + size;
+    }
+    void *p = c->data + c->used;
+    c->used += len;
+    return p;
+}
+
+static const char *store_string(PBF_Store *s, const char *str)
+{
+    if (!str || !*str) return "";
+    size_t len = strlen(str) + 1;
+    char *p = store_alloc(s, len);
+    if (p) memcpy(p, str, len);
+    return p;
+}
+
+/**
+ * @brief Add a copy of an entity to a store.
+ *
+ * @return The copy, or NULL if memory could not be allocated.
+ */
+const PBF_Entity *PBF_store_add(PBF_Store *s, const PBF_Entity *e)
+{
+    if (s->num == s->cap) {
+        size_t cap = s->cap ? 2 * s->cap : 1024;
+        PBF_Entity *ents = realloc(s->ents, cap * sizeof(PBF_Entity));
+        if (!ents) return NULL;
+        s->ents = ents;
+        s->cap = cap;
+    }
+    PBF_Entity c = *e;
+    c.user = store_string(s, e->user);
+    c.keys = c.vals = NULL;
+    c.refs = NULL;
+    c.members = NULL;
+    int ok = (c.user != NULL);
+    if (e->num_tags) {
+        const char **keys = store_alloc(s, 2 * e->num_tags * sizeof(char *));
+        if (keys) {
+            for (int i = 0; i < e->num_tags; i++) {
+                keys[i] = store_string(s, e->keys[i]);
+                keys[e->num_tags + i] = store_string(s, e->vals[i]);
+                if (!keys[i] || !keys[e->num_tags + i]) ok = 0;
+            }
+            c.keys = keys;
+            c.vals = keys + e->num_tags;
+        } else {
+            ok = 0;
+        }
+    }
+    if (e->num_refs) {
+        OSM_Id *refs = store_alloc(s, e->num_refs * sizeof(OSM_Id));
+        if (refs) memcpy(refs, e->refs, e->num_refs * sizeof(OSM_Id));
+        else ok = 0;
+        c.refs = refs;
+    }
+    if (e->num_members) {
+        PBF_Member *members = store_alloc(s, e->num_members * sizeof(PBF_Member));
+        if (members) {
+            for (int i = 0; i < e->num_members; i++) {
+                members[i] = e->members[i];
+                members[i].role = store_string(s, e->members[i].role);
+                if (!members[i].role) ok = 0;
+            }
+        } else {
+            ok = 0;
+        }
+        c.members = members;
+    }
+    if (!ok) return NULL;
+    s->ents[s->num] = c;
+    s->bytes += sizeof(PBF_Entity);
+    return &s->ents[s->num++];
+}
+
+/**
+ * @brief Remove all entities from a store.  The entity array and one chunk
+ * are kept for reuse.
+ */
+void PBF_store_clear(PBF_Store *s)
+{
+    struct PBF_Chunk *c = s->chunks;
+    if (c) {
+        while (c->next) {
+            struct PBF_Chunk *next = c->next->next;
+            free(c->next);
+            c->next = next;
+        }
+        c->used = 0;
+    }
+    s->num = 0;
+    s->bytes = c ? sizeof(struct PBF_Chunk) + c->size : 0;
+}
+
+/**
+ * @brief Free all memory of a store, leaving it empty.
+ */
+void PBF_store_free(PBF_Store *s)
+{
+    PBF_store_clear(s);
+    free(s->chunks);
+    free(s->ents);
+    memset(s, 0, sizeof(*s));
+}
@@ -2,9 +2,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include "global.h"
 #include "osm.h"
 #include "debug.h"
+#include "outbuf.h"
+#include "query.h"
+#include "server.h"
+#include "catalog.h"
+#include "extsort.h"
+#include "diff.h"
+#include "sample.h"
+#include "validate.h"
+#include "refcheck.h"
+#include "renumber.h"
+#include "shard.h"
+#include "distload.h"
 
 /* Variable to be set by process_args if the '-h' flag is seen. */
 int help_requested = 0;
@@ -12,16 +27,454 @@ int help_requested = 0;
 /* Variable to be set by process_args to any filename specified with '-f'. */
 char* osm_input_file = NULL;
 
+/* Variable to be set by process_args once it has run a tool such as --sort. */
+int tool_requested = 0;
+
+/**
+ * @brief Sort the input file by type, then id, into the output file.
+ * @return 0 on success, -1 on error.
+ */
+static int run_sort(const char* output_file, long budget)
+{
+    FILE* in = stdin;
+    if (osm_input_file && !(in = fopen(osm_input_file, "rb")))
+    {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", osm_input_file);
+        return -1;
+    }
+    FILE* out = fopen(output_file, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "ERROR: Cannot create '%s'.\n", output_file);
+        if (in != stdin) fclose(in);
+        return -1;
+    }
+    EXT_Stats st;
+    int rc = EXT_sort(in, out, (size_t)budget << 20, &st);
+    if (fclose(out) != 0) rc = -1;
+    if (in != stdin) fclose(in);
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to sort the map.\n");
+        remove(output_file);
+        return -1;
+    }
+    printf("entities: %lld, runs: %d, merge passes: %d\n", (long long)st.entities, st.runs, st.passes);
+    return 0;
+}
+
+/**
+ * @brief Merge sorted input files, keeping the highest version of each
+ * entity, into the output file.
+ * @return 0 on success, -1 on error.
+ */
+static int run_merge(char** inputs, int num_inputs, const char* output_file)
+{
+    FILE** ins = calloc(num_inputs, sizeof(FILE*));
+    FILE* out = NULL;
+    int rc = -1;
+    if (!ins)
+    {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return -1;
+    }
+    for (int i = 0; i < num_inputs; i++)
+    {
+        if (!(ins[i] = fopen(inputs[i], "rb")))
+        {
+            fprintf(stderr, "ERROR: Cannot open '%s'.\n", inputs[i]);
+            goto done;
+        }
+    }
+    if (!(out = fopen(output_file, "wb")))
+    {
+        fprintf(stderr, "ERROR: Cannot create '%s'.\n", output_file);
+        goto done;
+    }
+    EXT_Stats st;
+    rc = EXT_merge(ins, num_inputs, out, &st);
+    if (fclose(out) != 0) rc = -1;
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to merge the maps.\n");
+        remove(output_file);
+        goto done;
+    }
+    printf("entities: %lld, duplicates: %lld\n", (long long)st.entities, (long long)st.duplicates);
+
+done:
+    for (int i = 0; i < num_inputs; i++)
+    {
+        if (ins[i]) fclose(ins[i]);
+    }
+    free(ins);
+    return rc;
+}
+
+/**
+ * @brief Write the changes from the old to the new file as an OsmChange
+ * document to the output file.
+ * @return 0 on success, -1 on error.
+ */
+static int run_diff(const char* old_file, const char* new_file, const char* output_file)
+{
+    FILE* old_in = fopen(old_file, "rb");
+    FILE* new_in = fopen(new_file, "rb");
+    int fd = -1;
+    int rc = -1;
+    if (!old_in || !new_in)
+    {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", old_in ? new_file : old_file);
+        goto done;
+    }
+    if ((fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        fprintf(stderr, "ERROR: Cannot create '%s'.\n", output_file);
+        goto done;
+    }
+    DIF_Stats st;
+    rc = DIF_write_osc(old_in, new_in, fd, &st);
+    if (close(fd) != 0) rc = -1;
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to diff the maps.\n");
+        remove(output_file);
+        goto done;
+    }
+    printf("created: %lld, modified: %lld, deleted: %lld, unchanged: %lld\n", (long long)st.created,
+           (long long)st.modified, (long long)st.deleted, (long long)st.unchanged);
+
+done:
+    if (old_in) fclose(old_in);
+    if (new_in) fclose(new_in);
+    return rc;
+}
+
+/**
+ * @brief Renumber the entities of the input file densely into the output
+ * file, and write the old and new ids to the table file if one is given.
+ * @return 0 on success, -1 on error.
+ */
+static int run_renumber(const char* output_file, const char* table_file)
+{
+    FILE* in = fopen(osm_input_file, "rb");
+    FILE* out = NULL;
+    FILE* table = NULL;
+    int rc = -1;
+    if (!in)
+    {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", osm_input_file);
+        return -1;
+    }
+    if (!(out = fopen(output_file, "wb")) || (table_file && !(table = fopen(table_file, "w"))))
+    {
+        fprintf(stderr, "ERROR: Cannot create '%s'.\n", out ? table_file : output_file);
+        goto done;
+    }
+    REN_Stats st;
+    rc = REN_renumber(in, out, table, &st);
+    if (fclose(out) != 0) rc = -1;
+    out = NULL;
+    if (table && fclose(table) != 0) rc = -1;
+    table = NULL;
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to renumber the map.\n");
+        remove(output_file);
+        if (table_file) remove(table_file);
+        goto done;
+    }
+    printf("nodes: %lld, ways: %lld, relations: %lld\n", (long long)st.entities[PBF_NODE],
+           (long long)st.entities[PBF_WAY], (long long)st.entities[PBF_RELATION]);
+    printf("dropped way refs: %lld, node members: %lld, way members: %lld, relation members: %lld\n",
+           (long long)st.dropped_refs, (long long)st.dropped[PBF_NODE], (long long)st.dropped[PBF_WAY],
+           (long long)st.dropped[PBF_RELATION]);
+
+done:
+    if (out) fclose(out);
+    if (table) fclose(table);
+    fclose(in);
+    return rc;
+}
+
+/**
+ * @brief Split the input file into num_shards spatially balanced shards,
+ * written to prefix.0.pbf, prefix.1.pbf, ...
+ * @return 0 on success, -1 on error.
+ */
+static int run_shard(const char* prefix, int num_shards, int nthreads)
+{
+    FILE* in = fopen(osm_input_file, "rb");
+    FILE** outs = calloc(num_shards, sizeof(FILE*));
+    SHD_Shard* shards = calloc(num_shards, sizeof(SHD_Shard));
+    size_t len = strlen(prefix) + 16;
+    char* path = malloc(len);
+    int rc = -1, s;
+    if (!in)
+    {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", osm_input_file);
+        goto done;
+    }
+    if (!outs || !shards || !path)
+    {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        goto done;
+    }
+    for (s = 0; s < num_shards; s++)
+    {
+        snprintf(path, len, "%s.%d.pbf", prefix, s);
+        if (!(outs[s] = fopen(path, "wb")))
+        {
+            fprintf(stderr, "ERROR: Cannot create '%s'.\n", path);
+            goto done;
+        }
+    }
+    rc = SHD_shard(in, outs, num_shards, nthreads, shards);
+    for (s = 0; s < num_shards; s++)
+    {
+        if (fclose(outs[s]) != 0) rc = -1;
+        outs[s] = NULL;
+    }
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to shard the map.\n");
+        goto done;
+    }
+    for (s = 0; s < num_shards; s++)
+    {
+        printf("shard %d: nodes: %lld (+%lld copied), ways: %lld, relations: %lld\n", s, (long long)shards[s].nodes,
+               (long long)shards[s].copies, (long long)shards[s].ways, (long long)shards[s].relations);
+    }
+
+done:
+    for (s = 0; outs && s < num_shards; s++)
+    {
+        if (outs[s]) fclose(outs[s]);
+        if (rc < 0 && path)
+        {
+            snprintf(path, len, "%s.%d.pbf", prefix, s);
+            remove(path);
+        }
+    }
+    if (in) fclose(in);
+    free(outs);
+    free(shards);
+    free(path);
+    return rc;
+}
+
+/**
+ * @brief Write a snapshot of the input file, decoded by num_parts processes,
+ * or, if part is not negative, the partial snapshot of that part only.
+ * @return 0 on success, -1 on error.
+ */
+static int run_snapshot(const char* output_file, int num_parts, int part)
+{
+    DST_Part* parts = calloc(num_parts, sizeof(DST_Part));
+    int rc = -1;
+    if (!parts)
+    {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return -1;
+    }
+    if (part < 0)
+    {
+        rc = DST_load(osm_input_file, output_file, num_parts, parts);
+    }
+    else
+    {
+        FILE* in = fopen(osm_input_file, "rb");
+        if (!in)
+        {
+            fprintf(stderr, "ERROR: Cannot open '%s'.\n", osm_input_file);
+            goto done;
+        }
+        rc = DST_split(in, num_parts, parts);
+        fclose(in);
+        if (rc == 0) rc = DST_write_part(osm_input_file, &parts[part], output_file);
+    }
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to write the snapshot.\n");
+        goto done;
+    }
+    for (int i = (part < 0) ? 0 : part; i < ((part < 0) ? num_parts : part + 1); i++)
+    {
+        printf("part %d: bytes %lld-%lld, blobs: %lld", i, (long long)parts[i].begin, (long long)parts[i].end,
+               (long long)parts[i].blobs);
+        if (part < 0) printf(", snapshot: %lld bytes", (long long)parts[i].bytes);
+        printf("\n");
+    }
+
+done:
+    free(parts);
+    return rc;
+}
+
+/* Print an estimate of --sample, or that there is none. */
+static void print_estimate(const char* name, const SMP_Estimate* est, const char* unit)
+{
+    if (est->unseen)
+    {
+        printf("%s: not estimated, none in the sampled blobs\n", name);
+        return;
+    }
+    printf("%s: %.0f +/- %.0f%s\n", name, est->value, est->margin, unit);
+}
+
+/**
+ * @brief Estimate the statistics of the input file from a random sample of
+ * percent percent of its blobs, and print them.
+ * @return 0 on success, -1 on error.
+ */
+static int run_sample(double percent, uint64_t seed)
+{
+    FILE* in = fopen(osm_input_file, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", osm_input_file);
+        return -1;
+    }
+    SMP_Result res;
+    int rc = SMP_sample(in, percent, seed, &res);
+    fclose(in);
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to sample the map.\n");
+        return -1;
+    }
+    printf("blobs: %lld, sampled: %lld, seed: %llu\n", (long long)res.blobs, (long long)res.sampled,
+           (unsigned long long)seed);
+    print_estimate("nodes", &res.nodes, "");
+    print_estimate("ways", &res.ways, "");
+    print_estimate("relations", &res.relations, "");
+    print_estimate("memory", &res.memory, " bytes");
+    for (int i = 0; i < res.num_keys; i++)
+    {
+        printf("key %s: %.0f +/- %.0f\n", res.keys[i].key, res.keys[i].count.value, res.keys[i].count.margin);
+    }
+    SMP_free(&res);
+    return 0;
+}
+
+/**
+ * @brief Check the structure of the input file, with nthreads threads, and
+ * report the first bad blob if there is one.
+ * @return 0 if the file is valid, -1 otherwise.
+ */
+static int run_validate(int nthreads)
+{
+    FILE* in = fopen(osm_input_file, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", osm_input_file);
+        return -1;
+    }
+    VAL_Report rep;
+    int rc = VAL_validate(in, nthreads, &rep);
+    fclose(in);
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to validate the map.\n");
+        return -1;
+    }
+    if (rc > 0)
+    {
+        printf("invalid: blob at offset %lld: %s\n", (long long)rep.bad_offset, rep.reason);
+        return -1;
+    }
+    printf("valid: %lld blobs, %lld bytes, nodes: %lld, ways: %lld, relations: %lld\n", (long long)rep.blobs,
+           (long long)rep.bytes, (long long)rep.nodes, (long long)rep.ways, (long long)rep.relations);
+    return 0;
+}
+
+/**
+ * @brief Check that the refs of the ways and the members of the relations
+ * of the input file exist in it, and report those missing.
+ * @return 0 if none is missing, -1 otherwise.
+ */
+static int run_check_refs(void)
+{
+    static const char* names[3] = {"node", "way", "relation"};
+    FILE* in = stdin;
+    if (osm_input_file && !(in = fopen(osm_input_file, "rb")))
+    {
+        fprintf(stderr, "ERROR: Cannot open '%s'.\n", osm_input_file);
+        return -1;
+    }
+    REF_Report rep;
+    int rc = REF_check(in, &rep);
+    if (in != stdin) fclose(in);
+    if (rc < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to check the refs of the map.\n");
+        return -1;
+    }
+    printf("nodes: %lld, ways: %lld, relations: %lld\n", (long long)rep.entities[PBF_NODE],
+           (long long)rep.entities[PBF_WAY], (long long)rep.entities[PBF_RELATION]);
+    for (int t = 0; t < 3; t++)
+    {
+        if (!rep.refs[t]) continue;
+        printf("%s refs: %lld, missing: %lld", names[t], (long long)rep.refs[t], (long long)rep.missing[t]);
+        for (int i = 0; i < rep.num_samples[t]; i++)
+        {
+            printf("%s%lld", i ? "," : " (", (long long)rep.samples[t][i]);
+        }
+        printf("%s\n", rep.num_samples[t] < rep.missing[t] ? ",...)" : rep.num_samples[t] ? ")" : "");
+    }
+    printf("broken ways: %lld, broken relations: %lld\n", (long long)rep.broken[PBF_WAY],
+           (long long)rep.broken[PBF_RELATION]);
+    printf("bitsets: %zu bytes, passes: %d\n", rep.bitset_bytes, rep.passes);
+    return (rep.broken[PBF_WAY] || rep.broken[PBF_RELATION]) ? -1 : 0;
+}
+
+/**
+ * @brief Parse a decimal count given as an option argument.
+ * @return The count, or -1 if the argument is not a number in [min, max].
+ */
+static long parse_count(const char* str, long min, long max)
+{
+    char* end;
+    long n = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || n < min || n > max) return -1;
+    return n;
+}
+
 int process_args(int argc, char** argv, OSM_Map* mp)
 {
     int i = 1;
+    int rc = 0;
     int f_specified = 0;
     int summary_requested = 0;
     int bounding_box_requested = 0;
-    OSM_Id node_id = 0;
-    OSM_Id way_id = 0;
-    int num_way_keys = 0;
-    char* way_keys[10]; // Store keys for -w queries
+    int query_file = 0;                 // argv index of the -q filename, if any
+    int num_threads = 0;                // 0 means one per CPU
+    const char* server_socket = NULL;
+    long cache_size = SRV_DEFAULT_CACHE_SIZE;
+    long server_workers = 0;
+    long map_budget = 0;                // Megabytes, 0 for unlimited
+    int num_named_maps = 0;
+    const char** named_maps = NULL;     // The -M specs, in order
+    CAT_Catalog* catalog = NULL;
+    QRY_List node_queries = {0};        // Items of all -n options, in order
+    QRY_List way_queries = {0};         // All -w options, in order
+    QRY_List batch_queries = {0};       // Contents of the -q file
+    int sort_requested = 0;
+    int merge_inputs = 0;               // argv index of the first --merge file, if any
+    int num_merge_inputs = 0;
+    int diff_inputs = 0;                // argv index of the --diff old file, if any
+    const char* output_file = NULL;
+    long sort_budget = EXT_DEFAULT_BUDGET;
+    const char* blob_cache = NULL;      // Directory of the -C blob cache, if any
+    double sample_percent = 0;          // Percentage of blobs for --sample, 0 if not given
+    const char* sample_seed = NULL;     // The --seed of --sample, if given
+    int validate_requested = 0;
+    int check_refs_requested = 0;
+    int renumber_requested = 0;
+    long num_shards = 0;                // Shards for --shard, 0 if not given
+    long num_parts = 0;                 // Parts for --snapshot or --snapshot-part, 0 if neither is given
+    long snapshot_part = -1;            // The part of --snapshot-part, -1 for all parts
+    const char* id_map_file = NULL;     // Table of old and new ids written by --renumber, if any
 
     /* --- PHASE 1: Argument Validation --- */
     if (argc < 2)
@@ -44,12 +497,14 @@ int process_args(int argc, char** argv, OSM_Map* mp)
             if ((i + 1) >= argc || argv[i + 1][0] == '-')
             {
                 fprintf(stderr, "ERROR: -f requires a filename.\n");
-                return -1;
+                rc = -1;
+                goto done;
             }
             if (f_specified)
             {
                 fprintf(stderr, "ERROR: Multiple -f options specified.\n");
-                return -1;
+                rc = -1;
+                goto done;
             }
             osm_input_file = argv[i + 1];
             f_specified = 1;
@@ -70,9 +525,15 @@ int process_args(int argc, char** argv, OSM_Map* mp)
             if ((i + 1) >= argc || argv[i + 1][0] == '-')
             {
                 fprintf(stderr, "ERROR: -n requires a node ID.\n");
-                return -1;
+                rc = -1;
+                goto done;
+            }
+            if (QRY_parse_node_spec(&node_queries, argv[i + 1]) < 0)
+            {
+                fprintf(stderr, "ERROR: Invalid node ID, list or range: %s\n", argv[i + 1]);
+                rc = -1;
+                goto done;
             }
-            node_id = atoll(argv[i + 1]);
             i += 2;
         }
         else if (strcmp(argv[i], "-w") == 0)
@@ -80,154 +541,484 @@ int process_args(int argc, char** argv, OSM_Map* mp)
             if ((i + 1) >= argc || argv[i + 1][0] == '-')
             {
                 fprintf(stderr, "ERROR: -w requires a way ID.\n");
-                return -1;
+                rc = -1;
+                goto done;
             }
-            way_id = atoll(argv[i + 1]);
+            QRY_Query q = {QRY_WAY, atoll(argv[i + 1]), 0, NULL, 0};
+            q.hi = q.lo;
             i += 2;
-            num_way_keys = 0;
+            q.keys = &argv[i];
 
             while (i < argc && argv[i][0] != '-')
             {
-                if (num_way_keys < 10)
+                if (q.num_keys < QRY_MAX_KEYS)
                 {
-                    way_keys[num_way_keys++] = argv[i];
+                    q.num_keys++;
                 }
                 else
                 {
                     fprintf(stderr, "ERROR: Too many keys for -w (max 10 allowed).\n");
-                    return -1;
+                    rc = -1;
+                    goto done;
                 }
                 i++;
             }
+            if (QRY_add(&way_queries, &q) < 0)
+            {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                rc = -1;
+                goto done;
+            }
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            if ((i + 1) >= argc || argv[i + 1][0] == '-')
+            {
+                fprintf(stderr, "ERROR: -q requires a filename.\n");
+                rc = -1;
+                goto done;
+            }
+            if (query_file)
+            {
+                fprintf(stderr, "ERROR: Multiple -q options specified.\n");
+                rc = -1;
+                goto done;
+            }
+            // The file itself is read only once the map has been loaded.
+            query_file = i + 1;
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            if ((i + 1) >= argc || (num_threads = (int)parse_count(argv[i + 1], 1, 4096)) < 0)
+            {
+                fprintf(stderr, "ERROR: -t requires a positive number of threads.\n");
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-S") == 0)
+        {
+            if ((i + 1) >= argc || argv[i + 1][0] == '-')
+            {
+                fprintf(stderr, "ERROR: -S requires a socket path.\n");
+                rc = -1;
+                goto done;
+            }
+            server_socket = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            if ((i + 1) >= argc || (cache_size = parse_count(argv[i + 1], 0, 1L << 30)) < 0)
+            {
+                fprintf(stderr, "ERROR: -c requires a number of cache entries.\n");
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-M") == 0)
+        {
+            if ((i + 1) >= argc || argv[i + 1][0] == '-')
+            {
+                fprintf(stderr, "ERROR: -M requires name=file.\n");
+                rc = -1;
+                goto done;
+            }
+            if (!named_maps && !(named_maps = calloc(argc, sizeof(char*))))
+            {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                rc = -1;
+                goto done;
+            }
+            named_maps[num_named_maps++] = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-B") == 0)
+        {
+            if ((i + 1) >= argc || (map_budget = parse_count(argv[i + 1], 0, 1L << 30)) < 0)
+            {
+                fprintf(stderr, "ERROR: -B requires a memory budget in megabytes.\n");
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-P") == 0)
+        {
+            if ((i + 1) >= argc || (server_workers = parse_count(argv[i + 1], 1, 1024)) < 0)
+            {
+                fprintf(stderr, "ERROR: -P requires a number of worker processes.\n");
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-C") == 0)
+        {
+            if ((i + 1) >= argc || argv[i + 1][0] == '-')
+            {
+                fprintf(stderr, "ERROR: -C requires a cache directory.\n");
+                rc = -1;
+                goto done;
+            }
+            blob_cache = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--sort") == 0)
+        {
+            sort_requested = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--merge") == 0)
+        {
+            merge_inputs = ++i;
+            while (i < argc && argv[i][0] != '-')
+            {
+                num_merge_inputs++;
+                i++;
+            }
+            if (num_merge_inputs == 0)
+            {
+                fprintf(stderr, "ERROR: --merge requires input files.\n");
+                rc = -1;
+                goto done;
+            }
+        }
+        else if (strcmp(argv[i], "--diff") == 0)
+        {
+            if ((i + 2) >= argc || argv[i + 1][0] == '-' || argv[i + 2][0] == '-')
+            {
+                fprintf(stderr, "ERROR: --diff requires an old and a new file.\n");
+                rc = -1;
+                goto done;
+            }
+            diff_inputs = i + 1;
+            i += 3;
+        }
+        else if (strcmp(argv[i], "--sample") == 0)
+        {
+            char* end = NULL;
+            if ((i + 1) < argc)
+            {
+                sample_percent = strtod(argv[i + 1], &end);
+            }
+            if (!end || end == argv[i + 1] || *end != '\0' || !(sample_percent > 0 && sample_percent <= 100))
+            {
+                fprintf(stderr, "ERROR: --sample requires a percentage in (0, 100].\n");
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--seed") == 0)
+        {
+            char* end = NULL;
+            if ((i + 1) < argc && argv[i + 1][0] != '-')
+            {
+                strtoull(argv[i + 1], &end, 10);
+            }
+            if (!end || end == argv[i + 1] || *end != '\0')
+            {
+                fprintf(stderr, "ERROR: --seed requires a number.\n");
+                rc = -1;
+                goto done;
+            }
+            sample_seed = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--validate") == 0)
+        {
+            validate_requested = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--check-refs") == 0)
+        {
+            check_refs_requested = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--renumber") == 0)
+        {
+            renumber_requested = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--shard") == 0)
+        {
+            if ((i + 1) >= argc || (num_shards = parse_count(argv[i + 1], 1, SHD_MAX_SHARDS)) < 0)
+            {
+                fprintf(stderr, "ERROR: --shard requires a number of shards, up to %d.\n", SHD_MAX_SHARDS);
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0)
+        {
+            if ((i + 1) >= argc || (num_parts = parse_count(argv[i + 1], 1, DST_MAX_PARTS)) < 0)
+            {
+                fprintf(stderr, "ERROR: --snapshot requires a number of processes, up to %d.\n", DST_MAX_PARTS);
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--snapshot-part") == 0)
+        {
+            char* slash = ((i + 1) < argc) ? strchr(argv[i + 1], '/') : NULL;
+            if (slash)
+            {
+                *slash = '\0';
+                snapshot_part = parse_count(argv[i + 1], 0, DST_MAX_PARTS - 1);
+                num_parts = parse_count(slash + 1, 1, DST_MAX_PARTS);
+                *slash = '/';
+            }
+            if (!slash || snapshot_part < 0 || num_parts < 0 || snapshot_part >= num_parts)
+            {
+                fprintf(stderr, "ERROR: --snapshot-part requires a part and a number of parts, as in 0/4.\n");
+                rc = -1;
+                goto done;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--id-map") == 0)
+        {
+            if ((i + 1) >= argc || argv[i + 1][0] == '-')
+            {
+                fprintf(stderr, "ERROR: --id-map requires a filename.\n");
+                rc = -1;
+                goto done;
+            }
+            id_map_file = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            if ((i + 1) >= argc || argv[i + 1][0] == '-')
+            {
+                fprintf(stderr, "ERROR: -o requires a filename.\n");
+                rc = -1;
+                goto done;
+            }
+            output_file = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            if ((i + 1) >= argc || (sort_budget = parse_count(argv[i + 1], 1, 1L << 30)) < 0)
+            {
+                fprintf(stderr, "ERROR: -m requires a memory budget in megabytes.\n");
+                rc = -1;
+                goto done;
+            }
+            i += 2;
         }
         else
         {
             fprintf(stderr, "ERROR: Unknown argument: %s\n", argv[i]);
-            return -1;
+            rc = -1;
+            goto done;
         }
     }
 
-    /* --- PHASE 2: Query Execution (Only if mp is provided) --- */
-    if (!mp) return 0;
-
-    if (summary_requested)
+    int writes_output = sort_requested || merge_inputs || diff_inputs || renumber_requested || num_shards > 0 ||
+                        num_parts > 0;
+    int needs_f = sample_percent > 0 || validate_requested || renumber_requested || num_shards > 0 || num_parts > 0;
+    if (writes_output || needs_f || check_refs_requested || output_file || id_map_file || sample_seed)
     {
-        printf("nodes: %d, ways: %d\n", OSM_Map_get_num_nodes(mp), OSM_Map_get_num_ways(mp));
-    }
-
-    if (bounding_box_requested)
-    {
-        OSM_BBox* bbox = OSM_Map_get_BBox(mp);
-        if (bbox)
+        if (sample_seed && !(sample_percent > 0))
         {
-            printf("min_lon: %.9f, max_lon: %.9f, max_lat: %.9f, min_lat: %.9f\n",
-                   OSM_BBox_get_min_lon(bbox) / 1e9,
-                   OSM_BBox_get_max_lon(bbox) / 1e9,
-                   OSM_BBox_get_max_lat(bbox) / 1e9,
-                   OSM_BBox_get_min_lat(bbox) / 1e9);
+            fprintf(stderr, "ERROR: --seed may only be given with --sample.\n");
+            rc = -1;
+            goto done;
         }
-    }
-
-    if (node_id != 0)
-    {
-        OSM_Node* node = NULL;
-        int num_nodes = OSM_Map_get_num_nodes(mp);
-        for (int j = 0; j < num_nodes; j++)
+        const char* tool = sort_requested ? "--sort" : merge_inputs ? "--merge" : diff_inputs ? "--diff" :
+                           renumber_requested ? "--renumber" : num_shards > 0 ? "--shard" :
+                           num_parts > 0 ? (snapshot_part < 0 ? "--snapshot" : "--snapshot-part") :
+                           sample_percent > 0 ? "--sample" : validate_requested ? "--validate" : "--check-refs";
+        int reads_f = sort_requested || needs_f || check_refs_requested;
+        if (sort_requested + !!merge_inputs + !!diff_inputs + renumber_requested + (num_shards > 0) +
+            (num_parts > 0) + (sample_percent > 0) + validate_requested + check_refs_requested > 1)
         {
-            OSM_Node* current_node = OSM_Map_get_Node(mp, j);
-            if (OSM_Node_get_id(current_node) == node_id)
-            {
-                node = current_node;
-                break;
-            }
+            fprintf(stderr, "ERROR: Only one of --sort, --merge, --diff, --renumber, --shard, --snapshot, "
+                    "--sample, --validate and --check-refs may be given.\n");
+            rc = -1;
+            goto done;
         }
-
-        if (node)
+        if (!output_file != !writes_output)
         {
-            // Get raw nanodegree values
-            long lat_raw = OSM_Node_get_lat(node);
-            long lon_raw = OSM_Node_get_lon(node);
-
-            // Convert nanodegrees to degrees (divide by 1e7)
-            double lat_in_degrees = lat_raw / 1e7;
-            double lon_in_degrees = lon_raw / 1e7;
-
-            // Print the converted values
-            printf("%ld\t%.7f %.7f\n", OSM_Node_get_id(node), lat_in_degrees, lon_in_degrees);
+            fprintf(stderr, "ERROR: -o must be given with --sort, --merge, --diff, --renumber, --shard or --snapshot.\n");
+            rc = -1;
+            goto done;
         }
-        else
+        if (id_map_file && !renumber_requested)
         {
-            printf("Node %ld not found.\n", node_id);
+            fprintf(stderr, "ERROR: --id-map may only be given with --renumber.\n");
+            rc = -1;
+            goto done;
+        }
+        if (summary_requested || bounding_box_requested || node_queries.num || way_queries.num ||
+            query_file || server_socket || num_named_maps || (!reads_f && f_specified))
+        {
+            fprintf(stderr, "ERROR: %s cannot be combined with queries%s.\n", tool, reads_f ? "" : " or -f");
+            rc = -1;
+            goto done;
+        }
+        if (needs_f && !f_specified)
+        {
+            fprintf(stderr, "ERROR: %s requires -f, as it reads the file out of order or twice.\n", tool);
+            rc = -1;
+            goto done;
+        }
+        if (!mp)
+        {
+            tool_requested = 1;
+            if (sort_requested)
+            {
+                rc = run_sort(output_file, sort_budget);
+            }
+            else if (merge_inputs)
+            {
+                rc = run_merge(&argv[merge_inputs], num_merge_inputs, output_file);
+            }
+            else if (diff_inputs)
+            {
+                rc = run_diff(argv[diff_inputs], argv[diff_inputs + 1], output_file);
+            }
+            else if (renumber_requested)
+            {
+                rc = run_renumber(output_file, id_map_file);
+            }
+            else if (num_shards > 0)
+            {
+                rc = run_shard(output_file, (int)num_shards, num_threads);
+            }
+            else if (num_parts > 0)
+            {
+                rc = run_snapshot(output_file, (int)num_parts, (int)snapshot_part);
+            }
+            else if (sample_percent > 0)
+            {
+                // Without --seed, every run draws another sample; the seed is printed to repeat it.
+                uint64_t seed = sample_seed ? strtoull(sample_seed, NULL, 10)
+                                            : (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+                rc = run_sample(sample_percent, seed);
+            }
+            else if (validate_requested)
+            {
+                rc = run_validate(num_threads);
+            }
+            else
+            {
+                rc = run_check_refs();
+            }
         }
+        goto done;
     }
 
+    // Set before the map, and any named maps, are read.
+    if (!mp && blob_cache && OSM_set_blob_cache(blob_cache) < 0)
+    {
+        rc = -1;
+        goto done;
+    }
 
-    if (way_id != 0)
+    if (num_named_maps > 0)
     {
-        OSM_Way* way = NULL;
-        int num_ways = OSM_Map_get_num_ways(mp);
-        for (int j = 0; j < num_ways; j++)
+        if (!(catalog = CAT_create((size_t)map_budget << 20)))
         {
-            OSM_Way* current_way = OSM_Map_get_Way(mp, j);
-            if (OSM_Way_get_id(current_way) == way_id)
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            rc = -1;
+            goto done;
+        }
+        for (int m = 0; m < num_named_maps; m++)
+        {
+            if (CAT_add(catalog, named_maps[m]) < 0)
             {
-                way = current_way;
-                break;
+                fprintf(stderr, "ERROR: Invalid or duplicate named map: %s\n", named_maps[m]);
+                rc = -1;
+                goto done;
             }
         }
+    }
+
+    /* --- PHASE 2: Query Execution (Only if mp is provided) --- */
+    if (!mp) goto done;
+
+    // All query output goes through one large buffer that is written with write(2).
+    fflush(stdout);
+    OUT_Buffer out;
+    if (OUT_init(&out, STDOUT_FILENO, OUT_DEFAULT_SIZE) < 0)
+    {
+        rc = -1;
+        goto done;
+    }
+
+    if (summary_requested)
+    {
+        OUT_put_str(&out, "nodes: ");
+        OUT_put_int64(&out, OSM_Map_get_num_nodes(mp));
+        OUT_put_str(&out, ", ways: ");
+        OUT_put_int64(&out, OSM_Map_get_num_ways(mp));
+        OUT_put_char(&out, '\n');
+    }
 
-        if (way)
+    if (bounding_box_requested)
+    {
+        OSM_BBox* bbox = OSM_Map_get_BBox(mp);
+        if (bbox)
         {
-            // If keys are specified, process key-value query first
-            if (num_way_keys > 0)
-            {
-                // Print the way ID for the key/value output
-                printf("%ld\t", OSM_Way_get_id(way));
+            // Bounding box coordinates are in nanodegrees.
+            OUT_put_str(&out, "min_lon: ");
+            OUT_put_fixed(&out, OSM_BBox_get_min_lon(bbox), 9);
+            OUT_put_str(&out, ", max_lon: ");
+            OUT_put_fixed(&out, OSM_BBox_get_max_lon(bbox), 9);
+            OUT_put_str(&out, ", max_lat: ");
+            OUT_put_fixed(&out, OSM_BBox_get_max_lat(bbox), 9);
+            OUT_put_str(&out, ", min_lat: ");
+            OUT_put_fixed(&out, OSM_BBox_get_min_lat(bbox), 9);
+            OUT_put_char(&out, '\n');
+        }
+    }
 
-                int found_key = 0;
+    // A session that only answers these queries cracks unsorted id columns
+    // rather than scanning them for each lookup; the server indexes them.
+    if (!server_socket) OSM_Map_enable_cracking(mp);
 
-                // Loop through all requested keys
-                for (int k = 0; k < num_way_keys; k++)
-                {
-                    char* requested_key = way_keys[k];
-
-                    // Check if any of the keys in the way match the requested keys
-                    for (int j = 0; j < OSM_Way_get_num_keys(way); j++)
-                    {
-                        if (strcmp(OSM_Way_get_key(way, j), requested_key) == 0)
-                        {
-                            // If found, print the corresponding value
-                            if (found_key)
-                            {
-                                printf(" "); // Separate values with a space if there were previous values
-                            }
-                            printf("%s", OSM_Way_get_value(way, j));
-                            found_key = 1;
-                        }
-                    }
-                }
+    // Node items precede way queries, which precede the batch file.
+    if (query_file && QRY_read_file(&batch_queries, argv[query_file]) < 0)
+    {
+        rc = -1;
+    }
+    if (rc == 0 && (QRY_run(&out, mp, &node_queries, num_threads) < 0 ||
+                    QRY_run(&out, mp, &way_queries, num_threads) < 0 ||
+                    QRY_run(&out, mp, &batch_queries, num_threads) < 0))
+    {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        rc = -1;
+    }
 
-                // If no keys were found, print a tab as per specification
-                if (!found_key)
-                {
-                    printf("\t");
-                }
+    if (OUT_fini(&out) < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to write query output.\n");
+        rc = -1;
+    }
 
-                // Print a newline after the keys/values are printed
-                printf("\n");
-            }
-            else
-            {
-                // If no keys are specified, print the way ID and node references
-                printf("%ld\t", OSM_Way_get_id(way));
-                for (int j = 0; j < OSM_Way_get_num_refs(way); j++)
-                {
-                    printf("%ld ", OSM_Way_get_ref(way, j));
-                }
-                printf("\n");
-            }
-        }
+    // Serving starts once all other output has been written; the server
+    // takes over the map.
+    if (rc == 0 && server_socket)
+    {
+        SRV_Config cfg = {server_socket, osm_input_file, (size_t)cache_size, (int)server_workers, catalog};
+        catalog = NULL;
+        rc = SRV_run(&cfg, mp);
     }
 
-    return 0;
+done:
+    CAT_destroy(catalog);
+    free(named_maps);
+    QRY_free_list(&node_queries);
+    QRY_free_list(&way_queries);
+    QRY_free_list(&batch_queries);
+    return rc;
 }
@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "query.h"
+#include "parallel.h"
+#include "debug.h"
+
+/* Fewest queries worth giving a worker of their own. */
+#define QRY_MIN_SHARD 4096
+
+/* Number of sampled keys per shard used to choose the shard boundaries. */
+#define QRY_OVERSAMPLE 32
+
+/* Number of consecutive single-id queries looked up together. */
+#define QRY_BLOCK 1024
+
+/* A query as seen by the executor: its sort key and its position in the list. */
+typedef struct {
+    uint64_t key;
+    size_t index;
+} QRY_Item;
+
+/* Where the answer to one query was written. */
+typedef struct {
+    int shard;
+    size_t off;
+    size_t len;
+} QRY_Span;
+
+/* State shared by the workers of one QRY_run. */
+typedef struct {
+    OSM_Map *mp;
+    const QRY_Query *queries;
+    size_t n;
+    int nshards;
+    uint64_t *splitters;    // nshards - 1 boundaries between shards
+    size_t *pos;            // nshards x nshards counts, then scatter positions
+    QRY_Item *items;        // Queries grouped by shard
+    size_t *shard_start;    // nshards + 1 offsets into items
+    OUT_Buffer *bufs;       // One answer buffer per shard
+    QRY_Span *spans;        // Location of each answer, by query index
+} QRY_Exec;
+
+/**
+ * @brief Parse a non-negative decimal id occupying all of [str, end).
+ * @return 0 on success, -1 if the text is not a valid id.
+ */
+static int parse_id(const char *str, const char *end, OSM_Id *idp)
+{
+    if (str == end) return -1;
+    OSM_Id id = 0;
+    for (const char *p = str; p < end; p++) {
+        if (*p < '0' || *p > '9') return -1;
+        if (id > (INT64_MAX - (*p - '0')) / 10) return -1;
+        id = id * 10 + (*p - '0');
+    }
+    *idp = id;
+    return 0;
+}
+
+/**
+ * @brief Append a query to a list.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int QRY_add(QRY_List *ql, const QRY_Query *q)
+{
+    if (ql->num == ql->cap) {
+        size_t cap = ql->cap ? ql->cap * 2 : 16;
+        QRY_Query *qs = realloc(ql->queries, cap * sizeof(QRY_Query));
+        if (!qs) return -1;
+        ql->queries = qs;
+        ql->cap = cap;
+    }
+    ql->queries[ql->num++] = *q;
+    return 0;
+}
+
+/**
+ * @brief Parse a node specification and append its items to a list.
+ *
+ * The specification is a comma-separated list whose items are either single
+ * ids ("123") or inclusive ranges ("1000-2000").
+ *
+ * @return 0 on success, -1 if the specification is malformed or memory runs
+ * out.
+ */
+int QRY_parse_node_spec(QRY_List *ql, const char *spec)
+{
+    const char *item = spec;
+    while (1) {
+        const char *end = strchr(item, ',');
+        if (!end) end = item + strlen(item);
+
+        QRY_Query q = {QRY_NODE, 0, 0, NULL, 0};
+        const char *dash = memchr(item, '-', end - item);
+        if (dash) {
+            if (parse_id(item, dash, &q.lo) < 0 || parse_id(dash + 1, end, &q.hi) < 0 || q.lo > q.hi)
+                return -1;
+            q.kind = QRY_RANGE;
+        } else {
+            if (parse_id(item, end, &q.lo) < 0) return -1;
+            q.hi = q.lo;
+        }
+        if (QRY_add(ql, &q) < 0) return -1;
+
+        if (*end == '\0') break;
+        item = end + 1;
+    }
+    return 0;
+}
+
+/*
+ * Split a line into whitespace-separated words, in place.
+ * Returns the number of words, or -1 if there are more than max.
+ */
+static int split_words(char *line, char **words, int max)
+{
+    int n = 0;
+    char *p = line;
+    while (1) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+        if (*p == '\0') return n;
+        if (n == max) return -1;
+        words[n++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r') p++;
+        if (*p) *p++ = '\0';
+    }
+}
+
+/**
+ * @brief Parse one line of query text and append its queries to a list.
+ *
+ * The line is split into words in place.  Keys of a way query are stored
+ * in the caller-supplied array, which must have room for QRY_MAX_KEYS
+ * entries, and point into the line.  Empty lines and comments add nothing.
+ *
+ * @param ql        The list to append to.
+ * @param line      The line, without its newline; modified.
+ * @param keys      Storage for the keys of a way query.
+ * @param num_keys  Receives the number of entries of keys that were used.
+ * @return 0 on success, -1 if the line is not a valid query or memory runs
+ * out.
+ */
+int QRY_parse_line(QRY_List *ql, char *line, char **keys, size_t *num_keys)
+{
+    char *words[QRY_MAX_KEYS + 2];
+    *num_keys = 0;
+    line += strspn(line, " \t\r");
+    int nw = (*line == '#') ? 0 : split_words(line, words, QRY_MAX_KEYS + 2);
+    if (nw == 0) return 0;
+    if (nw < 0) return -1;
+
+    if (strcmp(words[0], "n") == 0) {
+        return (nw == 2) ? QRY_parse_node_spec(ql, words[1]) : -1;
+    }
+    if (strcmp(words[0], "w") != 0 || nw < 2) return -1;
+
+    QRY_Query q = {QRY_WAY, 0, 0, NULL, 0};
+    if (parse_id(words[1], words[1] + strlen(words[1]), &q.lo) < 0) return -1;
+    q.hi = q.lo;
+    if (nw > 2) {
+        q.keys = keys;
+        q.num_keys = nw - 2;
+        for (int k = 2; k < nw; k++) keys[k - 2] = words[k];
+    }
+    if (QRY_add(ql, &q) < 0) return -1;
+    *num_keys = (size_t)q.num_keys;
+    return 0;
+}
+
+/**
+ * @brief Read a batch query file and append its queries to a list.
+ *
+ * The file is kept in memory by the list, and the keys of way queries point
+ * into it.  A list can hold the contents of only one file.
+ *
+ * @param ql        The list to append to.
+ * @param filename  Name of the query file.
+ * @return 0 on success, -1 if the file cannot be read or contains an
+ * invalid query (an error message is printed).
+ */
+int QRY_read_file(QRY_List *ql, const char *filename)
+{
+    if (ql->text) return -1;
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: Cannot open query file '%s'.\n", filename);
+        return -1;
+    }
+
+    size_t len = 0, cap = 1 << 16;
+    char *text = malloc(cap);
+    while (text) {
+        len += fread(text + len, 1, cap - len - 1, f);
+        if (len < cap - 1) break;
+        cap *= 2;
+        char *t = realloc(text, cap);
+        if (!t) free(text);
+        text = t;
+    }
+    int read_error = ferror(f);
+    fclose(f);
+    if (!text || read_error) {
+        fprintf(stderr, "ERROR: Cannot read query file '%s'.\n", filename);
+        free(text);
+        return -1;
+    }
+    text[len] = '\0';
+    ql->text = text;
+
+    // Every key is a separate word, so the number of words bounds the pool.
+    size_t num_words = 0;
+    for (size_t i = 0; i < len; i++) {
+        int space = (text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\n');
+        int next_space = (i + 1 == len || text[i + 1] == ' ' || text[i + 1] == '\t' ||
+                          text[i + 1] == '\r' || text[i + 1] == '\n');
+        if (!space && next_space) num_words++;
+    }
+    ql->key_pool = malloc((num_words + QRY_MAX_KEYS) * sizeof(char *));
+    if (!ql->key_pool) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return -1;
+    }
+    size_t pool_used = 0;
+
+    size_t lineno = 0;
+    char *line = text;
+    while (*line) {
+        char *nl = strchr(line, '\n');
+        char *next = nl ? nl + 1 : line + strlen(line);
+        if (nl) *nl = '\0';
+        lineno++;
+
+        size_t num_keys = 0;
+        int ok = (QRY_parse_line(ql, line, &ql->key_pool[pool_used], &num_keys) == 0);
+        pool_used += num_keys;
+        if (!ok) {
+            fprintf(stderr, "ERROR: %s:%zu: Invalid query.\n", filename, lineno);
+            return -1;
+        }
+        line = next;
+    }
+    return 0;
+}
+
+/**
+ * @brief Release the storage held by a list of queries.
+ */
+void QRY_free_list(QRY_List *ql)
+{
+    if (!ql) return;
+    free(ql->queries);
+    free(ql->text);
+    free(ql->key_pool);
+    memset(ql, 0, sizeof(*ql));
+}
+
+/*
+ * Output the answer to a single node query, given the node's index (or -1),
+ * as "id<TAB>lat lon".  Coordinates are stored in units of 1e-7 degrees.
+ */
+static void put_node(OUT_Buffer *out, OSM_Map *mp, OSM_Id id, int64_t index)
+{
+    if (index < 0) {
+        OUT_put_str(out, "Node ");
+        OUT_put_int64(out, id);
+        OUT_put_str(out, " not found.\n");
+        return;
+    }
+    OUT_put_int64(out, OSM_Map_get_node_ids(mp, NULL)[index]);
+    OUT_put_char(out, '\t');
+    OUT_put_fixed(out, OSM_Map_get_node_lats(mp, NULL)[index], 7);
+    OUT_put_char(out, ' ');
+    OUT_put_fixed(out, OSM_Map_get_node_lons(mp, NULL)[index], 7);
+    OUT_put_char(out, '\n');
+}
+
+/*
+ * Output every node whose id lies in [q->lo, q->hi], in map order.  With
+ * sorted ids the matching nodes form one contiguous run that starts at the
+ * lower bound; otherwise the map finds them (with its index, if built).
+ */
+static void put_range(OUT_Buffer *out, OSM_Map *mp, const QRY_Query *q)
+{
+    int64_t num_nodes;
+    const OSM_Id *ids = OSM_Map_get_node_ids(mp, &num_nodes);
+    int64_t j = OSM_Map_lower_bound_Node(mp, q->lo);
+    int64_t *rows, count;
+    if (j >= 0) {
+        for (; j < num_nodes && ids[j] <= q->hi; j++) put_node(out, mp, ids[j], j);
+    } else if (OSM_Map_range_Nodes(mp, q->lo, q->hi, &rows, &count) == 0) {
+        for (int64_t i = 0; i < count; i++) put_node(out, mp, ids[rows[i]], rows[i]);
+        free(rows);
+    } else {
+        for (j = 0; j < num_nodes; j++) {
+            if (ids[j] >= q->lo && ids[j] <= q->hi) put_node(out, mp, ids[j], j);
+        }
+    }
+}
+
+/*
+ * Output the answer to a way query, given the way's index: either its refs,
+ * or the values of the requested keys.  Nothing is output if the way does
+ * not exist.
+ */
+static void put_way(OUT_Buffer *out, OSM_Map *mp, const QRY_Query *q, int64_t index)
+{
+    if (index < 0) return;
+    OSM_Way *way = OSM_Map_get_Way(mp, (int)index);
+
+    OUT_put_int64(out, OSM_Way_get_id(way));
+    OUT_put_char(out, '\t');
+    if (q->num_keys > 0) {
+        int found_key = 0;
+        for (int k = 0; k < q->num_keys; k++) {
+            for (int j = 0; j < OSM_Way_get_num_keys(way); j++) {
+                if (strcmp(OSM_Way_get_key(way, j), q->keys[k]) == 0) {
+                    // Values are separated by spaces.
+                    if (found_key) OUT_put_char(out, ' ');
+                    OUT_put_str(out, OSM_Way_get_value(way, j));
+                    found_key = 1;
+                }
+            }
+        }
+        // If none of the keys were found, a tab is output instead.
+        if (!found_key) OUT_put_char(out, '\t');
+    } else {
+        for (int j = 0; j < OSM_Way_get_num_refs(way); j++) {
+            OUT_put_int64(out, OSM_Way_get_ref(way, j));
+            OUT_put_char(out, ' ');
+        }
+    }
+    OUT_put_char(out, '\n');
+}
+
+/**
+ * @brief Answer a single query.
+ *
+ * @param out  Buffer the answer is appended to.
+ * @param mp   The map to be queried.
+ * @param q    The query.
+ */
+void QRY_answer(OUT_Buffer *out, OSM_Map *mp, const QRY_Query *q)
+{
+    switch (q->kind) {
+    case QRY_NODE:
+        put_node(out, mp, q->lo, OSM_Map_find_Node(mp, q->lo));
+        break;
+    case QRY_RANGE:
+        put_range(out, mp, q);
+        break;
+    case QRY_WAY:
+        put_way(out, mp, q, OSM_Map_find_Way(mp, q->lo));
+        break;
+    }
+}
+
+/*
+ * Sort key of a query: node queries (ordered by their first id) precede way
+ * queries (ordered by id).  Ids are non-negative, so the top bit is free.
+ */
+static uint64_t query_key(const QRY_Query *q)
+{
+    return (q->kind == QRY_WAY ? (1ULL << 63) : 0) | (uint64_t)q->lo;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    const QRY_Item *x = a, *y = b;
+    if (x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* The shard a key belongs to: the number of splitters not greater than it. */
+static int shard_of(const QRY_Exec *ex, uint64_t key)
+{
+    int lo = 0, hi = ex->nshards - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ex->splitters[mid] <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Partition pass 1: count the queries of each chunk that fall in each shard. */
+static void count_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    QRY_Exec *ex = arg;
+    size_t *row = &ex->pos[(size_t)worker * ex->nshards];
+    for (int64_t i = begin; i < end; i++) {
+        row[shard_of(ex, query_key(&ex->queries[i]))]++;
+    }
+}
+
+/* Partition pass 2: move each query to its place in its shard. */
+static void scatter_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    QRY_Exec *ex = arg;
+    size_t *row = &ex->pos[(size_t)worker * ex->nshards];
+    for (int64_t i = begin; i < end; i++) {
+        uint64_t key = query_key(&ex->queries[i]);
+        QRY_Item *it = &ex->items[row[shard_of(ex, key)]++];
+        it->key = key;
+        it->index = (size_t)i;
+    }
+}
+
+/*
+ * Answer the queries of one shard, in id order, into the shard's buffer.
+ * Runs of single node or way queries are looked up together: the node ids
+ * are already sorted, so they are merged against the node id column.
+ */
+static void answer_shard(QRY_Exec *ex, int s)
+{
+    OUT_Buffer *out = &ex->bufs[s];
+    QRY_Item *items = &ex->items[ex->shard_start[s]];
+    size_t count = ex->shard_start[s + 1] - ex->shard_start[s];
+    OSM_Id ids[QRY_BLOCK];
+    int64_t found[QRY_BLOCK];
+
+    qsort(items, count, sizeof(QRY_Item), compare_items);
+    size_t i = 0;
+    while (i < count) {
+        QRY_Kind kind = ex->queries[items[i].index].kind;
+        size_t n = 1;
+        if (kind != QRY_RANGE) {
+            while (n < QRY_BLOCK && i + n < count && ex->queries[items[i + n].index].kind == kind) n++;
+            for (size_t k = 0; k < n; k++) ids[k] = ex->queries[items[i + k].index].lo;
+            if (kind == QRY_NODE) OSM_Map_find_sorted_Nodes(ex->mp, ids, n, found);
+            else OSM_Map_find_Ways(ex->mp, ids, n, found);
+        }
+        for (size_t k = 0; k < n; k++) {
+            const QRY_Query *q = &ex->queries[items[i + k].index];
+            QRY_Span *sp = &ex->spans[items[i + k].index];
+            sp->shard = s;
+            sp->off = out->len;
+            if (kind == QRY_NODE) put_node(out, ex->mp, q->lo, found[k]);
+            else if (kind == QRY_WAY) put_way(out, ex->mp, q, found[k]);
+            else put_range(out, ex->mp, q);
+            sp->len = out->len - sp->off;
+        }
+        i += n;
+    }
+}
+
+static void answer_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    QRY_Exec *ex = arg;
+    for (int64_t s = begin; s < end; s++) answer_shard(ex, (int)s);
+}
+
+/**
+ * @brief Answer a list of queries, writing the answers in list order.
+ *
+ * The queries are split into shards of consecutive ids (node queries before
+ * way queries), using boundaries chosen from a sample of the query ids, and
+ * each shard is answered by its own thread into a private buffer.  Within a
+ * shard the queries are answered in id order, so the workers touch disjoint
+ * slices of the id columns and consecutive lookups land close together.
+ * Finally the answers are copied to the output in the original order.
+ *
+ * @param out       Buffer the answers are appended to.
+ * @param mp        The map to be queried.
+ * @param ql        The queries.
+ * @param nthreads  Maximum number of threads (0 for one per CPU).  Fewer are
+ *                  used for small lists.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int QRY_run(OUT_Buffer *out, OSM_Map *mp, const QRY_List *ql, int nthreads)
+{
+    size_t n = ql->num;
+    if (n == 0) return 0;
+
+    int nshards = PAR_num_threads(nthreads);
+    if ((size_t)nshards > n / QRY_MIN_SHARD) nshards = (int)(n / QRY_MIN_SHARD);
+    if (nshards < 1) nshards = 1;
+
+    int rc = -1;
+    QRY_Exec ex = {mp, ql->queries, n, nshards};
+    size_t num_samples = (size_t)nshards * QRY_OVERSAMPLE;
+    uint64_t *samples = calloc(num_samples, sizeof(uint64_t));
+    ex.splitters = calloc(nshards, sizeof(uint64_t));
+    ex.pos = calloc((size_t)nshards * nshards, sizeof(size_t));
+    ex.items = malloc(n * sizeof(QRY_Item));
+    ex.shard_start = calloc(nshards + 1, sizeof(size_t));
+    ex.bufs = calloc(nshards, sizeof(OUT_Buffer));
+    ex.spans = malloc(n * sizeof(QRY_Span));
+    if (!samples || !ex.splitters || !ex.pos || !ex.items || !ex.shard_start || !ex.bufs || !ex.spans)
+        goto done;
+
+    // Shard boundaries: evenly spaced keys from a sorted sample.
+    if (nshards > 1) {
+        for (size_t k = 0; k < num_samples; k++) samples[k] = query_key(&ql->queries[k * n / num_samples]);
+        qsort(samples, num_samples, sizeof(uint64_t), compare_keys);
+        for (int s = 0; s < nshards - 1; s++) ex.splitters[s] = samples[(size_t)(s + 1) * QRY_OVERSAMPLE];
+    }
+
+    // Group the queries by shard.  Both passes use the same chunks, so each
+    // worker scatters exactly the queries it counted.
+    if (PAR_for(n, nshards, count_task, &ex) < 0) goto done;
+    size_t total = 0;
+    for (int s = 0; s < nshards; s++) {
+        ex.shard_start[s] = total;
+        for (int w = 0; w < nshards; w++) {
+            size_t c = ex.pos[(size_t)w * nshards + s];
+            ex.pos[(size_t)w * nshards + s] = total;
+            total += c;
+        }
+    }
+    ex.shard_start[nshards] = total;
+    if (PAR_for(n, nshards, scatter_task, &ex) < 0) goto done;
+
+    for (int s = 0; s < nshards; s++) {
+        if (OUT_init(&ex.bufs[s], -1, 1 << 16) < 0) goto done;
+    }
+    if (PAR_for(nshards, nshards, answer_task, &ex) < 0) goto done;
+    for (int s = 0; s < nshards; s++) {
+        if (ex.bufs[s].err) goto done;
+    }
+    debug("DEBUG: QRY_run - %zu queries answered in %d shards.\n", n, nshards);
+
+    for (size_t i = 0; i < n; i++) {
+        OUT_put_bytes(out, ex.bufs[ex.spans[i].shard].buf + ex.spans[i].off, ex.spans[i].len);
+    }
+    rc = 0;
+
+done:
+    if (ex.bufs) {
+        for (int s = 0; s < nshards; s++) free(ex.bufs[s].buf);
+    }
+    free(samples);
+    free(ex.splitters);
+    free(ex.pos);
+    free(ex.items);
+    free(ex.shard_start);
+    free(ex.bufs);
+    free(ex.spans);
+    return rc;
+}
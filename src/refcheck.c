@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "refcheck.h"
+#include "pbf.h"
+#include "debug.h"
+
+/* A page of a bitset: the bits of ids page * REF_PAGE_IDS and up. */
+typedef struct {
+    int64_t page;
+    uint64_t *bits;             // NULL for a free slot
+} REF_Page;
+
+/* Paged bitset: an open-addressing table of the pages that have bits set. */
+typedef struct {
+    REF_Page *pages;
+    size_t cap;                 // A power of two
+    size_t num;
+    REF_Page *last;             // Page used last, as ids usually come in runs
+} REF_Bitset;
+
+/* A ref to a type whose ids are not all known yet, tested at the end. */
+typedef struct {
+    OSM_Id id;
+    PBF_Type type;
+    int64_t owner;              // Number of the relation holding it
+} REF_Deferred;
+
+typedef struct {
+    REF_Bitset present[3];      // Ids present, by type
+    REF_Bitset broken[3];       // Numbers of the ways and relations found broken
+    REF_Deferred *deferred;
+    size_t num_deferred;
+    size_t cap_deferred;
+    REF_Report *rep;
+} REF_State;
+
+static size_t page_slot(const REF_Bitset *bs, int64_t page)
+{
+    uint64_t h = (uint64_t)page * 0x9e3779b97f4a7c15ULL;
+    size_t i = (size_t)(h >> 20) & (bs->cap - 1);
+    while (bs->pages[i].bits && bs->pages[i].page != page) i = (i + 1) & (bs->cap - 1);
+    return i;
+}
+
+/* Find the page holding an id, adding it if create is set.  Returns NULL if
+ * the page does not exist (or memory ran out). */
+static uint64_t *find_page(REF_Bitset *bs, int64_t page, int create)
+{
+    if (bs->last && bs->last->page == page) return bs->last->bits;
+    if (create && 2 * (bs->num + 1) > bs->cap) {
+        REF_Bitset grown = {calloc(bs->cap ? 2 * bs->cap : 64, sizeof(REF_Page)), bs->cap ? 2 * bs->cap : 64,
+                            bs->num, NULL};
+        if (!grown.pages) return NULL;
+        for (size_t i = 0; i < bs->cap; i++) {
+            if (bs->pages[i].bits) grown.pages[page_slot(&grown, bs->pages[i].page)] = bs->pages[i];
+        }
+        free(bs->pages);
+        *bs = grown;
+    }
+    if (!bs->cap) return NULL;
+    REF_Page *p = &bs->pages[page_slot(bs, page)];
+    if (!p->bits) {
+        if (!create || !(p->bits = calloc(REF_PAGE_IDS / 64, sizeof(uint64_t)))) return NULL;
+        p->page = page;
+        bs->num++;
+    }
+    bs->last = p;
+    return p->bits;
+}
+
+/* Set the bit of an id.  Returns its previous value, or -1 if out of memory. */
+static int set_bit(REF_Bitset *bs, int64_t id)
+{
+    uint64_t *bits = find_page(bs, id >> REF_PAGE_BITS, 1);
+    if (!bits) return -1;
+    uint64_t mask = 1ULL << (id & 63), *word = &bits[(id & (REF_PAGE_IDS - 1)) >> 6];
+    int was = (*word & mask) != 0;
+    *word |= mask;
+    return was;
+}
+
+static int test_bit(REF_Bitset *bs, int64_t id)
+{
+    uint64_t *bits = find_page(bs, id >> REF_PAGE_BITS, 0);
+    return bits && (bits[(id & (REF_PAGE_IDS - 1)) >> 6] & (1ULL << (id & 63)));
+}
+
+static size_t bitset_bytes(const REF_Bitset *bs)
+{
+    return bs->num * (REF_PAGE_IDS / 8) + bs->cap * sizeof(REF_Page);
+}
+
+static void free_bitset(REF_Bitset *bs)
+{
+    for (size_t i = 0; i < bs->cap; i++) free(bs->pages[i].bits);
+    free(bs->pages);
+    memset(bs, 0, sizeof(*bs));
+}
+
+/* Count a missing ref to (type, id) from the given way or relation. */
+static int record_missing(REF_State *st, PBF_Type type, OSM_Id id, PBF_Type owner_type, int64_t owner)
+{
+    REF_Report *rep = st->rep;
+    rep->missing[type]++;
+    int n = rep->num_samples[type], i = 0;
+    while (i < n && rep->samples[type][i] != id) i++;
+    if (i == n && n < REF_SAMPLES) rep->samples[type][rep->num_samples[type]++] = id;
+    int was = set_bit(&st->broken[owner_type], owner);
+    if (was < 0) return -1;
+    if (!was) rep->broken[owner_type]++;
+    return 0;
+}
+
+/* Test a ref now if its type is complete, or else keep it for the end. */
+static int check_ref(REF_State *st, PBF_Type type, OSM_Id id, PBF_Type owner_type, int64_t owner, int complete)
+{
+    st->rep->refs[type]++;
+    if (complete) return test_bit(&st->present[type], id) ? 0 : record_missing(st, type, id, owner_type, owner);
+    if (st->num_deferred == st->cap_deferred) {
+        size_t cap = st->cap_deferred ? 2 * st->cap_deferred : 1024;
+        REF_Deferred *d = realloc(st->deferred, cap * sizeof(REF_Deferred));
+        if (!d) return -1;
+        st->deferred = d;
+        st->cap_deferred = cap;
+    }
+    REF_Deferred d = {id, type, owner};
+    st->deferred[st->num_deferred++] = d;
+    return 0;
+}
+
+/*
+ * Read the file once.  With set, record the ids present.  With test, check
+ * refs; if all_known, against all the ids of the file, recorded by a
+ * previous pass, or else against the types read completely so far.
+ * Returns 0 on success, 1 if the file is not grouped by type, although
+ * this needs it, or -1 on error.
+ */
+static int scan(FILE *in, REF_State *st, int set, int test, int all_known)
+{
+    PBF_Reader *r = PBF_open_with(in, PBF_READ_AHEAD);
+    if (!r) return -1;
+    REF_Report *rep = st->rep;
+    int64_t seen[3] = {0};
+    int cur_type = PBF_NODE;
+    const PBF_Entity *e;
+    int rc = 0, next;
+    while ((next = PBF_next(r, &e)) > 0) {
+        if ((int)e->type < cur_type && test && !all_known) {
+            rc = 1;
+            break;
+        }
+        if ((int)e->type > cur_type) cur_type = e->type;
+        int64_t owner = seen[e->type]++;
+        if (set && set_bit(&st->present[e->type], e->id) < 0) {
+            rc = -1;
+            break;
+        }
+        for (int i = 0; test && rc == 0 && i < e->num_refs; i++) {
+            rc = check_ref(st, PBF_NODE, e->refs[i], PBF_WAY, owner, 1);
+        }
+        for (int i = 0; test && rc == 0 && i < e->num_members; i++) {
+            PBF_Type t = e->members[i].type;
+            rc = check_ref(st, t, e->members[i].id, PBF_RELATION, owner, all_known || (int)t < cur_type);
+        }
+        if (rc < 0) break;
+    }
+    if (next < 0) rc = -1;
+    PBF_close(r);
+    if (set) memcpy(rep->entities, seen, sizeof(seen));
+    rep->passes++;
+    if (rc < 0) fprintf(stderr, "ERROR: REF_check - cannot read the file, or out of memory.\n");
+    return rc;
+}
+
+static void free_state(REF_State *st)
+{
+    for (int t = 0; t < 3; t++) {
+        free_bitset(&st->present[t]);
+        free_bitset(&st->broken[t]);
+    }
+    free(st->deferred);
+    st->deferred = NULL;
+    st->num_deferred = st->cap_deferred = 0;
+}
+
+/**
+ * @brief Check that the refs of the ways and the members of the relations
+ * of a PBF file exist in it.
+ *
+ * @param in   The file, positioned at its start.  It is read once if it is
+ *             grouped by type, or else twice, in which case it must be
+ *             seekable.
+ * @param rep  Receives the counts of refs and missing refs.
+ * @return 0 on success (whether refs are missing or not), -1 on error.
+ */
+int REF_check(FILE *in, REF_Report *rep)
+{
+    REF_State st = {0};
+    memset(rep, 0, sizeof(*rep));
+    st.rep = rep;
+    int rc = scan(in, &st, 1, 1, 0);
+    for (size_t i = 0; rc == 0 && i < st.num_deferred; i++) {
+        REF_Deferred *d = &st.deferred[i];
+        if (!test_bit(&st.present[d->type], d->id)) rc = record_missing(&st, d->type, d->id, PBF_RELATION, d->owner);
+    }
+    if (rc > 0) {
+        debug("DEBUG: REF_check - the file is not grouped by type; reading it twice.\n");
+        free_state(&st);
+        memset(rep, 0, sizeof(*rep));
+        if (fseeko(in, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "ERROR: REF_check - the file is not grouped by type, and cannot be read twice.\n");
+            rc = -1;
+        } else {
+            rc = scan(in, &st, 1, 0, 1);
+            if (rc == 0) rc = (fseeko(in, 0, SEEK_SET) < 0) ? -1 : scan(in, &st, 0, 1, 1);
+        }
+    }
+    for (int t = 0; t < 3; t++) rep->bitset_bytes += bitset_bytes(&st.present[t]);
+    free_state(&st);
+    return rc < 0 ? -1 : 0;
+}
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "renumber.h"
+#include "pbf.h"
+#include "debug.h"
+
+/* The ids of one type, ascending.  The new id of ids[i] is nums[i], or
+ * i + 1 if the ids came in ascending order and nums is NULL. */
+typedef struct {
+    OSM_Id *ids;
+    int64_t *nums;
+    int64_t num;
+    int64_t cap;
+} REN_Column;
+
+/* An id looked up, and the slot of the batch that receives its new id. */
+typedef struct {
+    OSM_Id id;
+    int type;
+    int64_t slot;
+} REN_Lookup;
+
+typedef struct {
+    OSM_Id id;
+    int64_t num;
+} REN_Pair;
+
+static int compare_pairs(const void *a, const void *b)
+{
+    const REN_Pair *x = a, *y = b;
+    if (x->id != y->id) return x->id < y->id ? -1 : 1;
+    return (x->num > y->num) - (x->num < y->num);
+}
+
+static int compare_lookups(const void *a, const void *b)
+{
+    const REN_Lookup *x = a, *y = b;
+    if (x->type != y->type) return x->type - y->type;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int push_id(REN_Column *c, OSM_Id id)
+{
+    if (c->num == c->cap) {
+        int64_t cap = c->cap ? 2 * c->cap : 65536;
+        OSM_Id *ids = realloc(c->ids, cap * sizeof(OSM_Id));
+        if (!ids) return -1;
+        c->ids = ids;
+        c->cap = cap;
+    }
+    c->ids[c->num++] = id;
+    return 0;
+}
+
+/* Sort a column that is not in ascending order, keeping the new ids. */
+static int sort_column(REN_Column *c)
+{
+    int64_t i = 1;
+    while (i < c->num && c->ids[i - 1] <= c->ids[i]) i++;
+    if (i >= c->num) return 0;
+    REN_Pair *pairs = malloc(c->num * sizeof(REN_Pair));
+    if (!pairs || !(c->nums = malloc(c->num * sizeof(int64_t)))) {
+        free(pairs);
+        return -1;
+    }
+    for (i = 0; i < c->num; i++) {
+        pairs[i].id = c->ids[i];
+        pairs[i].num = i + 1;
+    }
+    qsort(pairs, c->num, sizeof(REN_Pair), compare_pairs);
+    for (i = 0; i < c->num; i++) {
+        c->ids[i] = pairs[i].id;
+        c->nums[i] = pairs[i].num;
+    }
+    free(pairs);
+    return 0;
+}
+
+/* Index of the first id of the column not below id, searching from
+ * position from on: first by doubling steps, then by bisection. */
+static int64_t seek_id(const REN_Column *c, int64_t from, OSM_Id id)
+{
+    int64_t lo = from, step = 1, hi = from;
+    while (hi < c->num && c->ids[hi] < id) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > c->num) hi = c->num;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (c->ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+typedef struct {
+    REN_Column cols[3];
+    PBF_Store batch;            // Entities read, not written yet
+    REN_Lookup *lookups;
+    OSM_Id *nums;               // New ids of the refs and members of the batch, 0 if missing
+    PBF_Member *members;        // Members of the batch, renumbered
+    size_t cap;
+    int64_t seq[3];             // New ids given so far
+} REN_State;
+
+static int reserve(REN_State *st, size_t n)
+{
+    if (n <= st->cap) return 0;
+    size_t cap = st->cap ? st->cap : 65536;
+    while (cap < n) cap *= 2;
+    REN_Lookup *l = realloc(st->lookups, cap * sizeof(REN_Lookup));
+    if (l) st->lookups = l;
+    OSM_Id *u = realloc(st->nums, cap * sizeof(OSM_Id));
+    if (u) st->nums = u;
+    PBF_Member *m = realloc(st->members, cap * sizeof(PBF_Member));
+    if (m) st->members = m;
+    if (!l || !u || !m) return -1;
+    st->cap = cap;
+    return 0;
+}
+
+/* Renumber the refs and members of the batch, and write it. */
+static int flush_batch(REN_State *st, PBF_Writer *w, FILE *table, REN_Stats *stats)
+{
+    static const char letters[3] = {'n', 'w', 'r'};
+    PBF_Store *b = &st->batch;
+    size_t n = 0;
+    for (size_t i = 0; i < b->num; i++) n += b->ents[i].num_refs + b->ents[i].num_members;
+    if (reserve(st, n) < 0) return -1;
+
+    n = 0;
+    for (size_t i = 0; i < b->num; i++) {
+        PBF_Entity *e = &b->ents[i];
+        for (int j = 0; j < e->num_refs; j++, n++) {
+            REN_Lookup l = {e->refs[j], PBF_NODE, n};
+            st->lookups[n] = l;
+        }
+        for (int j = 0; j < e->num_members; j++, n++) {
+            REN_Lookup l = {e->members[j].id, e->members[j].type, n};
+            st->lookups[n] = l;
+        }
+    }
+    if (n) qsort(st->lookups, n, sizeof(REN_Lookup), compare_lookups);
+    int64_t pos = 0;
+    for (size_t k = 0; k < n; k++) {
+        REN_Lookup *l = &st->lookups[k];
+        if (k == 0 || l->type != st->lookups[k - 1].type) pos = 0;
+        const REN_Column *c = &st->cols[l->type];
+        pos = seek_id(c, pos, l->id);
+        st->nums[l->slot] = (pos < c->num && c->ids[pos] == l->id) ? (c->nums ? c->nums[pos] : pos + 1) : 0;
+    }
+
+    // Rewrite in place, dropping what has no new id.
+    n = 0;
+    for (size_t i = 0; i < b->num; i++) {
+        PBF_Entity *e = &b->ents[i];
+        OSM_Id *refs = &st->nums[n];
+        int num_refs = 0;
+        for (int j = 0; j < e->num_refs; j++, n++) {
+            if (st->nums[n]) refs[num_refs++] = st->nums[n];
+            else stats->dropped_refs++;
+        }
+        PBF_Member *members = &st->members[n];
+        int num_members = 0;
+        for (int j = 0; j < e->num_members; j++, n++) {
+            if (!st->nums[n]) {
+                stats->dropped[e->members[j].type]++;
+                continue;
+            }
+            members[num_members] = e->members[j];
+            members[num_members++].id = st->nums[n];
+        }
+        OSM_Id old = e->id;
+        e->id = ++st->seq[e->type];
+        e->refs = refs;
+        e->num_refs = num_refs;
+        e->members = members;
+        e->num_members = num_members;
+        if (PBF_write(w, e) < 0) return -1;
+        if (table && fprintf(table, "%c %lld %lld\n", letters[e->type], (long long)old, (long long)e->id) < 0)
+            return -1;
+        stats->entities[e->type]++;
+    }
+    PBF_store_clear(b);
+    return 0;
+}
+
+static void free_state(REN_State *st)
+{
+    for (int t = 0; t < 3; t++) {
+        free(st->cols[t].ids);
+        free(st->cols[t].nums);
+    }
+    PBF_store_free(&st->batch);
+    free(st->lookups);
+    free(st->nums);
+    free(st->members);
+}
+
+/**
+ * @brief Write a copy of a PBF file with the entities of each type
+ * numbered 1 to N in file order, and refs and members to match.
+ *
+ * @param in     The file, positioned at its start.  It is read twice, so
+ *               it must be seekable.
+ * @param out    Where the renumbered file is written.
+ * @param table  If not NULL, receives a line "n|w|r old new" for every
+ *               entity, in file order.
+ * @param stats  Receives the counts of entities and of refs dropped.
+ * @return 0 on success, -1 on error.
+ */
+int REN_renumber(FILE *in, FILE *out, FILE *table, REN_Stats *stats)
+{
+    REN_State st = {0};
+    memset(stats, 0, sizeof(*stats));
+    int rc = -1, next, grouped = 1, last_type = PBF_NODE;
+    const PBF_Entity *e;
+
+    PBF_Reader *r = PBF_open_with(in, PBF_READ_AHEAD);
+    if (!r) goto done;
+    while ((next = PBF_next(r, &e)) > 0) {
+        if ((int)e->type < last_type) grouped = 0;
+        last_type = e->type;
+        if (push_id(&st.cols[e->type], e->id) < 0) {
+            fprintf(stderr, "ERROR: REN_renumber - out of memory.\n");
+            next = -1;
+            break;
+        }
+    }
+    PBF_close(r);
+    r = NULL;
+    if (next < 0) goto done;
+    for (int t = 0; t < 3; t++) {
+        if (sort_column(&st.cols[t]) < 0) {
+            fprintf(stderr, "ERROR: REN_renumber - out of memory.\n");
+            goto done;
+        }
+    }
+    debug("DEBUG: REN_renumber - %lld nodes, %lld ways, %lld relations%s.\n", (long long)st.cols[0].num,
+          (long long)st.cols[1].num, (long long)st.cols[2].num, grouped ? "" : ", not grouped by type");
+
+    if (fseeko(in, 0, SEEK_SET) < 0 || !(r = PBF_open_with(in, PBF_READ_AHEAD))) {
+        fprintf(stderr, "ERROR: REN_renumber - cannot read the input again.\n");
+        goto done;
+    }
+    PBF_Header hdr = *PBF_get_header(r);
+    hdr.sorted = grouped;
+    PBF_Writer *w = PBF_create(out, &hdr);
+    if (!w) goto done;
+    while ((next = PBF_next(r, &e)) > 0) {
+        if (!PBF_store_add(&st.batch, e) ||
+            (st.batch.num == PBF_BLOCK_ENTITIES && flush_batch(&st, w, table, stats) < 0)) {
+            next = -1;
+            break;
+        }
+    }
+    if (next == 0 && flush_batch(&st, w, table, stats) < 0) next = -1;
+    if (PBF_finish(w) == 0 && next == 0) rc = 0;
+    if (next < 0) fprintf(stderr, "ERROR: REN_renumber - cannot rewrite the file.\n");
+
+done:
+    if (r) PBF_close(r);
+    free_state(&st);
+    return rc;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sample.h"
+#include "pbf.h"
+#include "debug.h"
+
+/* Bytes OSM_read_Map uses per node (id, lat, lon and handle), per way (id,
+ * ref and tag offsets and handle), per way ref and per way tag, besides the
+ * tag strings.  Relations and node tags are not kept. */
+#define NODE_BYTES (3 * sizeof(int64_t) + sizeof(void *))
+#define WAY_BYTES (3 * sizeof(int64_t) + sizeof(void *))
+#define REF_BYTES sizeof(int64_t)
+#define TAG_BYTES (2 * sizeof(char *))
+
+/* z for a two-sided 95% confidence interval, and Student's t for the few
+ * degrees of freedom of small samples, whose variance is poorly known. */
+#define Z_95 1.959964
+static const double t_95[31] = {
+    0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131,
+    2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+enum { Q_NODES, Q_WAYS, Q_RELATIONS, Q_MEMORY, NUM_Q };
+
+/* Sums over the sampled blobs of a quantity y, whose blob sizes are x. */
+typedef struct {
+    double y, yy, xy;
+} SMP_Sums;
+
+/* A tag key seen in the sample. */
+typedef struct {
+    char *key;
+    uint64_t hash;
+    SMP_Sums sums;
+    int64_t cur;                // Tags with the key in the current blob
+    int64_t blob;               // Blob that cur counts, -1 if none
+} SMP_Entry;
+
+/* The keys seen, with an open-addressing table of them by hash. */
+typedef struct {
+    SMP_Entry *ents;
+    size_t num;
+    size_t cap_ents;
+    size_t *slots;              // Index + 1 of an entry, 0 if free
+    size_t cap;                 // A power of two
+    size_t *touched;            // Entries counted in the current blob
+    size_t num_touched;
+    size_t cap_touched;
+} SMP_Table;
+
+static uint64_t hash_string(const char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    return h;
+}
+
+static size_t *find_slot(SMP_Table *t, size_t *slots, size_t cap, const char *key, uint64_t h)
+{
+    size_t i = h & (cap - 1);
+    while (slots[i] && (t->ents[slots[i] - 1].hash != h || strcmp(t->ents[slots[i] - 1].key, key) != 0))
+        i = (i + 1) & (cap - 1);
+    return &slots[i];
+}
+
+/* Grow an array to hold at least need elements. */
+static int reserve(void **arrp, size_t *capp, size_t need, size_t elem)
+{
+    if (need <= *capp) return 0;
+    size_t cap = *capp ? 2 * *capp : 256;
+    void *arr = realloc(*arrp, cap * elem);
+    if (!arr) return -1;
+    *arrp = arr;
+    *capp = cap;
+    return 0;
+}
+
+/* Count a tag with the given key in blob b.  Returns -1 if out of memory. */
+static int count_key(SMP_Table *t, const char *key, int64_t b)
+{
+    if (2 * (t->num + 1) > t->cap) {
+        size_t cap = t->cap ? 2 * t->cap : 1024;
+        size_t *slots = calloc(cap, sizeof(size_t));
+        if (!slots) return -1;
+        for (size_t i = 0; i < t->num; i++) *find_slot(t, slots, cap, t->ents[i].key, t->ents[i].hash) = i + 1;
+        free(t->slots);
+        t->slots = slots;
+        t->cap = cap;
+    }
+    uint64_t h = hash_string(key);
+    size_t *slot = find_slot(t, t->slots, t->cap, key, h);
+    if (!*slot) {
+        if (reserve((void **)&t->ents, &t->cap_ents, t->num + 1, sizeof(SMP_Entry)) < 0) return -1;
+        SMP_Entry *e = &t->ents[t->num];
+        memset(e, 0, sizeof(*e));
+        if (!(e->key = strdup(key))) return -1;
+        e->hash = h;
+        e->blob = -1;
+        *slot = ++t->num;
+    }
+    SMP_Entry *e = &t->ents[*slot - 1];
+    if (e->blob != b) {
+        if (reserve((void **)&t->touched, &t->cap_touched, t->num_touched + 1, sizeof(size_t)) < 0) return -1;
+        t->touched[t->num_touched++] = *slot - 1;
+        e->blob = b;
+        e->cur = 0;
+    }
+    e->cur++;
+    return 0;
+}
+
+static void add_sample(SMP_Sums *s, double y, double x)
+{
+    s->y += y;
+    s->yy += y * y;
+    s->xy += x * y;
+}
+
+/*
+ * Ratio estimate of the total of y over all n_all blobs, whose sizes total
+ * x_all, from n sampled blobs whose sizes have sum x and sum of squares xx.
+ * If y is 0 in every sampled blob but not all were sampled, the blobs that
+ * have it may all have been skipped, and it is marked unseen.
+ */
+static SMP_Estimate estimate(const SMP_Sums *s, int64_t n, int64_t n_all, double x, double xx, double x_all)
+{
+    SMP_Estimate est = {0, 0, 0};
+    if (s->y == 0 && n < n_all) est.unseen = 1;
+    if (n == 0 || x <= 0 || est.unseen) return est;
+    double r = s->y / x;
+    est.value = r * x_all;
+    if (n < n_all) {
+        double var = (s->yy - 2 * r * s->xy + r * r * xx) / (n - 1);
+        double fpc = 1 - (double)n / n_all;
+        double q = (n - 1 <= 30) ? t_95[n - 1] : Z_95;
+        est.margin = q * n_all * sqrt(fpc * (var > 0 ? var : 0) / n);
+    }
+    return est;
+}
+
+/* xorshift64*, seeded by splitmix64. */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+static uint64_t seed_state(uint64_t seed)
+{
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    const SMP_Key *x = a, *y = b;
+    if (x->count.value != y->count.value) return x->count.value < y->count.value ? 1 : -1;
+    return strcmp(x->key, y->key);
+}
+
+/**
+ * @brief Estimate the statistics of a file from a random sample of its
+ * OSMData blobs.
+ *
+ * @param in       The file, which must be seekable, positioned at its start.
+ * @param percent  Percentage of the blobs to decode, in (0, 100].  At least
+ *                 two blobs are decoded if there are two, so that every
+ *                 estimate has a confidence interval.
+ * @param seed     Seed of the random choice of blobs.
+ * @param res      Receives the estimates, to be freed with SMP_free.
+ * @return 0 on success, -1 on error.
+ */
+int SMP_sample(FILE *in, double percent, uint64_t seed, SMP_Result *res)
+{
+    memset(res, 0, sizeof(*res));
+    PBF_Blob *blobs = NULL;
+    int64_t num_blobs;
+    int rc = PBF_index(in, &blobs, &num_blobs);
+    if (rc != 0) {
+        if (rc > 0) {
+            int64_t offset = num_blobs ? blobs[num_blobs - 1].offset + blobs[num_blobs - 1].size : 0;
+            fprintf(stderr, "ERROR: SMP_sample - malformed blob at offset %lld.\n", (long long)offset);
+        }
+        free(blobs);
+        return -1;
+    }
+
+    // Keep the data blobs, then every (n_all / n)th of them from a random start.
+    int64_t n_all = 0;
+    double x_all = 0;
+    for (int64_t i = 0; i < num_blobs; i++) {
+        if (!blobs[i].data) continue;
+        blobs[n_all++] = blobs[i];
+        x_all += blobs[i].size;
+    }
+    int64_t n = (int64_t)ceil(n_all * percent / 100);
+    if (n < 2) n = n_all < 2 ? n_all : 2;
+    if (n > n_all) n = n_all;
+    uint64_t state = seed_state(seed);
+    double step = n ? (double)n_all / n : 0;
+    double start = (next_random(&state) >> 11) * 0x1.0p-53 * step;
+    for (int64_t i = 0; i < n; i++) blobs[i] = blobs[(int64_t)(start + i * step)];
+    res->blobs = n_all;
+    res->sampled = n;
+
+    SMP_Sums sums[NUM_Q] = {{0}};
+    SMP_Table keys = {0};
+    double x = 0, xx = 0;
+    PBF_Reader *r = (fseeko(in, 0, SEEK_SET) == 0) ? PBF_open(in) : NULL;
+    if (!r) rc = -1;
+    for (int64_t b = 0; rc == 0 && b < n; b++) {
+        const PBF_Entity *ents;
+        int64_t num = PBF_read_block(r, blobs[b].offset, &ents);
+        if (num < 0) {
+            fprintf(stderr, "ERROR: SMP_sample - cannot decode the blob at offset %lld.\n",
+                    (long long)blobs[b].offset);
+            rc = -1;
+            break;
+        }
+        double y[NUM_Q] = {0};
+        for (int64_t i = 0; rc == 0 && i < num; i++) {
+            const PBF_Entity *e = &ents[i];
+            if (e->type == PBF_NODE) {
+                y[Q_NODES]++;
+                y[Q_MEMORY] += NODE_BYTES;
+            } else if (e->type == PBF_WAY) {
+                y[Q_WAYS]++;
+                y[Q_MEMORY] += WAY_BYTES + e->num_refs * REF_BYTES;
+            } else {
+                y[Q_RELATIONS]++;
+            }
+            for (int t = 0; t < e->num_tags; t++) {
+                if (e->type == PBF_WAY) y[Q_MEMORY] += TAG_BYTES + strlen(e->keys[t]) + strlen(e->vals[t]) + 2;
+                if (count_key(&keys, e->keys[t], b) < 0) {
+                    rc = -1;
+                    break;
+                }
+            }
+        }
+        double sx = (double)blobs[b].size;
+        x += sx;
+        xx += sx * sx;
+        for (int q = 0; q < NUM_Q; q++) add_sample(&sums[q], y[q], sx);
+        for (size_t i = 0; i < keys.num_touched; i++) {
+            SMP_Entry *k = &keys.ents[keys.touched[i]];
+            add_sample(&k->sums, k->cur, sx);
+        }
+        keys.num_touched = 0;
+        debug("DEBUG: SMP_sample - blob at %lld: %lld entities\n", (long long)blobs[b].offset, (long long)num);
+    }
+    PBF_close(r);
+
+    if (rc == 0) {
+        res->nodes = estimate(&sums[Q_NODES], n, n_all, x, xx, x_all);
+        res->ways = estimate(&sums[Q_WAYS], n, n_all, x, xx, x_all);
+        res->relations = estimate(&sums[Q_RELATIONS], n, n_all, x, xx, x_all);
+        res->memory = estimate(&sums[Q_MEMORY], n, n_all, x, xx, x_all);
+        // The memory of the nodes or of the ways would be missing.
+        if (res->nodes.unseen || res->ways.unseen) res->memory.unseen = 1;
+        SMP_Key *all = malloc((keys.num ? keys.num : 1) * sizeof(SMP_Key));
+        if (!all) rc = -1;
+        for (size_t i = 0; all && i < keys.num; i++) {
+            all[i].key = keys.ents[i].key;
+            all[i].count = estimate(&keys.ents[i].sums, n, n_all, x, xx, x_all);
+        }
+        if (all) {
+            // The keys' strings pass to the result; all but the top ones are freed.
+            qsort(all, keys.num, sizeof(SMP_Key), compare_keys);
+            res->num_keys = keys.num < SMP_TOP_KEYS ? (int)keys.num : SMP_TOP_KEYS;
+            for (size_t i = res->num_keys; i < keys.num; i++) free(all[i].key);
+            res->keys = all;
+            keys.num = 0;
+        }
+    }
+    for (size_t i = 0; i < keys.num; i++) free(keys.ents[i].key);
+    free(keys.ents);
+    free(keys.slots);
+    free(keys.touched);
+    free(blobs);
+    if (rc < 0) SMP_free(res);
+    return rc;
+}
+
+/**
+ * @brief Free the keys of a result.
+ */
+void SMP_free(SMP_Result *res)
+{
+    for (int i = 0; i < res->num_keys; i++) free(res->keys[i].key);
+    free(res->keys);
+    res->keys = NULL;
+    res->num_keys = 0;
+}
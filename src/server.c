@@ -0,0 +1,973 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "server.h"
+#include "cache.h"
+#include "catalog.h"
+#include "outbuf.h"
+#include "query.h"
+#include "metrics.h"
+#include "debug.h"
+
+/* Longest request line accepted. */
+#define SRV_MAX_LINE (64 * 1024)
+
+/* Most responses gathered into a single writev(2). */
+#define SRV_MAX_IOV 64
+
+/* Number of independently locked cache shards. */
+#define SRV_CACHE_SHARDS 64
+
+/* Seconds allowed on shutdown for responses to reach their clients. */
+#define SRV_DRAIN_SECS 5
+
+/* Slots for published counters per worker, as workers being replaced
+ * overlap with their replacements. */
+#define SRV_SLOTS_PER_WORKER 4
+
+struct SRV_State;
+
+/* Counters of a worker process, or their sums. */
+typedef struct {
+    pid_t pid;                      // The worker, or 0 if the slot is free
+    MET_Counters requests;
+    uint64_t connections;
+    uint64_t open;
+    CACHE_Stats cache;
+    CAT_Stats maps;
+} SRV_Totals;
+
+/*
+ * Counters of all the worker processes, in memory that the supervisor maps
+ * shared before forking them.  Each worker publishes its counters to a slot
+ * of its own about once a second, and CACHE and STATS add up the slots.
+ * The counters of a worker that has exited are folded into retired when it
+ * is reaped, so that the sums never go down.
+ */
+typedef struct {
+    pthread_mutex_t lock;           // Process-shared and robust
+    uint64_t reloads_ok;            // Reloads done by the supervisor, read atomically
+    uint64_t reloads_failed;
+    SRV_Totals retired;             // Counters (but not gauges) of exited workers
+    int num_slots;
+    SRV_Totals slots[];
+} SRV_Shared;
+
+/* An open client connection, served by its own thread. */
+typedef struct SRV_Conn {
+    int fd;
+    struct SRV_State *st;
+    struct SRV_Conn *prev;
+    struct SRV_Conn *next;
+} SRV_Conn;
+
+typedef struct SRV_State {
+    const SRV_Config *cfg;
+    pthread_rwlock_t map_lock;      // Held for reading while answering, for writing to swap maps
+    OSM_Map *mp;
+    CACHE_Cache *cache;
+    CAT_Catalog *catalog;           // Named maps
+    pthread_mutex_t reload_lock;    // Serializes reloads
+    pthread_t indexer;              // Builds the indexes of mp (under reload_lock, or in the supervisor)
+    int indexer_running;
+    pthread_mutex_t conn_lock;      // Protects conns
+    pthread_cond_t conn_closed;
+    SRV_Conn *conns;                // Open connections
+    MET_Registry metrics;           // Request counters of all connections
+    uint64_t reloads_ok;            // Updated under reload_lock, read atomically
+    uint64_t reloads_failed;
+    pid_t supervisor;               // In a worker process, the pid of the supervisor
+    SRV_Shared *shared;             // With worker processes, their counters (else NULL)
+    int slot;                       // In a worker process, its slot in shared, or -1
+} SRV_State;
+
+/* Per-connection scratch space for answering queries. */
+typedef struct {
+    QRY_List ql;
+    OUT_Buffer out;
+    char *line;                     // Copy of the request, split up by the parser
+    MET_Counters *counters;         // This connection's request counters
+} SRV_Worker;
+
+/* Responses waiting to be sent, in request order. */
+typedef struct {
+    CACHE_Value *vals[SRV_MAX_IOV];
+    int n;
+} SRV_Pending;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig)
+{
+    if (sig == SIGHUP) reload_requested = 1;
+    else stop_requested = 1;
+}
+
+static CACHE_Value *text_response(const char *text)
+{
+    return CACHE_new_value(text, strlen(text));
+}
+
+/**
+ * @brief Read and compact a map file.
+ * @return The map, or NULL if it could not be read.
+ */
+static OSM_Map *load_map(const char *filename)
+{
+    FILE *in = fopen(filename, "rb");
+    if (!in) return NULL;
+    OSM_Map *mp = OSM_read_Map(in);
+    fclose(in);
+    if (mp) OSM_Map_compact(mp);
+    return mp;
+}
+
+/* Build the id indexes of a map.  Lookups use them as soon as each is done. */
+static void *build_indexes(void *arg)
+{
+    OSM_Map *mp = arg;
+    for (int i = 0; i < OSM_NUM_INDEXES; i++) {
+        if (OSM_Map_build_index(mp, (OSM_Index)i, 0) < 0) break;
+    }
+    return NULL;
+}
+
+/* Nonzero if all id indexes of a map are ready. */
+static int indexes_ready(OSM_Map *mp)
+{
+    for (int i = 0; i < OSM_NUM_INDEXES; i++) {
+        if (!OSM_Map_index_ready(mp, (OSM_Index)i)) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Start building the indexes of the served map in the background, so that
+ * queries are answered (by scanning) from the moment the map is loaded.
+ */
+static void start_indexer(SRV_State *st)
+{
+    if (indexes_ready(st->mp)) return;
+    st->indexer_running = (pthread_create(&st->indexer, NULL, build_indexes, st->mp) == 0);
+}
+
+/* Stop building the indexes of a map that is about to be freed. */
+static void stop_indexer(SRV_State *st, OSM_Map *mp)
+{
+    if (!st->indexer_running) return;
+    OSM_Map_cancel_index(mp);
+    pthread_join(st->indexer, NULL);
+    st->indexer_running = 0;
+}
+
+/**
+ * @brief Re-read the map file and replace the served map.
+ *
+ * The new map is read while queries continue to be answered from the old
+ * one; only the swap itself excludes readers.  Its indexes are built after
+ * the swap, in the background.  The cache is invalidated as
+ * part of the swap, and named maps are dropped, to be read again when next
+ * queried.  In a worker process, the reload is left to the
+ * supervisor, which starts new workers for the new map.
+ *
+ * @return A response describing the outcome.
+ */
+static CACHE_Value *reload_map(SRV_State *st)
+{
+    if (!st->cfg->map_file) return text_response("ERROR no map file to reload from\n\n");
+    if (st->supervisor) {
+        kill(st->supervisor, SIGHUP);
+        return text_response("OK reload requested\n\n");
+    }
+
+    pthread_mutex_lock(&st->reload_lock);
+    OSM_Map *mp = load_map(st->cfg->map_file);
+    if (!mp) {
+        __atomic_add_fetch(&st->reloads_failed, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&st->reload_lock);
+        return text_response("ERROR reload failed\n\n");
+    }
+
+    pthread_rwlock_wrlock(&st->map_lock);
+    OSM_Map *old = st->mp;
+    st->mp = mp;
+    CACHE_invalidate(st->cache);
+    CAT_invalidate(st->catalog);
+    pthread_rwlock_unlock(&st->map_lock);
+    __atomic_add_fetch(&st->reloads_ok, 1, __ATOMIC_RELAXED);
+    stop_indexer(st, old);
+    start_indexer(st);
+    pthread_mutex_unlock(&st->reload_lock);
+    OSM_free_Map(old);
+    debug("DEBUG: reload_map - map reloaded from '%s'.\n", st->cfg->map_file);
+
+    OUT_Buffer ob;
+    if (OUT_init(&ob, -1, 128) < 0) return NULL;
+    OUT_put_str(&ob, "OK nodes: ");
+    OUT_put_int64(&ob, OSM_Map_get_num_nodes(mp));
+    OUT_put_str(&ob, ", ways: ");
+    OUT_put_int64(&ob, OSM_Map_get_num_ways(mp));
+    OUT_put_str(&ob, "\n\n");
+    CACHE_Value *v = ob.err ? NULL : CACHE_new_value(ob.buf, ob.len);
+    OUT_fini(&ob);
+    return v;
+}
+
+/* Map the counters shared by the workers, or return NULL. */
+static SRV_Shared *create_shared(int num_slots)
+{
+    size_t size = sizeof(SRV_Shared) + num_slots * sizeof(SRV_Totals);
+    SRV_Shared *sh = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sh == MAP_FAILED) return NULL;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sh->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    sh->num_slots = num_slots;
+    return sh;
+}
+
+static void destroy_shared(SRV_Shared *sh)
+{
+    pthread_mutex_destroy(&sh->lock);
+    munmap(sh, sizeof(SRV_Shared) + sh->num_slots * sizeof(SRV_Totals));
+}
+
+/* Lock the shared counters, even if a worker died holding the lock (its
+ * slot is then at worst half written). */
+static void lock_shared(SRV_Shared *sh)
+{
+    if (pthread_mutex_lock(&sh->lock) == EOWNERDEAD) pthread_mutex_consistent(&sh->lock);
+}
+
+/* Add the counters of t to sum, and its gauges too if gauges is nonzero. */
+static void add_totals(SRV_Totals *sum, const SRV_Totals *t, int gauges)
+{
+    MET_add(&sum->requests, &t->requests);
+    sum->connections += t->connections;
+    sum->cache.hits += t->cache.hits;
+    sum->cache.misses += t->cache.misses;
+    sum->cache.insertions += t->cache.insertions;
+    sum->cache.evictions += t->cache.evictions;
+    sum->maps.loads += t->maps.loads;
+    sum->maps.load_failures += t->maps.load_failures;
+    sum->maps.evictions += t->maps.evictions;
+    if (!gauges) return;
+    sum->open += t->open;
+    sum->cache.entries += t->cache.entries;
+    sum->cache.capacity += t->cache.capacity;
+    sum->maps.loaded += t->maps.loaded;
+    sum->maps.bytes += t->maps.bytes;
+}
+
+/* Get the counters of this process. */
+static void get_totals(SRV_State *st, SRV_Totals *t)
+{
+    memset(t, 0, sizeof(*t));
+    MET_collect(&st->metrics, &t->requests, &t->connections, &t->open);
+    CACHE_get_stats(st->cache, &t->cache);
+    CAT_get_stats(st->catalog, &t->maps);
+}
+
+/* In a worker process, take a free slot for its counters. */
+static void claim_slot(SRV_State *st)
+{
+    SRV_Shared *sh = st->shared;
+    st->slot = -1;
+    lock_shared(sh);
+    for (int i = 0; i < sh->num_slots && st->slot < 0; i++) {
+        if (sh->slots[i].pid == 0) {
+            memset(&sh->slots[i], 0, sizeof(SRV_Totals));
+            sh->slots[i].pid = getpid();
+            st->slot = i;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (st->slot < 0) debug("DEBUG: claim_slot - no slot for worker %d.\n", (int)getpid());
+}
+
+/* In a worker process, publish its counters for the others to add up. */
+static void publish(SRV_State *st)
+{
+    if (!st->shared || st->slot < 0) return;
+    SRV_Totals t;
+    get_totals(st, &t);
+    t.pid = getpid();
+    lock_shared(st->shared);
+    st->shared->slots[st->slot] = t;
+    pthread_mutex_unlock(&st->shared->lock);
+}
+
+/* In the supervisor, fold the counters of an exited worker into retired. */
+static void retire_slot(SRV_Shared *sh, pid_t pid)
+{
+    lock_shared(sh);
+    for (int i = 0; i < sh->num_slots; i++) {
+        if (sh->slots[i].pid == pid) {
+            add_totals(&sh->retired, &sh->slots[i], 0);
+            sh->slots[i].pid = 0;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * Get the counters of the server: those of this process, plus with worker
+ * processes those the others last published and those of exited workers.
+ * The cache generation and the named map budget are this process's.
+ */
+static void collect_totals(SRV_State *st, SRV_Totals *sum)
+{
+    SRV_Totals own;
+    get_totals(st, &own);
+    if (!st->shared) {
+        *sum = own;
+        return;
+    }
+    SRV_Shared *sh = st->shared;
+    lock_shared(sh);
+    if (st->slot >= 0) {
+        own.pid = getpid();
+        sh->slots[st->slot] = own;
+    }
+    *sum = sh->retired;
+    for (int i = 0; i < sh->num_slots; i++) {
+        if (sh->slots[i].pid) add_totals(sum, &sh->slots[i], 1);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (st->slot < 0) add_totals(sum, &own, 1);
+    sum->cache.generation = own.cache.generation;
+    sum->maps.maps = own.maps.maps;
+    sum->maps.budget = own.maps.budget;
+}
+
+/**
+ * @brief Format the statistics of the response cache.
+ */
+static CACHE_Value *cache_stats(SRV_State *st, OUT_Buffer *out)
+{
+    SRV_Totals t;
+    collect_totals(st, &t);
+    CACHE_Stats cs = t.cache;
+    uint64_t lookups = cs.hits + cs.misses;
+
+    out->len = 0;
+    OUT_put_str(out, "hits: ");
+    OUT_put_int64(out, (int64_t)cs.hits);
+    OUT_put_str(out, "\nmisses: ");
+    OUT_put_int64(out, (int64_t)cs.misses);
+    OUT_put_str(out, "\nhit_rate: ");
+    OUT_put_fixed(out, lookups ? (int64_t)(cs.hits * 10000 / lookups) : 0, 4);
+    OUT_put_str(out, "\nentries: ");
+    OUT_put_int64(out, (int64_t)cs.entries);
+    OUT_put_str(out, "\ncapacity: ");
+    OUT_put_int64(out, (int64_t)cs.capacity);
+    OUT_put_str(out, "\nevictions: ");
+    OUT_put_int64(out, (int64_t)cs.evictions);
+    OUT_put_str(out, "\ngeneration: ");
+    OUT_put_int64(out, (int64_t)cs.generation);
+    OUT_put_str(out, "\n\n");
+    return out->err ? NULL : CACHE_new_value(out->buf, out->len);
+}
+
+/**
+ * @brief Format all server metrics in Prometheus text format.
+ */
+static CACHE_Value *server_stats(SRV_State *st, OUT_Buffer *out)
+{
+    static const char *parts[] = {"nodes", "ways", "refs", "tags", "handles", "indexes"};
+    static const char *index_names[OSM_NUM_INDEXES] = {"node_ids", "way_ids"};
+    char labels[64];
+    SRV_Totals t;
+    OSM_Map_Memory mem;
+
+    collect_totals(st, &t);
+    CACHE_Stats cs = t.cache;
+    CAT_Stats ms = t.maps;
+    uint64_t *reloads = st->shared ? &st->shared->reloads_ok : &st->reloads_ok;
+    uint64_t *failures = st->shared ? &st->shared->reloads_failed : &st->reloads_failed;
+    pthread_rwlock_rdlock(&st->map_lock);
+    int64_t load_ns = OSM_Map_get_load_ns(st->mp);
+    int64_t num_nodes = OSM_Map_get_num_nodes(st->mp);
+    int64_t num_ways = OSM_Map_get_num_ways(st->mp);
+    int64_t blobs[2];
+    OSM_Map_get_blob_counts(st->mp, &blobs[0], &blobs[1]);
+    OSM_Map_get_memory(st->mp, &mem);
+    int index_ready[OSM_NUM_INDEXES];
+    int64_t index_ns[OSM_NUM_INDEXES];
+    for (int i = 0; i < OSM_NUM_INDEXES; i++) {
+        index_ready[i] = OSM_Map_index_ready(st->mp, (OSM_Index)i);
+        index_ns[i] = OSM_Map_get_index_ns(st->mp, (OSM_Index)i);
+    }
+    pthread_rwlock_unlock(&st->map_lock);
+    size_t part_bytes[] = {mem.nodes, mem.ways, mem.refs, mem.tags, mem.handles, mem.indexes};
+
+    out->len = 0;
+    MET_put_header(out, "pbf_map_load_seconds", "gauge", "Time taken to read the served map.");
+    MET_put_sample(out, "pbf_map_load_seconds", NULL, load_ns, 9);
+    MET_put_header(out, "pbf_map_nodes", "gauge", "Nodes in the served map.");
+    MET_put_sample(out, "pbf_map_nodes", NULL, num_nodes, 0);
+    MET_put_header(out, "pbf_map_ways", "gauge", "Ways in the served map.");
+    MET_put_sample(out, "pbf_map_ways", NULL, num_ways, 0);
+    MET_put_header(out, "pbf_map_blobs", "gauge", "Data blobs of the served map, by whether they were decoded or taken from the blob cache.");
+    MET_put_sample(out, "pbf_map_blobs", "source=\"decoded\"", blobs[0], 0);
+    MET_put_sample(out, "pbf_map_blobs", "source=\"cached\"", blobs[1], 0);
+    MET_put_header(out, "pbf_map_memory_bytes", "gauge", "Heap memory held by the served map, by part.");
+    for (int i = 0; i < 6; i++) {
+        snprintf(labels, sizeof(labels), "part=\"%s\"", parts[i]);
+        MET_put_sample(out, "pbf_map_memory_bytes", labels, (int64_t)part_bytes[i], 0);
+    }
+    MET_put_header(out, "pbf_index_ready", "gauge", "Whether lookups use an index (1) or scan (0), by id column.");
+    for (int i = 0; i < OSM_NUM_INDEXES; i++) {
+        snprintf(labels, sizeof(labels), "index=\"%s\"", index_names[i]);
+        MET_put_sample(out, "pbf_index_ready", labels, index_ready[i], 0);
+    }
+    MET_put_header(out, "pbf_index_build_seconds", "gauge", "Time taken to build each index (0 if not built).");
+    for (int i = 0; i < OSM_NUM_INDEXES; i++) {
+        snprintf(labels, sizeof(labels), "index=\"%s\"", index_names[i]);
+        MET_put_sample(out, "pbf_index_build_seconds", labels, index_ns[i], 9);
+    }
+    MET_put_header(out, "pbf_reloads_total", "counter", "Map reloads, by result.");
+    MET_put_sample(out, "pbf_reloads_total", "result=\"ok\"",
+                   (int64_t)__atomic_load_n(reloads, __ATOMIC_RELAXED), 0);
+    MET_put_sample(out, "pbf_reloads_total", "result=\"error\"",
+                   (int64_t)__atomic_load_n(failures, __ATOMIC_RELAXED), 0);
+    MET_put_header(out, "pbf_named_maps", "gauge", "Named maps that can be queried.");
+    MET_put_sample(out, "pbf_named_maps", NULL, ms.maps, 0);
+    MET_put_header(out, "pbf_named_maps_loaded", "gauge", "Named maps currently loaded.");
+    MET_put_sample(out, "pbf_named_maps_loaded", NULL, ms.loaded, 0);
+    MET_put_header(out, "pbf_named_maps_memory_bytes", "gauge", "Heap memory held by loaded named maps.");
+    MET_put_sample(out, "pbf_named_maps_memory_bytes", NULL, (int64_t)ms.bytes, 0);
+    MET_put_header(out, "pbf_named_maps_budget_bytes", "gauge", "Memory budget for named maps (0: unlimited).");
+    MET_put_sample(out, "pbf_named_maps_budget_bytes", NULL, (int64_t)ms.budget, 0);
+    MET_put_header(out, "pbf_named_map_loads_total", "counter", "Named maps read, by result.");
+    MET_put_sample(out, "pbf_named_map_loads_total", "result=\"ok\"", (int64_t)ms.loads, 0);
+    MET_put_sample(out, "pbf_named_map_loads_total", "result=\"error\"", (int64_t)ms.load_failures, 0);
+    MET_put_header(out, "pbf_named_map_evictions_total", "counter", "Named maps freed to stay within the budget.");
+    MET_put_sample(out, "pbf_named_map_evictions_total", NULL, (int64_t)ms.evictions, 0);
+    MET_put_header(out, "pbf_connections_total", "counter", "Client connections accepted.");
+    MET_put_sample(out, "pbf_connections_total", NULL, (int64_t)t.connections, 0);
+    MET_put_header(out, "pbf_connections_open", "gauge", "Client connections currently open.");
+    MET_put_sample(out, "pbf_connections_open", NULL, (int64_t)t.open, 0);
+
+    MET_put_requests(out, &t.requests);
+
+    uint64_t lookups = cs.hits + cs.misses;
+    MET_put_header(out, "pbf_cache_hits_total", "counter", "Response cache hits.");
+    MET_put_sample(out, "pbf_cache_hits_total", NULL, (int64_t)cs.hits, 0);
+    MET_put_header(out, "pbf_cache_misses_total", "counter", "Response cache misses.");
+    MET_put_sample(out, "pbf_cache_misses_total", NULL, (int64_t)cs.misses, 0);
+    MET_put_header(out, "pbf_cache_evictions_total", "counter", "Responses evicted from the cache.");
+    MET_put_sample(out, "pbf_cache_evictions_total", NULL, (int64_t)cs.evictions, 0);
+    MET_put_header(out, "pbf_cache_hit_ratio", "gauge", "Fraction of cache lookups that hit.");
+    MET_put_sample(out, "pbf_cache_hit_ratio", NULL, lookups ? (int64_t)(cs.hits * 1000000 / lookups) : 0, 6);
+    MET_put_header(out, "pbf_cache_entries", "gauge", "Responses currently cached.");
+    MET_put_sample(out, "pbf_cache_entries", NULL, (int64_t)cs.entries, 0);
+    MET_put_header(out, "pbf_cache_capacity", "gauge", "Maximum number of cached responses.");
+    MET_put_sample(out, "pbf_cache_capacity", NULL, (int64_t)cs.capacity, 0);
+    OUT_put_char(out, '\n');
+    return out->err ? NULL : CACHE_new_value(out->buf, out->len);
+}
+
+/*
+ * Kind of a query request, judged from its text (the request may turn out
+ * to be invalid when parsed).
+ */
+static MET_Kind request_kind(const char *line)
+{
+    line += strspn(line, " \t");
+    if (line[0] == 'w') return MET_WAY;
+    return strchr(line, '-') ? MET_RANGE : MET_NODE;
+}
+
+/**
+ * @brief Answer one query line, from the cache if possible.
+ *
+ * A query prefixed with "@name " is answered from that named map, which is
+ * loaded if needed (a cached response does not need the map).  The map
+ * lock is not held meanwhile, so that a reload need not wait for the read;
+ * a response from a map that was invalidated on the way is not cached.
+ *
+ * @param st    Server state.
+ * @param w     Scratch space of the calling connection.
+ * @param line  The request, which is also the cache key.
+ * @param len   Length of the request.
+ * @param kind  Receives the kind of request, for the metrics.
+ * @param hit   Receives 1 if the response came from the cache, else 0.
+ * @return The response, or NULL if memory could not be allocated.
+ */
+static CACHE_Value *answer_query(SRV_State *st, SRV_Worker *w, const char *line, size_t len,
+                                 MET_Kind *kind, int *hit)
+{
+    const char *query = line;
+    int index = -1;
+    if (line[0] == '@') {
+        size_t name_len = strcspn(line + 1, " \t");
+        index = CAT_find(st->catalog, line + 1, name_len);
+        if (index < 0) {
+            *kind = MET_INVALID;
+            return text_response("ERROR unknown map\n\n");
+        }
+        query = line + 1 + name_len;
+    }
+    *kind = request_kind(query);
+    pthread_rwlock_rdlock(&st->map_lock);
+    uint64_t gen = CACHE_generation(st->cache);
+    CACHE_Value *v = CACHE_lookup(st->cache, line, len);
+    *hit = (v != NULL);
+    if (v || index >= 0) pthread_rwlock_unlock(&st->map_lock);
+    if (v) return v;
+
+    char *keys[QRY_MAX_KEYS];
+    size_t num_keys;
+    memcpy(w->line, query, len - (query - line) + 1);
+    w->ql.num = 0;
+    w->out.len = 0;
+    if (QRY_parse_line(&w->ql, w->line, keys, &num_keys) < 0) {
+        if (index < 0) pthread_rwlock_unlock(&st->map_lock);
+        *kind = MET_INVALID;
+        return text_response("ERROR invalid query\n\n");
+    }
+    CAT_Map *named = NULL;
+    if (index >= 0 && !(named = CAT_acquire(st->catalog, index))) {
+        return text_response("ERROR map could not be loaded\n\n");
+    }
+    OSM_Map *mp = named ? named->mp : st->mp;
+    for (size_t i = 0; i < w->ql.num; i++) {
+        QRY_answer(&w->out, mp, &w->ql.queries[i]);
+    }
+    CAT_release(st->catalog, named);
+    OUT_put_char(&w->out, '\n');
+    // The insert must not overlap the invalidation of the cache by a reload.
+    if (named) pthread_rwlock_rdlock(&st->map_lock);
+    if (!w->out.err) {
+        v = CACHE_new_value(w->out.buf, w->out.len);
+        CACHE_insert(st->cache, line, len, gen, v);
+    }
+    pthread_rwlock_unlock(&st->map_lock);
+    return v;
+}
+
+/**
+ * @brief Send all pending responses with writev(2), then release them.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int send_pending(int fd, SRV_Pending *p)
+{
+    struct iovec iov[SRV_MAX_IOV];
+    for (int i = 0; i < p->n; i++) {
+        iov[i].iov_base = p->vals[i]->data;
+        iov[i].iov_len = p->vals[i]->len;
+    }
+
+    int rc = 0;
+    int first = 0;
+    while (first < p->n) {
+        ssize_t n = writev(fd, &iov[first], p->n - first);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        // Skip what was written; a partially written response stays first.
+        while (first < p->n && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < p->n) {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+
+    for (int i = 0; i < p->n; i++) CACHE_release(p->vals[i]);
+    p->n = 0;
+    return rc;
+}
+
+/* Queue a response, sending the queue first if it is full. */
+static int queue_response(int fd, SRV_Pending *p, CACHE_Value *v)
+{
+    if (!v) return -1;
+    if (p->n == SRV_MAX_IOV && send_pending(fd, p) < 0) {
+        CACHE_release(v);
+        return -1;
+    }
+    p->vals[p->n++] = v;
+    return 0;
+}
+
+/**
+ * @brief Serve one connection until the client closes it or sends QUIT.
+ *
+ * All complete request lines that arrive together are answered before any
+ * response is sent, and their responses then go out in one writev(2).
+ */
+static void *serve_connection(void *arg)
+{
+    SRV_Conn *c = arg;
+    SRV_State *st = c->st;
+    SRV_Worker w = {{0}};
+    SRV_Pending pending = {{0}};
+    char *buf = malloc(SRV_MAX_LINE);
+    w.line = malloc(SRV_MAX_LINE);
+    w.counters = MET_register(&st->metrics);
+    int ok = (buf && w.line && OUT_init(&w.out, -1, 4096) == 0);
+    size_t have = 0;
+
+    while (ok) {
+        ssize_t n = read(c->fd, buf + have, SRV_MAX_LINE - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += (size_t)n;
+
+        char *p = buf, *nl;
+        while (ok && (nl = memchr(p, '\n', buf + have - p))) {
+            *nl = '\0';
+            size_t len = nl - p;
+            if (len > 0 && p[len - 1] == '\r') p[--len] = '\0';
+
+            uint64_t t0 = MET_now_ns();
+            MET_Kind kind = MET_COMMAND;
+            int hit = 0;
+            CACHE_Value *v;
+            if (strcmp(p, "QUIT") == 0) {
+                ok = 0;
+                break;
+            } else if (strcmp(p, "RELOAD") == 0) v = reload_map(st);
+            else if (strcmp(p, "CACHE") == 0) v = cache_stats(st, &w.out);
+            else if (strcmp(p, "STATS") == 0) v = server_stats(st, &w.out);
+            else v = answer_query(st, &w, p, len, &kind, &hit);
+            MET_record(w.counters, kind, MET_now_ns() - t0, hit);
+            ok = (queue_response(c->fd, &pending, v) == 0);
+            p = nl + 1;
+        }
+        if (send_pending(c->fd, &pending) < 0) break;
+
+        have = buf + have - p;
+        memmove(buf, p, have);
+        if (have == SRV_MAX_LINE) {
+            queue_response(c->fd, &pending, text_response("ERROR request too long\n\n"));
+            send_pending(c->fd, &pending);
+            break;
+        }
+    }
+    send_pending(c->fd, &pending);
+
+    free(buf);
+    free(w.line);
+    QRY_free_list(&w.ql);
+    OUT_fini(&w.out);
+    MET_unregister(&st->metrics, w.counters);
+
+    pthread_mutex_lock(&st->conn_lock);
+    close(c->fd);
+    if (c->prev) c->prev->next = c->next;
+    else st->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    pthread_cond_broadcast(&st->conn_closed);
+    pthread_mutex_unlock(&st->conn_lock);
+    free(c);
+    return NULL;
+}
+
+/**
+ * @brief Create a listening UNIX socket.  A stale socket left at the same
+ * path by an earlier server is removed first.
+ * @return The socket, or -1 on error.
+ */
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: Socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat sb;
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "ERROR: Cannot listen on '%s'.\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Install the signal handlers.  No SA_RESTART, so that a signal interrupts
+ * the wait for connections or for workers. */
+static void install_signals(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * @brief Accept and serve connections until SIGINT or SIGTERM.
+ *
+ * This runs in the only server process, or in each worker process.  The
+ * cache and the counters are created here, so that in a worker they live
+ * in memory of its own; a worker publishes its counters to the shared slots
+ * as it goes.  The map is not freed.
+ *
+ * @return 0 after a clean stop, -1 if the cache could not be created.
+ */
+static int serve(SRV_State *st, int lfd)
+{
+    st->cache = CACHE_create(st->cfg->cache_size, SRV_CACHE_SHARDS);
+    if (st->cfg->cache_size > 0 && !st->cache) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return -1;
+    }
+    pthread_rwlock_init(&st->map_lock, NULL);
+    pthread_mutex_init(&st->reload_lock, NULL);
+    pthread_mutex_init(&st->conn_lock, NULL);
+    pthread_cond_init(&st->conn_closed, NULL);
+    MET_init(&st->metrics);
+    if (!st->supervisor) start_indexer(st);
+    if (st->shared) claim_slot(st);
+
+    while (!stop_requested) {
+        if (reload_requested) {
+            reload_requested = 0;
+            CACHE_release(reload_map(st));
+        }
+        publish(st);
+        struct pollfd pfd = {lfd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) continue;
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) continue;
+
+        SRV_Conn *c = calloc(1, sizeof(SRV_Conn));
+        if (!c) {
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        c->st = st;
+        pthread_mutex_lock(&st->conn_lock);
+        c->next = st->conns;
+        if (st->conns) st->conns->prev = c;
+        st->conns = c;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, serve_connection, c) == 0) {
+            pthread_detach(tid);
+        } else {
+            st->conns = c->next;
+            if (st->conns) st->conns->prev = NULL;
+            close(cfd);
+            free(c);
+        }
+        pthread_mutex_unlock(&st->conn_lock);
+    }
+
+    // Wake connection threads blocked in read(2), and let them send the
+    // responses to requests already read.  Connections still open after
+    // SRV_DRAIN_SECS (clients not reading) are cut off.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SRV_DRAIN_SECS;
+    pthread_mutex_lock(&st->conn_lock);
+    for (SRV_Conn *c = st->conns; c; c = c->next) shutdown(c->fd, SHUT_RD);
+    while (st->conns) {
+        if (pthread_cond_timedwait(&st->conn_closed, &st->conn_lock, &deadline) == ETIMEDOUT) {
+            for (SRV_Conn *c = st->conns; c; c = c->next) shutdown(c->fd, SHUT_RDWR);
+            deadline.tv_sec += 3600;
+        }
+    }
+    pthread_mutex_unlock(&st->conn_lock);
+
+    stop_indexer(st, st->mp);
+    publish(st);
+    CACHE_destroy(st->cache);
+    st->cache = NULL;
+    pthread_rwlock_destroy(&st->map_lock);
+    pthread_mutex_destroy(&st->reload_lock);
+    pthread_mutex_destroy(&st->conn_lock);
+    pthread_cond_destroy(&st->conn_closed);
+    MET_fini(&st->metrics);
+    return 0;
+}
+
+/**
+ * @brief Fork a worker process that serves connections on the shared socket.
+ * @return The worker's pid, or -1 if it could not be created.
+ */
+static pid_t spawn_worker(SRV_State *st, int lfd)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        st->supervisor = getppid();
+        st->indexer_running = 0;    // The supervisor's indexer is not in this process
+        int rc = serve(st, lfd);
+        // The map belongs to the supervisor.  Freeing it here would only
+        // write to (and so copy) the pages this worker shares with it.
+        _exit(rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (pid < 0) fprintf(stderr, "ERROR: Cannot fork a server worker.\n");
+    else debug("DEBUG: spawn_worker - started worker %d.\n", (int)pid);
+    return pid;
+}
+
+/* Replace every worker, starting each new one before stopping the old one. */
+static void roll_workers(SRV_State *st, int lfd, pid_t *pids, int n)
+{
+    for (int i = 0; i < n; i++) {
+        pid_t old_pid = pids[i];
+        pids[i] = spawn_worker(st, lfd);
+        if (old_pid > 0) kill(old_pid, SIGTERM);
+    }
+}
+
+/**
+ * @brief Run a pool of worker processes until SIGINT or SIGTERM.
+ *
+ * The workers are forked after the map has been loaded, so they share its
+ * pages copy-on-write; the map is never written after loading, so no page
+ * is ever copied.  All workers accept connections on the one listening
+ * socket they inherit.  Workers that exit are replaced.  On SIGHUP (which
+ * workers send on RELOAD) the map is reloaded here and a new set of
+ * workers is started before the old ones are told to stop.
+ *
+ * Each worker has its own cache and counters.  The workers publish their
+ * counters in memory shared with the others, so that CACHE and STATS report
+ * the sums over all workers, whichever worker answers them.
+ *
+ * Workers start on a map without indexes, and answer lookups by scanning.
+ * Meanwhile the indexes are built by a thread of this process, while it
+ * goes on reaping workers and handling reloads.  Once they are ready the
+ * workers are replaced by ones that share the indexes too.
+ *
+ * @return 0 after a clean stop, -1 if memory could not be allocated.
+ */
+static int supervise(SRV_State *st, int lfd)
+{
+    int n = st->cfg->workers;
+    pid_t *pids = calloc(n, sizeof(pid_t));
+    st->shared = create_shared(SRV_SLOTS_PER_WORKER * n);
+    if (!pids || !st->shared) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        free(pids);
+        if (st->shared) destroy_shared(st->shared);
+        st->shared = NULL;
+        return -1;
+    }
+
+    while (!stop_requested) {
+        if (reload_requested) {
+            reload_requested = 0;
+            OSM_Map *mp = load_map(st->cfg->map_file);
+            if (mp) {
+                OSM_Map *old = st->mp;
+                st->mp = mp;
+                __atomic_add_fetch(&st->shared->reloads_ok, 1, __ATOMIC_RELAXED);
+                roll_workers(st, lfd, pids, n);
+                stop_indexer(st, old);
+                OSM_free_Map(old);
+            } else {
+                __atomic_add_fetch(&st->shared->reloads_failed, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        // Reap workers that have exited, then start replacements (at most
+        // once per second, in case they keep failing).
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (int i = 0; i < n; i++) {
+                if (pids[i] == pid) pids[i] = 0;
+            }
+            retire_slot(st->shared, pid);
+        }
+        for (int i = 0; i < n; i++) {
+            if (pids[i] <= 0) pids[i] = spawn_worker(st, lfd);
+        }
+
+        // An indexer that failed is left alone until the next reload; its
+        // workers go on scanning.
+        if (!st->indexer_running) {
+            start_indexer(st);
+        } else if (indexes_ready(st->mp)) {
+            pthread_join(st->indexer, NULL);
+            st->indexer_running = 0;
+            roll_workers(st, lfd, pids, n);
+        }
+        poll(NULL, 0, 1000);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    stop_indexer(st, st->mp);
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+    free(pids);
+    destroy_shared(st->shared);
+    st->shared = NULL;
+    return 0;
+}
+
+/**
+ * @brief Serve queries on a UNIX socket until SIGINT or SIGTERM.
+ *
+ * The server takes ownership of the map, which is freed (or replaced, on
+ * reload) by the server, and of the catalog of named maps, if any.  With cfg->workers > 0, queries are answered by
+ * that many forked worker processes sharing the map; otherwise by threads
+ * of this process.
+ *
+ * @param cfg  Server configuration.
+ * @param mp   The map to serve.
+ * @return 0 after a clean shutdown, -1 if the server could not be started.
+ */
+int SRV_run(const SRV_Config *cfg, OSM_Map *mp)
+{
+    SRV_State st;
+    memset(&st, 0, sizeof(st));
+    st.cfg = cfg;
+    st.mp = mp;
+    st.catalog = cfg->catalog;
+    OSM_Map_compact(mp);
+
+    int lfd = open_socket(cfg->socket_path);
+    if (lfd < 0) {
+        OSM_free_Map(mp);
+        CAT_destroy(st.catalog);
+        return -1;
+    }
+    install_signals();
+    debug("DEBUG: SRV_run - listening on '%s'.\n", cfg->socket_path);
+
+    int rc = (cfg->workers > 0) ? supervise(&st, lfd) : serve(&st, lfd);
+    debug("DEBUG: SRV_run - stopped.\n");
+
+    close(lfd);
+    unlink(cfg->socket_path);
+    OSM_free_Map(st.mp);
+    CAT_destroy(st.catalog);
+    return rc;
+}
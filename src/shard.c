@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "shard.h"
+#include "pbf.h"
+#include "parallel.h"
+#include "debug.h"
+
+#define SHD_DIGIT_BITS 8
+#define SHD_DIGITS (1 << SHD_DIGIT_BITS)
+
+/* Ranges of fewer points are split on one thread. */
+#define SHD_PARALLEL_MIN 65536
+
+typedef struct {
+    int64_t key[2];             // Latitude and longitude, in nanodegrees
+    int64_t row;                // Position of the node in the file
+} SHD_Point;
+
+/* State of the parallel passes over the range of points being split. */
+typedef struct {
+    SHD_Point *pts;
+    SHD_Point *out;
+    int axis;                   // Key cut on
+    int64_t min;                // Least key on the axis
+    int shift;                  // Position of the digit counted
+    uint64_t prefix;            // Higher digits of the keys still selected
+    uint64_t cut;               // Key, less min, at which the range is cut
+    int64_t *bounds;            // Per worker: least and greatest latitude and longitude
+    int64_t *hist;              // Per worker: SHD_DIGITS counts
+    int64_t *below;             // Per worker: keys below the cut, then where its left part goes
+    int64_t *equal;             // Per worker: keys at the cut
+    int64_t *left;              // Per worker: keys at the cut to put left
+    int64_t *right;             // Per worker: points, then where its right part goes
+} SHD_Job;
+
+/* The shard of an id. */
+typedef struct {
+    OSM_Id id;
+    int shard;
+} SHD_Entry;
+
+typedef struct {
+    SHD_Entry *entries;
+    int64_t num;
+    int64_t cap;
+} SHD_Table;
+
+static void bounds_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    SHD_Job *job = arg;
+    int64_t *b = &job->bounds[4 * worker];
+    b[0] = b[2] = INT64_MAX;
+    b[1] = b[3] = INT64_MIN;
+    for (int64_t i = begin; i < end; i++) {
+        const int64_t *k = job->pts[i].key;
+        if (k[0] < b[0]) b[0] = k[0];
+        if (k[0] > b[1]) b[1] = k[0];
+        if (k[1] < b[2]) b[2] = k[1];
+        if (k[1] > b[3]) b[3] = k[1];
+    }
+}
+
+static void hist_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    SHD_Job *job = arg;
+    int64_t *h = &job->hist[(size_t)worker * SHD_DIGITS];
+    int high = job->shift + SHD_DIGIT_BITS;
+    memset(h, 0, SHD_DIGITS * sizeof(int64_t));
+    for (int64_t i = begin; i < end; i++) {
+        uint64_t u = (uint64_t)(job->pts[i].key[job->axis] - job->min);
+        if (high < 64 && (u >> high) != job->prefix) continue;
+        h[(u >> job->shift) & (SHD_DIGITS - 1)]++;
+    }
+}
+
+static void count_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    SHD_Job *job = arg;
+    int64_t below = 0, equal = 0;
+    for (int64_t i = begin; i < end; i++) {
+        uint64_t u = (uint64_t)(job->pts[i].key[job->axis] - job->min);
+        below += u < job->cut;
+        equal += u == job->cut;
+    }
+    job->below[worker] = below;
+    job->equal[worker] = equal;
+    job->right[worker] = end - begin;
+}
+
+static void scatter_task(void *arg, int worker, int64_t begin, int64_t end)
+{
+    SHD_Job *job = arg;
+    int64_t l = job->below[worker], r = job->right[worker], take = job->left[worker];
+    for (int64_t i = begin; i < end; i++) {
+        uint64_t u = (uint64_t)(job->pts[i].key[job->axis] - job->min);
+        if (u < job->cut || (u == job->cut && take-- > 0)) job->out[l++] = job->pts[i];
+        else job->out[r++] = job->pts[i];
+    }
+}
+
+/*
+ * Rearrange n points, stably, so that the first m, with 0 < m < n, have the
+ * least keys on job->axis, which range from min to max.  The key of rank m
+ * is selected a digit at a time, from histograms of the keys that agree
+ * with it on the digits above; tmp receives the partition.
+ */
+static int cut_points(SHD_Job *job, SHD_Point *pts, SHD_Point *tmp, int64_t n, int64_t m, int64_t min,
+                      int64_t max, int nthreads)
+{
+    uint64_t range = (uint64_t)(max - min);
+    int bits = 0;
+    while (bits < 64 && (range >> bits)) bits++;
+    job->pts = pts;
+    job->out = tmp;
+    job->min = min;
+    job->shift = bits ? ((bits - 1) / SHD_DIGIT_BITS) * SHD_DIGIT_BITS : 0;
+    job->prefix = 0;
+
+    // rank is the number of keys still selected that go left; it is less
+    // than the number selected, so the digit below is always found.
+    int64_t rank = m;
+    for (;;) {
+        int used = PAR_for(n, nthreads, hist_task, job);
+        if (used < 0) return -1;
+        int64_t below = 0;
+        int d;
+        for (d = 0; d < SHD_DIGITS - 1; d++) {
+            int64_t c = 0;
+            for (int w = 0; w < used; w++) c += job->hist[(size_t)w * SHD_DIGITS + d];
+            if (below + c > rank) break;
+            below += c;
+        }
+        rank -= below;
+        job->prefix = (job->prefix << SHD_DIGIT_BITS) | d;
+        if (job->shift == 0) break;
+        job->shift -= SHD_DIGIT_BITS;
+    }
+    job->cut = job->prefix;
+
+    // Of the keys at the cut, the first rank go left.
+    int used = PAR_for(n, nthreads, count_task, job);
+    if (used < 0) return -1;
+    int64_t l = 0, r = m;
+    for (int w = 0; w < used; w++) {
+        int64_t below = job->below[w], size = job->right[w];
+        int64_t take = job->equal[w] < rank ? job->equal[w] : rank;
+        rank -= take;
+        job->left[w] = take;
+        job->below[w] = l;
+        job->right[w] = r;
+        l += below + take;
+        r += size - below - take;
+    }
+    if (PAR_for(n, nthreads, scatter_task, job) < 0) return -1;
+    memcpy(pts, tmp, n * sizeof(SHD_Point));
+    return 0;
+}
+
+/*
+ * Split n points into the k shards from first on, recording the shard of
+ * each in the node table, indexed by row, and the bounds of each shard.
+ */
+static int split(SHD_Job *job, SHD_Point *pts, SHD_Point *tmp, int64_t n, int first, int k, int nthreads,
+                 SHD_Shard *shards, SHD_Table *nodes)
+{
+    int nt = (n >= SHD_PARALLEL_MIN) ? nthreads : 1;
+    int64_t b[4] = {0};
+    job->pts = pts;
+    int used = PAR_for(n, nt, bounds_task, job);
+    if (used < 0) return -1;
+    for (int w = 0; w < used; w++) {
+        const int64_t *wb = &job->bounds[4 * w];
+        if (w == 0 || wb[0] < b[0]) b[0] = wb[0];
+        if (w == 0 || wb[1] > b[1]) b[1] = wb[1];
+        if (w == 0 || wb[2] < b[2]) b[2] = wb[2];
+        if (w == 0 || wb[3] > b[3]) b[3] = wb[3];
+    }
+    if (k == 1) {
+        SHD_Shard *s = &shards[first];
+        s->nodes = n;
+        s->min_lat = b[0];
+        s->max_lat = b[1];
+        s->min_lon = b[2];
+        s->max_lon = b[3];
+        for (int64_t i = 0; i < n; i++) nodes->entries[pts[i].row].shard = first;
+        return 0;
+    }
+
+    int k1 = k / 2;
+    int64_t m = n * k1 / k;
+    if (m > 0 && m < n) {
+        double mid = (b[0] + b[1]) / 2e9 * M_PI / 180;
+        job->axis = (b[3] - b[2]) * cos(mid) > (double)(b[1] - b[0]);
+        if (cut_points(job, pts, tmp, n, m, b[2 * job->axis], b[2 * job->axis + 1], nt) < 0) return -1;
+    }
+    if (split(job, pts, tmp, m, first, k1, nthreads, shards, nodes) < 0) return -1;
+    return split(job, pts + m, tmp + m, n - m, first + k1, k - k1, nthreads, shards, nodes);
+}
+
+static int push_entry(SHD_Table *t, OSM_Id id, int shard)
+{
+    if (t->num == t->cap) {
+        int64_t cap = t->cap ? 2 * t->cap : 65536;
+        SHD_Entry *e = realloc(t->entries, cap * sizeof(SHD_Entry));
+        if (!e) return -1;
+        t->entries = e;
+        t->cap = cap;
+    }
+    SHD_Entry e = {id, shard};
+    t->entries[t->num++] = e;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const SHD_Entry *x = a, *y = b;
+    if (x->id != y->id) return x->id < y->id ? -1 : 1;
+    return x->shard - y->shard;
+}
+
+/* Sort a table by id, unless it is sorted already, and drop duplicates. */
+static void sort_table(SHD_Table *t)
+{
+    int64_t i = 1, j = 0;
+    while (i < t->num && compare_entries(&t->entries[i - 1], &t->entries[i]) <= 0) i++;
+    if (i < t->num) qsort(t->entries, t->num, sizeof(SHD_Entry), compare_entries);
+    for (i = 0; i < t->num; i++) {
+        if (j == 0 || compare_entries(&t->entries[j - 1], &t->entries[i]) != 0) t->entries[j++] = t->entries[i];
+    }
+    t->num = j;
+}
+
+/* Index of the first entry of a sorted table with an id not below id. */
+static int64_t find_entry(const SHD_Table *t, OSM_Id id)
+{
+    int64_t lo = 0, hi = t->num;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (t->entries[mid].id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* The shard of an id in a sorted table, or -1 if it is not there. */
+static int find_shard(const SHD_Table *t, OSM_Id id)
+{
+    int64_t i = find_entry(t, id);
+    return (i < t->num && t->entries[i].id == id) ? t->entries[i].shard : -1;
+}
+
+/* The shard of a way: that of its first node in the file, or else 0. */
+static int way_shard(const SHD_Table *nodes, const PBF_Entity *e)
+{
+    for (int i = 0; i < e->num_refs; i++) {
+        int s = find_shard(nodes, e->refs[i]);
+        if (s >= 0) return s;
+    }
+    return 0;
+}
+
+/* The shard of a relation: that of its first node or way member in the
+ * file, or else 0. */
+static int relation_shard(const SHD_Table *nodes, const SHD_Table *ways, const PBF_Entity *e)
+{
+    for (int i = 0; i < e->num_members; i++) {
+        const PBF_Member *m = &e->members[i];
+        int s = (m->type == PBF_NODE) ? find_shard(nodes, m->id) : (m->type == PBF_WAY) ? find_shard(ways, m->id) : -1;
+        if (s >= 0) return s;
+    }
+    return 0;
+}
+
+/* Read the nodes of the file into the node table and the points. */
+static int read_nodes(FILE *in, SHD_Table *nodes, SHD_Point **ptsp)
+{
+    PBF_Reader *r = PBF_open_with(in, PBF_READ_AHEAD);
+    if (!r) return -1;
+    SHD_Point *pts = NULL;
+    const PBF_Entity *e;
+    int next;
+    while ((next = PBF_next(r, &e)) > 0) {
+        if (e->type != PBF_NODE) continue;
+        // The points grow with the table, just before it does.
+        if (nodes->num == nodes->cap) {
+            SHD_Point *p = realloc(pts, (nodes->cap ? 2 * nodes->cap : 65536) * sizeof(SHD_Point));
+            if (!p) break;
+            pts = p;
+        }
+        SHD_Point p = {{e->lat, e->lon}, nodes->num};
+        pts[nodes->num] = p;
+        if (push_entry(nodes, e->id, 0) < 0) break;
+    }
+    PBF_close(r);
+    *ptsp = pts;
+    if (next > 0) fprintf(stderr, "ERROR: SHD_shard - out of memory.\n");
+    return next == 0 ? 0 : -1;
+}
+
+/* Assign the ways to shards, and list the nodes they need copied. */
+static int read_ways(FILE *in, const SHD_Table *nodes, SHD_Table *ways, SHD_Table *copies)
+{
+    PBF_Reader *r = PBF_open_with(in, PBF_READ_AHEAD);
+    if (!r) return -1;
+    const PBF_Entity *e;
+    int next, rc = 0;
+    while (rc == 0 && (next = PBF_next(r, &e)) > 0) {
+        if (e->type != PBF_WAY) continue;
+        int s = way_shard(nodes, e);
+        rc = push_entry(ways, e->id, s);
+        for (int i = 0; rc == 0 && i < e->num_refs; i++) {
+            int h = find_shard(nodes, e->refs[i]);
+            if (h >= 0 && h != s) rc = push_entry(copies, e->refs[i], s);
+        }
+    }
+    PBF_close(r);
+    if (rc < 0) fprintf(stderr, "ERROR: SHD_shard - out of memory.\n");
+    return (rc == 0 && next == 0) ? 0 : -1;
+}
+
+/* Write every entity to its shard, and nodes also where they are copied. */
+static int write_shards(FILE *in, FILE **outs, int num_shards, SHD_Shard *shards, const SHD_Table *nodes,
+                        const SHD_Table *ways, const SHD_Table *copies)
+{
+    PBF_Writer **ws = calloc(num_shards, sizeof(PBF_Writer *));
+    PBF_Reader *r = PBF_open_with(in, PBF_READ_AHEAD);
+    int rc = (ws && r) ? 0 : -1, next = -1;
+    for (int s = 0; rc == 0 && s < num_shards; s++) {
+        PBF_Header hdr = *PBF_get_header(r);
+        hdr.has_bbox = shards[s].nodes > 0;
+        hdr.min_lat = shards[s].min_lat;
+        hdr.max_lat = shards[s].max_lat;
+        hdr.min_lon = shards[s].min_lon;
+        hdr.max_lon = shards[s].max_lon;
+        if (!(ws[s] = PBF_create(outs[s], &hdr))) rc = -1;
+    }
+    const PBF_Entity *e;
+    while (rc == 0 && (next = PBF_next(r, &e)) > 0) {
+        if (e->type == PBF_NODE) {
+            rc = PBF_write(ws[find_shard(nodes, e->id)], e);
+            for (int64_t i = find_entry(copies, e->id); rc == 0 && i < copies->num && copies->entries[i].id == e->id; i++) {
+                rc = PBF_write(ws[copies->entries[i].shard], e);
+                shards[copies->entries[i].shard].copies++;
+            }
+        } else if (e->type == PBF_WAY) {
+            int s = find_shard(ways, e->id);
+            rc = PBF_write(ws[s], e);
+            shards[s].ways++;
+        } else {
+            int s = relation_shard(nodes, ways, e);
+            rc = PBF_write(ws[s], e);
+            shards[s].relations++;
+        }
+    }
+    if (next < 0) rc = -1;
+    for (int s = 0; ws && s < num_shards; s++) {
+        if (ws[s] && PBF_finish(ws[s]) < 0) rc = -1;
+    }
+    if (r) PBF_close(r);
+    free(ws);
+    return rc;
+}
+
+/**
+ * @brief Split a PBF file into spatially balanced shards.
+ *
+ * @param in          The file, positioned at its start.  It is read three
+ *                    times, so it must be seekable.
+ * @param outs        The num_shards files the shards are written to.
+ * @param num_shards  Number of shards, from 1 to SHD_MAX_SHARDS.
+ * @param nthreads    Threads used to split the nodes (0 for one per CPU).
+ * @param shards      Receives the counts and bounds of each shard.
+ * @return 0 on success, -1 on error.
+ */
+int SHD_shard(FILE *in, FILE **outs, int num_shards, int nthreads, SHD_Shard *shards)
+{
+    SHD_Table nodes = {0}, ways = {0}, copies = {0};
+    SHD_Point *pts = NULL, *tmp = NULL;
+    SHD_Job job = {0};
+    int rc = -1;
+    memset(shards, 0, num_shards * sizeof(SHD_Shard));
+    nthreads = PAR_num_threads(nthreads);
+
+    if (read_nodes(in, &nodes, &pts) < 0) goto done;
+    tmp = malloc((nodes.num ? nodes.num : 1) * sizeof(SHD_Point));
+    job.bounds = malloc(4 * nthreads * sizeof(int64_t));
+    job.hist = malloc((size_t)nthreads * SHD_DIGITS * sizeof(int64_t));
+    job.below = malloc(nthreads * sizeof(int64_t));
+    job.equal = malloc(nthreads * sizeof(int64_t));
+    job.left = malloc(nthreads * sizeof(int64_t));
+    job.right = malloc(nthreads * sizeof(int64_t));
+    if (!tmp || !job.bounds || !job.hist || !job.below || !job.equal || !job.left || !job.right ||
+        split(&job, pts, tmp, nodes.num, 0, num_shards, nthreads, shards, &nodes) < 0) {
+        fprintf(stderr, "ERROR: SHD_shard - out of memory.\n");
+        goto done;
+    }
+    free(pts);
+    free(tmp);
+    pts = tmp = NULL;
+    sort_table(&nodes);
+    debug("DEBUG: SHD_shard - %lld nodes split into %d shards.\n", (long long)nodes.num, num_shards);
+
+    if (fseeko(in, 0, SEEK_SET) < 0 || read_ways(in, &nodes, &ways, &copies) < 0) goto done;
+    sort_table(&ways);
+    sort_table(&copies);
+    if (fseeko(in, 0, SEEK_SET) < 0 || write_shards(in, outs, num_shards, shards, &nodes, &ways, &copies) < 0)
+        goto done;
+    rc = 0;
+
+done:
+    if (rc < 0) fprintf(stderr, "ERROR: SHD_shard - cannot shard the file.\n");
+    free(nodes.entries);
+    free(ways.entries);
+    free(copies.entries);
+    free(pts);
+    free(tmp);
+    free(job.bounds);
+    free(job.hist);
+    free(job.below);
+    free(job.equal);
+    free(job.left);
+    free(job.right);
+    return rc;
+}
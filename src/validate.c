@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <arpa/inet.h>  // for ntohl()
+#include "validate.h"
+#include "pbf.h"
+#include "parallel.h"
+#include "debug.h"
+
+/* Field numbers up to which fields are tallied. */
+#define VAL_FIELDS 32
+
+/* Largest uncompressed block allowed by the file format. */
+#define VAL_MAX_BLOCK (32 << 20)
+
+/* The bytes of a message, or the part of them not read yet. */
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} VAL_Wire;
+
+/* One field of a message. */
+typedef struct {
+    int num;
+    int wire;
+    uint64_t value;             // Varint fields
+    VAL_Wire sub;               // Length-delimited fields
+} VAL_Field;
+
+/* Number of values of each field of a message, packed or not, and the
+ * largest value and the number of zeros among the varints. */
+typedef struct {
+    uint64_t count[VAL_FIELDS];
+    uint64_t max[VAL_FIELDS];
+    uint64_t zeros[VAL_FIELDS];
+} VAL_Tally;
+
+/* Entities counted by a worker. */
+typedef struct {
+    int64_t nodes;
+    int64_t ways;
+    int64_t relations;
+} VAL_Counts;
+
+/* State shared by the workers. */
+typedef struct {
+    int fd;
+    const PBF_Blob *blobs;
+    int64_t num;
+    int64_t next;               // Next blob to check
+    int64_t bad;                // Index of the first bad blob found, num if none
+    const char *reason;
+    int64_t bytes;
+    VAL_Counts counts;
+    pthread_mutex_t lock;
+} VAL_State;
+
+static int read_varint(VAL_Wire *w, uint64_t *v)
+{
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && w->p < w->end; shift += 7) {
+        uint8_t b = *w->p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Read the next field.  Returns 1 if one was read, 0 at the end of the
+ * message, -1 if the message is malformed. */
+static int next_field(VAL_Wire *w, VAL_Field *f)
+{
+    uint64_t key, len;
+    if (w->p == w->end) return 0;
+    if (read_varint(w, &key) < 0 || (key >> 3) == 0 || (key >> 3) > 0x1fffffff) return -1;
+    f->num = (int)(key >> 3);
+    f->wire = (int)(key & 7);
+    switch (f->wire) {
+    case 0:
+        return read_varint(w, &f->value) < 0 ? -1 : 1;
+    case 1:
+    case 5:
+        len = (f->wire == 1) ? 8 : 4;
+        if ((uint64_t)(w->end - w->p) < len) return -1;
+        w->p += len;
+        return 1;
+    case 2:
+        if (read_varint(w, &len) < 0 || len > (uint64_t)(w->end - w->p)) return -1;
+        f->sub.p = w->p;
+        f->sub.end = w->p + len;
+        w->p += len;
+        return 1;
+    default:
+        return -1;              // Groups are not used by the format
+    }
+}
+
+static void count_value(VAL_Tally *t, int num, uint64_t v)
+{
+    t->count[num]++;
+    if (v > t->max[num]) t->max[num] = v;
+    if (v == 0) t->zeros[num]++;
+}
+
+/*
+ * Tally the fields of a message.  Length-delimited fields whose numbers
+ * are set in packed hold packed varints, each of which is counted.
+ * Returns NULL, or what is wrong with the message.
+ */
+static const char *tally(VAL_Wire msg, uint32_t packed, VAL_Tally *t)
+{
+    VAL_Field f;
+    int rc;
+    memset(t, 0, sizeof(*t));
+    while ((rc = next_field(&msg, &f)) > 0) {
+        if (f.num >= VAL_FIELDS) continue;
+        if (f.wire == 0) {
+            count_value(t, f.num, f.value);
+        } else if (f.wire == 2 && (packed & (1u << f.num))) {
+            uint64_t v;
+            while (f.sub.p < f.sub.end) {
+                if (read_varint(&f.sub, &v) < 0) return "malformed packed field";
+                count_value(t, f.num, v);
+            }
+        } else {
+            t->count[f.num]++;
+        }
+    }
+    return rc < 0 ? "malformed message" : NULL;
+}
+
+#define BIT(n) (1u << (n))
+
+/* Tags given by parallel key and value index arrays, in fields k and k + 1. */
+static const char *check_tags(const VAL_Tally *t, int k, uint64_t num_strings)
+{
+    if (t->count[k] != t->count[k + 1]) return "keys and values differ in number";
+    if (t->count[k] && (t->max[k] >= num_strings || t->max[k + 1] >= num_strings))
+        return "string index out of range";
+    return NULL;
+}
+
+static const char *check_node(VAL_Wire msg, uint64_t num_strings)
+{
+    VAL_Tally t;
+    const char *why = tally(msg, BIT(2) | BIT(3), &t);
+    if (why) return why;
+    if (t.count[1] != 1 || t.count[8] != 1 || t.count[9] != 1) return "node without id, lat or lon";
+    return check_tags(&t, 2, num_strings);
+}
+
+static const char *check_dense(VAL_Wire msg, uint64_t num_strings, VAL_Counts *c)
+{
+    VAL_Tally t;
+    const char *why = tally(msg, BIT(1) | BIT(8) | BIT(9) | BIT(10), &t);
+    if (why) return why;
+    uint64_t n = t.count[1];
+    if (t.count[8] != n || t.count[9] != n) return "DenseNodes ids, lats and lons differ in number";
+    if (t.count[10]) {
+        if (t.zeros[10] != n) return "DenseNodes keys_vals do not hold one list per node";
+        if (t.max[10] >= num_strings) return "string index out of range";
+    }
+
+    VAL_Field f;
+    VAL_Wire w = msg;
+    int rc;
+    while ((rc = next_field(&w, &f)) > 0) {
+        if (f.num != 5 || f.wire != 2) continue;
+        VAL_Tally info;
+        if ((why = tally(f.sub, BIT(1) | BIT(2) | BIT(3) | BIT(4) | BIT(5) | BIT(6), &info))) return why;
+        for (int i = 1; i <= 6; i++) {
+            if (info.count[i] && info.count[i] != n) return "DenseInfo arrays differ in number from ids";
+        }
+    }
+    c->nodes += (int64_t)n;
+    return NULL;
+}
+
+static const char *check_way(VAL_Wire msg, uint64_t num_strings)
+{
+    VAL_Tally t;
+    const char *why = tally(msg, BIT(2) | BIT(3) | BIT(8), &t);
+    if (why) return why;
+    if (t.count[1] != 1) return "way without id";
+    return check_tags(&t, 2, num_strings);
+}
+
+static const char *check_relation(VAL_Wire msg, uint64_t num_strings)
+{
+    VAL_Tally t;
+    const char *why = tally(msg, BIT(2) | BIT(3) | BIT(8) | BIT(9) | BIT(10), &t);
+    if (why) return why;
+    if (t.count[1] != 1) return "relation without id";
+    if (t.count[8] != t.count[9] || t.count[9] != t.count[10])
+        return "relation roles, member ids and member types differ in number";
+    if (t.count[10] && t.max[10] > 2) return "unknown relation member type";
+    if (t.count[8] && t.max[8] >= num_strings) return "string index out of range";
+    return check_tags(&t, 2, num_strings);
+}
+
+static const char *check_primitive_block(VAL_Wire msg, VAL_Counts *c)
+{
+    VAL_Field f;
+    VAL_Wire w = msg;
+    uint64_t num_strings = 0;
+    int rc, tables = 0;
+    const char *why = NULL;
+    while ((rc = next_field(&w, &f)) > 0) {
+        if (f.num != 1) continue;
+        if (f.wire != 2) return "malformed string table";
+        VAL_Field s;
+        VAL_Wire st = f.sub;
+        while ((rc = next_field(&st, &s)) > 0) num_strings += (s.num == 1);
+        if (rc < 0) return "malformed string table";
+        tables++;
+    }
+    if (rc < 0) return "malformed message";
+    if (tables != 1) return "block without a string table";
+
+    w = msg;
+    while (!why && next_field(&w, &f) > 0) {
+        if (f.num != 2) continue;
+        if (f.wire != 2) return "malformed primitive group";
+        VAL_Field e;
+        VAL_Wire g = f.sub;
+        while (!why && (rc = next_field(&g, &e)) > 0) {
+            if (e.wire != 2) continue;
+            switch (e.num) {
+            case 1:
+                why = check_node(e.sub, num_strings);
+                c->nodes++;
+                break;
+            case 2:
+                why = check_dense(e.sub, num_strings, c);
+                break;
+            case 3:
+                why = check_way(e.sub, num_strings);
+                c->ways++;
+                break;
+            case 4:
+                why = check_relation(e.sub, num_strings);
+                c->relations++;
+                break;
+            }
+        }
+        if (!why && rc < 0) why = "malformed primitive group";
+    }
+    return why;
+}
+
+static const char *check_header_block(VAL_Wire msg)
+{
+    static const char *known[] = {"OsmSchema-V0.6", "DenseNodes", "HistoricalInformation"};
+    VAL_Field f;
+    VAL_Wire w = msg;
+    int rc;
+    while ((rc = next_field(&w, &f)) > 0) {
+        if (f.num == 1 && f.wire == 2) {
+            VAL_Tally t;
+            if (tally(f.sub, 0, &t) || t.count[1] != 1 || t.count[2] != 1 || t.count[3] != 1 || t.count[4] != 1)
+                return "malformed bounding box";
+        } else if (f.num == 4 && f.wire == 2) {
+            size_t len = (size_t)(f.sub.end - f.sub.p), i = 0;
+            while (i < sizeof(known) / sizeof(known[0]) &&
+                   (strlen(known[i]) != len || memcmp(known[i], f.sub.p, len) != 0))
+                i++;
+            if (i == sizeof(known) / sizeof(known[0])) return "unsupported required feature";
+        }
+    }
+    return rc < 0 ? "malformed message" : NULL;
+}
+
+/* Grow a buffer to hold at least need bytes. */
+static int reserve(uint8_t **bufp, size_t *capp, size_t need)
+{
+    if (need <= *capp) return 0;
+    uint8_t *buf = realloc(*bufp, need);
+    if (!buf) return -1;
+    *bufp = buf;
+    *capp = need;
+    return 0;
+}
+
+/*
+ * Read, inflate and check blob i, using the worker's buffers.  Returns
+ * NULL, or what is wrong with the blob.
+ */
+static const char *check_blob(VAL_State *v, int64_t i, uint8_t **raw, size_t *raw_cap,
+                              uint8_t **data, size_t *data_cap, VAL_Counts *c, int64_t *bytes)
+{
+    const PBF_Blob *b = &v->blobs[i];
+    if (i == 0 && !b->header) return "the file does not start with an OSMHeader blob";
+    if (reserve(raw, raw_cap, (size_t)b->size) < 0) return "out of memory";
+    if (pread(v->fd, *raw, (size_t)b->size, b->offset) != (ssize_t)b->size) return "cannot read the blob";
+    uint32_t header_len;
+    memcpy(&header_len, *raw, 4);
+    header_len = ntohl(header_len);
+
+    // The Blob: exactly one of raw (1) and the compressed forms (3 to 7).
+    VAL_Wire w = {*raw + 4 + header_len, *raw + b->size};
+    VAL_Wire payload = {NULL, NULL};
+    VAL_Field f;
+    uint64_t raw_size = 0;
+    int rc, forms = 0, zlib = 0, have_size = 0;
+    while ((rc = next_field(&w, &f)) > 0) {
+        if (f.num == 2 && f.wire == 0) {
+            raw_size = f.value;
+            have_size = 1;
+        } else if (f.num == 1 || (f.num >= 3 && f.num <= 7)) {
+            if (f.wire != 2) return "malformed blob";
+            if (f.num != 1 && f.num != 3) return "unsupported compression";
+            payload = f.sub;
+            zlib = (f.num == 3);
+            forms++;
+        }
+    }
+    if (rc < 0) return "malformed blob";
+    if (forms != 1) return "blob without exactly one form of data";
+
+    if (zlib) {
+        if (!have_size || raw_size > VAL_MAX_BLOCK) return "compressed blob without a valid raw_size";
+        if (reserve(data, data_cap, raw_size ? raw_size : 1) < 0) return "out of memory";
+        uLongf got = (uLongf)raw_size;
+        if (uncompress(*data, &got, payload.p, (uLong)(payload.end - payload.p)) != Z_OK || got != raw_size)
+            return "zlib data does not inflate to raw_size bytes";
+        payload.p = *data;
+        payload.end = *data + got;
+    } else if (payload.end - payload.p > VAL_MAX_BLOCK) {
+        return "block larger than the format allows";
+    }
+    *bytes += payload.end - payload.p;
+    if (b->header) return check_header_block(payload);
+    if (b->data) return check_primitive_block(payload, c);
+    return NULL;                // Unknown blob types are skipped by readers
+}
+
+static void check_blobs(void *arg, int worker, int64_t begin, int64_t end)
+{
+    VAL_State *v = arg;
+    uint8_t *raw = NULL, *data = NULL;
+    size_t raw_cap = 0, data_cap = 0;
+    VAL_Counts c = {0};
+    int64_t bytes = 0;
+    for (;;) {
+        // Blobs are taken in file order, so none after a bad one is needed.
+        int64_t i = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED);
+        if (i >= v->num || i > __atomic_load_n(&v->bad, __ATOMIC_RELAXED)) break;
+        const char *why = check_blob(v, i, &raw, &raw_cap, &data, &data_cap, &c, &bytes);
+        if (why) {
+            debug("DEBUG: check_blobs - blob %lld: %s\n", (long long)i, why);
+            pthread_mutex_lock(&v->lock);
+            if (i < v->bad) {
+                __atomic_store_n(&v->bad, i, __ATOMIC_RELAXED);
+                v->reason = why;
+            }
+            pthread_mutex_unlock(&v->lock);
+        }
+    }
+    pthread_mutex_lock(&v->lock);
+    v->counts.nodes += c.nodes;
+    v->counts.ways += c.ways;
+    v->counts.relations += c.relations;
+    v->bytes += bytes;
+    pthread_mutex_unlock(&v->lock);
+    free(raw);
+    free(data);
+}
+
+/**
+ * @brief Check the structure of a PBF file.
+ *
+ * @param in        The file, which must be seekable.
+ * @param nthreads  Number of threads (0 for one per CPU).
+ * @param rep       Receives what was checked and the first bad blob, if
+ *                  any.  The counts are complete only if the file is valid.
+ * @return 0 if the file is valid, 1 if it is not, -1 if it could not be
+ * checked.
+ */
+int VAL_validate(FILE *in, int nthreads, VAL_Report *rep)
+{
+    memset(rep, 0, sizeof(*rep));
+    rep->bad_offset = -1;
+    PBF_Blob *blobs = NULL;
+    int64_t num;
+    int rc = PBF_index(in, &blobs, &num);
+    if (rc < 0) return -1;
+
+    VAL_State v = {fileno(in), blobs, num, 0, num, NULL, 0, {0}, PTHREAD_MUTEX_INITIALIZER};
+    int n = PAR_num_threads(nthreads);
+    if (PAR_for(n, n, check_blobs, &v) < 0 && num > 0) {
+        fprintf(stderr, "ERROR: VAL_validate - out of memory.\n");
+        free(blobs);
+        return -1;
+    }
+
+    rep->blobs = num;
+    rep->bytes = v.bytes;
+    rep->nodes = v.counts.nodes;
+    rep->ways = v.counts.ways;
+    rep->relations = v.counts.relations;
+    if (v.bad < num) {
+        rep->bad_offset = blobs[v.bad].offset;
+        rep->reason = v.reason;
+    } else if (rc > 0) {
+        // The index stopped at a blob whose header is bad.
+        rep->bad_offset = num ? blobs[num - 1].offset + blobs[num - 1].size : 0;
+        rep->reason = "malformed blob header, or blob past the end of the file";
+    } else if (num == 0) {
+        rep->bad_offset = 0;
+        rep->reason = "no blobs";
+    }
+    free(blobs);
+    return rep->reason ? 1 : 0;
+}
@@ -1,6 +1,28 @@
 #include <criterion/criterion.h>
 #include <criterion/logging.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include "global.h"
+#include "query.h"
+#include "cache.h"
+#include "metrics.h"
+#include "catalog.h"
+#include "server.h"
+#include "crack.h"
+#include "pbf.h"
+#include "extsort.h"
+#include "diff.h"
+#include "sample.h"
+#include "validate.h"
+#include "refcheck.h"
+#include "renumber.h"
+#include "shard.h"
+#include "distload.h"
+#include "cpu.h"
 #include "test_common.h"
 
 #define PROGRAM_PATH "bin/pbf"
@@ -134,6 +156,60 @@ Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
 }
 #undef TEST_NAME
 
+/**
+ * node_list_sbu_map
+ * @brief PROGRAM_PATH -n 213352011,5,7800140552 -n 213352014 < rsrc/sbu.pbf
+ */
+
+#define TEST_NAME node_list_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-n 213352011,5,7800140552 -n 213352014"); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * node_range_sbu_map
+ * @brief PROGRAM_PATH -n 213352011-213358548 -w 20175414 -w 20175414 highway < rsrc/sbu.pbf
+ */
+
+#define TEST_NAME node_range_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-n 213352011-213358548 -w 20175414 -w 20175414 highway"); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * batch_sbu_map
+ * @brief PROGRAM_PATH -q tests/rsrc/batch_sbu_map/queries.txt -t 3 < rsrc/sbu.pbf
+ */
+
+#define TEST_NAME batch_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-q tests/rsrc/batch_sbu_map/queries.txt -t 3"); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
 /* Unit tests -- these call functions in your program directly. */
 
 /**
@@ -153,3 +229,1241 @@ Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
 
 
 
+/**
+ * Translate way refs to node indices and check they still name the same nodes
+ */
+
+#define TEST_NAME index_refs_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    OSM_Way *wp = OSM_Map_get_Way(mp, (int)OSM_Map_find_Way(mp, 20175414));
+    cr_assert(wp != NULL, "Way 20175414 was expected to be in the map\n");
+    OSM_Id refs[7];
+    cr_assert_eq(OSM_Way_get_num_refs(wp), 7, "Way 20175414 was expected to have 7 refs\n");
+    for (int i = 0; i < 7; i++)
+        refs[i] = OSM_Way_get_ref(wp, i);
+
+    cr_assert_eq(OSM_Map_index_refs(mp, 4), 0, "OSM_Map_index_refs failed\n");
+    for (int i = 0; i < 7; i++) {
+        uint32_t node = OSM_Way_get_ref_index(wp, i);
+        cr_assert_neq(node, OSM_REF_MISSING, "Ref %d of way 20175414 was not resolved\n", i);
+        cr_assert_eq(OSM_Node_get_id(OSM_Map_get_Node(mp, node)), refs[i],
+                     "Ref %d resolved to the wrong node\n", i);
+        cr_assert_eq(OSM_Way_get_ref(wp, i), refs[i], "Ref %d changed after translation\n", i);
+    }
+}
+#undef TEST_NAME
+
+#define TEST_NAME node_batches_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    int64_t cursor = 0, seen = 0;
+    OSM_Node_Batch b;
+    while (OSM_Map_node_batches(mp, &cursor, 1000, &b)) {
+        cr_assert_eq(b.first, seen, "Batches were expected to be contiguous\n");
+        cr_assert(b.count > 0 && b.count <= 1000, "Unexpected batch size %ld\n", (long)b.count);
+        for (int64_t i = 0; i < b.count; i++) {
+            OSM_Node *np = OSM_Map_get_Node(mp, (int)(b.first + i));
+            cr_assert_eq(b.ids[i], OSM_Node_get_id(np), "Id mismatch at node %ld\n", (long)(b.first + i));
+            cr_assert_eq(b.lats[i], OSM_Node_get_lat(np), "Lat mismatch at node %ld\n", (long)(b.first + i));
+            cr_assert_eq(b.lons[i], OSM_Node_get_lon(np), "Lon mismatch at node %ld\n", (long)(b.first + i));
+        }
+        seen += b.count;
+    }
+    cr_assert_eq(seen, OSM_Map_get_num_nodes(mp), "Batches were expected to cover every node\n");
+
+    OSM_Way *wp = OSM_Map_get_Way(mp, (int)OSM_Map_find_Way(mp, 20175414));
+    int n;
+    const OSM_Id *refs = OSM_Way_get_refs(wp, &n);
+    cr_assert(refs != NULL && n == 7, "Way 20175414 was expected to have a span of 7 refs\n");
+    for (int i = 0; i < n; i++)
+        cr_assert_eq(refs[i], OSM_Way_get_ref(wp, i), "Ref %d mismatch\n", i);
+    cr_assert(OSM_Way_get_ref_indices(wp, NULL) == NULL, "No ref indices were expected before translation\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME query_shards_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    // Enough queries, in scrambled order, to be split across several shards.
+    QRY_List ql = {0};
+    int num_nodes = OSM_Map_get_num_nodes(mp), num_ways = OSM_Map_get_num_ways(mp);
+    for (int i = 0; i < 40000; i++) {
+        int r = (int)((i * 2654435761u) % 1000003);
+        QRY_Query q = {QRY_NODE, 0, 0, NULL, 0};
+        if (i % 3 == 0) {
+            q.kind = QRY_WAY;
+            q.lo = OSM_Way_get_id(OSM_Map_get_Way(mp, r % num_ways));
+        } else {
+            q.lo = OSM_Node_get_id(OSM_Map_get_Node(mp, r % num_nodes)) + (i % 7 == 0);
+        }
+        q.hi = q.lo;
+        cr_assert_eq(QRY_add(&ql, &q), 0, "QRY_add failed\n");
+    }
+
+    OUT_Buffer sharded, single;
+    OUT_init(&sharded, -1, 0);
+    OUT_init(&single, -1, 0);
+    cr_assert_eq(QRY_run(&sharded, mp, &ql, 4), 0, "QRY_run failed\n");
+    for (size_t i = 0; i < ql.num; i++)
+        QRY_answer(&single, mp, &ql.queries[i]);
+    cr_assert_eq(sharded.len, single.len, "Sharded and sequential answers differ in length\n");
+    cr_assert(memcmp(sharded.buf, single.buf, single.len) == 0, "Sharded and sequential answers differ\n");
+    OUT_fini(&sharded);
+    OUT_fini(&single);
+    QRY_free_list(&ql);
+}
+#undef TEST_NAME
+
+#define TEST_NAME response_cache
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    CACHE_Cache *c = CACHE_create(4, 1);
+    cr_assert(c != NULL, "A non-NULL cache was expected\n");
+    char key[16];
+    for (int i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "n %d", i);
+        CACHE_Value *v = CACHE_new_value(key, strlen(key));
+        CACHE_insert(c, key, strlen(key), CACHE_generation(c), v);
+        CACHE_release(v);
+    }
+
+    // A hit returns the stored bytes and protects the entry from the next eviction.
+    CACHE_Value *hit = CACHE_lookup(c, "n 0", 3);
+    cr_assert(hit != NULL && hit->len == 3 && memcmp(hit->data, "n 0", 3) == 0, "Expected a hit for 'n 0'\n");
+    CACHE_Value *v = CACHE_new_value("x", 1);
+    CACHE_insert(c, "n 4", 3, CACHE_generation(c), v);
+    CACHE_release(v);
+    CACHE_Value *again = CACHE_lookup(c, "n 0", 3);
+    cr_assert(again == hit, "The recently used entry was expected to survive eviction\n");
+    CACHE_release(again);
+    CACHE_Value *gone = CACHE_lookup(c, "n 1", 3);
+    cr_assert(gone == NULL, "The least recently used entry was expected to be evicted\n");
+
+    // After invalidation nothing hits, and responses from the old generation are not cached.
+    uint64_t old = CACHE_generation(c);
+    CACHE_invalidate(c);
+    cr_assert(CACHE_lookup(c, "n 0", 3) == NULL, "No hits were expected after invalidation\n");
+    v = CACHE_new_value("y", 1);
+    CACHE_insert(c, "n 5", 3, old, v);
+    CACHE_release(v);
+    cr_assert(CACHE_lookup(c, "n 5", 3) == NULL, "A stale response was cached\n");
+
+    CACHE_Stats st;
+    CACHE_get_stats(c, &st);
+    cr_assert_eq(st.hits, 2, "Expected 2 hits, got %lu\n", (unsigned long)st.hits);
+    cr_assert_eq(st.misses, 3, "Expected 3 misses, got %lu\n", (unsigned long)st.misses);
+    CACHE_destroy(c);
+
+    // The bytes of a hit stay valid until released, even after the cache is gone.
+    cr_assert(memcmp(hit->data, "n 0", 3) == 0, "A held response was freed\n");
+    CACHE_release(hit);
+}
+#undef TEST_NAME
+
+#define TEST_NAME metrics_registry
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    MET_Registry reg;
+    MET_init(&reg);
+    MET_Counters *a = MET_register(&reg);
+    MET_Counters *b = MET_register(&reg);
+    cr_assert(a != NULL && b != NULL, "Non-NULL counters were expected\n");
+    MET_record(a, MET_NODE, 500, 1);
+    MET_record(a, MET_NODE, 3000, 0);
+    MET_record(b, MET_WAY, 2000000000, 0);
+    MET_unregister(&reg, a);
+
+    // Totals include closed connections as well as open ones.
+    MET_Counters total;
+    uint64_t connections, open;
+    MET_collect(&reg, &total, &connections, &open);
+    cr_assert_eq(connections, 2, "Expected 2 connections\n");
+    cr_assert_eq(open, 1, "Expected 1 open connection\n");
+    cr_assert_eq(total.requests[MET_NODE], 2, "Expected 2 node requests\n");
+    cr_assert_eq(total.cache_hits[MET_NODE], 1, "Expected 1 node cache hit\n");
+    cr_assert_eq(total.latency_ns[MET_NODE], 3500, "Expected 3500ns of node latency\n");
+    cr_assert_eq(total.buckets[MET_NODE][0], 1, "Expected a node request in the 1us bucket\n");
+    cr_assert_eq(total.buckets[MET_NODE][2], 1, "Expected a node request in the 5us bucket\n");
+    cr_assert_eq(total.buckets[MET_WAY][MET_NUM_BUCKETS - 1], 1, "Expected a way request in the +Inf bucket\n");
+
+    MET_unregister(&reg, b);
+    MET_fini(&reg);
+}
+#undef TEST_NAME
+
+/* Send a request to the server listening at path, and read the response up
+ * to its empty line.  Returns the length of the response, 0 if none. */
+static size_t server_request(const char *path, const char *req, char *buf, size_t size)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    size_t len = 0;
+    ssize_t n;
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        write(fd, req, strlen(req)) == (ssize_t)strlen(req))
+    {
+        while (len < size - 1 && (len < 2 || memcmp(buf + len - 2, "\n\n", 2) != 0) &&
+               (n = read(fd, buf + len, size - 1 - len)) > 0)
+            len += n;
+    }
+    if (fd >= 0) close(fd);
+    buf[len] = '\0';
+    return len;
+}
+
+/* Value of a sample in a STATS response, or -1 if it is missing. */
+static long stats_value(const char *stats, const char *sample)
+{
+    const char *p = strstr(stats, sample);
+    return p ? atol(p + strlen(sample)) : -1;
+}
+
+#define TEST_NAME stats_add_up_workers
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // Each connection is served by whichever worker accepts it, yet STATS
+    // (answered by one of them) counts the requests of all.
+    char path[64], buf[65536];
+    snprintf(path, sizeof(path), "/tmp/pbf_test_%d.sock", (int)getpid());
+    pid_t pid = fork();
+    if (pid == 0) {
+        FILE *in = fopen("tests/rsrc/sbu.pbf", "rb");
+        OSM_Map *mp = in ? OSM_read_Map(in) : NULL;
+        SRV_Config cfg = {path, NULL, SRV_DEFAULT_CACHE_SIZE, 3, NULL};
+        _exit(mp && SRV_run(&cfg, mp) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    cr_assert(pid > 0, "The server could not be started\n");
+    for (int i = 0; i < 100 && server_request(path, "CACHE\n", buf, sizeof(buf)) == 0; i++) usleep(50000);
+
+    int queries = 24;
+    for (int i = 0; i < queries; i++) {
+        cr_assert(server_request(path, "n 213352011\n", buf, sizeof(buf)) > 0, "Query %d was not answered\n", i);
+    }
+    // Other workers publish their counters about once a second.
+    long nodes = -1, hits = -1, misses = -1;
+    for (int i = 0; i < 40 && nodes != queries; i++) {
+        if (i) usleep(100000);
+        server_request(path, "STATS\n", buf, sizeof(buf));
+        nodes = stats_value(buf, "pbf_requests_total{kind=\"node\"} ");
+        hits = stats_value(buf, "\npbf_cache_hits_total ");
+        misses = stats_value(buf, "\npbf_cache_misses_total ");
+    }
+    kill(pid, SIGTERM);
+    int status;
+    waitpid(pid, &status, 0);
+    cr_assert_eq(nodes, queries, "Expected %d node requests, got %ld\n", queries, nodes);
+    cr_assert_eq(hits + misses, queries, "Expected %d cache lookups, got %ld\n", queries, hits + misses);
+    cr_assert(misses >= 1 && misses <= 3, "Expected a miss per worker at most, got %ld\n", misses);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "The server did not stop cleanly\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME map_compact_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    FILE *ref_in = fopen(filename, "r");
+    OSM_Map *ref = OSM_read_Map(ref_in);
+    cr_assert(ref != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    OSM_Map_Memory before, after;
+    OSM_Map_get_memory(mp, &before);
+    cr_assert_eq(OSM_Map_compact(mp), 0, "OSM_Map_compact was expected to succeed\n");
+    OSM_Map_get_memory(mp, &after);
+    cr_assert(after.nodes <= before.nodes && after.tags <= before.tags, "Compaction was not expected to grow the map\n");
+
+    // A compacted map answers exactly like a freshly read one.
+    cr_assert_eq(OSM_Map_get_num_nodes(mp), OSM_Map_get_num_nodes(ref), "Node count changed\n");
+    cr_assert_eq(OSM_Map_get_num_ways(mp), OSM_Map_get_num_ways(ref), "Way count changed\n");
+    for (int i = 0; i < OSM_Map_get_num_nodes(mp); i++) {
+        OSM_Node *np = OSM_Map_get_Node(mp, i), *rp = OSM_Map_get_Node(ref, i);
+        cr_assert_eq(OSM_Node_get_id(np), OSM_Node_get_id(rp), "Id mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lat(np), OSM_Node_get_lat(rp), "Lat mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lon(np), OSM_Node_get_lon(rp), "Lon mismatch at node %d\n", i);
+    }
+    for (int i = 0; i < OSM_Map_get_num_ways(mp); i++) {
+        OSM_Way *wp = OSM_Map_get_Way(mp, i), *rp = OSM_Map_get_Way(ref, i);
+        cr_assert_eq(OSM_Way_get_num_refs(wp), OSM_Way_get_num_refs(rp), "Ref count mismatch at way %d\n", i);
+        for (int j = 0; j < OSM_Way_get_num_refs(wp); j++)
+            cr_assert_eq(OSM_Way_get_ref(wp, j), OSM_Way_get_ref(rp, j), "Ref mismatch at way %d\n", i);
+        cr_assert_eq(OSM_Way_get_num_keys(wp), OSM_Way_get_num_keys(rp), "Key count mismatch at way %d\n", i);
+        for (int j = 0; j < OSM_Way_get_num_keys(wp); j++) {
+            cr_assert_str_eq(OSM_Way_get_key(wp, j), OSM_Way_get_key(rp, j), "Key mismatch at way %d\n", i);
+            cr_assert_str_eq(OSM_Way_get_value(wp, j), OSM_Way_get_value(rp, j), "Value mismatch at way %d\n", i);
+        }
+    }
+    OSM_free_Map(mp);
+    OSM_free_Map(ref);
+}
+#undef TEST_NAME
+
+#define TEST_NAME map_catalog_budget
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // A budget of one byte holds no idle map: each is evicted once released.
+    CAT_Catalog *cat = CAT_create(1);
+    cr_assert(cat != NULL, "A non-NULL catalog was expected\n");
+    cr_assert_eq(CAT_add(cat, "a=tests/rsrc/sbu.pbf"), 0, "Adding map a was expected to succeed\n");
+    cr_assert_eq(CAT_add(cat, "b=tests/rsrc/sbu.pbf"), 0, "Adding map b was expected to succeed\n");
+    cr_assert_eq(CAT_add(cat, "a=tests/rsrc/sbu.pbf"), -1, "A duplicate name was expected to be refused\n");
+    cr_assert_eq(CAT_add(cat, "nofile"), -1, "A spec without a file was expected to be refused\n");
+    cr_assert_eq(CAT_find(cat, "b n 1", 1), 1, "Map b was expected at index 1\n");
+    cr_assert_eq(CAT_find(cat, "c", 1), -1, "No map c was expected\n");
+
+    CAT_Map *a = CAT_acquire(cat, 0);
+    cr_assert(a != NULL, "Map a was expected to load\n");
+    CAT_Map *a2 = CAT_acquire(cat, 0);
+    cr_assert(a2 == a, "A loaded map was expected to be shared\n");
+    CAT_Map *b = CAT_acquire(cat, 1);
+    cr_assert(b != NULL, "Map b was expected to load\n");
+    cr_assert_eq(OSM_Map_get_num_nodes(b->mp), OSM_Map_get_num_nodes(a->mp), "Both maps were expected to match\n");
+
+    // Maps in use stay loaded, whatever the budget.
+    CAT_Stats st;
+    CAT_get_stats(cat, &st);
+    cr_assert_eq(st.loaded, 2, "Expected 2 loaded maps\n");
+    cr_assert_eq(st.evictions, 0, "Expected no evictions\n");
+    CAT_release(cat, a);
+    CAT_release(cat, a2);
+    CAT_release(cat, b);
+    CAT_get_stats(cat, &st);
+    cr_assert_eq(st.loaded, 0, "Expected idle maps to be evicted\n");
+    cr_assert_eq(st.evictions, 2, "Expected 2 evictions\n");
+    cr_assert_eq(st.bytes, 0, "Expected no memory held\n");
+
+    a = CAT_acquire(cat, 0);
+    CAT_get_stats(cat, &st);
+    cr_assert_eq(st.loads, 3, "An evicted map was expected to be read again\n");
+    CAT_invalidate(cat);
+    CAT_get_stats(cat, &st);
+    cr_assert_eq(st.loaded, 1, "A map in use was expected to survive invalidation\n");
+    CAT_release(cat, a);
+    CAT_get_stats(cat, &st);
+    cr_assert_eq(st.loaded, 0, "An invalidated map was expected to be freed on release\n");
+    CAT_destroy(cat);
+}
+#undef TEST_NAME
+
+#define TEST_NAME map_catalog_missing_file
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    CAT_Catalog *cat = CAT_create(0);
+    cr_assert(cat != NULL, "A non-NULL catalog was expected\n");
+    cr_assert_eq(CAT_add(cat, "gone=tests/rsrc/no_such_map.pbf"), 0, "Adding the map was expected to succeed\n");
+    cr_assert(CAT_acquire(cat, 0) == NULL, "A missing file was expected to give no map\n");
+    cr_assert(CAT_acquire(cat, 0) == NULL, "A failed read was expected to be tried again, and fail\n");
+    CAT_Stats st;
+    CAT_get_stats(cat, &st);
+    cr_assert_eq(st.load_failures, 2, "Expected 2 load failures\n");
+    cr_assert_eq(st.loads, 0, "Expected no loads\n");
+    cr_assert_eq(st.loaded, 0, "Expected no loaded maps\n");
+    CAT_destroy(cat);
+}
+#undef TEST_NAME
+
+#define TEST_NAME id_index_shuffled_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // The same map as sbu.pbf, with nodes and ways in shuffled order, which
+    // are kept as they are.
+    FILE *in = fopen("tests/rsrc/sbu_shuffled.pbf", "r");
+    cr_assert(in != NULL, "The shuffled map could not be opened\n");
+    OSM_Map *mp = OSM_read_Map_with(in, OSM_READ_KEEP_ORDER);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    FILE *ref_in = fopen("tests/rsrc/sbu.pbf", "r");
+    OSM_Map *ref = OSM_read_Map(ref_in);
+    cr_assert(ref != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes(mp), OSM_Map_get_num_nodes(ref), "Node count mismatch\n");
+    cr_assert_eq(OSM_Map_get_num_ways(mp), OSM_Map_get_num_ways(ref), "Way count mismatch\n");
+    OSM_Id lo = OSM_Node_get_id(OSM_Map_get_Node(ref, 100));
+    OSM_Id hi = OSM_Node_get_id(OSM_Map_get_Node(ref, 400));
+
+    // Lookups are answered by scanning, then through the indexes.
+    for (int pass = 0; pass < 2; pass++) {
+        cr_assert_eq(OSM_Map_index_ready(mp, OSM_INDEX_NODE_IDS), pass, "Unexpected node index state\n");
+        cr_assert_eq(OSM_Map_index_ready(mp, OSM_INDEX_WAY_IDS), pass, "Unexpected way index state\n");
+        for (int i = 0; i < OSM_Map_get_num_nodes(ref); i++) {
+            OSM_Node *rp = OSM_Map_get_Node(ref, i);
+            int64_t j = OSM_Map_find_Node(mp, OSM_Node_get_id(rp));
+            cr_assert(j >= 0, "Node %ld was not found\n", (long)OSM_Node_get_id(rp));
+            OSM_Node *np = OSM_Map_get_Node(mp, j);
+            cr_assert_eq(OSM_Node_get_lat(np), OSM_Node_get_lat(rp), "Lat mismatch at node %d\n", i);
+            cr_assert_eq(OSM_Node_get_lon(np), OSM_Node_get_lon(rp), "Lon mismatch at node %d\n", i);
+        }
+        for (int i = 0; i < OSM_Map_get_num_ways(ref); i++) {
+            OSM_Way *rp = OSM_Map_get_Way(ref, i);
+            int64_t j = OSM_Map_find_Way(mp, OSM_Way_get_id(rp));
+            cr_assert(j >= 0, "Way %ld was not found\n", (long)OSM_Way_get_id(rp));
+            OSM_Way *wp = OSM_Map_get_Way(mp, j);
+            cr_assert_eq(OSM_Way_get_num_refs(wp), OSM_Way_get_num_refs(rp), "Ref count mismatch at way %d\n", i);
+        }
+        cr_assert_eq(OSM_Map_find_Node(mp, -1), -1, "No node -1 was expected\n");
+
+        int64_t *rows, count;
+        cr_assert_eq(OSM_Map_range_Nodes(mp, lo, hi, &rows, &count), 0, "The range was expected to succeed\n");
+        cr_assert_eq(count, 301, "Expected 301 nodes in the range, got %ld\n", (long)count);
+        for (int64_t k = 0; k < count; k++) {
+            OSM_Id id = OSM_Node_get_id(OSM_Map_get_Node(mp, rows[k]));
+            cr_assert(id >= lo && id <= hi, "Node %ld is outside the range\n", (long)id);
+            cr_assert(k == 0 || rows[k] > rows[k - 1], "Rows were expected in map order\n");
+        }
+        free(rows);
+
+        if (!pass) {
+            cr_assert_eq(OSM_Map_build_index(mp, OSM_INDEX_NODE_IDS, 4), 0, "Building the node index failed\n");
+            cr_assert_eq(OSM_Map_build_index(mp, OSM_INDEX_WAY_IDS, 4), 0, "Building the way index failed\n");
+        }
+    }
+    OSM_Map_Memory mem;
+    OSM_Map_get_memory(mp, &mem);
+    cr_assert(mem.indexes > 0, "The indexes were expected to be counted\n");
+    OSM_free_Map(mp);
+    OSM_free_Map(ref);
+}
+#undef TEST_NAME
+
+#define TEST_NAME cracked_index_shuffled_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *in = fopen("tests/rsrc/sbu_shuffled.pbf", "r");
+    cr_assert(in != NULL, "The shuffled map could not be opened\n");
+    OSM_Map *mp = OSM_read_Map_with(in, OSM_READ_KEEP_ORDER);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    FILE *ref_in = fopen("tests/rsrc/sbu.pbf", "r");
+    OSM_Map *ref = OSM_read_Map(ref_in);
+    cr_assert(ref != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    OSM_Map_enable_cracking(mp);
+
+    // Lookups in reverse id order, then ranges, crack the node ids.
+    for (int i = OSM_Map_get_num_nodes(ref) - 1; i >= 0; i--) {
+        OSM_Node *rp = OSM_Map_get_Node(ref, i);
+        int64_t j = OSM_Map_find_Node(mp, OSM_Node_get_id(rp));
+        cr_assert(j >= 0, "Node %ld was not found\n", (long)OSM_Node_get_id(rp));
+        cr_assert_eq(OSM_Node_get_lat(OSM_Map_get_Node(mp, j)), OSM_Node_get_lat(rp), "Lat mismatch at node %d\n", i);
+    }
+    cr_assert_eq(OSM_Map_find_Node(mp, OSM_Node_get_id(OSM_Map_get_Node(ref, 0)) - 1), -1, "No node was expected\n");
+    cr_assert(OSM_Map_get_num_cracks(mp, OSM_INDEX_NODE_IDS) > 0, "The node ids were expected to be cracked\n");
+    for (int start = 0; start + 500 < OSM_Map_get_num_nodes(ref); start += 4999) {
+        OSM_Id lo = OSM_Node_get_id(OSM_Map_get_Node(ref, start));
+        OSM_Id hi = OSM_Node_get_id(OSM_Map_get_Node(ref, start + 500));
+        int64_t *rows, count;
+        cr_assert_eq(OSM_Map_range_Nodes(mp, lo, hi, &rows, &count), 0, "The range was expected to succeed\n");
+        cr_assert_eq(count, 501, "Expected 501 nodes in the range, got %ld\n", (long)count);
+        for (int64_t k = 0; k < count; k++) {
+            OSM_Id id = OSM_Node_get_id(OSM_Map_get_Node(mp, rows[k]));
+            cr_assert(id >= lo && id <= hi, "Node %ld is outside the range\n", (long)id);
+            cr_assert(k == 0 || rows[k] > rows[k - 1], "Rows were expected in map order\n");
+        }
+        free(rows);
+    }
+
+    // A batch of way lookups cracks the way ids.
+    int num_ways = OSM_Map_get_num_ways(ref);
+    OSM_Id *ids = malloc(num_ways * sizeof(OSM_Id));
+    int64_t *found = malloc(num_ways * sizeof(int64_t));
+    for (int i = 0; i < num_ways; i++) ids[i] = OSM_Way_get_id(OSM_Map_get_Way(ref, i));
+    cr_assert_eq(OSM_Map_find_Ways(mp, ids, num_ways, found), 0, "The batch lookup was expected to succeed\n");
+    for (int i = 0; i < num_ways; i++) {
+        cr_assert(found[i] >= 0 && OSM_Way_get_id(OSM_Map_get_Way(mp, found[i])) == ids[i],
+                  "Way %ld was not found\n", (long)ids[i]);
+    }
+    cr_assert(OSM_Map_get_num_cracks(mp, OSM_INDEX_WAY_IDS) > 0, "The way ids were expected to be cracked\n");
+    free(ids);
+    free(found);
+
+    // Duplicate ids resolve to their first row, as a scan would.
+    OSM_Id col[] = {9, 4, 7, 4, 1, 9, 3};
+    CRK_Index *ix = CRK_create(col, 7);
+    cr_assert(ix != NULL, "A non-NULL index was expected\n");
+    cr_assert_eq(CRK_find(ix, 4), 1, "Expected the first row of id 4\n");
+    cr_assert_eq(CRK_find(ix, 9), 0, "Expected the first row of id 9\n");
+    cr_assert_eq(CRK_find(ix, 5), -1, "No id 5 was expected\n");
+    OSM_Id batch[] = {1, 3, 5, 7, 9, 4};
+    int64_t rows[6];
+    CRK_find_many(ix, batch, 6, rows);
+    cr_assert(rows[0] == 4 && rows[1] == 6 && rows[2] == -1 && rows[3] == 2 && rows[4] == 0 && rows[5] == 1,
+              "Expected the batch to resolve as single lookups do\n");
+    CRK_free(ix);
+    OSM_free_Map(mp);
+    OSM_free_Map(ref);
+}
+#undef TEST_NAME
+
+#define TEST_NAME sort_shuffled_map_on_load
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // The shuffled map is sorted by id when read, into sbu.pbf's order.
+    FILE *in = fopen("tests/rsrc/sbu_shuffled.pbf", "r");
+    cr_assert(in != NULL, "The shuffled map could not be opened\n");
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    FILE *ref_in = fopen("tests/rsrc/sbu.pbf", "r");
+    OSM_Map *ref = OSM_read_Map(ref_in);
+    cr_assert(ref != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    cr_assert_eq(OSM_Map_index_ready(mp, OSM_INDEX_NODE_IDS), 1, "The nodes were expected to be sorted\n");
+    cr_assert_eq(OSM_Map_index_ready(mp, OSM_INDEX_WAY_IDS), 1, "The ways were expected to be sorted\n");
+    cr_assert_eq(OSM_Map_get_num_nodes(mp), OSM_Map_get_num_nodes(ref), "Node count mismatch\n");
+    cr_assert_eq(OSM_Map_get_num_ways(mp), OSM_Map_get_num_ways(ref), "Way count mismatch\n");
+    for (int i = 0; i < OSM_Map_get_num_nodes(mp); i++) {
+        OSM_Node *np = OSM_Map_get_Node(mp, i), *rp = OSM_Map_get_Node(ref, i);
+        cr_assert_eq(OSM_Node_get_id(np), OSM_Node_get_id(rp), "Id mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lat(np), OSM_Node_get_lat(rp), "Lat mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lon(np), OSM_Node_get_lon(rp), "Lon mismatch at node %d\n", i);
+    }
+    for (int i = 0; i < OSM_Map_get_num_ways(mp); i++) {
+        OSM_Way *wp = OSM_Map_get_Way(mp, i), *rp = OSM_Map_get_Way(ref, i);
+        cr_assert_eq(OSM_Way_get_id(wp), OSM_Way_get_id(rp), "Id mismatch at way %d\n", i);
+        cr_assert_eq(OSM_Way_get_num_refs(wp), OSM_Way_get_num_refs(rp), "Ref count mismatch at way %d\n", i);
+        for (int j = 0; j < OSM_Way_get_num_refs(wp); j++)
+            cr_assert_eq(OSM_Way_get_ref(wp, j), OSM_Way_get_ref(rp, j), "Ref mismatch at way %d\n", i);
+        cr_assert_eq(OSM_Way_get_num_keys(wp), OSM_Way_get_num_keys(rp), "Key count mismatch at way %d\n", i);
+        for (int j = 0; j < OSM_Way_get_num_keys(wp); j++) {
+            cr_assert_str_eq(OSM_Way_get_key(wp, j), OSM_Way_get_key(rp, j), "Key mismatch at way %d\n", i);
+            cr_assert_str_eq(OSM_Way_get_value(wp, j), OSM_Way_get_value(rp, j), "Value mismatch at way %d\n", i);
+        }
+    }
+    cr_assert_eq(OSM_Map_compact(mp), 0, "A sorted map was expected to compact\n");
+    OSM_free_Map(mp);
+    OSM_free_Map(ref);
+}
+#undef TEST_NAME
+
+#define TEST_NAME external_sort_shuffled_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // A 1 MB budget forces several runs and merge passes.
+    FILE *in = fopen("tests/rsrc/sbu_shuffled.pbf", "r");
+    cr_assert(in != NULL, "The shuffled map could not be opened\n");
+    FILE *out = tmpfile();
+    EXT_Stats st;
+    cr_assert_eq(EXT_sort(in, out, 1 << 20, &st), 0, "The sort was expected to succeed\n");
+    fclose(in);
+    cr_assert(st.runs > 2 && st.passes > 1, "Expected several runs and passes, got %d and %d\n", st.runs, st.passes);
+
+    rewind(out);
+    PBF_Reader *r = PBF_open(out);
+    cr_assert(r != NULL, "The sorted file could not be opened\n");
+    cr_assert_eq(PBF_get_header(r)->sorted, 1, "The output was expected to declare Sort.Type_then_ID\n");
+    const PBF_Entity *e;
+    PBF_Entity prev = {0};
+    int64_t count = 0;
+    while (PBF_next(r, &e) > 0) {
+        cr_assert(count == 0 || PBF_compare(&prev, e) <= 0, "Entity %ld is out of order\n", (long)e->id);
+        prev = *e;
+        count++;
+    }
+    PBF_close(r);
+    cr_assert_eq(count, st.entities, "Expected %ld entities, got %ld\n", (long)st.entities, (long)count);
+
+    // Read in file order, the sorted file matches sbu.pbf.
+    rewind(out);
+    OSM_Map *mp = OSM_read_Map_with(out, OSM_READ_KEEP_ORDER);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    FILE *ref_in = fopen("tests/rsrc/sbu.pbf", "r");
+    OSM_Map *ref = OSM_read_Map(ref_in);
+    cr_assert(ref != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes(mp), OSM_Map_get_num_nodes(ref), "Node count mismatch\n");
+    cr_assert_eq(OSM_Map_get_num_ways(mp), OSM_Map_get_num_ways(ref), "Way count mismatch\n");
+    for (int i = 0; i < OSM_Map_get_num_nodes(mp); i++) {
+        OSM_Node *np = OSM_Map_get_Node(mp, i), *rp = OSM_Map_get_Node(ref, i);
+        cr_assert_eq(OSM_Node_get_id(np), OSM_Node_get_id(rp), "Id mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lat(np), OSM_Node_get_lat(rp), "Lat mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lon(np), OSM_Node_get_lon(rp), "Lon mismatch at node %d\n", i);
+    }
+    for (int i = 0; i < OSM_Map_get_num_ways(mp); i++) {
+        OSM_Way *wp = OSM_Map_get_Way(mp, i), *rp = OSM_Map_get_Way(ref, i);
+        cr_assert_eq(OSM_Way_get_id(wp), OSM_Way_get_id(rp), "Id mismatch at way %d\n", i);
+        cr_assert_eq(OSM_Way_get_num_refs(wp), OSM_Way_get_num_refs(rp), "Ref count mismatch at way %d\n", i);
+        cr_assert_eq(OSM_Way_get_num_keys(wp), OSM_Way_get_num_keys(rp), "Key count mismatch at way %d\n", i);
+        for (int j = 0; j < OSM_Way_get_num_keys(wp); j++)
+            cr_assert_str_eq(OSM_Way_get_value(wp, j), OSM_Way_get_value(rp, j), "Value mismatch at way %d\n", i);
+    }
+    OSM_free_Map(mp);
+    OSM_free_Map(ref);
+    fclose(out);
+}
+#undef TEST_NAME
+
+#define TEST_NAME merge_overlapping_extracts
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // Split sbu.pbf into two overlapping extracts; the second has a newer
+    // version of every other entity in the overlap.
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(in != NULL, "The map could not be opened\n");
+    PBF_Reader *r = PBF_open(in);
+    cr_assert(r != NULL, "The map could not be read\n");
+    FILE *ins[2] = {tmpfile(), tmpfile()};
+    PBF_Writer *w[2] = {PBF_create(ins[0], PBF_get_header(r)), PBF_create(ins[1], PBF_get_header(r))};
+    const PBF_Entity *e;
+    int64_t total = 0;
+    while (PBF_next(r, &e) > 0) {
+        PBF_Entity x = *e;
+        if (total < 30000) cr_assert_eq(PBF_write(w[0], &x), 0, "Write failed\n");
+        if (total >= 20000) {
+            if (total % 2) x.version++;
+            cr_assert_eq(PBF_write(w[1], &x), 0, "Write failed\n");
+        }
+        total++;
+    }
+    PBF_close(r);
+    fclose(in);
+    cr_assert_eq(PBF_finish(w[0]), 0, "Finish failed\n");
+    cr_assert_eq(PBF_finish(w[1]), 0, "Finish failed\n");
+    rewind(ins[0]);
+    rewind(ins[1]);
+
+    FILE *out = tmpfile();
+    EXT_Stats st;
+    cr_assert_eq(EXT_merge(ins, 2, out, &st), 0, "The merge was expected to succeed\n");
+    cr_assert_eq(st.entities, total, "Expected %ld entities, got %ld\n", (long)total, (long)st.entities);
+    cr_assert_eq(st.duplicates, 10000, "Expected 10000 duplicates, got %ld\n", (long)st.duplicates);
+
+    // Every entity appears once, in its newest version.
+    rewind(out);
+    in = fopen("tests/rsrc/sbu.pbf", "r");
+    PBF_Reader *ref = PBF_open(in);
+    PBF_Reader *merged = PBF_open(out);
+    cr_assert(merged != NULL, "The merged file could not be opened\n");
+    cr_assert_eq(PBF_get_header(merged)->sorted, 1, "The output was expected to declare Sort.Type_then_ID\n");
+    cr_assert_eq(PBF_get_header(merged)->min_lon, PBF_get_header(ref)->min_lon, "Bounding box mismatch\n");
+    const PBF_Entity *m;
+    for (int64_t i = 0; PBF_next(ref, &e) > 0; i++) {
+        cr_assert_eq(PBF_next(merged, &m), 1, "Entity %ld is missing\n", (long)i);
+        cr_assert(m->type == e->type && m->id == e->id, "Entity %ld mismatch\n", (long)i);
+        int32_t version = e->version + (i >= 20000 && i % 2);
+        cr_assert_eq(m->version, version, "Version mismatch at entity %ld\n", (long)i);
+        cr_assert_eq(m->num_tags, e->num_tags, "Tag count mismatch at entity %ld\n", (long)i);
+    }
+    cr_assert_eq(PBF_next(merged, &m), 0, "No more entities were expected\n");
+    PBF_close(ref);
+    PBF_close(merged);
+    fclose(in);
+    fclose(out);
+
+    // Unsorted inputs are refused.
+    FILE *shuffled = fopen("tests/rsrc/sbu_shuffled.pbf", "r");
+    out = tmpfile();
+    cr_assert_eq(EXT_merge(&shuffled, 1, out, &st), -1, "An unsorted input was expected to fail\n");
+    fclose(shuffled);
+    fclose(out);
+    fclose(ins[0]);
+    fclose(ins[1]);
+}
+#undef TEST_NAME
+
+#define TEST_NAME diff_snapshots_to_osmchange
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // The new snapshot drops every 10th entity, retags every 7th and
+    // bumps the version of every 5th without other changes.
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(in != NULL, "The map could not be opened\n");
+    PBF_Reader *r = PBF_open(in);
+    cr_assert(r != NULL, "The map could not be read\n");
+    FILE *new_in = tmpfile();
+    PBF_Writer *w = PBF_create(new_in, PBF_get_header(r));
+    const PBF_Entity *e;
+    const char *keys[] = {"note"}, *vals[] = {"changed & <checked>"};
+    int64_t i, dropped = 0, retagged = 0, total = 0;
+    for (i = 0; PBF_next(r, &e) > 0; i++) {
+        PBF_Entity x = *e;
+        if (i % 10 == 0) {
+            dropped++;
+            continue;
+        }
+        if (i % 7 == 0) {
+            x.num_tags = 1;
+            x.keys = keys;
+            x.vals = vals;
+            retagged++;
+        }
+        if (i % 5 == 0) x.version++;
+        cr_assert_eq(PBF_write(w, &x), 0, "Write failed\n");
+    }
+    total = i;
+    cr_assert_eq(PBF_finish(w), 0, "Finish failed\n");
+    PBF_close(r);
+    rewind(in);
+    rewind(new_in);
+
+    FILE *out = tmpfile();
+    DIF_Stats st;
+    cr_assert_eq(DIF_write_osc(in, new_in, fileno(out), &st), 0, "The diff was expected to succeed\n");
+    cr_assert_eq(st.created, 0, "No entities were expected to be created\n");
+    cr_assert_eq(st.deleted, dropped, "Expected %ld deletions, got %ld\n", (long)dropped, (long)st.deleted);
+    cr_assert_eq(st.modified, retagged, "Expected %ld modifications, got %ld\n", (long)retagged, (long)st.modified);
+    cr_assert_eq(st.unchanged, total - dropped - retagged, "Unchanged count mismatch\n");
+
+    // Sections alternate as the changes do; each change is one element.
+    rewind(out);
+    char line[1024];
+    int64_t deletes = 0, modifies = 0, escaped = 0;
+    char section[16] = "";
+    while (fgets(line, sizeof(line), out)) {
+        if (strncmp(line, "  <", 3) == 0 && sscanf(line + 3, "%15[a-z]>", section) == 1) continue;
+        if (strstr(line, "<tag k=\"note\" v=\"changed &amp; &lt;checked&gt;\"/>")) escaped++;
+        if (strncmp(line, "    <", 5) != 0 || line[5] == '/') continue;
+        if (strcmp(section, "delete") == 0) deletes++;
+        if (strcmp(section, "modify") == 0) modifies++;
+    }
+    cr_assert_eq(deletes, dropped, "Expected %ld deleted elements, got %ld\n", (long)dropped, (long)deletes);
+    cr_assert_eq(modifies, retagged, "Expected %ld modified elements, got %ld\n", (long)retagged, (long)modifies);
+    cr_assert_eq(escaped, retagged, "Tag values were expected to be escaped\n");
+
+    // Swapping the files turns deletions into creations.
+    rewind(in);
+    rewind(new_in);
+    FILE *back = tmpfile();
+    cr_assert_eq(DIF_write_osc(new_in, in, fileno(back), &st), 0, "The diff was expected to succeed\n");
+    cr_assert_eq(st.created, dropped, "Expected %ld creations, got %ld\n", (long)dropped, (long)st.created);
+    cr_assert_eq(st.deleted, 0, "No entities were expected to be deleted\n");
+    fclose(back);
+    fclose(out);
+    fclose(new_in);
+    fclose(in);
+}
+#undef TEST_NAME
+
+/* Write sbu.pbf again, moving the last node by lat_shift nanodegrees. */
+static FILE *rewrite_sbu(int64_t lat_shift)
+{
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(in != NULL, "The map could not be opened\n");
+    PBF_Reader *r = PBF_open(in);
+    cr_assert(r != NULL, "The map could not be read\n");
+    PBF_Store nodes = {0};
+    const PBF_Entity *e;
+    FILE *out = tmpfile();
+    PBF_Writer *w = PBF_create(out, PBF_get_header(r));
+    while (PBF_next(r, &e) > 0) {
+        if (e->type == PBF_NODE) {
+            PBF_store_add(&nodes, e);
+            continue;
+        }
+        if (nodes.num) {
+            nodes.ents[nodes.num - 1].lat += lat_shift;
+            for (size_t i = 0; i < nodes.num; i++) PBF_write(w, &nodes.ents[i]);
+            PBF_store_clear(&nodes);
+        }
+        PBF_write(w, e);
+    }
+    cr_assert_eq(PBF_finish(w), 0, "The map could not be written\n");
+    PBF_store_free(&nodes);
+    PBF_close(r);
+    fclose(in);
+    rewind(out);
+    return out;
+}
+
+#define TEST_NAME blob_cache_reload
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // Two versions of a map that differ in one node, hence in one blob.
+    FILE *v1 = rewrite_sbu(0), *v2 = rewrite_sbu(1000);
+    char dir[] = "/tmp/pbf_blob_cache_XXXXXX";
+    cr_assert(mkdtemp(dir) != NULL, "No cache directory\n");
+    cr_assert_eq(OSM_set_blob_cache(dir), 0, "The cache directory was expected to be usable\n");
+
+    int64_t decoded, cached;
+    OSM_Map *old = OSM_read_Map(v1);
+    cr_assert(old != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    OSM_Map_get_blob_counts(old, &decoded, &cached);
+    cr_assert(decoded > 2 && cached == 0, "Expected every blob decoded, got %ld decoded, %ld cached\n",
+              (long)decoded, (long)cached);
+    int64_t num_blobs = decoded;
+    OSM_free_Map(old);
+
+    OSM_Map *mp = OSM_read_Map(v2);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    OSM_Map_get_blob_counts(mp, &decoded, &cached);
+    cr_assert(decoded == 1 && cached == num_blobs - 1, "Expected only the changed blob decoded, got %ld decoded, %ld cached\n",
+              (long)decoded, (long)cached);
+
+    // The result matches a load without the cache.
+    OSM_set_blob_cache(NULL);
+    rewind(v2);
+    OSM_Map *ref = OSM_read_Map(v2);
+    cr_assert(ref != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes(mp), OSM_Map_get_num_nodes(ref), "Node count mismatch\n");
+    cr_assert_eq(OSM_Map_get_num_ways(mp), OSM_Map_get_num_ways(ref), "Way count mismatch\n");
+    for (int i = 0; i < OSM_Map_get_num_nodes(mp); i++) {
+        OSM_Node *np = OSM_Map_get_Node(mp, i), *rp = OSM_Map_get_Node(ref, i);
+        cr_assert_eq(OSM_Node_get_id(np), OSM_Node_get_id(rp), "Id mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lat(np), OSM_Node_get_lat(rp), "Lat mismatch at node %d\n", i);
+        cr_assert_eq(OSM_Node_get_lon(np), OSM_Node_get_lon(rp), "Lon mismatch at node %d\n", i);
+    }
+    for (int i = 0; i < OSM_Map_get_num_ways(mp); i++) {
+        OSM_Way *wp = OSM_Map_get_Way(mp, i), *rp = OSM_Map_get_Way(ref, i);
+        cr_assert_eq(OSM_Way_get_id(wp), OSM_Way_get_id(rp), "Id mismatch at way %d\n", i);
+        cr_assert_eq(OSM_Way_get_num_refs(wp), OSM_Way_get_num_refs(rp), "Ref count mismatch at way %d\n", i);
+        for (int j = 0; j < OSM_Way_get_num_refs(wp); j++)
+            cr_assert_eq(OSM_Way_get_ref(wp, j), OSM_Way_get_ref(rp, j), "Ref mismatch at way %d\n", i);
+        cr_assert_eq(OSM_Way_get_num_keys(wp), OSM_Way_get_num_keys(rp), "Key count mismatch at way %d\n", i);
+        for (int j = 0; j < OSM_Way_get_num_keys(wp); j++) {
+            cr_assert_str_eq(OSM_Way_get_key(wp, j), OSM_Way_get_key(rp, j), "Key mismatch at way %d\n", i);
+            cr_assert_str_eq(OSM_Way_get_value(wp, j), OSM_Way_get_value(rp, j), "Value mismatch at way %d\n", i);
+        }
+    }
+    OSM_free_Map(mp);
+    OSM_free_Map(ref);
+    fclose(v1);
+    fclose(v2);
+
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    char path[512];
+    while (d && (de = readdir(d))) {
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (de->d_name[0] != '.') unlink(path);
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+}
+#undef TEST_NAME
+
+#define TEST_NAME sample_all_and_half_of_blobs
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // Exact counts, from a full pass.
+    FILE *in = rewrite_sbu(0);
+    PBF_Reader *r = PBF_open(in);
+    cr_assert(r != NULL, "The map could not be read\n");
+    const PBF_Entity *e;
+    int64_t counts[3] = {0}, highway = 0;
+    while (PBF_next(r, &e) > 0) {
+        counts[e->type]++;
+        for (int i = 0; i < e->num_tags; i++) highway += strcmp(e->keys[i], "highway") == 0;
+    }
+    PBF_close(r);
+
+    // Sampling every blob gives them exactly.
+    rewind(in);
+    SMP_Result res;
+    cr_assert_eq(SMP_sample(in, 100, 1, &res), 0, "The sample was expected to succeed\n");
+    cr_assert(res.blobs > 2 && res.sampled == res.blobs, "Expected every blob sampled, got %ld of %ld\n",
+              (long)res.sampled, (long)res.blobs);
+    cr_assert(fabs(res.nodes.value - counts[PBF_NODE]) < 0.5 && res.nodes.margin == 0,
+              "Expected %ld nodes, got %f +/- %f\n", (long)counts[PBF_NODE], res.nodes.value, res.nodes.margin);
+    cr_assert(fabs(res.ways.value - counts[PBF_WAY]) < 0.5, "Expected %ld ways, got %f\n", (long)counts[PBF_WAY], res.ways.value);
+    cr_assert(fabs(res.relations.value - counts[PBF_RELATION]) < 0.5, "Expected %ld relations, got %f\n",
+              (long)counts[PBF_RELATION], res.relations.value);
+    cr_assert(res.num_keys == SMP_TOP_KEYS && strcmp(res.keys[0].key, "highway") == 0 &&
+              fabs(res.keys[0].count.value - highway) < 0.5, "Expected highway as the top key, %ld times\n", (long)highway);
+    int64_t num_blobs = res.blobs;
+    SMP_free(&res);
+
+    // Half of them give estimates with a confidence interval.
+    rewind(in);
+    cr_assert_eq(SMP_sample(in, 50, 2, &res), 0, "The sample was expected to succeed\n");
+    cr_assert_eq(res.sampled, (num_blobs + 1) / 2, "Expected %ld blobs sampled, got %ld\n",
+                 (long)(num_blobs + 1) / 2, (long)res.sampled);
+    double total = res.nodes.value + res.ways.value + res.relations.value;
+    cr_assert(total > 0 && isfinite(total) && res.memory.value > 0, "Expected positive estimates\n");
+    cr_assert(res.nodes.margin > 0 && isfinite(res.nodes.margin), "Expected a confidence interval, got %f\n",
+              res.nodes.margin);
+    SMP_free(&res);
+    fclose(in);
+}
+#undef TEST_NAME
+
+#define TEST_NAME sample_few_blobs_covers_or_declines
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // sbu.pbf has one data blob of nodes, of ways and of relations: half of
+    // them always misses one, whose count must not be given as exact.
+    const double truth[3] = {46415, 5812, 274};
+    int unseen = 0;
+    for (uint64_t seed = 1; seed <= 8; seed++) {
+        FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+        cr_assert(in != NULL, "The map could not be opened\n");
+        SMP_Result res;
+        cr_assert_eq(SMP_sample(in, 50, seed, &res), 0, "The sample was expected to succeed\n");
+        fclose(in);
+        cr_assert_eq(res.sampled, 2, "Expected 2 blobs sampled, got %ld\n", (long)res.sampled);
+        const SMP_Estimate *est[3] = {&res.nodes, &res.ways, &res.relations};
+        for (int t = 0; t < 3; t++) {
+            if (est[t]->unseen) {
+                unseen++;
+                continue;
+            }
+            cr_assert(fabs(est[t]->value - truth[t]) <= est[t]->margin,
+                      "Seed %d: expected %.0f within %.0f +/- %.0f\n", (int)seed, truth[t], est[t]->value, est[t]->margin);
+        }
+        cr_assert(res.memory.unseen || (!res.nodes.unseen && !res.ways.unseen), "Expected no memory estimate\n");
+        SMP_free(&res);
+    }
+    cr_assert_eq(unseen, 8, "Expected one type not estimated per sample, got %d\n", unseen);
+}
+#undef TEST_NAME
+
+#define TEST_NAME validate_finds_first_bad_blob
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(in != NULL, "The map could not be opened\n");
+    VAL_Report rep;
+    cr_assert_eq(VAL_validate(in, 4, &rep), 0, "sbu.pbf was expected to be valid: %s\n", rep.reason);
+    cr_assert_eq(rep.nodes, 46415, "Expected 46415 nodes, got %ld\n", (long)rep.nodes);
+    cr_assert_eq(rep.ways, 5812, "Expected 5812 ways, got %ld\n", (long)rep.ways);
+
+    // Copy the file, damaging the data of the second and the last blob.
+    PBF_Blob *blobs;
+    int64_t num;
+    cr_assert_eq(PBF_index(in, &blobs, &num), 0, "The file was expected to be indexed\n");
+    cr_assert(num > 2, "Expected more than 2 blobs\n");
+    size_t size = blobs[num - 1].offset + blobs[num - 1].size;
+    char *bytes = malloc(size);
+    rewind(in);
+    cr_assert_eq(fread(bytes, 1, size, in), size, "The file could not be read\n");
+    fclose(in);
+    bytes[blobs[1].offset + blobs[1].size - 100] ^= 0x55;
+    bytes[blobs[num - 1].offset + blobs[num - 1].size - 100] ^= 0x55;
+    FILE *bad = tmpfile();
+    fwrite(bytes, 1, size, bad);
+    fflush(bad);
+    cr_assert_eq(VAL_validate(bad, 4, &rep), 1, "The damaged file was expected to be invalid\n");
+    cr_assert_eq(rep.bad_offset, blobs[1].offset, "Expected the blob at %ld reported, got %ld (%s)\n",
+                 (long)blobs[1].offset, (long)rep.bad_offset, rep.reason);
+    fclose(bad);
+
+    // A truncated file is bad from its last, incomplete blob on.
+    bad = tmpfile();
+    fwrite(bytes, 1, size - 1, bad);
+    fflush(bad);
+    bytes[blobs[1].offset + blobs[1].size - 100] ^= 0x55;
+    cr_assert_eq(VAL_validate(bad, 4, &rep), 1, "The truncated file was expected to be invalid\n");
+    cr_assert_eq(rep.bad_offset, blobs[1].offset, "Expected the damaged blob reported first\n");
+    fclose(bad);
+    bad = tmpfile();
+    fwrite(bytes, 1, size - 1, bad);
+    fflush(bad);
+    cr_assert_eq(VAL_validate(bad, 4, &rep), 1, "The truncated file was expected to be invalid\n");
+    cr_assert_eq(rep.bad_offset, blobs[num - 1].offset, "Expected the blob at %ld reported, got %ld (%s)\n",
+                 (long)blobs[num - 1].offset, (long)rep.bad_offset, rep.reason);
+    fclose(bad);
+    free(bytes);
+    free(blobs);
+}
+#undef TEST_NAME
+
+#define TEST_NAME check_refs_finds_missing_nodes
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(in != NULL, "The map could not be opened\n");
+    REF_Report base, rep;
+    cr_assert_eq(REF_check(in, &base), 0, "The check was expected to succeed\n");
+    cr_assert_eq(base.passes, 1, "A file grouped by type was expected to be read once\n");
+    cr_assert_eq(base.broken[PBF_WAY], 0, "No way of sbu.pbf was expected to be broken\n");
+
+    // Drop the first node of the first way, and count the refs to it.
+    rewind(in);
+    PBF_Reader *r = PBF_open(in);
+    cr_assert(r != NULL, "The map could not be read\n");
+    PBF_Store ents = {0};
+    const PBF_Entity *e;
+    while (PBF_next(r, &e) > 0) PBF_store_add(&ents, e);
+    OSM_Id dropped = 0;
+    int64_t refs = 0, ways = 0;
+    for (size_t i = 0; i < ents.num; i++) {
+        PBF_Entity *x = &ents.ents[i];
+        if (!dropped && x->type == PBF_WAY) dropped = x->refs[0];
+        int n = 0;
+        for (int j = 0; j < x->num_refs; j++) n += x->refs[j] == dropped;
+        for (int j = 0; j < x->num_members; j++)
+            refs += x->members[j].type == PBF_NODE && x->members[j].id == dropped;
+        refs += n;
+        ways += n > 0;
+    }
+
+    // Written grouped by type, then with the nodes last, which takes two passes.
+    for (int pass = 1; pass <= 2; pass++) {
+        FILE *out = tmpfile();
+        PBF_Writer *w = PBF_create(out, PBF_get_header(r));
+        for (int k = 0; k < 2; k++) {
+            for (size_t i = 0; i < ents.num; i++) {
+                PBF_Entity *x = &ents.ents[i];
+                if (x->type == PBF_NODE && x->id == dropped) continue;
+                if ((pass == 1 && k == 0) || (pass == 2 && k == (x->type == PBF_NODE))) PBF_write(w, x);
+            }
+        }
+        cr_assert_eq(PBF_finish(w), 0, "The map could not be written\n");
+        rewind(out);
+        cr_assert_eq(REF_check(out, &rep), 0, "The check was expected to succeed\n");
+        cr_assert_eq(rep.passes, pass, "Expected %d passes, got %d\n", pass, rep.passes);
+        cr_assert_eq(rep.entities[PBF_NODE], base.entities[PBF_NODE] - 1, "Expected one node less\n");
+        cr_assert_eq(rep.refs[PBF_NODE], base.refs[PBF_NODE], "Expected the same node refs\n");
+        cr_assert_eq(rep.missing[PBF_NODE], base.missing[PBF_NODE] + refs, "Expected %ld missing node refs, got %ld\n",
+                     (long)(base.missing[PBF_NODE] + refs), (long)rep.missing[PBF_NODE]);
+        cr_assert_eq(rep.missing[PBF_WAY], base.missing[PBF_WAY], "Expected the same missing way refs\n");
+        cr_assert_eq(rep.broken[PBF_WAY], ways, "Expected %ld broken ways, got %ld\n", (long)ways,
+                     (long)rep.broken[PBF_WAY]);
+        cr_assert_eq(rep.samples[PBF_NODE][0], dropped, "Expected %ld as the first missing node, got %ld\n",
+                     (long)dropped, (long)rep.samples[PBF_NODE][0]);
+        fclose(out);
+    }
+    PBF_store_free(&ents);
+    PBF_close(r);
+    fclose(in);
+}
+#undef TEST_NAME
+
+static int compare_first_ids(const void *a, const void *b)
+{
+    OSM_Id x = *(const OSM_Id *)a, y = *(const OSM_Id *)b;
+    return (x > y) - (x < y);
+}
+
+#define TEST_NAME renumber_keeps_refs
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    const char *files[2] = {"tests/rsrc/sbu.pbf", "tests/rsrc/sbu_shuffled.pbf"};
+    for (int f = 0; f < 2; f++) {
+        FILE *in = fopen(files[f], "r");
+        cr_assert(in != NULL, "The map could not be opened\n");
+        FILE *out = tmpfile(), *table = tmpfile();
+        REN_Stats st;
+        cr_assert_eq(REN_renumber(in, out, table, &st), 0, "The renumbering of %s was expected to succeed\n", files[f]);
+
+        // The table maps the old ids to 1..N, in file order.
+        rewind(table);
+        int64_t total = st.entities[PBF_NODE] + st.entities[PBF_WAY] + st.entities[PBF_RELATION];
+        OSM_Id (*pairs)[2] = malloc(total * sizeof(*pairs));
+        int64_t num = 0, seq[3] = {0};
+        char c;
+        long long old, new;
+        while (fscanf(table, " %c %lld %lld", &c, &old, &new) == 3) {
+            int t = c == 'n' ? PBF_NODE : c == 'w' ? PBF_WAY : PBF_RELATION;
+            cr_assert_eq(new, ++seq[t], "Expected new id %ld, got %lld\n", (long)seq[t], new);
+            if (t == PBF_NODE) {
+                pairs[num][0] = old;
+                pairs[num++][1] = new;
+            }
+        }
+        cr_assert_eq(seq[PBF_NODE] + seq[PBF_WAY] + seq[PBF_RELATION], total, "Expected a line per entity\n");
+        qsort(pairs, num, sizeof(*pairs), compare_first_ids);
+
+        // Way refs are the new ids of the same nodes.
+        rewind(in);
+        rewind(out);
+        PBF_Reader *a = PBF_open(in), *b = PBF_open(out);
+        cr_assert(a != NULL && b != NULL, "The maps could not be read\n");
+        const PBF_Entity *x, *y;
+        int64_t n = 0, checked = 0, refs = 0;
+        while (PBF_next(a, &x) > 0) {
+            cr_assert_eq(PBF_next(b, &y), 1, "The renumbered map ends early\n");
+            cr_assert_eq(x->type, y->type, "Type mismatch at entity %ld\n", (long)n);
+            if (x->type == PBF_NODE) {
+                cr_assert(x->lat == y->lat && x->lon == y->lon, "Coordinate mismatch at node %ld\n", (long)n);
+            }
+            int k = 0;
+            for (int j = 0; j < x->num_refs; j++) {
+                OSM_Id (*p)[2] = bsearch(&x->refs[j], pairs, num, sizeof(*pairs), compare_first_ids);
+                if (!p) continue;
+                cr_assert(k < y->num_refs && y->refs[k] == (*p)[1], "Ref mismatch at entity %ld\n", (long)n);
+                k++;
+                checked++;
+            }
+            cr_assert_eq(k, y->num_refs, "Ref count mismatch at entity %ld\n", (long)n);
+            refs += x->num_refs;
+            n++;
+        }
+        cr_assert_eq(PBF_next(b, &y), 0, "The renumbered map has extra entities\n");
+        cr_assert(checked > 0, "No ref was checked\n");
+        cr_assert_eq(st.dropped_refs, refs - checked, "Expected %ld dropped way refs, got %ld\n",
+                     (long)(refs - checked), (long)st.dropped_refs);
+        PBF_close(a);
+        PBF_close(b);
+        free(pairs);
+        fclose(table);
+        fclose(out);
+        fclose(in);
+    }
+}
+#undef TEST_NAME
+
+#define TEST_NAME shard_balances_nodes_and_keeps_ways_whole
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(in != NULL, "The map could not be opened\n");
+    FILE *outs[3] = {tmpfile(), tmpfile(), tmpfile()};
+    SHD_Shard shards[3];
+    cr_assert_eq(SHD_shard(in, outs, 3, 4, shards), 0, "The sharding was expected to succeed\n");
+    fclose(in);
+
+    int64_t nodes = 0, ways = 0, relations = 0;
+    for (int s = 0; s < 3; s++) {
+        cr_assert(shards[s].nodes == 46415 / 3 || shards[s].nodes == 46415 / 3 + 1,
+                  "Expected balanced shards, got %ld nodes in shard %d\n", (long)shards[s].nodes, s);
+        nodes += shards[s].nodes;
+        ways += shards[s].ways;
+        relations += shards[s].relations;
+
+        // Every way of a shard has its nodes there.
+        rewind(outs[s]);
+        REF_Report rep;
+        cr_assert_eq(REF_check(outs[s], &rep), 0, "The check was expected to succeed\n");
+        cr_assert_eq(rep.entities[PBF_NODE], shards[s].nodes + shards[s].copies, "Node count mismatch in shard %d\n", s);
+        cr_assert_eq(rep.entities[PBF_WAY], shards[s].ways, "Way count mismatch in shard %d\n", s);
+        cr_assert_eq(rep.broken[PBF_WAY], 0, "Expected complete ways in shard %d\n", s);
+        fclose(outs[s]);
+    }
+    cr_assert_eq(nodes, 46415, "Expected every node in one shard, got %ld\n", (long)nodes);
+    cr_assert_eq(ways, 5812, "Expected every way in one shard, got %ld\n", (long)ways);
+    cr_assert_eq(relations, 274, "Expected every relation in one shard, got %ld\n", (long)relations);
+
+    // The cells do not overlap.
+    for (int s = 1; s < 3; s++) {
+        int apart = 0;
+        for (int t = 0; t < s; t++) {
+            apart = shards[s].min_lat > shards[t].max_lat || shards[s].max_lat < shards[t].min_lat ||
+                    shards[s].min_lon > shards[t].max_lon || shards[s].max_lon < shards[t].min_lon;
+            cr_assert(apart, "Expected shards %d and %d apart\n", t, s);
+        }
+    }
+}
+#undef TEST_NAME
+
+#define TEST_NAME snapshot_loads_same_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char path[] = "/tmp/pbf_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    cr_assert(fd >= 0, "The snapshot file could not be created\n");
+    close(fd);
+    DST_Part parts[3];
+    cr_assert_eq(DST_load("tests/rsrc/sbu.pbf", path, 3, parts), 0, "The load was expected to succeed\n");
+    int64_t blobs = 0;
+    for (int i = 0; i < 3; i++) {
+        if (i > 0) cr_assert_eq(parts[i].begin, parts[i - 1].end, "Expected contiguous parts\n");
+        blobs += parts[i].blobs;
+    }
+    cr_assert_eq(blobs, 4, "Expected every blob in one part, got %ld\n", (long)blobs);
+
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    FILE *snap = fopen(path, "r");
+    cr_assert(in != NULL && snap != NULL, "The maps could not be opened\n");
+    OSM_Map *mp = OSM_read_Map(in);
+    OSM_Map *sp = OSM_read_Map(snap);
+    fclose(in);
+    fclose(snap);
+    remove(path);
+    cr_assert(mp != NULL && sp != NULL, "The maps could not be read\n");
+
+    int64_t n, m;
+    const OSM_Id *ids = OSM_Map_get_node_ids(mp, &n), *sids = OSM_Map_get_node_ids(sp, &m);
+    const OSM_Lat *lats = OSM_Map_get_node_lats(mp, &n), *slats = OSM_Map_get_node_lats(sp, &m);
+    cr_assert_eq(m, n, "Expected %ld nodes, got %ld\n", (long)n, (long)m);
+    cr_assert(memcmp(ids, sids, n * sizeof(OSM_Id)) == 0, "Node ids differ\n");
+    cr_assert(memcmp(lats, slats, n * sizeof(OSM_Lat)) == 0, "Node latitudes differ\n");
+    cr_assert_eq(OSM_Map_get_num_ways(sp), OSM_Map_get_num_ways(mp), "Way count mismatch\n");
+    for (int i = 0; i < OSM_Map_get_num_ways(mp); i++) {
+        int nr, snr;
+        const OSM_Id *refs = OSM_Way_get_refs(OSM_Map_get_Way(mp, i), &nr);
+        const OSM_Id *srefs = OSM_Way_get_refs(OSM_Map_get_Way(sp, i), &snr);
+        cr_assert(nr == snr && memcmp(refs, srefs, nr * sizeof(OSM_Id)) == 0, "Refs of way %d differ\n", i);
+    }
+    OSM_BBox *bb = OSM_Map_get_BBox(mp), *sbb = OSM_Map_get_BBox(sp);
+    cr_assert(bb != NULL && sbb != NULL, "Expected bounding boxes\n");
+    cr_assert(OSM_BBox_get_min_lon(sbb) == OSM_BBox_get_min_lon(bb) &&
+              OSM_BBox_get_max_lon(sbb) == OSM_BBox_get_max_lon(bb) &&
+              OSM_BBox_get_min_lat(sbb) == OSM_BBox_get_min_lat(bb) &&
+              OSM_BBox_get_max_lat(sbb) == OSM_BBox_get_max_lat(bb), "Bounding boxes differ\n");
+    OSM_free_Map(mp);
+    OSM_free_Map(sp);
+
+    // More parts than blobs leaves some empty, ending where they begin.
+    DST_Part many[8];
+    in = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert_eq(DST_split(in, 8, many), 0, "The split was expected to succeed\n");
+    fclose(in);
+    blobs = 0;
+    for (int i = 0; i < 8; i++) {
+        cr_assert(many[i].blobs > 0 || many[i].begin == many[i].end, "Expected part %d empty\n", i);
+        blobs += many[i].blobs;
+    }
+    cr_assert_eq(blobs, 4, "Expected every blob in one part, got %ld\n", (long)blobs);
+    cr_assert_eq(many[0].begin, 0, "Expected the first part to hold the header\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME cpu_kernels_agree_at_every_level
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // Runs of one-byte values long enough for every vector width, mixed
+    // with values of up to ten bytes, and a length that is no multiple of
+    // a vector, ending with one of ten bytes.
+    enum { N = 5003 };
+    static uint64_t vals[N], got[N + 1];
+    static int64_t sums[N], want[N];
+    static uint8_t buf[N * 10];
+    size_t len = 0;
+    uint64_t x = 88172645463325252ULL, sum = 0;
+    for (int i = 0; i < N; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int r = (i / 100) % 3;
+        vals[i] = (i == N - 1) ? UINT64_MAX : (r == 0) ? (x & 0x7f) : (r == 1) ? (x & 0x3fff) : (x >> (x & 63));
+        sum += (vals[i] >> 1) ^ -(vals[i] & 1);
+        want[i] = (int64_t)sum;
+        for (uint64_t v = vals[i]; ; v >>= 7) {
+            buf[len++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+            if (v < 0x80) break;
+        }
+    }
+
+    CPU_Level top = CPU_detect(), bound = CPU_kernels.level;
+    for (int l = CPU_SCALAR; l <= top; l++) {
+        cr_assert_eq(CPU_select((CPU_Level)l), 0, "Level %s was expected to be selectable\n",
+                     CPU_level_name((CPU_Level)l));
+        memset(got, 0, sizeof(got));
+        cr_assert_eq(CPU_kernels.varints(buf, buf + len, got), N, "Wrong count at %s\n", CPU_level_name((CPU_Level)l));
+        cr_assert(memcmp(got, vals, sizeof(vals)) == 0, "Wrong varints at %s\n", CPU_level_name((CPU_Level)l));
+        cr_assert_eq(CPU_kernels.varints(buf, buf + len - 1, got), -1, "Expected the cut varint found at %s\n",
+                     CPU_level_name((CPU_Level)l));
+        CPU_kernels.deltas(vals, sums, N);
+        cr_assert(memcmp(sums, want, sizeof(want)) == 0, "Wrong sums at %s\n", CPU_level_name((CPU_Level)l));
+
+        // The map decodes the same at every level.
+        FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+        cr_assert(in != NULL, "The map could not be opened\n");
+        OSM_Map *mp = OSM_read_Map(in);
+        fclose(in);
+        cr_assert(mp != NULL, "The map could not be read\n");
+        cr_assert_eq(OSM_Map_get_num_nodes(mp), 46415, "Node count mismatch at %s\n", CPU_level_name((CPU_Level)l));
+        OSM_Node *np = OSM_Map_get_Node(mp, OSM_Map_find_Node(mp, 213352011));
+        cr_assert(np != NULL && OSM_Node_get_lat(np) == 409251928, "Wrong node at %s\n", CPU_level_name((CPU_Level)l));
+        OSM_free_Map(mp);
+    }
+    cr_assert_eq(CPU_select((CPU_Level)(top + 1)), -1, "Expected a level above the CPU refused\n");
+    CPU_select(bound);
+}
+#undef TEST_NAME